@@ -25,9 +25,12 @@
 #include <linux/backing-dev.h>
 #include <linux/writeback.h>
 #include <linux/xattr.h>
+#include <asm/unaligned.h>
+#include <crypto/aes.h>
 
 #include "glob.h"
 #include "export.h"
+#include "crypto_ctx.h"
 
 /* Fixed format data defining GSS header and fixed string
  * "not_defined_in_RFC4178@please_ignore".
@@ -46,68 +49,6 @@ char NEGOTIATE_GSS_HEADER[74] =  {
 	0x72, 0x65
 };
 
-static int crypto_md5_alloc(struct connection *conn)
-{
-	int rc;
-	unsigned int size;
-
-	/* check if already allocated */
-	if (conn->secmech.md5)
-		return 0;
-
-	conn->secmech.md5 = crypto_alloc_shash("md5", 0, 0);
-	if (IS_ERR(conn->secmech.md5)) {
-		cifsd_debug("could not allocate crypto md5\n");
-		rc = PTR_ERR(conn->secmech.md5);
-		conn->secmech.md5 = NULL;
-		return rc;
-	}
-
-	size = sizeof(struct shash_desc) +
-		crypto_shash_descsize(conn->secmech.md5);
-	conn->secmech.sdescmd5 = kmalloc(size, GFP_KERNEL);
-	if (!conn->secmech.sdescmd5) {
-		crypto_free_shash(conn->secmech.md5);
-		conn->secmech.md5 = NULL;
-		return -ENOMEM;
-	}
-	conn->secmech.sdescmd5->shash.tfm = conn->secmech.md5;
-	conn->secmech.sdescmd5->shash.flags = 0x0;
-
-	return 0;
-}
-
-static int crypto_hmacmd5_alloc(struct connection *conn)
-{
-	int rc;
-	unsigned int size;
-
-	/* check if already allocated */
-	if (conn->secmech.sdeschmacmd5)
-		return 0;
-
-	conn->secmech.hmacmd5 = crypto_alloc_shash("hmac(md5)", 0, 0);
-	if (IS_ERR(conn->secmech.hmacmd5)) {
-		cifsd_debug("could not allocate crypto hmacmd5\n");
-		rc = PTR_ERR(conn->secmech.hmacmd5);
-		conn->secmech.hmacmd5 = NULL;
-		return rc;
-	}
-
-	size = sizeof(struct shash_desc) +
-		crypto_shash_descsize(conn->secmech.hmacmd5);
-	conn->secmech.sdeschmacmd5 = kmalloc(size, GFP_KERNEL);
-	if (!conn->secmech.sdeschmacmd5) {
-		crypto_free_shash(conn->secmech.hmacmd5);
-		conn->secmech.hmacmd5 = NULL;
-		return -ENOMEM;
-	}
-	conn->secmech.sdeschmacmd5->shash.tfm = conn->secmech.hmacmd5;
-	conn->secmech.sdeschmacmd5->shash.flags = 0x0;
-
-	return 0;
-}
-
 /**
  * compute_sess_key() - function to generate session key
  * @sess:	session of connection
@@ -117,42 +58,43 @@ static int crypto_hmacmd5_alloc(struct connection *conn)
  */
 int compute_sess_key(struct cifsd_sess *sess, char *hash, char *hmac)
 {
+	struct cifsd_crypto_ctx *ctx;
 	int rc;
 
-	rc = crypto_hmacmd5_alloc(sess->conn);
-	if (rc) {
-		cifsd_debug("could not crypto alloc hmacmd5 rc %d\n", rc);
-		goto out;
+	ctx = cifsd_find_crypto_ctx(CRYPTO_SHASH_HMACMD5);
+	if (!ctx) {
+		cifsd_debug("could not crypto alloc hmacmd5\n");
+		return -ENOMEM;
 	}
 
-	rc = crypto_shash_setkey(sess->conn->secmech.hmacmd5, hash,
+	rc = crypto_shash_setkey(CRYPTO_HMACMD5_TFM(ctx), hash,
 			CIFS_HMAC_MD5_HASH_SIZE);
 	if (rc) {
 		cifsd_debug("hmacmd5 set key fail error %d\n", rc);
 		goto out;
 	}
 
-	rc = crypto_shash_init(&sess->conn->secmech.sdeschmacmd5->shash);
+	rc = crypto_shash_init(CRYPTO_HMACMD5(ctx));
 	if (rc) {
 		cifsd_debug("could not init hmacmd5 error %d\n", rc);
 		goto out;
 	}
 
-	rc = crypto_shash_update(&sess->conn->secmech.sdeschmacmd5->shash,
+	rc = crypto_shash_update(CRYPTO_HMACMD5(ctx),
 		hmac, SMB2_NTLMV2_SESSKEY_SIZE);
 	if (rc) {
 		cifsd_debug("Could not update with response error %d\n", rc);
 		goto out;
 	}
 
-	rc = crypto_shash_final(&sess->conn->secmech.sdeschmacmd5->shash,
-			sess->sess_key);
+	rc = crypto_shash_final(CRYPTO_HMACMD5(ctx), sess->sess_key);
 	if (rc) {
 		cifsd_debug("Could not generate hmacmd5 hash error %d\n", rc);
 		goto out;
 	}
 
 out:
+	cifsd_release_crypto_ctx(ctx);
 	return rc;
 }
 
@@ -160,25 +102,27 @@ static int calc_ntlmv2_hash(struct cifsd_sess *sess, char *ntlmv2_hash,
 	char *dname)
 {
 	int ret, len;
-	wchar_t *domain;
-	__le16 *uniname;
+	wchar_t *domain = NULL;
+	__le16 *uniname = NULL;
+	struct cifsd_crypto_ctx *ctx;
 
-	if (!sess->conn->secmech.sdeschmacmd5) {
+	ctx = cifsd_find_crypto_ctx(CRYPTO_SHASH_HMACMD5);
+	if (!ctx) {
 		cifsd_debug("can't generate ntlmv2 hash\n");
-		return -1;
+		return -ENOMEM;
 	}
 
-	ret = crypto_shash_setkey(sess->conn->secmech.hmacmd5,
+	ret = crypto_shash_setkey(CRYPTO_HMACMD5_TFM(ctx),
 		sess->usr->passkey, CIFS_ENCPWD_SIZE);
 	if (ret) {
 		cifsd_debug("Could not set NT Hash as a key\n");
-		return ret;
+		goto out;
 	}
 
-	ret = crypto_shash_init(&sess->conn->secmech.sdeschmacmd5->shash);
+	ret = crypto_shash_init(CRYPTO_HMACMD5(ctx));
 	if (ret) {
 		cifsd_debug("could not init hmacmd5\n");
-		return ret;
+		goto out;
 	}
 
 	/* convert user_name to unicode */
@@ -186,7 +130,7 @@ static int calc_ntlmv2_hash(struct cifsd_sess *sess, char *ntlmv2_hash,
 	uniname = kzalloc(2 + UNICODE_LEN(len), GFP_KERNEL);
 	if (!uniname) {
 		ret = -ENOMEM;
-		return ret;
+		goto out;
 	}
 
 	if (len) {
@@ -195,11 +139,11 @@ static int calc_ntlmv2_hash(struct cifsd_sess *sess, char *ntlmv2_hash,
 		UniStrupr(uniname);
 	}
 
-	ret = crypto_shash_update(&sess->conn->secmech.sdeschmacmd5->shash,
+	ret = crypto_shash_update(CRYPTO_HMACMD5(ctx),
 			(char *)uniname, UNICODE_LEN(len));
 	if (ret) {
 		cifsd_debug("Could not update with user\n");
-		return ret;
+		goto out;
 	}
 
 	/* Convert domain name or conn name to unicode and uppercase */
@@ -208,25 +152,28 @@ static int calc_ntlmv2_hash(struct cifsd_sess *sess, char *ntlmv2_hash,
 	if (!domain) {
 		cifsd_debug("memory allocation failed\n");
 		ret = -ENOMEM;
-		return ret;
+		goto out;
 	}
 
 	len = smb_strtoUTF16((__le16 *)domain, dname, len,
 		sess->conn->local_nls);
 
-	ret = crypto_shash_update(&sess->conn->secmech.sdeschmacmd5->shash,
+	ret = crypto_shash_update(CRYPTO_HMACMD5(ctx),
 					(char *)domain, UNICODE_LEN(len));
 	if (ret) {
 		cifsd_debug("Could not update with domain\n");
-		return ret;
+		goto out;
 	}
 
-	ret = crypto_shash_final(&sess->conn->secmech.sdeschmacmd5->shash,
-			ntlmv2_hash);
+	ret = crypto_shash_final(CRYPTO_HMACMD5(ctx), ntlmv2_hash);
 	if (ret) {
 		cifsd_debug("Could not generate md5 hash\n");
 	}
 
+out:
+	kfree(uniname);
+	kfree(domain);
+	cifsd_release_crypto_ctx(ctx);
 	return ret;
 }
 
@@ -280,15 +227,10 @@ int process_ntlmv2(struct cifsd_sess *sess, struct ntlmv2_resp *ntlmv2,
 {
 	char ntlmv2_hash[CIFS_ENCPWD_SIZE];
 	char ntlmv2_rsp[CIFS_HMAC_MD5_HASH_SIZE];
-	char *construct;
+	struct cifsd_crypto_ctx *ctx;
+	char *construct = NULL;
 	int rc, len;
 
-	rc = crypto_hmacmd5_alloc(sess->conn);
-	if (rc) {
-		cifsd_debug("could not crypto alloc hmacmd5 rc %d\n", rc);
-		goto out;
-	}
-
 	if (domain_name == netbios_name)
 		rc = calc_ntlmv2_hash(sess, ntlmv2_hash, netbios_name);
 	else
@@ -296,20 +238,26 @@ int process_ntlmv2(struct cifsd_sess *sess, struct ntlmv2_resp *ntlmv2,
 
 	if (rc) {
 		cifsd_debug("could not get v2 hash rc %d\n", rc);
-		goto out;
+		return rc;
 	}
 
-	rc = crypto_shash_setkey(sess->conn->secmech.hmacmd5, ntlmv2_hash,
+	ctx = cifsd_find_crypto_ctx(CRYPTO_SHASH_HMACMD5);
+	if (!ctx) {
+		cifsd_debug("could not crypto alloc hmacmd5\n");
+		return -ENOMEM;
+	}
+
+	rc = crypto_shash_setkey(CRYPTO_HMACMD5_TFM(ctx), ntlmv2_hash,
 						CIFS_HMAC_MD5_HASH_SIZE);
 	if (rc) {
 		cifsd_debug("Could not set NTLMV2 Hash as a key\n");
-		goto out;
+		goto release;
 	}
 
-	rc = crypto_shash_init(&sess->conn->secmech.sdeschmacmd5->shash);
+	rc = crypto_shash_init(CRYPTO_HMACMD5(ctx));
 	if (rc) {
 		cifsd_debug("Could not init hmacmd5\n");
-		goto out;
+		goto release;
 	}
 
 	len = CIFS_CRYPTO_KEY_SIZE + blen;
@@ -317,27 +265,28 @@ int process_ntlmv2(struct cifsd_sess *sess, struct ntlmv2_resp *ntlmv2,
 	if (!construct) {
 		cifsd_debug("Memory allocation failed\n");
 		rc = -ENOMEM;
-		goto out;
+		goto release;
 	}
 
 	memcpy(construct, sess->ntlmssp.cryptkey, CIFS_CRYPTO_KEY_SIZE);
 	memcpy(construct + CIFS_CRYPTO_KEY_SIZE,
 		(char *)(&ntlmv2->blob_signature), blen);
 
-	rc = crypto_shash_update(&sess->conn->secmech.sdeschmacmd5->shash,
-			construct, len);
+	rc = crypto_shash_update(CRYPTO_HMACMD5(ctx), construct, len);
 	if (rc) {
 		cifsd_debug("Could not update with response\n");
-		goto out;
+		goto release;
 	}
 
-	rc = crypto_shash_final(&sess->conn->secmech.sdeschmacmd5->shash,
-			ntlmv2_rsp);
+	rc = crypto_shash_final(CRYPTO_HMACMD5(ctx), ntlmv2_rsp);
 	if (rc) {
 		cifsd_debug("Could not generate md5 hash\n");
-		goto out;
+		goto release;
 	}
+	cifsd_release_crypto_ctx(ctx);
+	ctx = NULL;
 
+	/* takes a context of its own */
 	rc = compute_sess_key(sess, ntlmv2_hash, ntlmv2_rsp);
 	if (rc) {
 		cifsd_debug("%s: Could not generate sess key\n", __func__);
@@ -345,7 +294,11 @@ int process_ntlmv2(struct cifsd_sess *sess, struct ntlmv2_resp *ntlmv2,
 	}
 
 	rc = memcmp(ntlmv2->ntlmv2_hash, ntlmv2_rsp, CIFS_HMAC_MD5_HASH_SIZE);
+release:
+	if (ctx)
+		cifsd_release_crypto_ctx(ctx);
 out:
+	kfree(construct);
 	return rc;
 }
 
@@ -517,31 +470,30 @@ unsigned int build_ntlmssp_challenge_blob(CHALLENGE_MESSAGE *chgblob,
 int smb1_sign_smbpdu(struct cifsd_sess *sess, struct kvec *iov, int n_vec,
 		char *sig)
 {
+	struct cifsd_crypto_ctx *ctx;
 	int rc;
 	int i;
 
-	rc = crypto_md5_alloc(sess->conn);
-	if (rc) {
-		cifsd_debug("could not crypto alloc md5 rc %d\n", rc);
-		goto out;
+	ctx = cifsd_find_crypto_ctx(CRYPTO_SHASH_MD5);
+	if (!ctx) {
+		cifsd_debug("could not crypto alloc md5\n");
+		return -ENOMEM;
 	}
 
-	rc = crypto_shash_init(&sess->conn->secmech.sdescmd5->shash);
+	rc = crypto_shash_init(CRYPTO_MD5(ctx));
 	if (rc) {
 		cifsd_debug("md5 init error %d\n", rc);
 		goto out;
 	}
 
-	rc = crypto_shash_update(&sess->conn->secmech.sdescmd5->shash,
-			sess->sess_key, 40);
+	rc = crypto_shash_update(CRYPTO_MD5(ctx), sess->sess_key, 40);
 	if (rc) {
 		cifsd_debug("md5 update error %d\n", rc);
 		goto out;
 	}
 
 	for (i = 0; i < n_vec; i++) {
-		rc = crypto_shash_update(
-				&sess->conn->secmech.sdescmd5->shash,
+		rc = crypto_shash_update(CRYPTO_MD5(ctx),
 				iov[i].iov_base, iov[i].iov_len);
 		if (rc) {
 			cifsd_debug("md5 update error %d\n", rc);
@@ -549,108 +501,288 @@ int smb1_sign_smbpdu(struct cifsd_sess *sess, struct kvec *iov, int n_vec,
 		}
 	}
 
-	rc = crypto_shash_final(&sess->conn->secmech.sdescmd5->shash, sig);
+	rc = crypto_shash_final(CRYPTO_MD5(ctx), sig);
 	if (rc)
 		cifsd_debug("md5 generation error %d\n", rc);
 
 out:
+	cifsd_release_crypto_ctx(ctx);
 	return rc;
 }
 
 #ifdef CONFIG_CIFS_SMB2_SERVER
 
-static int crypto_hmacsha256_alloc(struct connection *conn)
+/*
+ * Signing transforms are keyed once, when the session or channel key is
+ * known, and are shared by all requests signed with that key. Every
+ * request hashes with its own descriptor on the stack, so requests of a
+ * connection are signed in parallel and the key schedule is not redone
+ * for every packet.
+ *
+ * A transform in use is never rekeyed. Re-authentication keys new
+ * transforms and swaps them in under the write side of key_sem, which
+ * signing and crypto hold for reading while they use the transforms.
+ */
+static int cifsd_init_sign_tfm(struct crypto_shash **tfm, const char *name,
+		const u8 *key, unsigned int key_size, struct rw_semaphore *sem)
 {
+	struct crypto_shash *new, *old;
 	int rc;
-	unsigned int size;
 
-	/* check if already allocated */
-	if (conn->secmech.hmacsha256)
-		return 0;
+	new = crypto_alloc_shash(name, 0, 0);
+	if (IS_ERR(new)) {
+		cifsd_debug("could not allocate crypto %s\n", name);
+		return PTR_ERR(new);
+	}
 
-	conn->secmech.hmacsha256 = crypto_alloc_shash("hmac(sha256)", 0, 0);
-	if (IS_ERR(conn->secmech.hmacsha256)) {
-		cifsd_debug("could not allocate crypto hmacsha256\n");
-		rc = PTR_ERR(conn->secmech.hmacsha256);
-		conn->secmech.hmacsha256 = NULL;
+	rc = crypto_shash_setkey(new, key, key_size);
+	if (rc) {
+		cifsd_debug("%s setkey error %d\n", name, rc);
+		crypto_free_shash(new);
 		return rc;
 	}
 
-	size = sizeof(struct shash_desc) +
-		crypto_shash_descsize(conn->secmech.hmacsha256);
-	conn->secmech.sdeschmacsha256 = kmalloc(size, GFP_KERNEL);
-	if (!conn->secmech.sdeschmacsha256) {
-		crypto_free_shash(conn->secmech.hmacsha256);
-		conn->secmech.hmacsha256 = NULL;
-		return -ENOMEM;
-	}
-	conn->secmech.sdeschmacsha256->shash.tfm = conn->secmech.hmacsha256;
-	conn->secmech.sdeschmacsha256->shash.flags = 0x0;
+	down_write(sem);
+	old = *tfm;
+	*tfm = new;
+	up_write(sem);
 
+	crypto_free_shash(old);
 	return 0;
 }
 
-static int crypto_cmac_alloc(struct connection *conn)
+static int cifsd_sign_iov(struct crypto_shash *tfm, struct kvec *iov,
+		int n_vec, char *sig)
 {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 18, 0)
+	SHASH_DESC_ON_STACK(shash, tfm);
+#else
+	struct shash_desc *shash;
+#endif
 	int rc;
-	unsigned int size;
+	int i;
 
-	/* check if already allocated */
-	if (conn->secmech.sdesccmacaes)
-		return 0;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 18, 0)
+	shash = kmalloc(sizeof(struct shash_desc) +
+			crypto_shash_descsize(tfm), GFP_KERNEL);
+	if (!shash)
+		return -ENOMEM;
+#endif
+	shash->tfm = tfm;
+	shash->flags = 0x0;
 
-	conn->secmech.cmacaes = crypto_alloc_shash("cmac(aes)", 0, 0);
-	if (IS_ERR(conn->secmech.cmacaes)) {
-		cifsd_debug("could not allocate crypto cmac-aes\n");
-		rc = PTR_ERR(conn->secmech.cmacaes);
-		conn->secmech.cmacaes = NULL;
-		return rc;
+	rc = crypto_shash_init(shash);
+	if (rc) {
+		cifsd_debug("sign init error %d\n", rc);
+		goto out;
 	}
 
-	size = sizeof(struct shash_desc) +
-		crypto_shash_descsize(conn->secmech.cmacaes);
-	conn->secmech.sdesccmacaes = kmalloc(size, GFP_KERNEL);
-	if (!conn->secmech.sdesccmacaes) {
-		crypto_free_shash(conn->secmech.cmacaes);
-		conn->secmech.cmacaes = NULL;
-		return -ENOMEM;
+	for (i = 0; i < n_vec; i++) {
+		rc = crypto_shash_update(shash, iov[i].iov_base,
+				iov[i].iov_len);
+		if (rc) {
+			cifsd_debug("sign update error %d\n", rc);
+			goto out;
+		}
 	}
-	conn->secmech.sdesccmacaes->shash.tfm = conn->secmech.cmacaes;
-	conn->secmech.sdesccmacaes->shash.flags = 0x0;
 
-	return 0;
+	rc = crypto_shash_final(shash, sig);
+	if (rc)
+		cifsd_debug("sign generation error %d\n", rc);
+
+out:
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 18, 0)
+	memzero_explicit(shash, sizeof(struct shash_desc) +
+			crypto_shash_descsize(tfm));
+#else
+	kzfree(shash);
+#endif
+	return rc;
 }
 
-static int crypto_sha512_alloc(struct connection *conn)
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0)
+#define SMB3_GMAC_NONCE_SIZE	12
+
+/* number of scatterlist entries needed to map @iov */
+static int cifsd_iov_nr_sg(struct kvec *iov, int n_vec)
 {
+	int i, nr = 0;
+
+	for (i = 0; i < n_vec; i++) {
+		if (is_vmalloc_addr(iov[i].iov_base))
+			nr += DIV_ROUND_UP(offset_in_page(iov[i].iov_base) +
+					iov[i].iov_len, PAGE_SIZE);
+		else
+			nr++;
+	}
+	return nr;
+}
+
+/* map @iov to @sg, vmalloc'ed buffers page by page */
+static struct scatterlist *cifsd_iov_to_sg(struct scatterlist *sg,
+		struct kvec *iov, int n_vec)
+{
+	unsigned int len, left;
+	char *buf;
+	int i;
+
+	for (i = 0; i < n_vec; i++) {
+		if (!is_vmalloc_addr(iov[i].iov_base)) {
+			sg_set_buf(sg++, iov[i].iov_base, iov[i].iov_len);
+			continue;
+		}
+
+		buf = iov[i].iov_base;
+		for (left = iov[i].iov_len; left; left -= len) {
+			len = min_t(unsigned int, left,
+					PAGE_SIZE - offset_in_page(buf));
+			sg_set_page(sg++, vmalloc_to_page(buf), len,
+					offset_in_page(buf));
+			buf += len;
+		}
+	}
+	return sg;
+}
+
+static int cifsd_init_gmac_tfm(struct channel *chann)
+{
+	struct crypto_aead *tfm, *old_tfm;
+	struct cifsd_split_gcm *split = NULL, *old_split;
 	int rc;
-	unsigned int size;
-
-	/* check if already allocated */
-	if (conn->secmech.sdescsha512)
-		return 0;
-
-	cifsd_debug("Inside crypto_sha512_alloc\n");
-	conn->secmech.sha512 = crypto_alloc_shash("sha512", 0, 0);
-	if (IS_ERR(conn->secmech.sha512)) {
-		cifsd_debug("could not allocate crypto sha512\n");
-		rc = PTR_ERR(conn->secmech.sha512);
-		conn->secmech.sha512 = NULL;
+
+	tfm = crypto_alloc_aead("gcm(aes)", 0, 0);
+	if (IS_ERR(tfm)) {
+		cifsd_debug("could not allocate crypto gcm-aes\n");
+		return PTR_ERR(tfm);
+	}
+
+	rc = crypto_aead_setkey(tfm, chann->smb3signingkey,
+			SMB3_SIGN_KEY_SIZE);
+	if (!rc)
+		rc = crypto_aead_setauthsize(tfm, SMB2_SIGNATURE_SIZE);
+	if (rc) {
+		cifsd_debug("gmac setkey error %d\n", rc);
+		crypto_free_aead(tfm);
 		return rc;
 	}
 
-	size = sizeof(struct shash_desc) +
-		crypto_shash_descsize(conn->secmech.sha512);
-	conn->secmech.sdescsha512 = kmalloc(size, GFP_KERNEL);
-	if (!conn->secmech.sdescsha512) {
-		crypto_free_shash(conn->secmech.sha512);
-		conn->secmech.sha512 = NULL;
+	/* large messages are signed over several CPUs when possible */
+	cifsd_split_gcm_setkey(&split, chann->smb3signingkey,
+			SMB3_SIGN_KEY_SIZE);
+
+	down_write(&chann->key_sem);
+	old_tfm = chann->gmac_tfm;
+	old_split = chann->gmac_split;
+	chann->gmac_tfm = tfm;
+	chann->gmac_split = split;
+	up_write(&chann->key_sem);
+
+	if (old_tfm)
+		crypto_free_aead(old_tfm);
+	cifsd_split_gcm_free(old_split);
+	return 0;
+}
+
+/*
+ * AES-GMAC is AES-GCM with the whole message as associated data and
+ * nothing to encrypt. The nonce is the MessageId, followed by a role
+ * word telling responses and CANCEL requests apart.
+ */
+static int smb3_gmac_sign(struct crypto_aead *tfm,
+		struct cifsd_split_gcm *split, struct kvec *iov, int n_vec,
+		char *sig)
+{
+	struct smb2_hdr *hdr = (struct smb2_hdr *)((char *)iov[0].iov_base -
+			offsetof(struct smb2_hdr, ProtocolId));
+	DECLARE_CRYPTO_WAIT(wait);
+	struct aead_request *req;
+	struct scatterlist *sg, *sg_end;
+	unsigned int assoc_len = 0;
+	u8 nonce[SMB3_GMAC_NONCE_SIZE];
+	u32 role = 0;
+	u8 *iv, *tag;
+	int i, nr_sg, rc;
+
+	for (i = 0; i < n_vec; i++)
+		assoc_len += iov[i].iov_len;
+
+	if (hdr->Flags & SMB2_FLAGS_SERVER_TO_REDIR)
+		role |= 1;
+	else if (hdr->Command == SMB2_CANCEL)
+		role |= 2;
+	memcpy(nonce, &hdr->MessageId, sizeof(hdr->MessageId));
+	put_unaligned_le32(role, nonce + sizeof(hdr->MessageId));
+
+	if (cifsd_split_gcm_wanted(split, assoc_len))
+		return cifsd_split_gcm_crypt(split, nonce, iov, n_vec, NULL, 0,
+				sig, true);
+
+	nr_sg = cifsd_iov_nr_sg(iov, n_vec) + 1;
+	sg = kmalloc(nr_sg * sizeof(struct scatterlist) +
+			SMB3_GMAC_NONCE_SIZE + SMB2_SIGNATURE_SIZE, GFP_KERNEL);
+	if (!sg)
+		return -ENOMEM;
+
+	req = aead_request_alloc(tfm, GFP_KERNEL);
+	if (!req) {
+		kfree(sg);
 		return -ENOMEM;
 	}
-	conn->secmech.sdescsha512->shash.tfm = conn->secmech.sha512;
-	conn->secmech.sdescsha512->shash.flags = 0x0;
 
-	return 0;
+	iv = (u8 *)(sg + nr_sg);
+	tag = iv + SMB3_GMAC_NONCE_SIZE;
+	memcpy(iv, nonce, SMB3_GMAC_NONCE_SIZE);
+
+	sg_init_table(sg, nr_sg);
+	sg_end = cifsd_iov_to_sg(sg, iov, n_vec);
+	sg_set_buf(sg_end, tag, SMB2_SIGNATURE_SIZE);
+
+	aead_request_set_callback(req, CRYPTO_TFM_REQ_MAY_BACKLOG |
+			CRYPTO_TFM_REQ_MAY_SLEEP, crypto_req_done, &wait);
+	aead_request_set_ad(req, assoc_len);
+	aead_request_set_crypt(req, sg, sg, 0, iv);
+
+	rc = crypto_wait_req(crypto_aead_encrypt(req), &wait);
+	if (rc)
+		cifsd_debug("gmac generation error %d\n", rc);
+	else
+		memcpy(sig, tag, SMB2_SIGNATURE_SIZE);
+
+	aead_request_free(req);
+	kfree(sg);
+	return rc;
+}
+#endif
+
+/**
+ * smb2_init_sign_tfm() - key the signing transform of a session
+ * @sess:	session whose session key was just established
+ *
+ * Return:	0 on success, otherwise error
+ */
+int smb2_init_sign_tfm(struct cifsd_sess *sess)
+{
+	return cifsd_init_sign_tfm(&sess->sign_tfm, "hmac(sha256)",
+			sess->sess_key, SMB2_NTLMV2_SESSKEY_SIZE,
+			&sess->key_sem);
+}
+
+/**
+ * smb3_init_sign_tfm() - key the signing transform of a channel
+ * @chann:	channel whose signing key was just derived
+ *
+ * Return:	0 on success, otherwise error
+ */
+int smb3_init_sign_tfm(struct channel *chann)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0)
+	if (chann->conn->dialect == SMB311_PROT_ID &&
+	    chann->conn->SigningAlgorithmId == SMB2_SIGNING_AES_GMAC)
+		return cifsd_init_gmac_tfm(chann);
+#endif
+	return cifsd_init_sign_tfm(&chann->sign_tfm, "cmac(aes)",
+			chann->smb3signingkey, SMB2_CMACAES_SIZE,
+			&chann->key_sem);
 }
 
 /**
@@ -665,49 +797,21 @@ int smb2_sign_smbpdu(struct cifsd_sess *sess, struct kvec *iov, int n_vec,
 		char *sig)
 {
 	int rc;
-	int i;
-
-	rc = crypto_hmacsha256_alloc(sess->conn);
-	if (rc) {
-		cifsd_debug("could not crypto alloc hmacmd5 rc %d\n", rc);
-		goto out;
-	}
 
-	rc = crypto_shash_setkey(sess->conn->secmech.hmacsha256,
-		sess->sess_key, SMB2_NTLMV2_SESSKEY_SIZE);
-	if (rc) {
-		cifsd_debug("hmacsha256 update error %d\n", rc);
-		goto out;
-	}
-
-	rc = crypto_shash_init(&sess->conn->secmech.sdeschmacsha256->shash);
-	if (rc) {
-		cifsd_debug("hmacsha256 init error %d\n", rc);
-		goto out;
-	}
-
-	for (i = 0; i < n_vec; i++) {
-		rc = crypto_shash_update(
-				&sess->conn->secmech.sdeschmacsha256->shash,
-				iov[i].iov_base, iov[i].iov_len);
-		if (rc) {
-			cifsd_debug("hmacsha256 update error %d\n", rc);
-			goto out;
-		}
+	down_read(&sess->key_sem);
+	if (sess->sign_tfm) {
+		rc = cifsd_sign_iov(sess->sign_tfm, iov, n_vec, sig);
+	} else {
+		cifsd_debug("session signing key is not set\n");
+		rc = -EINVAL;
 	}
-
-	rc = crypto_shash_final(&sess->conn->secmech.sdeschmacsha256->shash,
-		sig);
-	if (rc)
-		cifsd_debug("hmacsha256 generation error %d\n", rc);
-
-out:
+	up_read(&sess->key_sem);
 	return rc;
 }
 
 /**
  * smb3_sign_smbpdu() - function to generate packet signing
- * @sess:	session of connection
+ * @chann:	channel of connection
  * @iov:        buffer iov array
  * @n_vec:	number of iovecs
  * @sig:	signature value generated for client request packet
@@ -717,132 +821,100 @@ int smb3_sign_smbpdu(struct channel *chann, struct kvec *iov, int n_vec,
 		char *sig)
 {
 	int rc;
-	int i;
 
-	rc = crypto_shash_setkey(chann->conn->secmech.cmacaes,
-		chann->smb3signingkey,	SMB2_CMACAES_SIZE);
-	if (rc) {
-		cifsd_debug("cmaces update error %d\n", rc);
+	down_read(&chann->key_sem);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0)
+	if (chann->gmac_tfm) {
+		rc = smb3_gmac_sign(chann->gmac_tfm, chann->gmac_split,
+				iov, n_vec, sig);
 		goto out;
 	}
-
-	rc = crypto_shash_init(&chann->conn->secmech.sdesccmacaes->shash);
-	if (rc) {
-		cifsd_debug("cmaces init error %d\n", rc);
-		goto out;
-	}
-
-	for (i = 0; i < n_vec; i++) {
-		rc = crypto_shash_update(
-				&chann->conn->secmech.sdesccmacaes->shash,
-				iov[i].iov_base, iov[i].iov_len);
-		if (rc) {
-			cifsd_debug("cmaces update error %d\n", rc);
-			goto out;
-		}
+#endif
+	if (chann->sign_tfm) {
+		rc = cifsd_sign_iov(chann->sign_tfm, iov, n_vec, sig);
+	} else {
+		cifsd_debug("channel signing key is not set\n");
+		rc = -EINVAL;
 	}
-
-	rc = crypto_shash_final(&chann->conn->secmech.sdesccmacaes->shash,
-		sig);
-	if (rc)
-		cifsd_debug("cmaces generation error %d\n", rc);
-
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0)
 out:
+#endif
+	up_read(&chann->key_sem);
 	return rc;
 }
 
 
-/**
- * compute_smb3xsigningkey() - function to generate session key
- * @sess:	session of connection
- *
+/*
+ * SP800-108 KDF in counter mode with HMAC-SHA256, keyed with the session
+ * key. A single PRF round gives up to 32 bytes of key.
  */
-int compute_smb3xsigningkey(struct cifsd_sess *sess, __u8 *key,
-	unsigned int key_size)
+static int generate_key(struct cifsd_sess *sess, struct kvec label,
+	struct kvec context, __u8 *key, unsigned int key_size)
 {
 	unsigned char zero = 0x0;
 	int rc;
 	__u8 i[4] = {0, 0, 0, 1};
-	__u8 L[4] = {0, 0, 0, 128};
+	__u8 L[4];
 	unsigned char prfhash[SMB2_HMACSHA256_SIZE];
 	unsigned char *hashptr = prfhash;
+	struct cifsd_crypto_ctx *ctx;
 
 	memset(prfhash, 0x0, SMB2_HMACSHA256_SIZE);
 	memset(key, 0x0, key_size);
+	put_unaligned_be32(key_size * 8, L);
 
-	rc = crypto_hmacsha256_alloc(sess->conn);
-	if (rc) {
-		cifsd_debug("could not crypto alloc hmacmd5 rc %d\n", rc);
-		goto smb3signkey_ret;
-	}
-
-	rc = crypto_cmac_alloc(sess->conn);
-	if (rc) {
-		cifsd_debug("could not crypto alloc cmac rc %d\n", rc);
-		goto smb3signkey_ret;
+	ctx = cifsd_find_crypto_ctx(CRYPTO_SHASH_HMACSHA256);
+	if (!ctx) {
+		cifsd_debug("could not crypto alloc hmacsha256\n");
+		return -ENOMEM;
 	}
 
-	rc = crypto_shash_setkey(sess->conn->secmech.hmacsha256,
+	rc = crypto_shash_setkey(CRYPTO_HMACSHA256_TFM(ctx),
 			sess->sess_key, SMB2_NTLMV2_SESSKEY_SIZE);
 	if (rc) {
 		cifsd_debug("could not set with session key\n");
 		goto smb3signkey_ret;
 	}
 
-	rc = crypto_shash_init(&sess->conn->secmech.sdeschmacsha256->shash);
+	rc = crypto_shash_init(CRYPTO_HMACSHA256(ctx));
 	if (rc) {
 		cifsd_debug("could not init sign hmac\n");
 		goto smb3signkey_ret;
 	}
 
-	rc = crypto_shash_update(&sess->conn->secmech.sdeschmacsha256->shash,
-			i, 4);
+	rc = crypto_shash_update(CRYPTO_HMACSHA256(ctx), i, 4);
 	if (rc) {
 		cifsd_debug("could not update with n\n");
 		goto smb3signkey_ret;
 	}
 
-	if (sess->conn->dialect == SMB311_PROT_ID)
-		rc = crypto_shash_update(&sess->conn->
-				secmech.sdeschmacsha256->shash,
-				"SMBSigningKey", 14);
-	else
-		rc = crypto_shash_update(&sess->conn->
-				secmech.sdeschmacsha256->shash,
-				"SMB2AESCMAC", 12);
+	rc = crypto_shash_update(CRYPTO_HMACSHA256(ctx),
+			label.iov_base, label.iov_len);
 	if (rc) {
 		cifsd_debug("could not update with label\n");
 		goto smb3signkey_ret;
 	}
 
-	rc = crypto_shash_update(&sess->conn->secmech.sdeschmacsha256->shash,
-			&zero, 1);
+	rc = crypto_shash_update(CRYPTO_HMACSHA256(ctx), &zero, 1);
 	if (rc) {
 		cifsd_debug("could not update with zero\n");
 		goto smb3signkey_ret;
 	}
 
-	if (sess->conn->dialect == SMB311_PROT_ID)
-		rc = crypto_shash_update(&sess->conn->
-			secmech.sdeschmacsha256->shash, sess->Preauth_HashValue,
-			64);
-	else
-		rc = crypto_shash_update(&sess->conn->
-			secmech.sdeschmacsha256->shash, "SmbSign", 8);
+	rc = crypto_shash_update(CRYPTO_HMACSHA256(ctx),
+			context.iov_base, context.iov_len);
 	if (rc) {
 		cifsd_debug("could not update with context\n");
 		goto smb3signkey_ret;
 	}
 
-	rc = crypto_shash_update(&sess->conn->secmech.sdeschmacsha256->shash,
-			L, 4);
+	rc = crypto_shash_update(CRYPTO_HMACSHA256(ctx), L, 4);
 	if (rc) {
 		cifsd_debug("could not update with L\n");
 		goto smb3signkey_ret;
 	}
 
-	rc = crypto_shash_final(&sess->conn->secmech.sdeschmacsha256->shash,
-			hashptr);
+	rc = crypto_shash_final(CRYPTO_HMACSHA256(ctx), hashptr);
 	if (rc) {
 		cifsd_debug("Could not generate hmacmd5 hash error %d\n", rc);
 		goto smb3signkey_ret;
@@ -851,56 +923,340 @@ int compute_smb3xsigningkey(struct cifsd_sess *sess, __u8 *key,
 	memcpy(key, hashptr, key_size);
 
 smb3signkey_ret:
+	cifsd_release_crypto_ctx(ctx);
 	return rc;
 }
 
+/**
+ * compute_smb3xsigningkey() - function to generate session key
+ * @conn:	connection the session setup came in on
+ * @sess:	session of connection
+ *
+ * A binding session setup derives the key of its channel from the
+ * preauth hash of its own connection, not that of sess->conn.
+ */
+int compute_smb3xsigningkey(struct connection *conn, struct cifsd_sess *sess,
+	__u8 *key, unsigned int key_size)
+{
+	struct preauth_session *preauth_sess = NULL;
+	struct kvec label, context;
+	int rc;
+
+	if (conn->dialect == SMB311_PROT_ID) {
+		preauth_sess = lookup_preauth_session(conn, sess->sess_id);
+		if (!preauth_sess) {
+			cifsd_debug("no preauth hash for session %llu\n",
+				sess->sess_id);
+			return -ENOENT;
+		}
+
+		label.iov_base = "SMBSigningKey";
+		label.iov_len = 14;
+		context.iov_base = preauth_sess->Preauth_HashValue;
+		context.iov_len = PREAUTH_HASHVALUE_SIZE;
+	} else {
+		label.iov_base = "SMB2AESCMAC";
+		label.iov_len = 12;
+		context.iov_base = "SmbSign";
+		context.iov_len = 8;
+	}
+
+	rc = generate_key(sess, label, context, key, key_size);
+	if (preauth_sess)
+		put_preauth_session(preauth_sess);
+	return rc;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0)
+static inline bool cifsd_cipher_is_gcm(int cipher)
+{
+	return cipher == SMB2_ENCRYPTION_AES128_GCM ||
+		cipher == SMB2_ENCRYPTION_AES256_GCM;
+}
+
+static inline unsigned int cifsd_cipher_key_size(int cipher)
+{
+	if (cipher == SMB2_ENCRYPTION_AES256_CCM ||
+	    cipher == SMB2_ENCRYPTION_AES256_GCM)
+		return SMB3_ENC_KEY_SIZE_256;
+	return SMB3_ENC_KEY_SIZE;
+}
+
+/* allocate and key a new AEAD transform */
+static int cifsd_init_crypt_tfm(struct crypto_aead **tfm, int cipher,
+		const __u8 *key, unsigned int key_size)
+{
+	struct crypto_aead *new;
+	int rc;
+
+	new = crypto_alloc_aead(cifsd_cipher_is_gcm(cipher) ?
+			"gcm(aes)" : "ccm(aes)", 0, 0);
+	if (IS_ERR(new)) {
+		cifsd_debug("could not allocate crypto aead\n");
+		return PTR_ERR(new);
+	}
+
+	rc = crypto_aead_setkey(new, key, key_size);
+	if (!rc)
+		rc = crypto_aead_setauthsize(new, SMB2_SIGNATURE_SIZE);
+	if (rc) {
+		cifsd_debug("aead setkey error %d\n", rc);
+		crypto_free_aead(new);
+		return rc;
+	}
+
+	*tfm = new;
+	return 0;
+}
+
+/**
+ * compute_smb3xencryptionkey() - derive and key the encryption transforms
+ * @conn:	connection the session setup came in on
+ * @sess:	session whose session key was just established
+ *
+ * Return:	0 on success, otherwise error
+ */
+int compute_smb3xencryptionkey(struct connection *conn,
+	struct cifsd_sess *sess)
+{
+	unsigned int key_size = cifsd_cipher_key_size(conn->CipherId);
+	__u8 enc_key[SMB3_ENC_KEY_SIZE_256], dec_key[SMB3_ENC_KEY_SIZE_256];
+	struct crypto_aead *enc_tfm = NULL, *dec_tfm = NULL;
+	struct cifsd_split_gcm *enc_split = NULL, *dec_split = NULL;
+	struct kvec label, context;
+	int rc;
+
+	if (conn->dialect == SMB311_PROT_ID) {
+		struct preauth_session *preauth_sess;
+
+		preauth_sess = lookup_preauth_session(conn, sess->sess_id);
+		if (!preauth_sess) {
+			cifsd_debug("no preauth hash for session %llu\n",
+				sess->sess_id);
+			return -ENOENT;
+		}
+
+		context.iov_base = preauth_sess->Preauth_HashValue;
+		context.iov_len = PREAUTH_HASHVALUE_SIZE;
+		label.iov_base = "SMBS2CCipherKey";
+		label.iov_len = 16;
+		rc = generate_key(sess, label, context, enc_key, key_size);
+		if (!rc) {
+			label.iov_base = "SMBC2SCipherKey";
+			rc = generate_key(sess, label, context, dec_key,
+					key_size);
+		}
+		put_preauth_session(preauth_sess);
+	} else {
+		label.iov_base = "SMB2AESCCM";
+		label.iov_len = 11;
+		context.iov_base = "ServerOut";
+		context.iov_len = 10;
+		rc = generate_key(sess, label, context, enc_key, key_size);
+		if (rc)
+			goto out;
+
+		context.iov_base = "ServerIn ";
+		rc = generate_key(sess, label, context, dec_key, key_size);
+	}
+	if (rc)
+		goto out;
+
+	/* requests of the session may be using the current transforms */
+	rc = cifsd_init_crypt_tfm(&enc_tfm, conn->CipherId, enc_key,
+			key_size);
+	if (!rc)
+		rc = cifsd_init_crypt_tfm(&dec_tfm, conn->CipherId,
+				dec_key, key_size);
+	if (rc) {
+		if (enc_tfm)
+			crypto_free_aead(enc_tfm);
+		goto out;
+	}
+
+	/* large messages are encrypted over several CPUs when possible */
+	if (cifsd_cipher_is_gcm(conn->CipherId)) {
+		cifsd_split_gcm_setkey(&enc_split, enc_key, key_size);
+		cifsd_split_gcm_setkey(&dec_split, dec_key, key_size);
+	}
+
+	down_write(&sess->key_sem);
+	swap(sess->enc_tfm, enc_tfm);
+	swap(sess->dec_tfm, dec_tfm);
+	swap(sess->enc_split, enc_split);
+	swap(sess->dec_split, dec_split);
+	up_write(&sess->key_sem);
+
+	/* the previous keys, if any */
+	if (enc_tfm)
+		crypto_free_aead(enc_tfm);
+	if (dec_tfm)
+		crypto_free_aead(dec_tfm);
+	cifsd_split_gcm_free(enc_split);
+	cifsd_split_gcm_free(dec_split);
+out:
+	memzero_explicit(enc_key, sizeof(enc_key));
+	memzero_explicit(dec_key, sizeof(dec_key));
+	return rc;
+}
+
+/**
+ * cifsd_crypt_message() - encrypt or decrypt a message in place
+ * @sess:	session the message belongs to
+ * @tr_hdr:	transform header, Nonce and OriginalMessageSize set
+ * @iov:	message, OriginalMessageSize bytes in total
+ * @n_vec:	number of iovecs
+ * @enc:	encrypt and fill in the Signature, otherwise decrypt and
+ *		check it
+ *
+ * The transform header from Nonce on is the associated data and the
+ * tag is read from or written to its Signature, so the whole message
+ * goes through the cipher in one request without copies.
+ *
+ * Return:	0 on success, -EBADMSG if the message does not authenticate,
+ *		otherwise error
+ */
+static int __cifsd_crypt_message(struct cifsd_sess *sess,
+	struct smb2_transform_hdr *tr_hdr, struct kvec *iov, int n_vec,
+	bool enc)
+{
+	struct crypto_aead *tfm = enc ? sess->enc_tfm : sess->dec_tfm;
+	struct cifsd_split_gcm *split = enc ? sess->enc_split : sess->dec_split;
+	unsigned int crypt_len = le32_to_cpu(tr_hdr->OriginalMessageSize);
+	struct kvec aad = { tr_hdr->Nonce, SMB2_TRANSFORM_AAD_SIZE };
+	struct kvec tag = { tr_hdr->Signature, SMB2_SIGNATURE_SIZE };
+	DECLARE_CRYPTO_WAIT(wait);
+	struct aead_request *req;
+	struct scatterlist *sg, *sg_end;
+	u8 *iv;
+	int nr_sg, rc;
+
+	if (!tfm) {
+		cifsd_debug("session encryption key is not set\n");
+		return -EINVAL;
+	}
+
+	if (cifsd_cipher_is_gcm(sess->conn->CipherId) &&
+	    cifsd_split_gcm_wanted(split, crypt_len))
+		return cifsd_split_gcm_crypt(split, tr_hdr->Nonce, &aad, 1,
+				iov, n_vec, tr_hdr->Signature, enc);
+
+	nr_sg = cifsd_iov_nr_sg(&aad, 1) + cifsd_iov_nr_sg(iov, n_vec) +
+		cifsd_iov_nr_sg(&tag, 1);
+	sg = kmalloc(nr_sg * sizeof(struct scatterlist) + AES_BLOCK_SIZE,
+			GFP_KERNEL);
+	if (!sg)
+		return -ENOMEM;
+
+	req = aead_request_alloc(tfm, GFP_KERNEL);
+	if (!req) {
+		kfree(sg);
+		return -ENOMEM;
+	}
+
+	iv = (u8 *)(sg + nr_sg);
+	memset(iv, 0, AES_BLOCK_SIZE);
+	if (cifsd_cipher_is_gcm(sess->conn->CipherId)) {
+		memcpy(iv, tr_hdr->Nonce, SMB3_AES_GCM_NONCE);
+	} else {
+		/* CCM flags byte: 4 byte length field, L' = 3 */
+		iv[0] = 3;
+		memcpy(iv + 1, tr_hdr->Nonce, SMB3_AES_CCM_NONCE);
+	}
+
+	sg_init_table(sg, nr_sg);
+	sg_end = cifsd_iov_to_sg(sg, &aad, 1);
+	sg_end = cifsd_iov_to_sg(sg_end, iov, n_vec);
+	cifsd_iov_to_sg(sg_end, &tag, 1);
+
+	aead_request_set_callback(req, CRYPTO_TFM_REQ_MAY_BACKLOG |
+			CRYPTO_TFM_REQ_MAY_SLEEP, crypto_req_done, &wait);
+	aead_request_set_ad(req, SMB2_TRANSFORM_AAD_SIZE);
+	aead_request_set_crypt(req, sg, sg,
+			enc ? crypt_len : crypt_len + SMB2_SIGNATURE_SIZE, iv);
+
+	if (enc)
+		rc = crypto_wait_req(crypto_aead_encrypt(req), &wait);
+	else
+		rc = crypto_wait_req(crypto_aead_decrypt(req), &wait);
+	if (rc)
+		cifsd_debug("%scrypt error %d\n", enc ? "en" : "de", rc);
+
+	aead_request_free(req);
+	kfree(sg);
+	return rc;
+}
+
+int cifsd_crypt_message(struct cifsd_sess *sess,
+	struct smb2_transform_hdr *tr_hdr, struct kvec *iov, int n_vec,
+	bool enc)
+{
+	int rc;
+
+	/* a re-authentication does not swap the keys under the message */
+	down_read(&sess->key_sem);
+	rc = __cifsd_crypt_message(sess, tr_hdr, iov, n_vec, enc);
+	up_read(&sess->key_sem);
+	return rc;
+}
+#else
+int compute_smb3xencryptionkey(struct connection *conn,
+	struct cifsd_sess *sess)
+{
+	return -EOPNOTSUPP;
+}
+
+int cifsd_crypt_message(struct cifsd_sess *sess,
+	struct smb2_transform_hdr *tr_hdr, struct kvec *iov, int n_vec,
+	bool enc)
+{
+	return -EOPNOTSUPP;
+}
+#endif
+
 int calc_preauth_integrity_hash(struct connection *conn, char *buf,
 	__u8 *pi_hash)
 {
 	int rc = -1;
-	struct crypto_shash *c_shash;
-	struct sdesc *c_sdesc;
+	struct cifsd_crypto_ctx *ctx;
 	struct smb2_hdr *rcv_hdr2 = (struct smb2_hdr *)buf;
 	char *all_bytes_msg = rcv_hdr2->ProtocolId;
 	int msg_size = be32_to_cpu(rcv_hdr2->smb2_buf_length);
 
-	if (conn->Preauth_HashId == SMB2_PREAUTH_INTEGRITY_SHA512) {
-		rc = crypto_sha512_alloc(conn);
-		if (rc) {
-			cifsd_debug("could not alloc sha512 rc %d\n", rc);
-			goto out;
-		}
+	if (conn->Preauth_HashId != SMB2_PREAUTH_INTEGRITY_SHA512)
+		return rc;
 
-		c_shash = conn->secmech.sha512;
-		c_sdesc = conn->secmech.sdescsha512;
-	} else
-		goto out;
+	ctx = cifsd_find_crypto_ctx(CRYPTO_SHASH_SHA512);
+	if (!ctx) {
+		cifsd_debug("could not alloc sha512\n");
+		return -ENOMEM;
+	}
 
-	rc = crypto_shash_init(&c_sdesc->shash);
+	rc = crypto_shash_init(CRYPTO_SHA512(ctx));
 	if (rc) {
 		cifsd_debug("could not init shashn");
 		goto out;
 	}
 
-	rc = crypto_shash_update(&c_sdesc->shash,
-				pi_hash, 64);
+	rc = crypto_shash_update(CRYPTO_SHA512(ctx), pi_hash, 64);
 	if (rc) {
 		cifsd_debug("could not update with n\n");
 		goto out;
 	}
 
-	rc = crypto_shash_update(&c_sdesc->shash, all_bytes_msg, msg_size);
+	rc = crypto_shash_update(CRYPTO_SHA512(ctx), all_bytes_msg, msg_size);
 	if (rc) {
 		cifsd_debug("could not update with n\n");
 		goto out;
 	}
 
-	rc = crypto_shash_final(&c_sdesc->shash, pi_hash);
+	rc = crypto_shash_final(CRYPTO_SHA512(ctx), pi_hash);
 	if (rc) {
 		cifsd_debug("Could not generate hash err : %d\n", rc);
 		goto out;
 	}
 out:
+	cifsd_release_crypto_ctx(ctx);
 	return rc;
 }
 #endif
@@ -0,0 +1,160 @@
+/*
+ *   fs/cifsd/crypto_ctx.c
+ *
+ *   Copyright (C) 2016 Namjae Jeon <namjae.jeon@protocolfreedom.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/cpumask.h>
+
+#include "glob.h"
+#include "crypto_ctx.h"
+
+/*
+ * Hash transforms used for authentication, SMB1 signing, key derivation
+ * and preauth integrity
+ *
+ * Transforms are allocated once per CPU at module load instead of once
+ * per connection, so a burst of logons does not allocate transforms and
+ * an idle connection does not hold any. A keyed hash keeps its key in
+ * the transform, so a context is used by one caller at a time: it is
+ * keyed, hashed with and released under its lock. Callers pick the
+ * context of the CPU they run on, which is usually uncontended.
+ */
+
+static struct cifsd_crypto_ctx *crypto_ctxs;
+
+static const char * const shash_names[CRYPTO_SHASH_MAX] = {
+	[CRYPTO_SHASH_HMACMD5]		= "hmac(md5)",
+	[CRYPTO_SHASH_MD5]		= "md5",
+	[CRYPTO_SHASH_HMACSHA256]	= "hmac(sha256)",
+	[CRYPTO_SHASH_SHA512]		= "sha512",
+};
+
+static struct sdesc *alloc_shash_desc(int id)
+{
+	struct crypto_shash *tfm;
+	struct sdesc *desc;
+
+	tfm = crypto_alloc_shash(shash_names[id], 0, 0);
+	if (IS_ERR(tfm)) {
+		cifsd_debug("could not allocate crypto %s\n", shash_names[id]);
+		return NULL;
+	}
+
+	desc = kmalloc(sizeof(struct sdesc) + crypto_shash_descsize(tfm),
+			GFP_KERNEL);
+	if (!desc) {
+		crypto_free_shash(tfm);
+		return NULL;
+	}
+
+	desc->shash.tfm = tfm;
+	desc->shash.flags = 0x0;
+	return desc;
+}
+
+static void free_shash_desc(struct sdesc *desc)
+{
+	if (!desc)
+		return;
+
+	crypto_free_shash(desc->shash.tfm);
+	kzfree(desc);
+}
+
+/**
+ * cifsd_find_crypto_ctx() - take the crypto context of the current CPU
+ * @id:		CRYPTO_SHASH_* transform the caller needs
+ *
+ * Return:	locked context with transform @id, to be released with
+ *		cifsd_release_crypto_ctx(), NULL if it can not be allocated
+ */
+struct cifsd_crypto_ctx *cifsd_find_crypto_ctx(int id)
+{
+	struct cifsd_crypto_ctx *ctx;
+
+	/* any context works, migrating after the pick is harmless */
+	ctx = &crypto_ctxs[raw_smp_processor_id()];
+	mutex_lock(&ctx->lock);
+
+	/* allocation failed at load, or the CPU came up later */
+	if (!ctx->desc[id]) {
+		ctx->desc[id] = alloc_shash_desc(id);
+		if (!ctx->desc[id]) {
+			mutex_unlock(&ctx->lock);
+			return NULL;
+		}
+	}
+	return ctx;
+}
+
+/**
+ * cifsd_release_crypto_ctx() - release a context taken with
+ *				cifsd_find_crypto_ctx()
+ * @ctx:	crypto context
+ */
+void cifsd_release_crypto_ctx(struct cifsd_crypto_ctx *ctx)
+{
+	mutex_unlock(&ctx->lock);
+}
+
+/**
+ * cifsd_crypto_ctx_init() - allocate the per CPU crypto contexts
+ *
+ * Return:	0 on success, otherwise -ENOMEM
+ */
+int cifsd_crypto_ctx_init(void)
+{
+	struct cifsd_crypto_ctx *ctx;
+	int cpu, id;
+
+	crypto_ctxs = kcalloc(nr_cpu_ids, sizeof(struct cifsd_crypto_ctx),
+			GFP_KERNEL);
+	if (!crypto_ctxs)
+		return -ENOMEM;
+
+	for (cpu = 0; cpu < nr_cpu_ids; cpu++)
+		mutex_init(&crypto_ctxs[cpu].lock);
+
+	/* a missing algorithm only fails the requests that need it */
+	for_each_possible_cpu(cpu) {
+		ctx = &crypto_ctxs[cpu];
+		for (id = 0; id < CRYPTO_SHASH_MAX; id++)
+			ctx->desc[id] = alloc_shash_desc(id);
+	}
+	return 0;
+}
+
+/**
+ * cifsd_crypto_ctx_exit() - free the per CPU crypto contexts
+ */
+void cifsd_crypto_ctx_exit(void)
+{
+	int cpu, id;
+
+	if (!crypto_ctxs)
+		return;
+
+	for (cpu = 0; cpu < nr_cpu_ids; cpu++) {
+		for (id = 0; id < CRYPTO_SHASH_MAX; id++)
+			free_shash_desc(crypto_ctxs[cpu].desc[id]);
+	}
+	kfree(crypto_ctxs);
+	crypto_ctxs = NULL;
+}
@@ -0,0 +1,54 @@
+/*
+ *   fs/cifsd/crypto_ctx.h
+ *
+ *   Copyright (C) 2016 Namjae Jeon <namjae.jeon@protocolfreedom.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#ifndef __CIFSD_CRYPTO_CTX_H
+#define __CIFSD_CRYPTO_CTX_H
+
+#include <linux/mutex.h>
+#include <crypto/hash.h>
+
+enum {
+	CRYPTO_SHASH_HMACMD5	= 0,
+	CRYPTO_SHASH_MD5,
+	CRYPTO_SHASH_HMACSHA256,
+	CRYPTO_SHASH_SHA512,
+	CRYPTO_SHASH_MAX,
+};
+
+/* one per CPU, shared by all connections */
+struct cifsd_crypto_ctx {
+	struct mutex		lock;
+	struct sdesc		*desc[CRYPTO_SHASH_MAX];
+};
+
+#define CRYPTO_HMACMD5(c)	(&(c)->desc[CRYPTO_SHASH_HMACMD5]->shash)
+#define CRYPTO_MD5(c)		(&(c)->desc[CRYPTO_SHASH_MD5]->shash)
+#define CRYPTO_HMACSHA256(c)	(&(c)->desc[CRYPTO_SHASH_HMACSHA256]->shash)
+#define CRYPTO_SHA512(c)	(&(c)->desc[CRYPTO_SHASH_SHA512]->shash)
+
+#define CRYPTO_HMACMD5_TFM(c)	(CRYPTO_HMACMD5(c)->tfm)
+#define CRYPTO_HMACSHA256_TFM(c) (CRYPTO_HMACSHA256(c)->tfm)
+
+struct cifsd_crypto_ctx *cifsd_find_crypto_ctx(int id);
+void cifsd_release_crypto_ctx(struct cifsd_crypto_ctx *ctx);
+int cifsd_crypto_ctx_init(void);
+void cifsd_crypto_ctx_exit(void);
+
+#endif /* __CIFSD_CRYPTO_CTX_H */
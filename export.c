@@ -20,6 +20,8 @@
  */
 
 #include <linux/types.h>
+#include <linux/ctype.h>
+#include <linux/mutex.h>
 #include <linux/parser.h>
 #include "glob.h"
 #include "export.h"
@@ -40,7 +42,9 @@ struct cifsd_sysfs_obj *sysobj;
 LIST_HEAD(cifsd_usr_list);
 LIST_HEAD(cifsd_share_list);
 LIST_HEAD(cifsd_connection_list);
-LIST_HEAD(cifsd_session_list);
+/* all sessions by session id, lookups under RCU */
+DEFINE_HASHTABLE(cifsd_session_table, CIFSD_SESSION_HASH_BITS);
+DEFINE_SPINLOCK(cifsd_session_lock);
 
 __u16 vid = 1;
 __u16 tid = 1;
@@ -52,9 +56,18 @@ static inline void free_share(struct cifsd_share *share);
 /* Number of shares defined on server */
 int cifsd_num_shares;
 
+/*
+ * Exported shares are hashed by case-folded share name, tree connect looks
+ * them up under RCU. Shares are only added and changed from sysfs, under
+ * cifsd_share_lock, and are only freed on module exit.
+ */
+static DEFINE_HASHTABLE(cifsd_share_table, CIFSD_SHARE_HASH_BITS);
+static DEFINE_MUTEX(cifsd_share_lock);
+
 /* The parameters defined on configuration */
 int maptoguest;
 int server_signing;
+int server_encryption;
 char *guestAccountName;
 char *server_string;
 char *workgroup;
@@ -125,9 +138,52 @@ struct cifsd_pipe *get_pipe_desc(struct cifsd_sess *sess,
 	return NULL;
 }
 
+static inline u32 share_name_hash(const char *name)
+{
+	u32 hash = 0;
+
+	while (*name)
+		hash = hash * 31 + tolower(*name++);
+	return hash;
+}
+
 /**
- * __add_share() - helper function to add a share in global exported share list
- * @share:	share instance to be added to global share list
+ * __lookup_share() - find an exported share by name
+ * @sharename:	name of share, case insensitive
+ *
+ * Must be called under rcu_read_lock() or with cifsd_share_lock held.
+ *
+ * Return:      matching share if found, otherwise NULL
+ */
+static struct cifsd_share *__lookup_share(const char *sharename)
+{
+	struct cifsd_share *share;
+
+	hash_for_each_possible_rcu(cifsd_share_table, share, hlist,
+			share_name_hash(sharename)) {
+		if (!strcasecmp(share->sharename, sharename))
+			return share;
+	}
+	return NULL;
+}
+
+/**
+ * publish_share() - make a share visible in global exported share list
+ * @share:	share instance, fully set up
+ *
+ * Must be called with cifsd_share_lock held.
+ */
+static void publish_share(struct cifsd_share *share)
+{
+	list_add_rcu(&share->list, &cifsd_share_list);
+	hash_add_rcu(cifsd_share_table, &share->hlist,
+			share_name_hash(share->sharename));
+	cifsd_num_shares++;
+}
+
+/**
+ * __add_share() - helper function to set up a share before it is published
+ * @share:	share instance to be set up
  * @sharename:	name of share
  * @pathname:	path of share point
  *
@@ -167,9 +223,6 @@ static bool __add_share(struct cifsd_share *share, char *sharename,
 	share->tcount = 0;
 	share->tid = tid++;
 	share->sharename = sharename;
-	INIT_LIST_HEAD(&share->list);
-	list_add(&share->list, &cifsd_share_list);
-	cifsd_num_shares++;
 	return true;
 }
 
@@ -194,6 +247,8 @@ static void init_params(struct cifsd_share *share)
  * @sharename:	name of share
  * @pathname:	path of share point
  *
+ * Must be called with cifsd_share_lock held.
+ *
  * Return:      0 on success, error number on error
  */
 static int add_share(char *sharename, char *pathname)
@@ -207,13 +262,22 @@ static int add_share(char *sharename, char *pathname)
 
 	init_params(share);
 
-	ret = __add_share(share, sharename, pathname);
-	if (!ret) {
-		free_share(share);
-		kfree(share);
+	if (__lookup_share(sharename)) {
+		cifsd_err("share %s is already exported\n", sharename);
+		ret = -EEXIST;
+		goto out;
+	}
+
+	if (!__add_share(share, sharename, pathname)) {
+		ret = -EINVAL;
+		goto out;
 	}
 
+	publish_share(share);
 	return 0;
+out:
+	kfree(share);
+	return ret;
 }
 
 /**
@@ -247,6 +311,7 @@ static void cifsd_share_free(void)
 	list_for_each_safe(tmp, t, &cifsd_share_list) {
 		share = list_entry(tmp, struct cifsd_share, list);
 		list_del(&share->list);
+		hash_del(&share->hlist);
 		cifsd_num_shares--;
 		free_share(share);
 		kfree(share);
@@ -254,21 +319,12 @@ static void cifsd_share_free(void)
 }
 
 /**
- * cleanup_bad_share() - remove a bad share, added while config parse error
- * @badshare:	share name to be removed
+ * cleanup_bad_share() - free a share that failed config parse, it was
+ *		never published
+ * @badshare:	share to be freed
  */
 static void cleanup_bad_share(struct cifsd_share *badshare)
 {
-	struct cifsd_share *share;
-	struct list_head *tmp, *t;
-
-	list_for_each_safe(tmp, t, &cifsd_share_list) {
-		share = list_entry(tmp, struct cifsd_share, list);
-		if (share != badshare)
-			continue;
-		list_del(&share->list);
-		cifsd_num_shares--;
-	}
 	free_share(badshare);
 	kfree(badshare);
 }
@@ -359,28 +415,28 @@ static int parse_user_strings(const char *src, char **str, int exp_num,
  * @userslist:	list of allowed or denied user or host
  * @str2:	check if this user or host is present in userslist
  *
- * Return:      1 if str2 is present in userslist, otherwise 0
+ * The list is scanned in place, so this can be called under rcu_read_lock().
+ *
+ * Return:      1 if str2 is present in userslist, -ENOENT if not,
+ *		0 if there is no list
  */
-static int chktkn(char *userslist, char *str2)
+static int chktkn(const char *userslist, const char *str2)
 {
-	char *token;
-	char *dup, *dup_orig;
-
-	if (userslist) {
-		dup_orig = dup = kstrdup(userslist, GFP_KERNEL);
-		if (!dup)
-			return -ENOMEM;
-
-		while ((token = strsep(&dup, "	, ")) != NULL) {
-			if (!strcmp(token, str2)) {
-				kfree(dup_orig);
-				return 1;
-			}
-		}
-		kfree(dup_orig);
-		return -ENOENT;
+	size_t len, str2_len;
+
+	if (!userslist)
+		return 0;
+
+	str2_len = strlen(str2);
+	for (;;) {
+		len = strcspn(userslist, "	, ");
+		if (len == str2_len && !strncmp(userslist, str2, len))
+			return 1;
+		if (!userslist[len])
+			break;
+		userslist += len + 1;
 	}
-	return 0;
+	return -ENOENT;
 }
 
 /**
@@ -388,12 +444,14 @@ static int chktkn(char *userslist, char *str2)
  * @cip:	host ip to be checked
  * @share:	share config containing allowed and denied list of client ip
  *
+ * Must be called under rcu_read_lock().
+ *
  * Return:      1 if cip is allowed access to share, otherwise 0
  */
 int validate_host(char *cip, struct cifsd_share *share)
 {
-	char *alist = share->config.allow_hosts;
-	char *dlist = share->config.deny_hosts;
+	char *alist = rcu_dereference(share->config.allow_hosts);
+	char *dlist = rcu_dereference(share->config.deny_hosts);
 	int allow, deny;
 	int asz = 0;
 	int dsz = 0;
@@ -409,8 +467,6 @@ int validate_host(char *cip, struct cifsd_share *share)
 	allow = chktkn(alist, cip);
 	if (allow == -ENOENT)
 		return -EACCES;
-	else if (allow < 0)
-		return allow;
 
 	/*
 	 * "allow hosts" list takes precedence over "deny hosts" list,
@@ -420,10 +476,7 @@ int validate_host(char *cip, struct cifsd_share *share)
 		return 1;
 
 	deny = chktkn(dlist, cip);
-	if (deny < 0)
-		return -ENOMEM;
-
-	if (!asz && deny)
+	if (!asz && deny > 0)
 		return -EACCES;
 
 	/*
@@ -438,15 +491,17 @@ int validate_host(char *cip, struct cifsd_share *share)
  * @usr:	user to be checked
  * @share:	share config containing allowed and denied list of users
  *
+ * Must be called under rcu_read_lock().
+ *
  * Return:      1 if usr is allowed access to share, otherwise error
  */
 int validate_usr(struct cifsd_sess *sess, struct cifsd_share *share,
 	bool *can_write)
 {
-	char *vlist = share->config.valid_users;
-	char *ilist = share->config.invalid_users;
-	char *wlist = share->config.write_list;
-	char *rlist = share->config.read_list;
+	char *vlist = rcu_dereference(share->config.valid_users);
+	char *ilist = rcu_dereference(share->config.invalid_users);
+	char *wlist = rcu_dereference(share->config.write_list);
+	char *rlist = rcu_dereference(share->config.read_list);
 	int ret;
 
 	/* for share IPC$, does not support smb.conf share parameters*/
@@ -466,8 +521,6 @@ int validate_usr(struct cifsd_sess *sess, struct cifsd_share *share,
 
 	/* name should not be present in "invalid users" */
 	ret = chktkn(ilist, sess->usr->name);
-	if (ret == -ENOMEM)
-		return -ENOMEM;
 	if (ret > 0)
 		return -EACCES;
 
@@ -494,54 +547,34 @@ struct cifsd_share *get_cifsd_share(struct connection *conn,
 		struct cifsd_sess *sess,
 		char *sharename, bool *can_write)
 {
-	struct list_head *tmp;
 	struct cifsd_share *share;
 	int rc;
 
-	list_for_each(tmp, &cifsd_share_list) {
-		share = list_entry(tmp, struct cifsd_share, list);
-		cifsd_debug("comparing(%s) with treename %s\n",
-				sharename, share->sharename);
-		if (!strcasecmp(share->sharename, sharename)) {
-			rc = validate_host(conn->peeraddr, share);
-			if (rc < 0) {
-				cifsd_err(
-				"[host:%s] not allowed for [share:%s]\n"
-				, conn->peeraddr, share->sharename);
-				return ERR_PTR(rc);
-			}
-			rc = validate_usr(sess, share, can_write);
-			if (rc < 0) {
-				cifsd_err(
-				"[user:%s] not authorised for [share:%s]\n",
-				sess->usr->name, share->sharename);
-				return ERR_PTR(rc);
-			}
-			return share;
-		}
+	/* shares are not freed while the module is loaded */
+	rcu_read_lock();
+	share = __lookup_share(sharename);
+	if (!share) {
+		rcu_read_unlock();
+		cifsd_debug("Tree(%s) not exported on connection\n",
+				sharename);
+		return ERR_PTR(-ENOENT);
 	}
-	cifsd_debug("Tree(%s) not exported on connection\n", sharename);
-	return ERR_PTR(-ENOENT);
-}
-
-/**
- * find_matching_share() - get a share instance from tree id
- * @tid:	tree id for share instance lookup
- *
- * Return:      share if there is matching share tid, otherwise NULL
- */
-struct cifsd_share *find_matching_share(__u16 tid)
-{
-	struct cifsd_share *share;
-	struct list_head *tmp;
 
-	list_for_each(tmp, &cifsd_share_list) {
-		share = list_entry(tmp, struct cifsd_share, list);
-		if (share->tid == tid)
-			return share;
+	rc = validate_host(conn->peeraddr, share);
+	if (rc < 0) {
+		rcu_read_unlock();
+		cifsd_err("[host:%s] not allowed for [share:%s]\n",
+				conn->peeraddr, share->sharename);
+		return ERR_PTR(rc);
 	}
-
-	return NULL;
+	rc = validate_usr(sess, share, can_write);
+	rcu_read_unlock();
+	if (rc < 0) {
+		cifsd_err("[user:%s] not authorised for [share:%s]\n",
+				sess->usr->name, share->sharename);
+		return ERR_PTR(rc);
+	}
+	return share;
 }
 
 struct cifsd_usr *cifsd_is_user_present(char *name)
@@ -583,6 +616,8 @@ struct cifsd_usr *get_smb_session_user(struct cifsd_sess *sess)
  * check_sharepath() - check if a share path is already exported
  * @path:	share path to check
  *
+ * Must be called with cifsd_share_lock held.
+ *
  * Return:      false if share is already exported, otherwise true
  */
 static bool check_sharepath(char *path)
@@ -637,27 +672,21 @@ static bool getUser(char *name, char *pass)
 /**
  * check_share() - check if a share name is already exported,if not
  *		allocate a new empty share
- * @share_buf:	buffer containing share name
- * @share_sz:	share name length
+ * @share_name:	share name
+ * @alloc_share:	set if a new share is allocated
  *
- * Return:      share name if already exported, otherwise NULL
+ * Must be called with cifsd_share_lock held.
+ *
+ * Return:      exported share if found, otherwise new unpublished share
  */
 static struct cifsd_share *check_share(char *share_name, int *alloc_share)
 {
 	struct cifsd_share *share;
-	struct list_head *tmp;
-	int srclen;
 
-	list_for_each(tmp, &cifsd_share_list) {
-		share = list_entry(tmp, struct cifsd_share, list);
-		srclen = strlen(share->sharename);
-		if (srclen == strlen(share_name)) {
-			if (strncasecmp(share->sharename,
-					share_name, srclen) == 0) {
-				return share;
-			}
-		}
-	}
+	*alloc_share = 0;
+	share = __lookup_share(share_name);
+	if (share)
+		return share;
 
 	share = kzalloc(sizeof(struct cifsd_share), GFP_KERNEL);
 	if (!share)
@@ -685,6 +714,7 @@ static ssize_t share_show(struct kobject *kobj,
 	ssize_t len = 0, total = 0, limit = PAGE_SIZE;
 	char *tbuf = buf;
 
+	mutex_lock(&cifsd_share_lock);
 	list_for_each(tmp, &cifsd_share_list) {
 		share = list_entry(tmp, struct cifsd_share, list);
 		if (share->path) {
@@ -699,6 +729,7 @@ static ssize_t share_show(struct kobject *kobj,
 			limit -= len;
 		}
 	}
+	mutex_unlock(&cifsd_share_lock);
 
 	return total;
 }
@@ -727,16 +758,16 @@ static ssize_t share_store(struct kobject *kobj,
 	share = parse_ptr[0];
 	path = parse_ptr[1];
 
+	mutex_lock(&cifsd_share_lock);
 	/* check if sharepath is already exported */
-	rc = check_sharepath(path);
-	if (!rc) {
+	if (!check_sharepath(path)) {
 		cifsd_err("path %s is already exported\n", path);
-		kfree(share);
-		kfree(path);
-		return -EEXIST;
+		rc = -EEXIST;
+	} else {
+		rc = add_share(share, path);
 	}
+	mutex_unlock(&cifsd_share_lock);
 
-	rc = add_share(share, path);
 	if (rc) {
 		kfree(share);
 		kfree(path);
@@ -930,6 +961,7 @@ enum {
 	Opt_domain,
 	Opt_netbiosname,
 	Opt_signing,
+	Opt_encrypt,
 	Opt_maptoguest,
 	Opt_server_min_protocol,
 	Opt_server_max_protocol,
@@ -943,6 +975,7 @@ static const match_table_t cifsd_global_tokens = {
 	{ Opt_domain, "workgroup = %s" },
 	{ Opt_netbiosname, "netbios name = %s" },
 	{ Opt_signing, "server signing = %s" },
+	{ Opt_encrypt, "smb encrypt = %s" },
 	{ Opt_maptoguest, "map to guest = %s" },
 	{ Opt_server_min_protocol, "server min protocol = %s" },
 	{ Opt_server_max_protocol, "server max protocol = %s" },
@@ -1002,20 +1035,54 @@ static const match_table_t cifsd_share_tokens = {
 	{ Opt_share_err, NULL }
 };
 
+/* a replaced config string waiting for readers to be done with it */
+struct cifsd_config_str_free {
+	struct rcu_head rcu;
+	char *str;
+};
+
+static void cifsd_config_str_free_rcu(struct rcu_head *head)
+{
+	struct cifsd_config_str_free *cf;
+
+	cf = container_of(head, struct cifsd_config_str_free, rcu);
+	kfree(cf->str);
+	kfree(cf);
+}
+
 /*
  * cifsd_get_config_str() - get a configuration string
  * @arg:	configuration argument list
  * @config:	destination to store output config string
  *
+ * Share config strings are read under RCU by tree connect, so the new
+ * string is published first and the old one is freed after a grace period,
+ * without waiting for it under cifsd_share_lock.
+ *
  * Return:      0 on success, otherwise -ENOMEM
  */
 static int cifsd_get_config_str(substring_t args[], char **config)
 {
-	kfree(*config);
-	*config = match_strdup(args);
-	if (!*config)
+	struct cifsd_config_str_free *cf;
+	char *old = *config;
+	char *str;
+
+	str = match_strdup(args);
+	if (!str)
 		return -ENOMEM;
 
+	rcu_assign_pointer(*config, str);
+	if (!old)
+		return 0;
+
+	cf = kmalloc(sizeof(struct cifsd_config_str_free), GFP_KERNEL);
+	if (!cf) {
+		synchronize_rcu();
+		kfree(old);
+		return 0;
+	}
+	cf->str = old;
+	call_rcu(&cf->rcu, cifsd_config_str_free_rcu);
 	return 0;
 }
 
@@ -1113,6 +1180,10 @@ static int cifsd_parse_global_options(char *configdata)
 			if (cifsd_get_config_val(args, &server_signing) < 0)
 				goto out_nomem;
 			break;
+		case Opt_encrypt:
+			if (cifsd_get_config_val(args, &server_encryption) < 0)
+				goto out_nomem;
+			break;
 		case Opt_maptoguest:
 			if (cifsd_get_config_val(args, &maptoguest) < 0)
 				goto out_nomem;
@@ -1150,6 +1221,28 @@ config_err:
 	return 1;
 }
 
+/**
+ * cifsd_publish_new_share() - publish a share added by config once all of
+ *		its options are parsed
+ * @share:	share instance, may be NULL
+ * @new_share:	set if @share is not published yet, cleared on return
+ */
+static void cifsd_publish_new_share(struct cifsd_share *share,
+		unsigned int *new_share)
+{
+	if (!share || !*new_share)
+		return;
+
+	*new_share = 0;
+	if (!share->path) {
+		cifsd_err("share %s has no path, not exported\n",
+				share->sharename);
+		cleanup_bad_share(share);
+		return;
+	}
+	publish_share(share);
+}
+
 static int cifsd_parse_share_options(const char *configdata)
 {
 	struct cifsd_share *share = NULL;
@@ -1159,20 +1252,22 @@ static int cifsd_parse_share_options(const char *configdata)
 	char *string = NULL;
 	unsigned int val;
 	unsigned int new_share = 0;
+	bool skip_share = false;
 
 	separator[0] = '<';
 	separator[1] = 0;
 
 	if (!configdata)
-		goto config_err;
+		return 1;
 
 	configdata_copy = kstrndup(configdata, PAGE_SIZE, GFP_KERNEL);
 	if (!configdata_copy)
-		goto config_err;
+		return 1;
 
 	options = configdata_copy;
 	end = options + strlen(options);
 
+	mutex_lock(&cifsd_share_lock);
 	while ((data = strsep(&options, separator)) != NULL) {
 		substring_t args[MAX_OPT_ARGS];
 		int token;
@@ -1181,11 +1276,19 @@ static int cifsd_parse_share_options(const char *configdata)
 			continue;
 
 		token = match_token(data, cifsd_share_tokens, args);
+		/* options of a share that could not be added */
+		if (skip_share && token != Opt_sharename)
+			continue;
+
 		switch (token) {
 		case Opt_sharename:
 			string = match_strdup(args);
 			if (string == NULL)
 				goto out_nomem;
+			/* the previous share section is complete */
+			cifsd_publish_new_share(share, &new_share);
+			share = NULL;
+			skip_share = false;
 			if (!strncmp(string, "global", 6)) {
 				kfree(string);
 				if (cifsd_parse_global_options(options) != 0)
@@ -1198,7 +1301,10 @@ static int cifsd_parse_share_options(const char *configdata)
 					share = NULL;
 					goto config_err;
 				}
-				share->sharename = string;
+				if (new_share)
+					share->sharename = string;
+				else
+					kfree(string);
 			}
 			break;
 		case Opt_available:
@@ -1286,13 +1392,31 @@ static int cifsd_parse_share_options(const char *configdata)
 				goto out_nomem;
 			break;
 		case Opt_path:
-			if (!share || cifsd_get_config_str(args,
-						&share->path))
+			if (!share)
+				goto config_err;
+			string = match_strdup(args);
+			if (string == NULL)
 				goto out_nomem;
-			if (new_share && !__add_share(share, share->sharename,
-						share->path))
+			if (!new_share) {
+				/* requests may be using the path of a share */
+				if (!share->path || strcmp(share->path, string))
+					cifsd_err("path of share %s can not be changed\n",
+							share->sharename);
+				kfree(string);
+				break;
+			}
+			kfree(share->path);
+			share->path = string;
+			if (!__add_share(share, share->sharename,
+						share->path)) {
+				/* skip the share, keep the other sections */
 				cifsd_err("share add error %s:%s\n",
 						share->sharename, share->path);
+				cleanup_bad_share(share);
+				share = NULL;
+				new_share = 0;
+				skip_share = true;
+			}
 			break;
 		case Opt_readlist:
 			if (!share || cifsd_get_config_str(args,
@@ -1334,6 +1458,8 @@ static int cifsd_parse_share_options(const char *configdata)
 		}
 	}
 
+	cifsd_publish_new_share(share, &new_share);
+	mutex_unlock(&cifsd_share_lock);
 	kfree(configdata_copy);
 	return 0;
 
@@ -1343,6 +1469,7 @@ out_nomem:
 config_err:
 	if (new_share && share)
 		cleanup_bad_share(share);
+	mutex_unlock(&cifsd_share_lock);
 	kfree(configdata_copy);
 	return 1;
 }
@@ -1528,6 +1655,7 @@ static ssize_t config_show(struct kobject *kobj,
 	int cum = 0;
 	int ret = 0;
 
+	mutex_lock(&cifsd_share_lock);
 	list_for_each(tmp, &cifsd_share_list) {
 		share = list_entry(tmp, struct cifsd_share, list);
 		/* no need to show IPC$ share details */
@@ -1536,9 +1664,10 @@ static ssize_t config_show(struct kobject *kobj,
 
 		ret = show_share_config(buf, cum, share);
 		if (ret < 0)
-			return cum;
+			break;
 		cum += ret;
 	}
+	mutex_unlock(&cifsd_share_lock);
 
 	return cum;
 }
@@ -1571,7 +1700,6 @@ static ssize_t config_store(struct kobject *kobj,
 static ssize_t show_server_stat(char *buf)
 {
 	struct cifsd_share *share;
-	struct list_head *tmp;
 	int count = 0, cum = 0, ret = 0, limit = PAGE_SIZE;
 
 	ret = snprintf(buf+cum, limit - cum,
@@ -1581,11 +1709,12 @@ static ssize_t show_server_stat(char *buf)
 		return cum;
 	cum += ret;
 
-	list_for_each(tmp, &cifsd_share_list) {
-		share = list_entry(tmp, struct cifsd_share, list);
+	rcu_read_lock();
+	list_for_each_entry_rcu(share, &cifsd_share_list, list) {
 		if (share->path)
 			count++;
 	}
+	rcu_read_unlock();
 
 	ret = snprintf(buf+cum, limit - cum,
 			"Number of shares = %d\n", count);
@@ -1825,7 +1954,9 @@ static int cifsd_add_IPC_share(void)
 	memcpy(ipc, STR_IPC, len - 1);
 	ipc[len - 1] = '\0';
 
+	mutex_lock(&cifsd_share_lock);
 	rc = add_share(ipc, NULL);
+	mutex_unlock(&cifsd_share_lock);
 	if (rc)
 		kfree(ipc);
 
@@ -1866,6 +1997,7 @@ int cifsd_init_global_params(void)
 	memcpy(netbios_name, TGT_Name, len);
 
 	server_signing = 0;
+	server_encryption = 0;
 	maptoguest = 0;
 	server_min_pr = cifsd_min_protocol();
 	server_max_pr = cifsd_max_protocol();
@@ -1924,4 +2056,6 @@ void cifsd_export_exit(void)
 	cifsd_free_global_params();
 	cifsd_user_free();
 	cifsd_share_free();
+	/* replaced config strings still queued for freeing */
+	rcu_barrier();
 }
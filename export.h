@@ -38,7 +38,12 @@ extern int cifsd_debug_enable;
 extern struct list_head cifsd_usr_list;
 extern struct list_head cifsd_share_list;
 extern struct list_head cifsd_connection_list;
-extern struct list_head cifsd_session_list;
+
+#define CIFSD_SHARE_HASH_BITS		12
+#define CIFSD_SESSION_HASH_BITS		12
+extern DECLARE_HASHTABLE(cifsd_session_table, CIFSD_SESSION_HASH_BITS);
+/* protects cifsd_session_table and the session list of connections */
+extern spinlock_t cifsd_session_lock;
 
 /* Spinlock to protect global list */
 extern spinlock_t export_list_lock;
@@ -70,6 +75,7 @@ extern spinlock_t connect_list_lock;
 
 extern int cifsd_num_shares;
 extern int server_signing;
+extern int server_encryption;
 extern char *guestAccountName;
 extern int maptoguest;
 extern int server_max_pr;
@@ -104,22 +110,30 @@ struct cifsd_sess {
 	struct cifsd_usr *usr;
 	struct connection *conn;
 	struct list_head cifsd_ses_list;
-	struct list_head cifsd_ses_global_list;
-	struct list_head tcon_list;
-	struct hlist_head notify_table[64];
+	struct hlist_node hlist; /* cifsd_session_table */
+	struct rcu_head rcu;
+	atomic_t refcnt; /* session table and requests using it */
+	struct idr tcon_idr; /* tree connects by tree id */
+	spinlock_t tcon_lock;
 	int tcon_count;
 	int valid;
 	unsigned int sequence_number;
 	uint64_t sess_id;
 	struct ntlmssp_auth ntlmssp;
 	char sess_key[CIFS_KEY_SIZE];
+	struct crypto_shash *sign_tfm; /* hmac-sha256 keyed with sess_key */
+	struct crypto_aead *enc_tfm; /* server to client encryption */
+	struct crypto_aead *dec_tfm; /* client to server decryption */
+	struct cifsd_split_gcm *enc_split; /* gcm of large messages */
+	struct cifsd_split_gcm *dec_split;
+	struct rw_semaphore key_sem; /* rekeying against signing and crypto */
+	bool enc_forced; /* unencrypted requests are refused */
 	bool sign;
 	struct list_head cifsd_chann_list;
 	bool is_anonymous;
 	bool is_guest;
 	struct fidtable_desc fidtable;
 	int state;
-	__u8 Preauth_HashValue[64];
 	struct cifsd_pipe *pipe_desc[MAX_PIPE];
 	wait_queue_head_t pipe_q;
 	int ev_state;
@@ -185,15 +199,22 @@ struct cifsd_share {
 	struct share_config config;
 	/* global list of shares */
 	struct list_head list;
+	/* shares by name */
+	struct hlist_node hlist;
 	int writeable;
 };
 
 /* cifsd_tcon is coupled with cifsd_share */
+/* tree ids fit SMB1 Tid, 0xFFFF is not a valid one */
+#define CIFSD_MAX_TREE_ID	0xFFFF
+
 struct cifsd_tcon {
 	struct cifsd_share *share;
 	struct cifsd_sess *sess;
 	struct path share_path;
-	struct list_head tcon_list;
+	unsigned int id; /* tree id, unique in the session */
+	struct rcu_head rcu;
+	atomic_t refcnt; /* tree id and requests using it */
 	int writeable;
 	int maximal_access;
 };
@@ -208,7 +229,7 @@ struct cifsd_tcon {
  * Currently we have limited 1 cifsd session per tcp session.
  * However, multiple tree connect possible per session.
  * Each tree connect is associated with a share.
- * Tree cons are linked via tcon_list headed at cifsd_sess->tcon_list.
+ * Tree cons are indexed by tree id in cifsd_sess->tcon_idr.
  */
 
 /* functions */
@@ -217,7 +238,6 @@ extern int cifsd_min_protocol(void);
 extern int get_protocol_idx(char *str);
 extern int cifsd_init_registry(void);
 extern void cifsd_free_registry(void);
-extern struct cifsd_share *find_matching_share(__u16 tid);
 int validate_usr(struct cifsd_sess *sess, struct cifsd_share *share,
 	bool *can_write);
 int validate_host(char *cip, struct cifsd_share *share);
@@ -236,9 +256,24 @@ int smb2_sign_smbpdu(struct cifsd_sess *sess, struct kvec *iov, int n_vec,
 		char *sig);
 int smb3_sign_smbpdu(struct channel *chann, struct kvec *iov, int n_vec,
 		char *sig);
+int smb2_init_sign_tfm(struct cifsd_sess *sess);
+int smb3_init_sign_tfm(struct channel *chann);
 int compute_sess_key(struct cifsd_sess *sess, char *hash, char *hmac);
-int compute_smb3xsigningkey(struct cifsd_sess *sess,  __u8 *key,
+int compute_smb3xsigningkey(struct connection *conn, struct cifsd_sess *sess,
+	__u8 *key, unsigned int key_size);
+int compute_smb3xencryptionkey(struct connection *conn,
+	struct cifsd_sess *sess);
+bool cifsd_split_gcm_wanted(struct cifsd_split_gcm *ctx, unsigned int len);
+int cifsd_split_gcm_crypt(struct cifsd_split_gcm *ctx, const u8 *nonce,
+	struct kvec *assoc, int n_assoc, struct kvec *data, int n_data,
+	u8 *tag, bool enc);
+int cifsd_split_gcm_setkey(struct cifsd_split_gcm **pctx, const u8 *key,
 	unsigned int key_size);
+void cifsd_split_gcm_free(struct cifsd_split_gcm *ctx);
+struct smb2_transform_hdr;
+int cifsd_crypt_message(struct cifsd_sess *sess,
+	struct smb2_transform_hdr *tr_hdr, struct kvec *iov, int n_vec,
+	bool enc);
 extern struct cifsd_usr *cifsd_is_user_present(char *name);
 struct cifsd_share *get_cifsd_share(struct connection *conn,
 		struct cifsd_sess *sess, char *sharename, bool *can_write);
@@ -246,6 +281,9 @@ extern struct cifsd_tcon *construct_cifsd_tcon(struct cifsd_share *share,
 		struct cifsd_sess *sess);
 extern struct cifsd_tcon *get_cifsd_tcon(struct cifsd_sess *sess,
 			unsigned int tid);
+extern void cifsd_tcon_put(struct cifsd_tcon *tcon);
+extern void destroy_cifsd_tcon(struct cifsd_tcon *tcon);
+extern void destroy_cifsd_tcons(struct cifsd_sess *sess);
 struct cifsd_usr *get_smb_session_user(struct cifsd_sess *sess);
 #ifdef CONFIG_CIFS_SMB2_SERVER
 int cifsd_durable_reconnect(struct cifsd_sess *curr_sess,
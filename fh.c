@@ -26,6 +26,9 @@
 
 #include <linux/bootmem.h>
 #include <linux/xattr.h>
+#include <linux/pagemap.h>
+#include <linux/fadvise.h>
+#include <linux/interval_tree_generic.h>
 
 void fp_get(struct cifsd_file *fp)
 {
@@ -41,6 +44,298 @@ void fp_put(struct cifsd_file *fp)
 		wake_up(&fp->wq);
 }
 
+static bool readdir_ahead_enable = true;
+module_param(readdir_ahead_enable, bool, 0644);
+MODULE_PARM_DESC(readdir_ahead_enable,
+		"Read ahead next directory enumeration batch. Default: y/Y/1");
+
+#define READDIR_AHEAD_WORKERS	4
+#define READDIR_AHEAD_MIN_PART	32
+
+struct readdir_ahead_part {
+	struct work_struct	work;
+	struct cifsd_file	*dir_fp;
+	const char		*dirpath;
+	unsigned int		start;
+	unsigned int		end;
+};
+
+/**
+ * readdir_ahead_warm() - look up a range of buffered directory entries
+ * @work:	work of struct readdir_ahead_part
+ *
+ * Brings dentries and inodes of the entries into memory, so stat of them
+ * while answering the next QUERY_DIRECTORY does not wait for the disk.
+ */
+static void readdir_ahead_warm(struct work_struct *work)
+{
+	struct readdir_ahead_part *part =
+		container_of(work, struct readdir_ahead_part, work);
+	struct cifsd_file *dir_fp = part->dir_fp;
+	struct smb_dirent *de;
+	struct path path;
+	unsigned int off, reclen;
+	int dirlen = strlen(part->dirpath);
+	char *name;
+
+	name = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!name)
+		return;
+
+	memcpy(name, part->dirpath, dirlen);
+	name[dirlen] = '/';
+
+	for (off = part->start; off < part->end; off += reclen) {
+		de = (struct smb_dirent *)(dir_fp->readdir_data.dirent + off);
+		reclen = ALIGN(sizeof(struct smb_dirent) + de->namelen,
+				sizeof(__le64));
+
+		if (READ_ONCE(dir_fp->readdir_ahead_stop))
+			break;
+
+		if ((de->namelen == 1 && de->name[0] == '.') ||
+		    (de->namelen == 2 && de->name[0] == '.' &&
+		     de->name[1] == '.'))
+			continue;
+
+		if (dirlen + 1 + de->namelen >= PATH_MAX ||
+		    !cifsd_pattern_match(dir_fp->srch_pattern, de->name,
+					 de->namelen))
+			continue;
+
+		memcpy(name + dirlen + 1, de->name, de->namelen);
+		name[dirlen + 1 + de->namelen] = '\0';
+		if (!kern_path(name, 0, &path))
+			path_put(&path);
+	}
+
+	kfree(name);
+}
+
+/**
+ * readdir_ahead_work() - prepare next batch of a directory enumeration
+ * @work:	readdir_work of directory handle
+ *
+ * Refills the handle's dirent buffer when the previous response consumed
+ * it, then looks up the buffered entries, spread over a few workers.
+ */
+static void readdir_ahead_work(struct work_struct *work)
+{
+	struct cifsd_file *dir_fp =
+		container_of(work, struct cifsd_file, readdir_work);
+	struct readdir_ahead_part parts[READDIR_AHEAD_WORKERS];
+	struct smb_readdir_data r_data = {
+#if LINUX_VERSION_CODE > KERNEL_VERSION(3, 10, 30)
+		.ctx.actor = smb_filldir,
+#endif
+		.dirent = dir_fp->readdir_data.dirent
+	};
+	struct smb_dirent *de;
+	unsigned int off, reclen, count = 0, per, used;
+	char *buf, *dirpath;
+	int i, nr;
+
+	if (dir_fp->dirent_offset >= dir_fp->readdir_data.used) {
+		if (smb_vfs_readdir(dir_fp->filp, smb_filldir, &r_data) < 0)
+			goto out;
+		dir_fp->readdir_data.used = r_data.used;
+		dir_fp->readdir_data.full = r_data.full;
+		dir_fp->dirent_offset = 0;
+	}
+
+	used = dir_fp->readdir_data.used;
+	for (off = dir_fp->dirent_offset; off < used; off += reclen) {
+		de = (struct smb_dirent *)(dir_fp->readdir_data.dirent + off);
+		reclen = ALIGN(sizeof(struct smb_dirent) + de->namelen,
+				sizeof(__le64));
+		count++;
+	}
+	if (!count)
+		goto out;
+
+	buf = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!buf)
+		goto out;
+
+	dirpath = d_path(&dir_fp->filp->f_path, buf, PATH_MAX);
+	if (IS_ERR(dirpath))
+		goto out_free;
+
+	nr = min_t(int, READDIR_AHEAD_WORKERS,
+			DIV_ROUND_UP(count, READDIR_AHEAD_MIN_PART));
+	per = DIV_ROUND_UP(count, nr);
+
+	off = dir_fp->dirent_offset;
+	for (i = 0; i < nr; i++) {
+		parts[i].dir_fp = dir_fp;
+		parts[i].dirpath = dirpath;
+		parts[i].start = off;
+		for (count = 0; count < per && off < used; count++) {
+			de = (struct smb_dirent *)
+				(dir_fp->readdir_data.dirent + off);
+			off += ALIGN(sizeof(struct smb_dirent) + de->namelen,
+					sizeof(__le64));
+		}
+		parts[i].end = off;
+		INIT_WORK_ONSTACK(&parts[i].work, readdir_ahead_warm);
+		if (i)
+			schedule_work(&parts[i].work);
+	}
+
+	readdir_ahead_warm(&parts[0].work);
+	for (i = 0; i < nr; i++) {
+		flush_work(&parts[i].work);
+		destroy_work_on_stack(&parts[i].work);
+	}
+
+out_free:
+	kfree(buf);
+out:
+	fp_put(dir_fp);
+}
+
+/**
+ * cifsd_readdir_ahead() - start preparing next batch of an enumeration
+ * @dir_fp:	directory handle that just answered a QUERY_DIRECTORY
+ *
+ * The handle's enumeration state must not be touched until
+ * cifsd_readdir_ahead_wait() was called.
+ */
+void cifsd_readdir_ahead(struct cifsd_file *dir_fp)
+{
+	if (!readdir_ahead_enable || !dir_fp->readdir_data.dirent)
+		return;
+
+	dir_fp->readdir_ahead_stop = false;
+	fp_get(dir_fp);
+	if (!schedule_work(&dir_fp->readdir_work))
+		fp_put(dir_fp);
+}
+
+/**
+ * cifsd_readdir_ahead_wait() - stop read ahead of a directory handle
+ * @dir_fp:	directory handle
+ *
+ * Entries not looked up yet are left to the caller. The dirent buffer
+ * and position of the handle are stable once this returns.
+ */
+void cifsd_readdir_ahead_wait(struct cifsd_file *dir_fp)
+{
+	WRITE_ONCE(dir_fp->readdir_ahead_stop, true);
+	flush_work(&dir_fp->readdir_work);
+}
+
+static bool read_ahead_enable = true;
+module_param(read_ahead_enable, bool, 0644);
+MODULE_PARM_DESC(read_ahead_enable,
+		"Read ahead of sequentially read files. Default: y/Y/1");
+
+/* sequential reads seen before read ahead starts */
+#define READ_AHEAD_HITS		2
+#define READ_AHEAD_MIN_WINDOW	(256 * 1024)
+#define READ_AHEAD_MAX_WINDOW	(8 * 1024 * 1024)
+/* reads in flight a client may reorder, in units of the read size */
+#define READ_AHEAD_REORDER	8
+
+/**
+ * read_ahead_work() - bring the wanted range of a file into page cache
+ * @work:	ra.work of file handle
+ */
+static void read_ahead_work(struct work_struct *work)
+{
+	struct cifsd_file *fp = container_of(work, struct cifsd_file, ra.work);
+	struct file *filp = fp->filp;
+	loff_t start, end;
+
+	spin_lock(&fp->f_lock);
+	start = fp->ra.ra_issued;
+	end = fp->ra.ra_end;
+	fp->ra.ra_issued = end;
+	spin_unlock(&fp->f_lock);
+
+	if (end <= start)
+		goto out;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 19, 0)
+	vfs_fadvise(filp, start, end - start, POSIX_FADV_WILLNEED);
+#else
+	page_cache_sync_readahead(filp->f_mapping, &filp->f_ra, filp,
+			start >> PAGE_SHIFT,
+			DIV_ROUND_UP(end - start, PAGE_SIZE));
+#endif
+out:
+	fp_put(fp);
+}
+
+/**
+ * cifsd_read_ahead() - account a read and read ahead of a stream
+ * @fp:		file handle being read
+ * @pos:	offset of the read
+ * @count:	length of the read
+ *
+ * Clients pipeline large reads over several credits, so a sequential
+ * stream arrives somewhat out of order. A read is counted as part of the
+ * stream when it starts near the end of the highest read so far. Once a
+ * stream is established the next window past it is read ahead in the
+ * background, and the window grows while the stream keeps up with it.
+ */
+void cifsd_read_ahead(struct cifsd_file *fp, loff_t pos, size_t count)
+{
+	struct file *filp = fp->filp;
+	struct cifsd_read_ahead *ra = &fp->ra;
+	loff_t end = pos + count, isize, slack;
+	bool schedule = false;
+
+	if (!read_ahead_enable || !count || filp->f_mode & FMODE_RANDOM)
+		return;
+
+	isize = i_size_read(file_inode(filp));
+
+	spin_lock(&fp->f_lock);
+	slack = max_t(loff_t, ra->window, (loff_t)count * READ_AHEAD_REORDER);
+	if (ra->seq_end && pos >= ra->seq_end - slack &&
+	    pos <= ra->seq_end + slack) {
+		ra->hits++;
+		ra->seq_end = max(ra->seq_end, end);
+	} else {
+		ra->hits = fp->coption & FILE_SEQUENTIAL_ONLY_LE ?
+			READ_AHEAD_HITS : 0;
+		ra->window = max_t(unsigned int, READ_AHEAD_MIN_WINDOW,
+				min_t(size_t, count * 2, READ_AHEAD_MAX_WINDOW));
+		ra->seq_end = end;
+		ra->ra_end = end;
+		ra->ra_issued = end;
+	}
+
+	/* refill once less than half a window is left ahead of the stream */
+	if (ra->hits >= READ_AHEAD_HITS && ra->seq_end < isize &&
+	    ra->ra_end - ra->seq_end < ra->window / 2) {
+		if (ra->ra_end > ra->seq_end)
+			ra->window = min_t(unsigned int, ra->window * 2,
+					READ_AHEAD_MAX_WINDOW);
+		ra->ra_end = min(ra->seq_end + ra->window, isize);
+		if (ra->ra_issued < ra->seq_end)
+			ra->ra_issued = ra->seq_end;
+		schedule = true;
+	}
+	spin_unlock(&fp->f_lock);
+
+	if (schedule) {
+		fp_get(fp);
+		if (!schedule_work(&ra->work))
+			fp_put(fp);
+	}
+}
+
+/**
+ * cifsd_read_ahead_wait() - stop read ahead of a file handle
+ * @fp:		file handle
+ */
+void cifsd_read_ahead_wait(struct cifsd_file *fp)
+{
+	flush_work(&fp->ra.work);
+}
+
 /**
  * alloc_fid_mem() - alloc memory for fid management
  * @size:	mem allocation request size
@@ -312,6 +607,8 @@ insert_id_in_fidtable(struct cifsd_sess *sess, uint64_t sess_id,
 	INIT_LIST_HEAD(&fp->node);
 	spin_lock_init(&fp->f_lock);
 	init_waitqueue_head(&fp->wq);
+	INIT_WORK(&fp->readdir_work, readdir_ahead_work);
+	INIT_WORK(&fp->ra.work, read_ahead_work);
 
 	spin_lock(&sess->fidtable.fidtable_lock);
 	ftab = sess->fidtable.ftab;
@@ -390,6 +687,7 @@ void delete_id_from_fidtable(struct cifsd_sess *sess, unsigned int id)
 {
 	struct cifsd_file *fp;
 	struct fidtable *ftab;
+	struct ci_index *short_names;
 
 	spin_lock(&sess->fidtable.fidtable_lock);
 	ftab = sess->fidtable.ftab;
@@ -399,6 +697,10 @@ void delete_id_from_fidtable(struct cifsd_sess *sess, unsigned int id)
 	spin_lock(&fp->f_lock);
 	if (fp->is_stream)
 		kfree(fp->stream.name);
+	kfree(fp->srch_pattern);
+	fp->srch_pattern = NULL;
+	short_names = fp->short_names;
+	fp->short_names = NULL;
 	fp->f_mfp = NULL;
 	spin_unlock(&fp->f_lock);
 	fp_put(fp);
@@ -411,6 +713,70 @@ void delete_id_from_fidtable(struct cifsd_sess *sess, unsigned int id)
 
 	kmem_cache_free(cifsd_filp_cache, fp);
 	spin_unlock(&sess->fidtable.fidtable_lock);
+	cifsd_shortname_table_put(short_names);
+}
+
+static bool cifsd_fp_has_blocked_locks(struct cifsd_file *fp,
+		struct cifsd_mfile *mfp)
+{
+	struct cifsd_lock *lock;
+	bool pending = false;
+
+	spin_lock(&mfp->m_lock);
+	list_for_each_entry(lock, &fp->lock_list, flist) {
+		if (lock->work) {
+			pending = true;
+			break;
+		}
+	}
+	spin_unlock(&mfp->m_lock);
+	return pending;
+}
+
+/**
+ * cifsd_close_kick_blocked_locks() - detach the locks of a closing open
+ * @conn:	connection of the session the open belongs to
+ * @fp:		closing open
+ * @mfp:	master file of @fp
+ * @dispose:	granted locks are moved here, to be unlocked by the caller
+ *
+ * Pending blocked-lock requests are told the open is closing, the waiter
+ * keeps owning its lock until it has unlinked and freed it.
+ *
+ * Return:	true if there are blocked-lock requests left to wait for
+ */
+static bool cifsd_close_kick_blocked_locks(struct connection *conn,
+		struct cifsd_file *fp, struct cifsd_mfile *mfp,
+		struct list_head *dispose)
+{
+	struct cifsd_lock *lock, *tmp;
+	struct async_info *async;
+	bool pending = false;
+
+	/* request_lock nests outside m_lock, as in the lock waiters */
+	spin_lock(&conn->request_lock);
+	spin_lock(&mfp->m_lock);
+	list_for_each_entry_safe(lock, tmp, &fp->lock_list, flist) {
+		if (!lock->work) {
+			cifsd_lock_tree_remove(mfp, lock);
+			list_move(&lock->flist, dispose);
+			continue;
+		}
+
+		pending = true;
+		/* not gone async yet, it sees FP_FREEING once it is */
+		if (lock->work->type != ASYNC || !lock->work->async)
+			continue;
+		async = lock->work->async;
+		if (async->async_status == ASYNC_PROG) {
+			async->async_status = ASYNC_CLOSE;
+			if (async->cancel_fn)
+				async->cancel_fn(lock->work);
+		}
+	}
+	spin_unlock(&mfp->m_lock);
+	spin_unlock(&conn->request_lock);
+	return pending;
 }
 
 /**
@@ -431,6 +797,7 @@ int close_id(struct cifsd_sess *sess, uint64_t id, uint64_t p_id)
 	struct file *filp;
 	struct dentry *dir, *dentry;
 	struct cifsd_lock *lock, *tmp;
+	LIST_HEAD(dispose);
 	int err;
 
 	fp = get_id_from_fidtable(sess, id);
@@ -445,6 +812,9 @@ int close_id(struct cifsd_sess *sess, uint64_t id, uint64_t p_id)
 		return -ENOENT;
 	}
 
+	cifsd_readdir_ahead_wait(fp);
+	cifsd_read_ahead_wait(fp);
+
 	spin_lock(&fp->f_lock);
 	mfp = fp->f_mfp;
 	fp->f_state = FP_FREEING;
@@ -453,6 +823,8 @@ int close_id(struct cifsd_sess *sess, uint64_t id, uint64_t p_id)
 	spin_unlock(&mfp->m_lock);
 	spin_unlock(&fp->f_lock);
 
+	cifsd_notify_release(fp);
+
 	close_id_del_oplock(sess->conn, fp, id);
 
 	if (fp->islink)
@@ -460,29 +832,30 @@ int close_id(struct cifsd_sess *sess, uint64_t id, uint64_t p_id)
 	else
 		filp = fp->filp;
 
-	list_for_each_entry_safe(lock, tmp, &fp->lock_list, flist) {
-		struct file_lock *flock = NULL;
-
-		if (lock->work && lock->work->type == ASYNC &&
-			lock->work->async->async_status == ASYNC_PROG) {
-			struct smb_work *async_work = lock->work;
-
-			async_work->async->async_status = ASYNC_CLOSE;
-		} else {
-			flock = smb_flock_init(filp);
-			flock->fl_type = F_UNLCK;
-			flock->fl_start = lock->start;
-			flock->fl_end = lock->end;
-			err = smb_vfs_lock(filp, 0, flock);
-			if (err)
-				cifsd_err("unlock fail : %d\n", err);
-			list_del(&lock->llist);
-			list_del(&lock->glist);
-			list_del(&lock->flist);
-			locks_free_lock(lock->fl);
-			locks_free_lock(flock);
-			kfree(lock);
-		}
+	/*
+	 * A lock whose blocked-lock request is still pending belongs to the
+	 * waiter, which unlinks and frees it. Kick those and wait for them
+	 * before unlocking the granted locks, mfp must outlive the waiters.
+	 * Waiters wake fp->wq whenever a lock stops pending, one granted
+	 * meanwhile is moved to dispose on the next pass.
+	 */
+	while (cifsd_close_kick_blocked_locks(sess->conn, fp, mfp, &dispose))
+		wait_event(fp->wq, !cifsd_fp_has_blocked_locks(fp, mfp));
+
+	list_for_each_entry_safe(lock, tmp, &dispose, flist) {
+		struct file_lock *flock;
+
+		flock = smb_flock_init(filp);
+		flock->fl_type = F_UNLCK;
+		flock->fl_start = lock->start;
+		flock->fl_end = lock->end;
+		err = smb_vfs_lock(filp, 0, flock);
+		if (err)
+			cifsd_err("unlock fail : %d\n", err);
+		list_del(&lock->flist);
+		locks_free_lock(lock->fl);
+		locks_free_lock(flock);
+		kfree(lock);
 	}
 
 	if (fp->is_stream && (mfp->m_flags & S_DEL_ON_CLS_STREAM)) {
@@ -1141,6 +1514,9 @@ int smb_kern_path(char *name, unsigned int flags, struct path *path,
  * @dirname:	directory name
  * @filename:	filename to lookup
  *
+ * Caseless lookups are answered from the per-directory name index,
+ * directory is scanned linearly only if it could not be indexed.
+ *
  * Return:	0 on success, otherwise error
  */
 int smb_search_dir(char *dirname, char *filename)
@@ -1159,23 +1535,29 @@ int smb_search_dir(char *dirname, char *filename)
 #if LINUX_VERSION_CODE > KERNEL_VERSION(3, 10, 30)
 		.ctx.actor = smb_filldir,
 #endif
-		.dirent = (void *)__get_free_page(GFP_KERNEL)
 	};
 
-	if (!readdir_data.dirent) {
-		ret = -ENOMEM;
-		goto out;
-	}
-
 	ret = smb_kern_path(dirname, 0, &dir_path, true);
 	if (ret)
 		goto out;
 
+	ret = cifsd_ci_index_lookup(&dir_path, filename, namelen,
+			dirname + dirnamelen + 1);
+	if (ret != -EOPNOTSUPP)
+		goto out2;
+
+	readdir_data.dirent = (void *)__get_free_page(GFP_KERNEL);
+	if (!readdir_data.dirent) {
+		ret = -ENOMEM;
+		goto out2;
+	}
+
+	ret = 0;
 	dfilp = dentry_open(&dir_path, flags, current_cred());
 	if (IS_ERR(dfilp)) {
 		cifsd_err("cannot open directory %s\n", dirname);
 		ret = -EINVAL;
-		goto out2;
+		goto out3;
 	}
 
 	while (!ret && !match_found) {
@@ -1209,8 +1591,9 @@ int smb_search_dir(char *dirname, char *filename)
 		}
 	}
 
-	free_page((unsigned long)(readdir_data.dirent));
 	fput(dfilp);
+out3:
+	free_page((unsigned long)(readdir_data.dirent));
 out2:
 	path_put(&dir_path);
 out:
@@ -1350,9 +1733,75 @@ void mfp_init(struct cifsd_mfile *mfp, struct inode *inode)
 	mfp->m_flags = 0;
 	INIT_LIST_HEAD(&mfp->m_fp_list);
 	spin_lock_init(&mfp->m_lock);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 14, 0)
+	mfp->m_lock_tree = RB_ROOT_CACHED;
+#else
+	mfp->m_lock_tree = RB_ROOT;
+#endif
+	mfp->m_sync_pending = NULL;
+	mfp->m_sync_running = false;
+	init_waitqueue_head(&mfp->m_sync_wq);
 	insert_mfp_hash(mfp);
 }
 
+#define LOCK_START(lock)	((lock)->start)
+#define LOCK_LAST(lock)		((lock)->end)
+
+INTERVAL_TREE_DEFINE(struct cifsd_lock, rb, loff_t, __subtree_last,
+		LOCK_START, LOCK_LAST, static, lock_tree);
+
+/**
+ * cifsd_lock_tree_insert() - add a byte range lock to its master file
+ * @mfp:	master file of the locked inode, m_lock held
+ * @lock:	lock to add
+ */
+void cifsd_lock_tree_insert(struct cifsd_mfile *mfp, struct cifsd_lock *lock)
+{
+	lock_tree_insert(lock, &mfp->m_lock_tree);
+}
+
+/**
+ * cifsd_lock_tree_remove() - remove a byte range lock from its master file
+ * @mfp:	master file of the locked inode, m_lock held
+ * @lock:	lock to remove, nothing is done if it is not in the tree
+ */
+void cifsd_lock_tree_remove(struct cifsd_mfile *mfp, struct cifsd_lock *lock)
+{
+	if (RB_EMPTY_NODE(&lock->rb))
+		return;
+
+	lock_tree_remove(lock, &mfp->m_lock_tree);
+	RB_CLEAR_NODE(&lock->rb);
+}
+
+/**
+ * cifsd_lock_tree_first() - find first lock overlapping a byte range
+ * @mfp:	master file of the locked inode, m_lock held
+ * @start:	first byte of range
+ * @end:	last byte of range
+ *
+ * Return:	overlapping lock, or NULL if there is none
+ */
+struct cifsd_lock *cifsd_lock_tree_first(struct cifsd_mfile *mfp,
+		loff_t start, loff_t end)
+{
+	return lock_tree_iter_first(&mfp->m_lock_tree, start, end);
+}
+
+/**
+ * cifsd_lock_tree_next() - find next lock overlapping a byte range
+ * @lock:	lock returned by previous call
+ * @start:	first byte of range
+ * @end:	last byte of range
+ *
+ * Return:	overlapping lock, or NULL if there is none
+ */
+struct cifsd_lock *cifsd_lock_tree_next(struct cifsd_lock *lock,
+		loff_t start, loff_t end)
+{
+	return lock_tree_iter_next(lock, start, end);
+}
+
 void mfp_free(struct cifsd_mfile *mfp)
 {
 	remove_mfp_hash(mfp);
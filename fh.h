@@ -72,6 +72,30 @@ struct smb_readdir_data {
 	unsigned int   dirent_count;
 };
 
+#define CIFSD_PATTERN_MAX	1024
+
+enum cifsd_pattern_type {
+	PATTERN_EMPTY,
+	PATTERN_ANY,
+	PATTERN_LITERAL,
+	PATTERN_PREFIX,
+	PATTERN_SUFFIX,
+	PATTERN_GENERIC
+};
+
+/* search pattern compiled once per directory handle */
+struct cifsd_pattern {
+	enum cifsd_pattern_type type;
+	/* non-wildcard part for prefix and suffix patterns */
+	const char *fixed;
+	unsigned int fixed_len;
+	unsigned int len;
+	/* pattern as sent by client, to detect a changed pattern */
+	char *orig;
+	/* case folded pattern */
+	char str[];
+};
+
 struct smb_dirent {
 	__le64         ino;
 	__le64          offset;
@@ -80,15 +104,11 @@ struct smb_dirent {
 	char            name[];
 };
 
-struct notification {
-	unsigned int mode;
-	struct list_head queuelist;
-	struct smb_work *work;
-};
-
 struct cifsd_lock {
 	struct file_lock *fl;
-	struct list_head glist;
+	/* node in m_lock_tree of the master file, keyed by [start, end] */
+	struct rb_node rb;
+	loff_t __subtree_last;
 	struct list_head llist;
 	struct list_head flist;
 	unsigned int flags;
@@ -105,6 +125,15 @@ struct stream {
 	ssize_t size;
 };
 
+/* write through writes and flushes of an inode synced together */
+struct cifsd_sync_batch {
+	loff_t start;
+	loff_t end;
+	int nr_waiters;
+	bool done;
+	int err;
+};
+
 struct cifsd_mfile {
 	spinlock_t m_lock;
 	atomic_t m_count;
@@ -112,6 +141,28 @@ struct cifsd_mfile {
 	unsigned int m_flags;
 	struct hlist_node m_hash;
 	struct list_head m_fp_list;
+	/* byte range locks of all opens, protected by m_lock */
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 14, 0)
+	struct rb_root_cached m_lock_tree;
+#else
+	struct rb_root m_lock_tree;
+#endif
+	/* group commit, protected by m_lock */
+	struct cifsd_sync_batch *m_sync_pending;
+	bool m_sync_running;
+	wait_queue_head_t m_sync_wq;
+};
+
+struct cifsd_read_ahead {
+	/* end of the highest read of the current stream */
+	loff_t		seq_end;
+	/* end of the range wanted in the page cache */
+	loff_t		ra_end;
+	/* end of the range handed to the page cache */
+	loff_t		ra_issued;
+	unsigned int	window;
+	unsigned int	hits;
+	struct work_struct	work;
 };
 
 struct cifsd_file {
@@ -123,8 +174,15 @@ struct cifsd_file {
 	bool islink;
 	/* if ls is happening on directory, below is valid*/
 	struct smb_readdir_data	readdir_data;
+	struct cifsd_pattern	*srch_pattern;
+	struct ci_index		*short_names;
 	int	dot_dotdot[2];
 	int	dirent_offset;
+	/* background read ahead of the next enumeration batch */
+	struct work_struct	readdir_work;
+	bool	readdir_ahead_stop;
+	/* sequential read detection and read ahead, under f_lock */
+	struct cifsd_read_ahead	ra;
 	/* oplock info */
 	struct ofile_info *ofile;
 	bool is_nt_open;
@@ -144,8 +202,8 @@ struct cifsd_file {
 	bool is_stream;
 	struct stream stream;
 	struct list_head node;
-	struct hlist_node notify_node;
-	struct list_head queue;
+	/* change notify state, set by the first CHANGE_NOTIFY */
+	struct cifsd_notify_handle *notify;
 	struct list_head lock_list;
 	spinlock_t f_lock;
 	wait_queue_head_t wq;
@@ -226,8 +284,61 @@ void mfp_free(struct cifsd_mfile *mfp);
 void insert_mfp_hash(struct cifsd_mfile *mfp);
 void remove_mfp_hash(struct cifsd_mfile *mfp);
 struct cifsd_mfile *mfp_lookup(struct inode *inode);
+void cifsd_lock_tree_insert(struct cifsd_mfile *mfp, struct cifsd_lock *lock);
+void cifsd_lock_tree_remove(struct cifsd_mfile *mfp, struct cifsd_lock *lock);
+struct cifsd_lock *cifsd_lock_tree_first(struct cifsd_mfile *mfp,
+		loff_t start, loff_t end);
+struct cifsd_lock *cifsd_lock_tree_next(struct cifsd_lock *lock,
+		loff_t start, loff_t end);
+
+/* caseless name index */
+int cifsd_ci_index_lookup(struct path *dir_path, const char *filename,
+		int namelen, char *realname);
+void cifsd_ci_index_invalidate(struct inode *dir);
+struct ci_index *cifsd_shortname_table_get(struct path *dir_path);
+void cifsd_shortname_table_put(struct ci_index *idx);
+int cifsd_shortname_lookup(struct ci_index *idx, const char *name, int len,
+		char *shortname);
+int cifsd_shortname_get(struct path *dir_path, const char *name, int len,
+		char *shortname);
+
+/* negative lookup cache */
+unsigned int cifsd_neg_cache_seq(void);
+bool cifsd_neg_cache_lookup(const char *name);
+void cifsd_neg_cache_add(const char *name, unsigned int seq);
+void cifsd_neg_cache_remove(const char *name);
+void cifsd_neg_cache_flush(void);
+void cifsd_namecache_exit(void);
+
+/* directory enumeration read ahead */
+void cifsd_readdir_ahead(struct cifsd_file *dir_fp);
+void cifsd_readdir_ahead_wait(struct cifsd_file *dir_fp);
+
+/* file data read ahead */
+void cifsd_read_ahead(struct cifsd_file *fp, loff_t pos, size_t count);
+void cifsd_read_ahead_wait(struct cifsd_file *fp);
+
+/* change notify */
+#ifdef CONFIG_SMB2_NOTIFY_SUPPORT
+int cifsd_notify_init(void);
+void cifsd_notify_exit(void);
+void cifsd_notify_release(struct cifsd_file *fp);
+#else
+static inline int cifsd_notify_init(void) { return 0; }
+static inline void cifsd_notify_exit(void) {}
+static inline void cifsd_notify_release(struct cifsd_file *fp) {}
+#endif
 
 #ifdef CONFIG_CIFS_SMB2_SERVER
+/* offload data transfer tokens */
+#define CIFSD_ODX_TOKEN_ID_LEN	32
+
+int cifsd_odx_token_create(struct cifsd_file *fp, loff_t offset,
+		loff_t length, unsigned int ttl, u8 *id);
+struct file *cifsd_odx_token_get(const u8 *id, loff_t *offset,
+		loff_t *length);
+void cifsd_odx_exit(void);
+
 /* Persistent-ID operations */
 int cifsd_insert_in_global_table(struct cifsd_sess *sess,
 				   int volatile_id, struct file *filp,
@@ -53,9 +53,11 @@
 #include <uapi/linux/xattr.h>
 #endif
 #include <linux/hashtable.h>
+#include <linux/idr.h>
 #include "unicode.h"
 #include "fh.h"
 #include <crypto/hash.h>
+#include <crypto/aead.h>
 #include "smberr.h"
 
 extern struct kmem_cache *cifsd_work_cache;
@@ -88,8 +90,6 @@ extern char NEGOTIATE_GSS_HEADER[74];
 
 extern bool global_signing;
 
-extern struct list_head global_lock_list;
-
 /* cifsd's Specific ERRNO */
 #define ESHARE 50000
 
@@ -156,6 +156,12 @@ extern struct list_head global_lock_list;
  *   */
 #define SMB3_SIGN_KEY_SIZE (16)
 
+/*
+ *  * Size of the smb3 encryption keys, 128 and 256 bit ciphers
+ *   */
+#define SMB3_ENC_KEY_SIZE (16)
+#define SMB3_ENC_KEY_SIZE_256 (32)
+
 #define CIFS_CLIENT_CHALLENGE_SIZE (8)
 #define CIFS_SERVER_CHALLENGE_SIZE (8)
 #define CIFS_HMAC_MD5_HASH_SIZE (16)
@@ -315,29 +321,25 @@ struct ntlmssp_auth {
 };
 
 /* crypto hashing related structure/fields, not specific to a sec mech */
-struct cifs_secmech {
-	struct crypto_shash *hmacmd5; /* hmac-md5 hash function */
-	struct crypto_shash *md5; /* md5 hash function */
-	struct crypto_shash *hmacsha256; /* hmac-sha256 hash function */
-	struct crypto_shash *cmacaes; /* block-cipher based MAC function */
-	struct crypto_shash *sha512; /* sha512 hash function */
-	struct sdesc *sdeschmacmd5;  /* ctxt to generate ntlmv2 hash, CR1 */
-	struct sdesc *sdescmd5; /* ctxt to generate cifs/smb signature */
-	struct sdesc *sdeschmacsha256;  /* ctxt to generate smb2 signature */
-	struct sdesc *sdesccmacaes;  /* ctxt to generate smb3 signature */
-	struct sdesc *sdescsha512;  /* ctxt to generate preauth integrity */
-};
-
 struct channel {
 	__u8 smb3signingkey[SMB3_SIGN_KEY_SIZE];
+	struct crypto_shash *sign_tfm; /* cmac-aes keyed with signing key */
+	struct crypto_aead *gmac_tfm; /* gcm-aes keyed with signing key */
+	struct cifsd_split_gcm *gmac_split; /* gmac of large messages */
+	struct rw_semaphore key_sem; /* rekeying against signing */
 	struct connection *conn;
 	struct list_head chann_list;
 };
 
+#define PREAUTH_HASHVALUE_SIZE		64
+#define PREAUTH_SESS_HASH_BITS		4
+
+/* SMB 3.1.1 preauth integrity state of a session being set up */
 struct preauth_session {
-	int SessionId;
-	int HashId;
-	int HashValue;
+	struct hlist_node hlist;
+	__u64 id;
+	atomic_t refcount;
+	__u8 Preauth_HashValue[PREAUTH_HASHVALUE_SIZE];
 };
 
 struct connection {
@@ -368,12 +370,15 @@ struct connection {
 	char    *smallbuf;
 	char    *bigbuf;
 	char    *wbuf;
+	unsigned int wbuf_off;	/* start of the request in wbuf */
 	struct nls_table *local_nls;
 	unsigned int total_read;
 	/* This session will become part of global tcp session list */
 	struct list_head tcp_sess;
 	/* smb session 1 per user */
 	struct list_head cifsd_sess;
+	/* session the last lookup found, cleared when it goes away */
+	struct cifsd_sess *last_sess;
 	struct task_struct *handler;
 	int th_id;
 	__le16 vuid;
@@ -402,14 +407,18 @@ struct connection {
 #ifdef CONFIG_CIFS_SMB2_SERVER
 	char ClientGUID[SMB2_CLIENT_GUID_SIZE];
 #endif
-	struct cifs_secmech secmech;
 	char ntlmssp_cryptkey[CIFS_CRYPTO_KEY_SIZE]; /* used by ntlmssp */
 
 	int Preauth_HashId; /* PreAuth integrity Hash ID */
-	__u8 Preauth_HashValue[64]; /* PreAuth integrity Hash Value */
+	/* PreAuth integrity Hash Value of negotiate */
+	__u8 Preauth_HashValue[PREAUTH_HASHVALUE_SIZE];
 	int CipherId;
+	__le16 SigningAlgorithmId; /* SMB 3.1.1 signing algorithm */
+	bool signing_negotiated;
 
-	struct list_head p_sess_table;	/* PreAuthSession Table */
+	/* sessions in SMB 3.1.1 session setup, by session id */
+	DECLARE_HASHTABLE(preauth_sess_table, PREAUTH_SESS_HASH_BITS);
+	spinlock_t preauth_lock;
 	bool sec_ntlmssp;		/* supports NTLMSSP */
 	bool sec_kerberosu2u;		/* supports U2U Kerberos */
 	bool sec_kerberos;		/* supports plain Kerberos */
@@ -440,8 +449,16 @@ struct async_info {
 	__u64 async_id;	/* Async ID */
 	struct	work_struct async_work;
 	enum asyncEnum async_status;
-	int fd;
-	int wd;
+	/*
+	 * Set by handlers that park the request instead of waiting in the
+	 * worker: park_fn is called once the worker is done with the work,
+	 * cancel_fn under request_lock when the request is cancelled or
+	 * closed. A handler waiting in the worker may set cancel_fn alone
+	 * to be woken up.
+	 */
+	void (*park_fn)(struct smb_work *work);
+	void (*cancel_fn)(struct smb_work *work);
+	void *private;
 };
 
 #define SYNC 1
@@ -473,6 +490,7 @@ struct smb_work {
 	__u64 cur_local_pfid;
 	__u64 cur_local_sess_id;
 	bool req_wbuf:1;		/* large write request */
+	unsigned int wbuf_off;		/* buf is that far into the wbuf */
 	bool large_buf:1;		/* if valid response, is pointer
 							to large buf */
 	bool rsp_large_buf:1;
@@ -481,6 +499,12 @@ struct smb_work {
 	bool multiEnd:1;		/* both received */
 	bool send_no_response:1;	/* no response for cancelled request */
 	bool added_in_request_list:1;	/* added in conn->requests list */
+	bool encrypted:1;		/* request came in a transform message */
+	unsigned int transform_off;	/* transform header skipped in buf */
+	__u64 tr_sess_id;		/* session the request was encrypted for */
+	char *tr_buf;			/* transform header of response */
+	__u8 *preauth_hash;		/* preauth hash the response goes in */
+	struct preauth_session *preauth_sess; /* holds preauth_hash */
 
 	struct cifsd_sess *sess;
 	struct cifsd_tcon *tcon;
@@ -500,14 +524,21 @@ struct smb_version_ops {
 	int (*is_sign_req)(struct smb_work *work, unsigned int command);
 	int (*check_sign_req)(struct smb_work *work);
 	void (*set_sign_rsp)(struct smb_work *work);
-	int (*compute_signingkey)(struct cifsd_sess *sess,  __u8 *key,
-		unsigned int key_size);
+	int (*compute_signingkey)(struct connection *conn,
+		struct cifsd_sess *sess, __u8 *key, unsigned int key_size);
+	int (*decrypt_req)(struct smb_work *work);
+	int (*encrypt_resp)(struct smb_work *work);
 };
 
 struct smb_version_cmds {
 	int (*proc)(struct smb_work *swork);
 };
 
+/* 8 characters of base name, a dot and 3 characters of extension */
+#define SMB_SHORTNAME_LEN	12
+
+struct ci_index;
+
 struct cifsd_dir_info {
 	char *name;
 	char *bufptr;
@@ -515,6 +546,7 @@ struct cifsd_dir_info {
 	int data_count;
 	int out_buf_len;
 	int num_entry;
+	struct ci_index *short_names;
 };
 
 /* cifsd kstat wrapper to get valid create time when reading dir entry */
@@ -524,6 +556,12 @@ struct smb_kstat {
 	__le32 file_attributes;
 };
 
+/* range of FSCTL_QUERY_ALLOCATED_RANGES and FSCTL_SET_ZERO_DATA */
+struct file_allocated_range_buffer {
+	__le64 file_offset;
+	__le64 length;
+} __packed;
+
 struct smb2_fs_sector_size {
 	unsigned short logical_sector_size;
 	unsigned int physical_sector_size;
@@ -596,6 +634,16 @@ int switch_req_buf(struct connection *conn);
 int negotiate_dialect(void *buf);
 struct cifsd_sess *lookup_session_on_server(struct connection *conn,
 		uint64_t sess_id);
+struct cifsd_sess *lookup_session_global(uint64_t sess_id);
+void register_session(struct connection *conn, struct cifsd_sess *sess);
+bool unregister_session(struct cifsd_sess *sess);
+struct preauth_session *alloc_preauth_session(struct connection *conn,
+		__u64 sess_id);
+struct preauth_session *lookup_preauth_session(struct connection *conn,
+		__u64 sess_id);
+void put_preauth_session(struct preauth_session *preauth_sess);
+void remove_preauth_session(struct connection *conn, __u64 sess_id);
+void destroy_preauth_sessions(struct connection *conn);
 
 /* cifsd export functions */
 extern int cifsd_export_init(void);
@@ -611,6 +659,7 @@ extern int cifsd_stop_tcp_sess(void);
 
 /* cifsd misc functions */
 extern int check_smb_message(char *buf);
+extern bool is_transform_message(char *buf);
 extern void add_request_to_queue(struct smb_work *smb_work);
 extern void dump_smb_msg(void *buf, int smb_buf_length);
 extern int switch_rsp_buf(struct smb_work *smb_work);
@@ -628,8 +677,9 @@ extern int smb_check_shared_mode(struct file *filp,
 extern struct cifsd_file *find_fp_using_inode(struct inode *inode);
 extern void remove_async_id(__u64 async_id);
 extern char *alloc_data_mem(size_t size);
-extern int pattern_cmp(const char *string, const char *pattern);
-extern bool is_matched(const char *fname, const char *exp);
+extern struct cifsd_pattern *cifsd_compile_pattern(const char *pattern);
+extern bool cifsd_pattern_match(struct cifsd_pattern *pat, const char *name,
+	unsigned int nlen);
 extern int check_invalid_stream_char(char *stream_name);
 extern int check_invalid_char(char *filename);
 extern int parse_stream_name(char *filename, char **stream_name, int *s_type);
@@ -640,14 +690,16 @@ extern int construct_xattr_stream_name(char *stream_name,
 int smb_vfs_create(const char *name, umode_t mode);
 int smb_vfs_mkdir(const char *name, umode_t mode);
 int smb_vfs_read(struct cifsd_sess *sess, uint64_t fid, uint64_t p_id,
-	char **buf, size_t count, loff_t *pos);
+	char **buf, size_t count, loff_t *pos, bool unbuffered);
 int smb_vfs_write(struct cifsd_sess *sess, uint64_t fid, uint64_t p_id,
-	char *buf, size_t count, loff_t *pos, bool fsync, ssize_t *written);
+	char *buf, size_t count, loff_t *pos, bool fsync, bool unbuffered,
+	ssize_t *written);
 int smb_vfs_getattr(struct cifsd_sess *sess, uint64_t fid,
 		struct kstat *stat);
 int smb_vfs_setattr(struct cifsd_sess *sess, const char *name,
 		uint64_t fid, struct iattr *attrs);
 int smb_vfs_fsync(struct cifsd_sess *sess, uint64_t fid, uint64_t p_id);
+int smb_vfs_sync_range(struct cifsd_file *fp, loff_t start, loff_t end);
 int smb_dentry_open(struct smb_work *work, const struct path *path,
 		int flags, __u16 *fid, int *oplock, int option,
 		int fexist);
@@ -669,11 +721,27 @@ int smb_kern_path(char *name, unsigned int flags, struct path *path,
 int smb_search_dir(char *dirname, char *filename);
 void smb_vfs_set_fadvise(struct file *filp, int option);
 int smb_vfs_lock(struct file *filp, int cmd, struct file_lock *flock);
-int check_lock_range(struct file *filp, loff_t start,
+int check_lock_range(struct cifsd_file *fp, loff_t start,
 		loff_t end, unsigned char type);
 int smb_vfs_readdir(struct file *file, filldir_t filler,
 			struct smb_readdir_data *buf);
 int smb_vfs_alloc_size(struct file *filp, loff_t len);
+int smb_vfs_zero_data(struct connection *conn, struct cifsd_file *fp,
+		loff_t off, loff_t len);
+int smb_vfs_fqar_lseek(struct cifsd_file *fp, loff_t start, loff_t length,
+		struct file_allocated_range_buffer *ranges, int in_count,
+		int *out_count);
+ssize_t smb_vfs_copy_file_range(struct connection *conn,
+		struct cifsd_file *src_fp, loff_t src_off,
+		struct cifsd_file *dst_fp, loff_t dst_off, size_t len);
+ssize_t smb_vfs_offload_write(struct connection *conn, struct file *src,
+		loff_t src_off, struct cifsd_file *dst_fp, loff_t dst_off,
+		size_t len);
+int smb_vfs_clone_file_range(struct connection *conn,
+		struct cifsd_file *src_fp, loff_t src_off,
+		struct cifsd_file *dst_fp, loff_t dst_off, u64 len);
+bool smb_vfs_can_clone(struct path *path);
+void smb_vfs_clone_probes_free(void);
 int smb_vfs_truncate_xattr(struct dentry *dentry);
 int smb_vfs_truncate_stream_xattr(struct dentry *dentry);
 int smb_vfs_remove_xattr(struct path *path, char *field_name);
@@ -698,6 +766,7 @@ extern int is_smb2_rsp(struct smb_work *smb_work);
 
 /* functions */
 extern void smb_delete_session(struct cifsd_sess *sess);
+extern void cifsd_sess_put(struct cifsd_sess *sess);
 extern int connect_tcp_sess(struct socket *sock);
 extern int cifsd_read_from_socket(struct connection *conn, char *buf,
 		unsigned int to_read);
@@ -712,12 +781,13 @@ extern int E_P24(unsigned char *p21, const unsigned char *c8,
 extern int smb_mdfour(unsigned char *md4_hash, unsigned char *link_str,
 		int link_len);
 extern int smb_send_rsp(struct smb_work *smb_work);
+void smb_complete_parked_work(struct smb_work *smb_work);
 bool conn_unresponsive(struct connection *conn);
 /* trans2 functions */
 
 int query_fs_info(struct smb_work *smb_work);
 void create_trans2_reply(struct smb_work *smb_work, __u16 count);
-char *convert_to_unix_name(char *name, int tid);
+char *convert_to_unix_name(char *name, struct cifsd_tcon *tcon);
 void convert_delimiter(char *path, int flags);
 int find_first(struct smb_work *smb_work);
 int find_next(struct smb_work *smb_work);
@@ -730,6 +800,10 @@ int smb_filldir(void *__buf, const char *name, int namlen,
 #endif
 int smb_get_shortname(struct connection *conn, char *longname,
 		char *shortname);
+unsigned int smb_shortname_hash(const char *longname, int len);
+int smb_mangle_shortname(const char *longname, int len, unsigned int hash,
+		char *out);
+int smb_shortname_to_utf16(const char *shortname, int len, char *dst);
 char *read_next_entry(struct smb_work *smb_work, struct smb_kstat *smb_kstat,
 		struct smb_dirent *de, char *dpath);
 void *fill_common_info(char **p, struct smb_kstat *smb_kstat);
@@ -738,10 +812,10 @@ void fill_create_time(struct smb_work *smb_work,
 		struct path *path, struct smb_kstat *smb_kstat);
 void fill_file_attributes(struct smb_work *smb_work,
 		struct path *path, struct smb_kstat *smb_kstat);
-char *convname_updatenextoffset(char *namestr, int len, int size,
+int convname_updatenextoffset(char *namestr, int len, int size,
 		const struct nls_table *local_nls, int *name_len,
 		int *next_entry_offset, int *buf_len, int *data_count,
-		int alignment);
+		int alignment, char *dst);
 
 /* netlink functions */
 int cifsd_net_init(void);
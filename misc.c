@@ -21,6 +21,8 @@
 
 #include <linux/kernel.h>
 #include <linux/version.h>
+#include <linux/ctype.h>
+#include <linux/bitmap.h>
 #if LINUX_VERSION_CODE > KERNEL_VERSION(3, 10, 30)
 #include <linux/xattr.h>
 #endif
@@ -125,6 +127,9 @@ static inline int check_smb2_hdr(struct smb2_hdr *smb)
  */
 int check_smb_message(char *buf)
 {
+	/* checked once decrypted, by the worker */
+	if (is_transform_message(buf))
+		return 0;
 
 	if (*(__le32 *)((struct smb2_hdr *)buf)->ProtocolId ==
 			SMB2_PROTO_NUMBER) {
@@ -138,6 +143,18 @@ int check_smb_message(char *buf)
 
 }
 
+/**
+ * is_transform_message() - check if a request is an smb3 transform message
+ * @buf:	request buffer, starting with the RFC1001 length
+ *
+ * Return:	true if the request is encrypted
+ */
+bool is_transform_message(char *buf)
+{
+	return *(__le32 *)((struct smb2_hdr *)buf)->ProtocolId ==
+		SMB2_TRANSFORM_PROTO_NUM;
+}
+
 /**
  * add_request_to_queue() - check a request for addition to pending smb work
  *				queue
@@ -150,6 +167,10 @@ void add_request_to_queue(struct smb_work *smb_work)
 	struct connection *conn = smb_work->conn;
 	struct list_head *requests_queue = NULL;
 
+	/* the command is unknown until decrypted, the worker queues it */
+	if (is_transform_message(smb_work->buf))
+		return;
+
 	if (*(__le32 *)((struct smb2_hdr *)smb_work->buf)->ProtocolId ==
 			SMB2_PROTO_NUMBER) {
 		unsigned int command = conn->ops->get_cmd_val(smb_work);
@@ -226,10 +247,12 @@ int switch_req_buf(struct connection *conn)
 {
 	char *buf = conn->smallbuf;
 	unsigned int pdu_length = get_rfc1002_length(buf);
-	unsigned int hdr_len;
+	unsigned int hdr_len, tr_len = 0;
 
 #ifdef CONFIG_CIFS_SMB2_SERVER
 	hdr_len = MAX_SMB2_HDR_SIZE;
+	/* a full sized write may come encrypted */
+	tr_len = sizeof(struct smb2_transform_hdr) - 4;
 #else
 	hdr_len = MAX_CIFS_HDR_SIZE;
 #endif
@@ -239,9 +262,13 @@ int switch_req_buf(struct connection *conn)
 		cifsd_debug("switching to large buffer\n");
 		conn->large_buf = true;
 		memcpy(conn->bigbuf, buf, conn->total_read);
-	} else if (pdu_length <= CIFS_DEFAULT_IOSIZE + hdr_len - 4) {
-		/* allocate big buffer for large write request i.e. > 64K */
-		conn->wbuf = vmalloc(CIFS_DEFAULT_IOSIZE + hdr_len);
+	} else if (pdu_length <= CIFS_DEFAULT_IOSIZE + hdr_len + tr_len - 4) {
+		/*
+		 * allocate big buffer for large write request i.e. > 64K,
+		 * with room to page align the write payload
+		 */
+		conn->wbuf = vmalloc(CIFS_DEFAULT_IOSIZE + hdr_len + tr_len +
+				PAGE_SIZE);
 		if (!conn->wbuf) {
 			cifsd_debug("failed to alloc mem\n");
 			return -ENOMEM;
@@ -433,39 +460,260 @@ int negotiate_dialect(void *buf)
 	return ret;
 }
 
-struct cifsd_sess *lookup_session_on_server(struct connection *conn,
-		uint64_t sess_id)
+/*
+ * Sessions are hashed by session id in cifsd_session_table and linked on
+ * the session list of their connection. Both are changed under
+ * cifsd_session_lock, the table is looked up under RCU and a session is
+ * freed after a grace period. Each connection remembers the session its
+ * last lookup found, which is the session of nearly every request.
+ *
+ * The table holds a reference to a registered session, and a lookup
+ * returns a new reference, dropped with cifsd_sess_put() once the caller
+ * is done, usually when its smb_work is freed. A session being deleted
+ * is no longer returned once its last reference is gone.
+ */
+static struct cifsd_sess *__lookup_session(uint64_t sess_id)
 {
 	struct cifsd_sess *sess;
-	struct list_head *tmp, *t;
 
-	list_for_each_safe(tmp, t, &conn->cifsd_sess) {
-		sess = list_entry(tmp, struct cifsd_sess, cifsd_ses_list);
+	hash_for_each_possible_rcu(cifsd_session_table, sess, hlist, sess_id) {
 		if (sess->sess_id == sess_id)
 			return sess;
 	}
+	return NULL;
+}
+
+/**
+ * lookup_session_global() - find a session of any connection
+ * @sess_id:	session id
+ *
+ * Return:	referenced matching session, otherwise NULL
+ */
+struct cifsd_sess *lookup_session_global(uint64_t sess_id)
+{
+	struct cifsd_sess *sess;
+
+	rcu_read_lock();
+	sess = __lookup_session(sess_id);
+	if (sess && !atomic_inc_not_zero(&sess->refcnt))
+		sess = NULL;
+	rcu_read_unlock();
+	return sess;
+}
+
+/**
+ * lookup_session_on_server() - find a session of a connection
+ * @conn:	connection the session belongs to
+ * @sess_id:	session id
+ *
+ * Return:	referenced matching session, otherwise NULL
+ */
+struct cifsd_sess *lookup_session_on_server(struct connection *conn,
+		uint64_t sess_id)
+{
+	struct cifsd_sess *sess;
+
+	rcu_read_lock();
+	sess = READ_ONCE(conn->last_sess);
+	if (sess && sess->sess_id == sess_id &&
+	    atomic_inc_not_zero(&sess->refcnt)) {
+		rcu_read_unlock();
+		return sess;
+	}
 
-	cifsd_err("User session(ID : %llu) not found\n", sess_id);
+	sess = __lookup_session(sess_id);
+	if (sess && sess->conn == conn &&
+	    atomic_inc_not_zero(&sess->refcnt)) {
+		spin_lock(&cifsd_session_lock);
+		/* do not cache a session unregistered meanwhile */
+		if (!hlist_unhashed(&sess->hlist))
+			WRITE_ONCE(conn->last_sess, sess);
+		spin_unlock(&cifsd_session_lock);
+	} else
+		sess = NULL;
+	rcu_read_unlock();
+
+	if (!sess)
+		cifsd_err("User session(ID : %llu) not found\n", sess_id);
+	return sess;
+}
+
+/**
+ * register_session() - make a new session visible to lookups
+ * @conn:	connection the session is set up on
+ * @sess:	session, with its session id set
+ *
+ * The table takes its own reference, on top of the one of the caller.
+ */
+void register_session(struct connection *conn, struct cifsd_sess *sess)
+{
+	atomic_inc(&sess->refcnt);
+	spin_lock(&cifsd_session_lock);
+	list_add(&sess->cifsd_ses_list, &conn->cifsd_sess);
+	hash_add_rcu(cifsd_session_table, &sess->hlist, sess->sess_id);
+	spin_unlock(&cifsd_session_lock);
+}
+
+/**
+ * unregister_session() - hide a session from lookups before freeing it
+ * @sess:	session
+ *
+ * Return:	true if the session was registered, the caller then owns
+ *		the reference of the table
+ */
+bool unregister_session(struct cifsd_sess *sess)
+{
+	struct connection *conn = sess->conn;
+	bool registered;
+
+	spin_lock(&cifsd_session_lock);
+	registered = !hlist_unhashed(&sess->hlist);
+	list_del_init(&sess->cifsd_ses_list);
+	hash_del_rcu(&sess->hlist);
+	if (conn->last_sess == sess)
+		WRITE_ONCE(conn->last_sess, NULL);
+	spin_unlock(&cifsd_session_lock);
+	return registered;
+}
+
+/*
+ * SMB 3.1.1 preauth integrity
+ *
+ * Each session setup exchange extends a SHA-512 chain that starts from
+ * the negotiate hash of the connection. The chain value of a session is
+ * only needed until its keys are derived, so it is kept per connection
+ * in a table of sessions being set up rather than in the session, and
+ * a binding session setup on another channel gets its own chain.
+ *
+ * A work item that has to hash its response keeps a reference to the
+ * entry until the response is sent.
+ */
+static struct preauth_session *__lookup_preauth_session(
+		struct connection *conn, __u64 sess_id)
+{
+	struct preauth_session *preauth_sess;
+
+	hash_for_each_possible(conn->preauth_sess_table, preauth_sess, hlist,
+			sess_id) {
+		if (preauth_sess->id == sess_id)
+			return preauth_sess;
+	}
 	return NULL;
 }
 
+/**
+ * alloc_preauth_session() - start the preauth chain of a session setup
+ * @conn:	connection the session setup runs on
+ * @sess_id:	session id
+ *
+ * Any chain the session had on @conn is dropped.
+ *
+ * Return:	referenced entry, NULL on allocation failure
+ */
+struct preauth_session *alloc_preauth_session(struct connection *conn,
+		__u64 sess_id)
+{
+	struct preauth_session *preauth_sess, *old;
+
+	preauth_sess = kmalloc(sizeof(struct preauth_session), GFP_KERNEL);
+	if (!preauth_sess)
+		return NULL;
+
+	preauth_sess->id = sess_id;
+	/* one for the table, one for the caller */
+	atomic_set(&preauth_sess->refcount, 2);
+	memcpy(preauth_sess->Preauth_HashValue, conn->Preauth_HashValue,
+			PREAUTH_HASHVALUE_SIZE);
+
+	spin_lock(&conn->preauth_lock);
+	old = __lookup_preauth_session(conn, sess_id);
+	if (old)
+		hash_del(&old->hlist);
+	hash_add(conn->preauth_sess_table, &preauth_sess->hlist, sess_id);
+	spin_unlock(&conn->preauth_lock);
+
+	if (old)
+		put_preauth_session(old);
+	return preauth_sess;
+}
+
+/**
+ * lookup_preauth_session() - find the preauth chain of a session setup
+ * @conn:	connection the session setup runs on
+ * @sess_id:	session id
+ *
+ * Return:	referenced entry, NULL if the session has no chain on @conn
+ */
+struct preauth_session *lookup_preauth_session(struct connection *conn,
+		__u64 sess_id)
+{
+	struct preauth_session *preauth_sess;
+
+	spin_lock(&conn->preauth_lock);
+	preauth_sess = __lookup_preauth_session(conn, sess_id);
+	if (preauth_sess)
+		atomic_inc(&preauth_sess->refcount);
+	spin_unlock(&conn->preauth_lock);
+	return preauth_sess;
+}
+
+void put_preauth_session(struct preauth_session *preauth_sess)
+{
+	if (atomic_dec_and_test(&preauth_sess->refcount))
+		kzfree(preauth_sess);
+}
+
+/**
+ * remove_preauth_session() - drop the preauth chain of a session setup
+ * @conn:	connection the session setup ran on
+ * @sess_id:	session id
+ */
+void remove_preauth_session(struct connection *conn, __u64 sess_id)
+{
+	struct preauth_session *preauth_sess;
+
+	spin_lock(&conn->preauth_lock);
+	preauth_sess = __lookup_preauth_session(conn, sess_id);
+	if (preauth_sess)
+		hash_del(&preauth_sess->hlist);
+	spin_unlock(&conn->preauth_lock);
+
+	if (preauth_sess)
+		put_preauth_session(preauth_sess);
+}
+
+void destroy_preauth_sessions(struct connection *conn)
+{
+	struct preauth_session *preauth_sess;
+	struct hlist_node *tmp;
+	int bkt;
+
+	hash_for_each_safe(conn->preauth_sess_table, bkt, tmp, preauth_sess,
+			hlist) {
+		hash_del(&preauth_sess->hlist);
+		put_preauth_session(preauth_sess);
+	}
+}
+
 /**
  * validate_sess_handle() - check for valid session handle
  * @sess:	handle to be validated
  *
- * Return:      matching session handle, otherwise NULL
+ * Return:      referenced matching session handle, otherwise NULL
  */
 struct cifsd_sess *validate_sess_handle(struct cifsd_sess *session)
 {
 	struct cifsd_sess *sess;
-	struct list_head *tmp, *t;
+	int bkt;
 
-	list_for_each_safe(tmp, t, &cifsd_session_list) {
-		sess = list_entry(tmp, struct cifsd_sess,
-				cifsd_ses_global_list);
-		if (sess == session)
+	rcu_read_lock();
+	hash_for_each_rcu(cifsd_session_table, bkt, sess, hlist) {
+		if (sess == session && atomic_inc_not_zero(&sess->refcnt)) {
+			rcu_read_unlock();
 			return sess;
+		}
 	}
+	rcu_read_unlock();
 
 	cifsd_err("session(%p) not found\n", session);
 	return NULL;
@@ -712,87 +960,219 @@ char *alloc_data_mem(size_t size)
 	return vzalloc(size);
 }
 
+/* DOS wildcards, see MS-FSA 2.1.4.4 */
+#define DOS_STAR	'<'
+#define DOS_QM		'>'
+#define DOS_DOT		'"'
+
+static inline bool is_wildcard(char c)
+{
+	return c == '*' || c == '?' || c == DOS_STAR || c == DOS_QM ||
+		c == DOS_DOT;
+}
+
 /**
- * pattern_cmp() - compare a string with a pattern which might include
- * wildcard '*' and '?'
- * TODO : implement consideration about DOS_DOT, DOS_QM and DOS_STAR
+ * cifsd_compile_pattern() - prepare a search pattern for matching
+ * @pattern:	search pattern which might include '*', '?' and the
+ *		DOS_STAR, DOS_QM and DOS_DOT wildcards
  *
- * @string:	string to compare with a pattern
- * @pattern:	pattern string which might include wildcard '*' and '?'
+ * Patterns are classified once so that the common cases ("*", a plain
+ * name, "prefix*" and "*suffix") are matched without running the
+ * generic wildcard engine for every directory entry.
  *
- * Return:	0 if pattern matched with the string, otherwise non zero value
+ * Return:	compiled pattern on success, otherwise error pointer
  */
-int pattern_cmp(const char *string, const char *pattern)
+struct cifsd_pattern *cifsd_compile_pattern(const char *pattern)
 {
-	const char *cp = NULL;
-	const char *mp = NULL;
-	int diff;
+	struct cifsd_pattern *pat;
+	unsigned int len = strlen(pattern);
+	unsigned int i, nr_wild = 0;
+
+	if (len > CIFSD_PATTERN_MAX)
+		return ERR_PTR(-ENAMETOOLONG);
 
-	/* handle plain characters and '?' */
-	while ((*string) && (*pattern != '*')) {
-		diff = strncasecmp(pattern, string, 1);
-		if (diff && (*pattern != '?'))
-			return diff;
+	pat = kmalloc(sizeof(struct cifsd_pattern) + 2 * (len + 1), GFP_KERNEL);
+	if (!pat)
+		return ERR_PTR(-ENOMEM);
 
-		pattern++;
-		string++;
+	pat->orig = pat->str + len + 1;
+	memcpy(pat->orig, pattern, len + 1);
+	for (i = 0; i < len; i++) {
+		pat->str[i] = tolower(pattern[i]);
+		if (is_wildcard(pattern[i]))
+			nr_wild++;
+	}
+	pat->str[len] = '\0';
+	pat->len = len;
+
+	if (!len) {
+		pat->type = PATTERN_EMPTY;
+	} else if (!nr_wild) {
+		pat->type = PATTERN_LITERAL;
+	} else if (len == 1 && pattern[0] == '*') {
+		pat->type = PATTERN_ANY;
+	} else if (nr_wild == 1 && pattern[len - 1] == '*') {
+		pat->type = PATTERN_PREFIX;
+		pat->fixed = pat->str;
+		pat->fixed_len = len - 1;
+	} else if (nr_wild == 1 && pattern[0] == '*') {
+		pat->type = PATTERN_SUFFIX;
+		pat->fixed = pat->str + 1;
+		pat->fixed_len = len - 1;
+	} else {
+		pat->type = PATTERN_GENERIC;
 	}
 
-	/* handle '*' wildcard */
-	while (*string) {
-		if (*pattern == '*') {
-			/*
-			 * if the last char of a pattern is '*',
-			 * any string matches with the pattern
-			 */
-			if (!*++pattern)
-				return 0;
-
-			mp = pattern;
-			cp = string + 1;
-		} else if (!strncasecmp(pattern, string, 1)
-				|| (*pattern == '?')) {
-			/* ? is matched with any "one" char */
-			pattern++;
-			string++;
-		} else {
-			pattern = mp;
-			string = cp++;
+	return pat;
+}
+
+/*
+ * Add @state and everything reachable from it without consuming a name
+ * character to @set. @c is the next name character, or 0 at the end of
+ * the name.
+ */
+static void pattern_closure(const char *p, unsigned int plen,
+		unsigned long *set, unsigned int state, char c)
+{
+	while (state <= plen && !test_bit(state, set)) {
+		__set_bit(state, set);
+		if (state == plen)
+			break;
+
+		switch (p[state]) {
+		case '*':
+		case DOS_STAR:
+			/* match zero characters */
+			state++;
+			break;
+		case DOS_QM:
+			/* zero characters at a period or at the end */
+			if (c == '.' || !c) {
+				state++;
+				break;
+			}
+			return;
+		case DOS_DOT:
+			/* zero characters beyond the end of the name */
+			if (!c) {
+				state++;
+				break;
+			}
+			return;
+		default:
+			return;
+		}
+	}
+}
+
+/*
+ * Generic matcher: simulates the pattern as a nondeterministic automaton
+ * over the name, tracking all live pattern positions in a bitmap. This
+ * keeps matching linear in the name length regardless of how many stars
+ * the pattern contains.
+ */
+static bool pattern_match_generic(struct cifsd_pattern *pat,
+		const char *name, unsigned int nlen)
+{
+	DECLARE_BITMAP(cur, CIFSD_PATTERN_MAX + 1);
+	DECLARE_BITMAP(next, CIFSD_PATTERN_MAX + 1);
+	const char *p = pat->str;
+	unsigned int plen = pat->len;
+	int last_dot = -1;
+	unsigned int i, state;
+
+	for (i = 0; i < nlen; i++) {
+		if (name[i] == '.')
+			last_dot = i;
+	}
+
+	bitmap_zero(cur, plen + 1);
+	pattern_closure(p, plen, cur, 0, nlen ? name[0] : 0);
+
+	for (i = 0; i < nlen; i++) {
+		char c = tolower(name[i]);
+		char nc = i + 1 < nlen ? name[i + 1] : 0;
+		bool is_last_dot = ((int)i == last_dot);
+
+		bitmap_zero(next, plen + 1);
+		for_each_set_bit(state, cur, plen) {
+			switch (p[state]) {
+			case '*':
+				pattern_closure(p, plen, next, state, nc);
+				break;
+			case DOS_STAR:
+				/* everything up to the final period */
+				if (!is_last_dot)
+					pattern_closure(p, plen, next, state,
+							nc);
+				break;
+			case '?':
+				pattern_closure(p, plen, next, state + 1, nc);
+				break;
+			case DOS_QM:
+				if (c != '.')
+					pattern_closure(p, plen, next,
+							state + 1, nc);
+				break;
+			case DOS_DOT:
+				if (c == '.')
+					pattern_closure(p, plen, next,
+							state + 1, nc);
+				break;
+			default:
+				if (c == p[state])
+					pattern_closure(p, plen, next,
+							state + 1, nc);
+				break;
+			}
 		}
+
+		if (bitmap_empty(next, plen + 1))
+			return false;
+		bitmap_copy(cur, next, plen + 1);
 	}
 
-	/* handle remaining '*' */
-	while (*pattern == '*')
-		pattern++;
+	return test_bit(plen, cur);
+}
 
-	return *pattern;
+static bool fixed_casecmp(const char *fixed, const char *name,
+		unsigned int len)
+{
+	while (len--) {
+		if (*fixed++ != tolower(*name++))
+			return false;
+	}
+	return true;
 }
 
 /**
- * is_matched() - compare a file name with an expression which might
- * include wildcards
- *
- * @fname:	file name to compare with an expression
- * @exp:	an expression which might include wildcard '*' and '?'
+ * cifsd_pattern_match() - match a file name against a compiled pattern
+ * @pat:	pattern from cifsd_compile_pattern()
+ * @name:	file name to test
+ * @nlen:	length of @name
  *
- * Return:	true if fname and exp are matched, otherwise false
+ * Return:	true if @name matches, otherwise false
  */
-bool is_matched(const char *fname, const char *exp)
-{
-	/* optimization to avoid pattern compare */
-	if (!*fname && *exp)
-		return false;
-	else if (*fname && !*exp)
-		return false;
-	else if (!*fname && !*exp)
-		return true;
-	else if (*exp == '*' && strlen(exp) == 1)
-		return true;
-
-	if (pattern_cmp(fname, exp))
-		return false;
-	else
+bool cifsd_pattern_match(struct cifsd_pattern *pat, const char *name,
+		unsigned int nlen)
+{
+	switch (pat->type) {
+	case PATTERN_EMPTY:
+		return !nlen;
+	case PATTERN_ANY:
 		return true;
+	case PATTERN_LITERAL:
+		return nlen == pat->len && fixed_casecmp(pat->str, name, nlen);
+	case PATTERN_PREFIX:
+		return nlen >= pat->fixed_len &&
+			fixed_casecmp(pat->fixed, name, pat->fixed_len);
+	case PATTERN_SUFFIX:
+		return nlen >= pat->fixed_len &&
+			fixed_casecmp(pat->fixed,
+				name + nlen - pat->fixed_len, pat->fixed_len);
+	default:
+		return pattern_match_generic(pat, name, nlen);
+	}
 }
 
 /*
@@ -0,0 +1,1112 @@
+/*
+ *   fs/cifsd/namecache.c
+ *
+ *   Copyright (C) 2015 Samsung Electronics Co., Ltd.
+ *   Copyright (C) 2016 Namjae Jeon <namjae.jeon@protocolfreedom.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mutex.h>
+#include <linux/hash.h>
+#include <linux/hashtable.h>
+#include <linux/ctype.h>
+#include <linux/log2.h>
+#include <linux/sort.h>
+#include <linux/version.h>
+
+#include "glob.h"
+#include "fh.h"
+
+/*
+ * Case-insensitive name index
+ *
+ * When a caseless lookup misses in the dcache, smb_search_dir() used to
+ * read the whole parent directory and strncasecmp() every entry. Instead,
+ * the first miss in a directory builds a hash of its entries keyed by the
+ * case-folded name, and later caseless lookups (hits and misses alike) are
+ * answered from that hash.
+ *
+ * An index is considered valid as long as the directory mtime and ctime
+ * did not change since it was built, which catches local modifications
+ * done behind our back. cifsd's own namespace operations additionally drop
+ * the index of the parent directory explicitly, so filesystems with coarse
+ * timestamps do not serve stale entries. Directories modified within the
+ * last second are never cached, otherwise an update landing in the same
+ * timestamp tick as the build would go unnoticed.
+ *
+ * Directories too large to index, or modified within the last second, get
+ * an empty mark instead of an index, keyed by mtime and ctime like one.
+ * While the mark is valid lookups go straight to the linear scan rather
+ * than reading the directory for an index that would be thrown away.
+ *
+ * Memory is bounded by a global budget of indexed names and directories,
+ * the least recently used indexes are evicted first.
+ *
+ * The index also carries the 8.3 short names of the directory entries.
+ * They are filled in once per index, the first time a directory is listed
+ * with an information class that returns them. Names whose mangled form
+ * collides with another entry are resolved by probing the next mangling
+ * hash.
+ *
+ * Short names handed out are remembered per directory in a short name
+ * map, which outlives the indexes of the directory: a rebuilt index keeps
+ * the short names of the entries that were already there, and only new
+ * entries are mangled, so a change to the directory does not renumber
+ * the others. Querying the short name of a single entry only consults
+ * and extends the map, without reading the directory. Maps are bounded
+ * by their own LRU budget, a directory whose map was evicted starts over.
+ */
+
+#define CI_INDEX_HASH_BITS	6
+#define CI_INDEX_MAX_DIRS	64
+#define CI_INDEX_MAX_NAMES	(256 * 1024)
+#define CI_SHORTNAME_PROBES	64
+
+/* state of a directory in the index table */
+enum {
+	CI_INDEX_VALID,
+	/* marks, the directory has no index */
+	CI_INDEX_TOO_BIG,
+	CI_INDEX_RECENT,
+};
+
+struct ci_name {
+	struct hlist_node	node;
+	unsigned int		hash;
+	unsigned int		short_hash;
+	unsigned int		len;
+	unsigned char		short_len;
+	char			short_name[SMB_SHORTNAME_LEN];
+	char			name[];
+};
+
+struct ci_index {
+	struct hlist_node	hnode;
+	struct list_head	lru;
+	struct super_block	*sb;
+	unsigned long		ino;
+	__u32			generation;
+	struct timespec		mtime;
+	struct timespec		ctime;
+	atomic_t		refcount;
+	int			state;
+	unsigned int		nr_names;
+	unsigned int		bits;
+	struct hlist_head	*names;
+	struct mutex		sn_mutex;
+	bool			sn_ready;
+};
+
+static DEFINE_SPINLOCK(ci_index_lock);
+static DEFINE_HASHTABLE(ci_index_table, CI_INDEX_HASH_BITS);
+static LIST_HEAD(ci_index_lru);
+static unsigned int ci_index_nr_dirs;
+static unsigned int ci_index_nr_names;
+
+static inline unsigned int ci_name_hash(const char *name, unsigned int len)
+{
+	unsigned int hash = 0;
+
+	while (len--)
+		hash = hash * 31 + tolower(*name++);
+	return hash;
+}
+
+static inline unsigned long ci_index_key(struct super_block *sb,
+		unsigned long ino)
+{
+	return (unsigned long)sb ^ ino;
+}
+
+static void ci_index_free(struct ci_index *idx)
+{
+	struct ci_name *cn;
+	struct hlist_node *tmp;
+	unsigned int i;
+
+	if (idx->names) {
+		for (i = 0; i < (1U << idx->bits); i++) {
+			hlist_for_each_entry_safe(cn, tmp, &idx->names[i],
+					node)
+				kfree(cn);
+		}
+		vfree(idx->names);
+	}
+	kfree(idx);
+}
+
+static void ci_index_put(struct ci_index *idx)
+{
+	if (atomic_dec_and_test(&idx->refcount))
+		ci_index_free(idx);
+}
+
+/* must be called with ci_index_lock held, caller drops the table ref */
+static void __ci_index_unhash(struct ci_index *idx)
+{
+	hash_del(&idx->hnode);
+	list_del_init(&idx->lru);
+	ci_index_nr_dirs--;
+	ci_index_nr_names -= idx->nr_names;
+}
+
+static bool ci_index_match(struct ci_index *idx, struct inode *inode)
+{
+	return idx->sb == inode->i_sb && idx->ino == inode->i_ino &&
+		idx->generation == inode->i_generation;
+}
+
+/* an update in the same timestamp tick would go unnoticed */
+static bool ci_inode_recent(struct inode *inode)
+{
+	return inode->i_mtime.tv_sec + 1 >= get_seconds() ||
+		inode->i_ctime.tv_sec + 1 >= get_seconds();
+}
+
+static bool ci_index_stale(struct ci_index *idx, struct inode *inode)
+{
+	if (idx->state == CI_INDEX_RECENT && !ci_inode_recent(inode))
+		return true;
+
+	return !timespec_equal(&idx->mtime, &inode->i_mtime) ||
+		!timespec_equal(&idx->ctime, &inode->i_ctime);
+}
+
+/**
+ * ci_index_get() - find a valid index for a directory
+ * @inode:	directory inode
+ *
+ * Return:	referenced index on success, otherwise NULL
+ */
+static struct ci_index *ci_index_get(struct inode *inode)
+{
+	struct ci_index *idx, *stale = NULL;
+
+	spin_lock(&ci_index_lock);
+	hash_for_each_possible(ci_index_table, idx, hnode,
+			ci_index_key(inode->i_sb, inode->i_ino)) {
+		if (!ci_index_match(idx, inode))
+			continue;
+
+		if (ci_index_stale(idx, inode)) {
+			__ci_index_unhash(idx);
+			stale = idx;
+			idx = NULL;
+		} else {
+			atomic_inc(&idx->refcount);
+			list_move(&idx->lru, &ci_index_lru);
+		}
+		break;
+	}
+	spin_unlock(&ci_index_lock);
+
+	if (stale)
+		ci_index_put(stale);
+	return idx;
+}
+
+/**
+ * ci_index_insert() - publish a freshly built index
+ * @idx:	index to publish, caller keeps its own reference
+ *
+ * If another thread raced us and already published an index for the
+ * same directory, ours is simply not hashed and goes away with the
+ * caller's reference.
+ */
+static void ci_index_insert(struct ci_index *idx)
+{
+	struct ci_index *cur;
+	LIST_HEAD(evicted);
+
+	spin_lock(&ci_index_lock);
+	hash_for_each_possible(ci_index_table, cur, hnode,
+			ci_index_key(idx->sb, idx->ino)) {
+		if (cur->sb == idx->sb && cur->ino == idx->ino &&
+				cur->generation == idx->generation) {
+			spin_unlock(&ci_index_lock);
+			return;
+		}
+	}
+
+	atomic_inc(&idx->refcount);
+	hash_add(ci_index_table, &idx->hnode, ci_index_key(idx->sb, idx->ino));
+	list_add(&idx->lru, &ci_index_lru);
+	ci_index_nr_dirs++;
+	ci_index_nr_names += idx->nr_names;
+
+	while (ci_index_nr_dirs > CI_INDEX_MAX_DIRS ||
+			ci_index_nr_names > CI_INDEX_MAX_NAMES) {
+		cur = list_last_entry(&ci_index_lru, struct ci_index, lru);
+		if (cur == idx)
+			break;
+		__ci_index_unhash(cur);
+		list_add(&cur->lru, &evicted);
+	}
+	spin_unlock(&ci_index_lock);
+
+	while (!list_empty(&evicted)) {
+		cur = list_first_entry(&evicted, struct ci_index, lru);
+		list_del(&cur->lru);
+		ci_index_put(cur);
+	}
+}
+
+/**
+ * ci_index_build() - read a directory and hash its entries
+ * @dir_path:	path of directory to index
+ * @cacheable:	set to false if the index must not be published
+ *
+ * Return:	index with one reference on success, otherwise error pointer
+ */
+static struct ci_index *ci_index_build(struct path *dir_path, bool *cacheable)
+{
+	struct inode *inode = dir_path->dentry->d_inode;
+	struct ci_index *idx;
+	struct ci_name *cn;
+	struct hlist_node *tmp;
+	struct file *dfilp;
+	struct smb_dirent *buf_p;
+	HLIST_HEAD(names);
+	int iter, reclen, err = 0;
+	struct smb_readdir_data readdir_data = {
+#if LINUX_VERSION_CODE > KERNEL_VERSION(3, 10, 30)
+		.ctx.actor = smb_filldir,
+#endif
+		.dirent = (void *)__get_free_page(GFP_KERNEL)
+	};
+
+	if (!readdir_data.dirent)
+		return ERR_PTR(-ENOMEM);
+
+	idx = kzalloc(sizeof(struct ci_index), GFP_KERNEL);
+	if (!idx) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	INIT_LIST_HEAD(&idx->lru);
+	mutex_init(&idx->sn_mutex);
+	atomic_set(&idx->refcount, 1);
+	idx->sb = inode->i_sb;
+	idx->ino = inode->i_ino;
+	idx->generation = inode->i_generation;
+	idx->mtime = inode->i_mtime;
+	idx->ctime = inode->i_ctime;
+
+	dfilp = dentry_open(dir_path, O_RDONLY | O_LARGEFILE, current_cred());
+	if (IS_ERR(dfilp)) {
+		err = PTR_ERR(dfilp);
+		goto out;
+	}
+
+	for (;;) {
+		readdir_data.used = 0;
+		readdir_data.full = 0;
+		err = smb_vfs_readdir(dfilp, smb_filldir, &readdir_data);
+		if (err || !readdir_data.used)
+			break;
+
+		buf_p = (struct smb_dirent *)readdir_data.dirent;
+		for (iter = 0; iter < readdir_data.used; iter += reclen,
+		     buf_p = (struct smb_dirent *)((char *)buf_p + reclen)) {
+			reclen = ALIGN(sizeof(struct smb_dirent) +
+				       buf_p->namelen, sizeof(__le64));
+
+			if (idx->nr_names >= CI_INDEX_MAX_NAMES / 2) {
+				err = -E2BIG;
+				break;
+			}
+
+			cn = kmalloc(sizeof(struct ci_name) + buf_p->namelen,
+					GFP_KERNEL);
+			if (!cn) {
+				err = -ENOMEM;
+				break;
+			}
+
+			cn->len = buf_p->namelen;
+			cn->hash = ci_name_hash(buf_p->name, cn->len);
+			memcpy(cn->name, buf_p->name, cn->len);
+			hlist_add_head(&cn->node, &names);
+			idx->nr_names++;
+		}
+		if (err)
+			break;
+	}
+	fput(dfilp);
+	if (err)
+		goto out;
+
+	idx->bits = ilog2(roundup_pow_of_two(idx->nr_names | 1));
+	if (idx->bits < 4)
+		idx->bits = 4;
+	idx->names = vzalloc(sizeof(struct hlist_head) << idx->bits);
+	if (!idx->names) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	hlist_for_each_entry_safe(cn, tmp, &names, node) {
+		hlist_del(&cn->node);
+		hlist_add_head(&cn->node,
+			&idx->names[hash_32(cn->hash, idx->bits)]);
+	}
+
+	*cacheable = timespec_equal(&idx->mtime, &inode->i_mtime) &&
+		timespec_equal(&idx->ctime, &inode->i_ctime) &&
+		!ci_inode_recent(inode);
+
+out:
+	free_page((unsigned long)readdir_data.dirent);
+	if (err) {
+		hlist_for_each_entry_safe(cn, tmp, &names, node)
+			kfree(cn);
+		if (idx)
+			ci_index_free(idx);
+		return ERR_PTR(err);
+	}
+	return idx;
+}
+
+/**
+ * ci_index_mark() - remember a directory is not to be indexed for now
+ * @inode:	directory inode
+ * @state:	CI_INDEX_TOO_BIG or CI_INDEX_RECENT
+ * @mtime:	directory mtime the decision was taken on
+ * @ctime:	directory ctime the decision was taken on
+ */
+static void ci_index_mark(struct inode *inode, int state,
+		struct timespec *mtime, struct timespec *ctime)
+{
+	struct ci_index *idx;
+
+	idx = kzalloc(sizeof(struct ci_index), GFP_KERNEL);
+	if (!idx)
+		return;
+
+	INIT_LIST_HEAD(&idx->lru);
+	mutex_init(&idx->sn_mutex);
+	atomic_set(&idx->refcount, 1);
+	idx->state = state;
+	idx->sb = inode->i_sb;
+	idx->ino = inode->i_ino;
+	idx->generation = inode->i_generation;
+	idx->mtime = *mtime;
+	idx->ctime = *ctime;
+
+	ci_index_insert(idx);
+	ci_index_put(idx);
+}
+
+/**
+ * ci_index_get_or_build() - get a valid index, building it if needed
+ * @dir_path:	path of directory
+ *
+ * Return:	referenced index on success, otherwise error pointer,
+ *		-EOPNOTSUPP if the directory is marked as not indexed
+ */
+static struct ci_index *ci_index_get_or_build(struct path *dir_path)
+{
+	struct inode *inode = dir_path->dentry->d_inode;
+	struct ci_index *idx;
+	struct timespec mtime, ctime;
+	bool cacheable = false;
+
+	idx = ci_index_get(inode);
+	if (idx) {
+		if (idx->state == CI_INDEX_VALID)
+			return idx;
+		ci_index_put(idx);
+		return ERR_PTR(-EOPNOTSUPP);
+	}
+
+	mtime = inode->i_mtime;
+	ctime = inode->i_ctime;
+	idx = ci_index_build(dir_path, &cacheable);
+	if (IS_ERR(idx)) {
+		cifsd_debug("cannot index directory, err %ld\n",
+				PTR_ERR(idx));
+		if (PTR_ERR(idx) == -E2BIG)
+			ci_index_mark(inode, CI_INDEX_TOO_BIG, &mtime, &ctime);
+		return idx;
+	}
+	if (cacheable)
+		ci_index_insert(idx);
+	else if (ci_inode_recent(inode))
+		ci_index_mark(inode, CI_INDEX_RECENT, &idx->mtime, &idx->ctime);
+	return idx;
+}
+
+/**
+ * cifsd_ci_index_lookup() - caseless lookup of a name in a directory
+ * @dir_path:	path of parent directory
+ * @filename:	name to lookup
+ * @namelen:	length of @filename
+ * @realname:	on success, receives the on-disk name (@namelen bytes)
+ *
+ * Return:	0 if found, -ENOENT if not found, -EOPNOTSUPP if the
+ *		directory could not be indexed and the caller has to fall
+ *		back to scanning it
+ */
+int cifsd_ci_index_lookup(struct path *dir_path, const char *filename,
+		int namelen, char *realname)
+{
+	struct ci_index *idx;
+	struct ci_name *cn;
+	unsigned int hash;
+	int ret = -ENOENT;
+
+	idx = ci_index_get_or_build(dir_path);
+	if (IS_ERR(idx))
+		return -EOPNOTSUPP;
+
+	hash = ci_name_hash(filename, namelen);
+	hlist_for_each_entry(cn, &idx->names[hash_32(hash, idx->bits)], node) {
+		if (cn->hash != hash || cn->len != namelen)
+			continue;
+#if LINUX_VERSION_CODE > KERNEL_VERSION(3, 10, 30)
+		if (strncasecmp(filename, cn->name, namelen))
+#else
+		if (strnicmp(filename, cn->name, namelen))
+#endif
+			continue;
+		memcpy(realname, cn->name, namelen);
+		ret = 0;
+		break;
+	}
+
+	ci_index_put(idx);
+	return ret;
+}
+
+#define SN_MAP_HASH_BITS	10
+#define SN_MAP_MAX_DIRS		256
+#define SN_MAP_MAX_NAMES	(256 * 1024)
+
+struct sn_entry {
+	struct hlist_node	node;
+	struct hlist_node	snode;
+	unsigned int		hash;
+	unsigned int		len;
+	unsigned char		short_len;
+	char			short_name[SMB_SHORTNAME_LEN];
+	char			name[];
+};
+
+struct sn_map {
+	struct hlist_node	hnode;
+	struct list_head	lru;
+	struct super_block	*sb;
+	unsigned long		ino;
+	__u32			generation;
+	unsigned int		nr_names;
+	/* entries by long name and by short name */
+	DECLARE_HASHTABLE(names, SN_MAP_HASH_BITS);
+	DECLARE_HASHTABLE(shorts, SN_MAP_HASH_BITS);
+};
+
+/* serializes all short name assignment, may sleep */
+static DEFINE_MUTEX(sn_map_mutex);
+static DEFINE_HASHTABLE(sn_map_table, CI_INDEX_HASH_BITS);
+static LIST_HEAD(sn_map_lru);
+static unsigned int sn_map_nr_dirs;
+static unsigned int sn_map_nr_names;
+
+static void sn_map_free(struct sn_map *map)
+{
+	struct sn_entry *se;
+	struct hlist_node *tmp;
+	int bkt;
+
+	hash_del(&map->hnode);
+	list_del(&map->lru);
+	sn_map_nr_dirs--;
+	sn_map_nr_names -= map->nr_names;
+
+	hash_for_each_safe(map->names, bkt, tmp, se, node)
+		kfree(se);
+	vfree(map);
+}
+
+/**
+ * sn_map_get() - find or create the short name map of a directory
+ * @inode:	directory inode
+ *
+ * Must be called with sn_map_mutex held.
+ *
+ * Return:	map on success, otherwise NULL
+ */
+static struct sn_map *sn_map_get(struct inode *inode)
+{
+	struct sn_map *map;
+
+	hash_for_each_possible(sn_map_table, map, hnode,
+			ci_index_key(inode->i_sb, inode->i_ino)) {
+		if (map->sb == inode->i_sb && map->ino == inode->i_ino &&
+		    map->generation == inode->i_generation) {
+			list_move(&map->lru, &sn_map_lru);
+			return map;
+		}
+	}
+
+	while (sn_map_nr_dirs >= SN_MAP_MAX_DIRS ||
+	       sn_map_nr_names > SN_MAP_MAX_NAMES) {
+		if (list_empty(&sn_map_lru))
+			break;
+		sn_map_free(list_last_entry(&sn_map_lru, struct sn_map, lru));
+	}
+
+	map = vzalloc(sizeof(struct sn_map));
+	if (!map)
+		return NULL;
+
+	map->sb = inode->i_sb;
+	map->ino = inode->i_ino;
+	map->generation = inode->i_generation;
+	hash_init(map->names);
+	hash_init(map->shorts);
+	hash_add(sn_map_table, &map->hnode,
+			ci_index_key(inode->i_sb, inode->i_ino));
+	list_add(&map->lru, &sn_map_lru);
+	sn_map_nr_dirs++;
+	return map;
+}
+
+static struct sn_entry *sn_map_find(struct sn_map *map, const char *name,
+		unsigned int len, unsigned int hash)
+{
+	struct sn_entry *se;
+
+	hash_for_each_possible(map->names, se, node, hash) {
+		if (se->hash == hash && se->len == len &&
+		    !memcmp(se->name, name, len))
+			return se;
+	}
+	return NULL;
+}
+
+static bool sn_map_taken(struct sn_map *map, const char *short_name,
+		int short_len)
+{
+	struct sn_entry *se;
+
+	hash_for_each_possible(map->shorts, se, snode,
+			ci_name_hash(short_name, short_len)) {
+		if (se->short_len == short_len &&
+		    !memcmp(se->short_name, short_name, short_len))
+			return true;
+	}
+	return false;
+}
+
+static void sn_map_del(struct sn_map *map, struct sn_entry *se)
+{
+	hash_del(&se->node);
+	if (se->short_len)
+		hash_del(&se->snode);
+	map->nr_names--;
+	sn_map_nr_names--;
+	kfree(se);
+}
+
+/**
+ * sn_map_assign() - give a new entry a short name not handed out yet
+ * @map:	short name map of the directory
+ * @name:	long name of the entry
+ * @len:	length of @name
+ * @hash:	ci_name_hash() of @name
+ * @short_hash:	smb_shortname_hash() of @name
+ *
+ * Return:	recorded entry, otherwise NULL
+ */
+static struct sn_entry *sn_map_assign(struct sn_map *map, const char *name,
+		unsigned int len, unsigned int hash, unsigned int short_hash)
+{
+	struct sn_entry *se;
+	char out[SMB_SHORTNAME_LEN];
+	unsigned int probe;
+	int short_len = 0;
+
+	for (probe = 0; probe < CI_SHORTNAME_PROBES; probe++) {
+		short_len = smb_mangle_shortname(name, len,
+				short_hash + probe, out);
+		if (!short_len || !sn_map_taken(map, out, short_len))
+			break;
+	}
+
+	se = kmalloc(sizeof(struct sn_entry) + len, GFP_KERNEL);
+	if (!se)
+		return NULL;
+
+	se->hash = hash;
+	se->len = len;
+	memcpy(se->name, name, len);
+	/* give up on uniqueness rather than probe forever */
+	se->short_len = short_len;
+	if (short_len) {
+		memcpy(se->short_name, out, short_len);
+		hash_add(map->shorts, &se->snode,
+				ci_name_hash(out, short_len));
+	}
+	hash_add(map->names, &se->node, hash);
+	map->nr_names++;
+	sn_map_nr_names++;
+	return se;
+}
+
+static int ci_name_short_cmp(const void *a, const void *b)
+{
+	const struct ci_name *x = *(const struct ci_name **)a;
+	const struct ci_name *y = *(const struct ci_name **)b;
+
+	if (x->short_hash != y->short_hash)
+		return x->short_hash < y->short_hash ? -1 : 1;
+	if (x->len != y->len)
+		return x->len < y->len ? -1 : 1;
+	return memcmp(x->name, y->name, x->len);
+}
+
+static struct ci_name *ci_index_find_exact(struct ci_index *idx,
+		const char *name, unsigned int len, unsigned int hash)
+{
+	struct ci_name *cn;
+
+	hlist_for_each_entry(cn, &idx->names[hash_32(hash, idx->bits)],
+			node) {
+		if (cn->hash == hash && cn->len == len &&
+		    !memcmp(cn->name, name, len))
+			return cn;
+	}
+	return NULL;
+}
+
+/**
+ * ci_index_mangle() - assign a unique short name to every indexed entry
+ * @idx:	index, caller holds sn_mutex
+ * @inode:	directory inode of @idx
+ *
+ * Entries keep the short name the map already has for them. The others
+ * are mangled in an order that depends only on the set of names.
+ *
+ * Return:	0 on success, otherwise error
+ */
+static int ci_index_mangle(struct ci_index *idx, struct inode *inode)
+{
+	struct ci_name **sorted = NULL, *cn;
+	struct sn_map *map;
+	struct sn_entry *se;
+	struct hlist_node *tmp;
+	unsigned int i, nr = 0;
+	int bkt, err = 0;
+
+	mutex_lock(&sn_map_mutex);
+	map = sn_map_get(inode);
+	if (!map) {
+		err = -ENOMEM;
+		goto out;
+	}
+
+	/* names gone from the directory release their short names */
+	hash_for_each_safe(map->names, bkt, tmp, se, node) {
+		if (!ci_index_find_exact(idx, se->name, se->len, se->hash))
+			sn_map_del(map, se);
+	}
+
+	if (idx->nr_names) {
+		sorted = vmalloc(sizeof(struct ci_name *) * idx->nr_names);
+		if (!sorted) {
+			err = -ENOMEM;
+			goto out;
+		}
+	}
+
+	for (i = 0; i < (1U << idx->bits); i++) {
+		hlist_for_each_entry(cn, &idx->names[i], node) {
+			se = sn_map_find(map, cn->name, cn->len, cn->hash);
+			if (se) {
+				cn->short_len = se->short_len;
+				memcpy(cn->short_name, se->short_name,
+						se->short_len);
+				continue;
+			}
+			cn->short_hash = smb_shortname_hash(cn->name, cn->len);
+			sorted[nr++] = cn;
+		}
+	}
+	sort(sorted, nr, sizeof(struct ci_name *), ci_name_short_cmp, NULL);
+
+	for (i = 0; i < nr; i++) {
+		cn = sorted[i];
+		se = sn_map_assign(map, cn->name, cn->len, cn->hash,
+				cn->short_hash);
+		if (!se) {
+			err = -ENOMEM;
+			break;
+		}
+		cn->short_len = se->short_len;
+		memcpy(cn->short_name, se->short_name, se->short_len);
+	}
+
+out:
+	mutex_unlock(&sn_map_mutex);
+	vfree(sorted);
+	return err;
+}
+
+/**
+ * cifsd_shortname_table_get() - get 8.3 names of a directory's entries
+ * @dir_path:	path of directory
+ *
+ * The returned table is a snapshot of the directory, callers enumerating
+ * it are expected to keep the reference for the whole enumeration.
+ *
+ * Return:	referenced table on success, otherwise error pointer
+ */
+struct ci_index *cifsd_shortname_table_get(struct path *dir_path)
+{
+	struct ci_index *idx;
+	int err = 0;
+
+	idx = ci_index_get_or_build(dir_path);
+	if (IS_ERR(idx))
+		return idx;
+
+	mutex_lock(&idx->sn_mutex);
+	if (!idx->sn_ready) {
+		err = ci_index_mangle(idx, dir_path->dentry->d_inode);
+		if (!err)
+			idx->sn_ready = true;
+	}
+	mutex_unlock(&idx->sn_mutex);
+
+	if (err) {
+		ci_index_put(idx);
+		return ERR_PTR(err);
+	}
+	return idx;
+}
+
+/**
+ * cifsd_shortname_table_put() - release a table from
+ *				 cifsd_shortname_table_get()
+ * @idx:	table to release, error pointers and NULL are ignored
+ */
+void cifsd_shortname_table_put(struct ci_index *idx)
+{
+	if (!IS_ERR_OR_NULL(idx))
+		ci_index_put(idx);
+}
+
+/**
+ * cifsd_shortname_lookup() - get 8.3 name of a directory entry
+ * @idx:	table from cifsd_shortname_table_get(), may be an error
+ *		pointer or NULL
+ * @name:	long name of the entry
+ * @len:	length of @name
+ * @shortname:	destination UTF-16 buffer of SMB_SHORTNAME_LEN characters
+ *
+ * Entries missing from the table, e.g. created after it was built, get
+ * their default short name.
+ *
+ * Return:	length of short name in bytes, 0 if entry has none
+ */
+int cifsd_shortname_lookup(struct ci_index *idx, const char *name, int len,
+		char *shortname)
+{
+	struct ci_name *cn;
+	char out[SMB_SHORTNAME_LEN];
+	unsigned int hash;
+
+	if (!IS_ERR_OR_NULL(idx)) {
+		hash = ci_name_hash(name, len);
+		hlist_for_each_entry(cn, &idx->names[hash_32(hash, idx->bits)],
+				node) {
+			if (cn->hash == hash && cn->len == len &&
+			    !memcmp(cn->name, name, len))
+				return smb_shortname_to_utf16(cn->short_name,
+						cn->short_len, shortname);
+		}
+	}
+
+	len = smb_mangle_shortname(name, len, smb_shortname_hash(name, len),
+			out);
+	return smb_shortname_to_utf16(out, len, shortname);
+}
+
+/**
+ * cifsd_shortname_get() - get 8.3 name of a single directory entry
+ * @dir_path:	path of parent directory
+ * @name:	long name of the entry
+ * @len:	length of @name
+ * @shortname:	destination UTF-16 buffer of SMB_SHORTNAME_LEN characters
+ *
+ * The short name already handed out for the entry is returned, otherwise
+ * one is assigned and remembered, without reading the directory.
+ *
+ * Return:	length of short name in bytes, 0 if entry has none
+ */
+int cifsd_shortname_get(struct path *dir_path, const char *name, int len,
+		char *shortname)
+{
+	struct sn_map *map;
+	struct sn_entry *se = NULL;
+	char out[SMB_SHORTNAME_LEN];
+	unsigned int hash = ci_name_hash(name, len);
+
+	mutex_lock(&sn_map_mutex);
+	map = sn_map_get(dir_path->dentry->d_inode);
+	if (map) {
+		se = sn_map_find(map, name, len, hash);
+		if (!se)
+			se = sn_map_assign(map, name, len, hash,
+					smb_shortname_hash(name, len));
+	}
+	if (se) {
+		len = se->short_len;
+		memcpy(out, se->short_name, len);
+	}
+	mutex_unlock(&sn_map_mutex);
+
+	if (!se)
+		len = smb_mangle_shortname(name, len,
+				smb_shortname_hash(name, len), out);
+	return smb_shortname_to_utf16(out, len, shortname);
+}
+
+/**
+ * cifsd_ci_index_invalidate() - drop caseless index of a directory
+ * @dir:	directory inode whose entries were changed by cifsd
+ */
+void cifsd_ci_index_invalidate(struct inode *dir)
+{
+	struct ci_index *idx, *found = NULL;
+
+	if (!dir)
+		return;
+
+	spin_lock(&ci_index_lock);
+	hash_for_each_possible(ci_index_table, idx, hnode,
+			ci_index_key(dir->i_sb, dir->i_ino)) {
+		if (ci_index_match(idx, dir)) {
+			__ci_index_unhash(idx);
+			found = idx;
+			break;
+		}
+	}
+	spin_unlock(&ci_index_lock);
+
+	if (found)
+		ci_index_put(found);
+}
+
+/*
+ * Negative lookup cache
+ *
+ * Windows clients keep probing for names that do not exist (desktop.ini,
+ * thumbs.db, autorun.inf, DLL search paths, ...). Each of those costs a
+ * path walk and, with caseless lookup, a search of the parent directory.
+ * Remember recent misses by their case-folded absolute path for a short
+ * time so repeated probes are answered without touching the VFS.
+ *
+ * Paths created by cifsd drop their entry, a rename flushes the whole
+ * cache since it can make an entire subtree appear. Changes done locally
+ * on the server are picked up once the entry expires.
+ */
+
+#define NEG_CACHE_HASH_BITS	10
+#define NEG_CACHE_MAX_ENTRIES	4096
+#define NEG_CACHE_TTL		(2 * HZ)
+
+struct neg_entry {
+	struct hlist_node	hnode;
+	struct list_head	lru;
+	unsigned long		expires;
+	unsigned int		hash;
+	unsigned int		len;
+	char			name[];
+};
+
+static DEFINE_SPINLOCK(neg_cache_lock);
+static DEFINE_HASHTABLE(neg_cache_table, NEG_CACHE_HASH_BITS);
+static LIST_HEAD(neg_cache_lru);
+static unsigned int neg_cache_count;
+static atomic_t neg_cache_seq = ATOMIC_INIT(0);
+
+/* must be called with neg_cache_lock held */
+static void __neg_cache_del(struct neg_entry *ne)
+{
+	hash_del(&ne->hnode);
+	list_del(&ne->lru);
+	neg_cache_count--;
+	kfree(ne);
+}
+
+/* must be called with neg_cache_lock held */
+static struct neg_entry *__neg_cache_find(const char *name, unsigned int len,
+		unsigned int hash)
+{
+	struct neg_entry *ne;
+
+	hash_for_each_possible(neg_cache_table, ne, hnode, hash) {
+		if (ne->hash != hash || ne->len != len)
+			continue;
+#if LINUX_VERSION_CODE > KERNEL_VERSION(3, 10, 30)
+		if (strncasecmp(ne->name, name, len))
+#else
+		if (strnicmp(ne->name, name, len))
+#endif
+			continue;
+		return ne;
+	}
+	return NULL;
+}
+
+/**
+ * cifsd_neg_cache_seq() - sample negative cache sequence before a lookup
+ *
+ * Return:	sequence number to pass to cifsd_neg_cache_add()
+ */
+unsigned int cifsd_neg_cache_seq(void)
+{
+	return atomic_read(&neg_cache_seq);
+}
+
+/**
+ * cifsd_neg_cache_lookup() - check if a path is known not to exist
+ * @name:	absolute path name
+ *
+ * Return:	true if a recent lookup of @name failed with -ENOENT
+ */
+bool cifsd_neg_cache_lookup(const char *name)
+{
+	struct neg_entry *ne;
+	unsigned int len = strlen(name);
+	unsigned int hash = ci_name_hash(name, len);
+	bool found = false;
+
+	spin_lock(&neg_cache_lock);
+	ne = __neg_cache_find(name, len, hash);
+	if (ne) {
+		if (time_before(jiffies, ne->expires))
+			found = true;
+		else
+			__neg_cache_del(ne);
+	}
+	spin_unlock(&neg_cache_lock);
+
+	return found;
+}
+
+/**
+ * cifsd_neg_cache_add() - remember that a path does not exist
+ * @name:	absolute path name
+ * @seq:	value of cifsd_neg_cache_seq() sampled before the lookup
+ *
+ * The entry is not added if a namespace change raced with the lookup.
+ */
+void cifsd_neg_cache_add(const char *name, unsigned int seq)
+{
+	struct neg_entry *ne, *old;
+	unsigned int len = strlen(name);
+
+	ne = kmalloc(sizeof(struct neg_entry) + len, GFP_KERNEL);
+	if (!ne)
+		return;
+
+	ne->len = len;
+	ne->hash = ci_name_hash(name, len);
+	ne->expires = jiffies + NEG_CACHE_TTL;
+	memcpy(ne->name, name, len);
+
+	spin_lock(&neg_cache_lock);
+	if (atomic_read(&neg_cache_seq) != seq ||
+			__neg_cache_find(name, len, ne->hash)) {
+		spin_unlock(&neg_cache_lock);
+		kfree(ne);
+		return;
+	}
+
+	hash_add(neg_cache_table, &ne->hnode, ne->hash);
+	list_add(&ne->lru, &neg_cache_lru);
+	neg_cache_count++;
+
+	while (neg_cache_count > NEG_CACHE_MAX_ENTRIES) {
+		old = list_last_entry(&neg_cache_lru, struct neg_entry, lru);
+		__neg_cache_del(old);
+	}
+	spin_unlock(&neg_cache_lock);
+}
+
+/**
+ * cifsd_neg_cache_remove() - forget a path which now exists
+ * @name:	absolute path name created by cifsd
+ */
+void cifsd_neg_cache_remove(const char *name)
+{
+	struct neg_entry *ne;
+	unsigned int len = strlen(name);
+	unsigned int hash = ci_name_hash(name, len);
+
+	spin_lock(&neg_cache_lock);
+	atomic_inc(&neg_cache_seq);
+	ne = __neg_cache_find(name, len, hash);
+	if (ne)
+		__neg_cache_del(ne);
+	spin_unlock(&neg_cache_lock);
+}
+
+/**
+ * cifsd_neg_cache_flush() - drop all negative entries
+ */
+void cifsd_neg_cache_flush(void)
+{
+	struct neg_entry *ne, *tmp;
+
+	spin_lock(&neg_cache_lock);
+	atomic_inc(&neg_cache_seq);
+	list_for_each_entry_safe(ne, tmp, &neg_cache_lru, lru)
+		__neg_cache_del(ne);
+	spin_unlock(&neg_cache_lock);
+}
+
+/**
+ * cifsd_namecache_exit() - free name indexes and negative entries
+ */
+void cifsd_namecache_exit(void)
+{
+	struct ci_index *idx;
+
+	spin_lock(&ci_index_lock);
+	while (!list_empty(&ci_index_lru)) {
+		idx = list_first_entry(&ci_index_lru, struct ci_index, lru);
+		__ci_index_unhash(idx);
+		spin_unlock(&ci_index_lock);
+		ci_index_put(idx);
+		spin_lock(&ci_index_lock);
+	}
+	spin_unlock(&ci_index_lock);
+
+	mutex_lock(&sn_map_mutex);
+	while (!list_empty(&sn_map_lru))
+		sn_map_free(list_first_entry(&sn_map_lru, struct sn_map, lru));
+	mutex_unlock(&sn_map_mutex);
+
+	cifsd_neg_cache_flush();
+}
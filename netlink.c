@@ -205,6 +205,7 @@ static int cifsd_common_pipe_rsp(struct nlmsghdr *nlh)
 	pipe_desc = sess->pipe_desc[ev->pipe_type];
 	if (unlikely(!pipe_desc)) {
 		cifsd_err("invalid pipe descriptor\n");
+		cifsd_sess_put(sess);
 		return -EINVAL;
 	}
 
@@ -225,6 +226,7 @@ static int cifsd_common_pipe_rsp(struct nlmsghdr *nlh)
 out:
 	sess->ev_state = NETLINK_REQ_RECV;
 	wake_up_interruptible(&sess->pipe_q);
+	cifsd_sess_put(sess);
 	return 0;
 }
 
@@ -0,0 +1,966 @@
+/*
+ *   fs/cifsd/notify.c
+ *
+ *   Copyright (C) 2016 Namjae Jeon <namjae.jeon@protocolfreedom.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/slab.h>
+#include <linux/dcache.h>
+#include <linux/namei.h>
+#include <linux/hashtable.h>
+#include <linux/fsnotify_backend.h>
+
+#include "glob.h"
+#include "export.h"
+#include "smb2pdu.h"
+
+#ifdef CONFIG_SMB2_NOTIFY_SUPPORT
+
+/*
+ * SMB2 CHANGE_NOTIFY
+ *
+ * cifsd owns a single fsnotify group. A watched directory carries one mark
+ * of that group whatever the number of handles watching it; each handle is
+ * linked to the mark by a notify_link. A handle watching a tree is linked
+ * to the marks of the subdirectories below it as well, which are added as
+ * the tree is walked and as new directories show up in it.
+ *
+ * Changes are formatted into FILE_NOTIFY_INFORMATION entries in a buffer
+ * of the handle as they happen, whether a request is pending or not, so
+ * nothing is lost between two requests. A request that finds the buffer
+ * empty is parked and completed by notify_work() once a change, a cancel
+ * or the close of its handle arrives.
+ */
+
+#define NOTIFY_HASH_BITS	8
+#define NOTIFY_TREE_MAX_DIRS	1024
+
+#define NOTIFY_MARK_MASK	(FS_CREATE | FS_DELETE | FS_MOVED_FROM | \
+				 FS_MOVED_TO | FS_MODIFY | FS_ATTRIB | \
+				 FS_EVENT_ON_CHILD)
+
+#define NOTIFY_FILTER_WRITE	(FILE_NOTIFY_CHANGE_SIZE | \
+				 FILE_NOTIFY_CHANGE_LAST_WRITE)
+#define NOTIFY_FILTER_ATTRIB	(FILE_NOTIFY_CHANGE_ATTRIBUTES | \
+				 FILE_NOTIFY_CHANGE_LAST_WRITE | \
+				 FILE_NOTIFY_CHANGE_LAST_ACCESS | \
+				 FILE_NOTIFY_CHANGE_CREATION | \
+				 FILE_NOTIFY_CHANGE_EA | \
+				 FILE_NOTIFY_CHANGE_SECURITY)
+
+struct notify_mark {
+	struct fsnotify_mark	fsn_mark;
+	struct hlist_node	hnode;
+	struct inode		*inode;
+	struct list_head	links;
+	/* links of handles watching the tree above this directory */
+	int			nr_subdir_links;
+	bool			dead;
+	struct list_head	dead_node;
+};
+
+struct notify_link {
+	struct list_head	mark_node;
+	struct list_head	handle_node;
+	struct notify_mark	*mark;
+	struct cifsd_notify_handle *nh;
+	bool			subdir;
+};
+
+struct cifsd_notify_handle {
+	struct cifsd_file	*fp;
+	struct nls_table	*nls;
+	struct work_struct	work;
+	wait_queue_head_t	wq;
+	struct list_head	links;
+	struct list_head	pending;
+	struct list_head	new_dirs;
+	unsigned int		filter;
+	bool			tree;
+	bool			closing;
+	bool			overflow;
+	int			nr_requests;
+	int			nr_dirs;
+	/* path of the watched directory inside its filesystem */
+	char			*root_path;
+	int			root_len;
+	/* FILE_NOTIFY_INFORMATION entries not reported yet */
+	char			*buf;
+	unsigned int		buf_size;
+	unsigned int		buf_len;
+	unsigned int		last_entry;
+};
+
+struct notify_request {
+	struct list_head	queuelist;
+	struct smb_work		*work;
+	struct cifsd_notify_handle *nh;
+	unsigned int		out_len;
+	bool			parked;
+	bool			cancelled;
+};
+
+struct notify_new_dir {
+	struct list_head	list;
+	struct dentry		*dentry;
+};
+
+static struct fsnotify_group *notify_group;
+/* serializes watch setup and teardown, may sleep */
+static DEFINE_MUTEX(notify_mutex);
+/* protects marks hash, links, buffers and pending requests */
+static DEFINE_SPINLOCK(notify_lock);
+static DEFINE_HASHTABLE(notify_marks, NOTIFY_HASH_BITS);
+
+static struct notify_mark *notify_mark_lookup(struct inode *inode)
+{
+	struct notify_mark *nm;
+
+	hash_for_each_possible(notify_marks, nm, hnode, (unsigned long)inode) {
+		if (nm->inode == inode)
+			return nm;
+	}
+	return NULL;
+}
+
+/* must be called with notify_lock held */
+static void notify_unlink(struct notify_link *link)
+{
+	if (link->subdir)
+		link->mark->nr_subdir_links--;
+	list_del(&link->mark_node);
+	list_del(&link->handle_node);
+	kfree(link);
+}
+
+static void notify_free_mark(struct fsnotify_mark *fsn_mark)
+{
+	kfree(container_of(fsn_mark, struct notify_mark, fsn_mark));
+}
+
+/*
+ * Called once per mark, when we destroy it or when fsnotify drops it along
+ * with its inode; the hash holds the initial reference of the mark.
+ */
+static void notify_freeing_mark(struct fsnotify_mark *fsn_mark,
+		struct fsnotify_group *group)
+{
+	struct notify_mark *nm =
+		container_of(fsn_mark, struct notify_mark, fsn_mark);
+	struct notify_link *link, *tmp;
+
+	spin_lock(&notify_lock);
+	if (!nm->dead) {
+		nm->dead = true;
+		hash_del(&nm->hnode);
+	}
+	list_for_each_entry_safe(link, tmp, &nm->links, mark_node)
+		notify_unlink(link);
+	spin_unlock(&notify_lock);
+
+	fsnotify_put_mark(fsn_mark);
+}
+
+/**
+ * notify_add_entry() - buffer a FILE_NOTIFY_INFORMATION entry
+ * @nh:		notify handle
+ * @action:	FILE_ACTION_* of the change
+ * @dir:	path of the parent relative to the watched directory, or NULL
+ * @dirlen:	length of @dir
+ * @name:	name of the changed entry
+ * @namelen:	length of @name
+ *
+ * Must be called with notify_lock held. Once the changes do not fit the
+ * buffer they are dropped and the next request gets NOTIFY_ENUM_DIR.
+ */
+static void notify_add_entry(struct cifsd_notify_handle *nh, __le32 action,
+		const char *dir, int dirlen, const char *name, int namelen)
+{
+	struct FileNotifyInformation *info, *last;
+	__le16 *uni;
+	unsigned int off, need;
+	int len = 0, i;
+
+	if (nh->overflow)
+		return;
+
+	/* every byte converts to at most one UTF-16 code unit */
+	need = sizeof(struct FileNotifyInformation) +
+		(dirlen + 1 + namelen) * 2;
+	off = nh->buf_len ? ALIGN(nh->buf_len, 4) : 0;
+	if (off + need > nh->buf_size) {
+		nh->overflow = true;
+		nh->buf_len = 0;
+		return;
+	}
+
+	info = (struct FileNotifyInformation *)(nh->buf + off);
+	uni = (__le16 *)info->FileName;
+	if (dirlen) {
+		len = smb_strtoUTF16(uni, dir, dirlen, nh->nls);
+		for (i = 0; i < len; i++) {
+			if (uni[i] == cpu_to_le16('/'))
+				uni[i] = cpu_to_le16('\\');
+		}
+		uni[len++] = cpu_to_le16('\\');
+	}
+	len += smb_strtoUTF16(uni + len, name, namelen, nh->nls);
+
+	/* a file written to in a loop is reported once per request */
+	if (nh->buf_len) {
+		last = (struct FileNotifyInformation *)(nh->buf +
+				nh->last_entry);
+		if (last->Action == action &&
+		    le32_to_cpu(last->FileNameLength) == len * 2 &&
+		    !memcmp(last->FileName, uni, len * 2))
+			return;
+		last->NextEntryOffset = cpu_to_le32(off - nh->last_entry);
+	}
+
+	info->NextEntryOffset = 0;
+	info->Action = action;
+	info->FileNameLength = cpu_to_le32(len * 2);
+	nh->last_entry = off;
+	nh->buf_len = off + sizeof(struct FileNotifyInformation) + len * 2;
+}
+
+static __le32 notify_action(u32 mask, unsigned int *filter)
+{
+	unsigned int name_filter = mask & FS_ISDIR ?
+		FILE_NOTIFY_CHANGE_DIR_NAME : FILE_NOTIFY_CHANGE_FILE_NAME;
+
+	if (mask & FS_CREATE) {
+		*filter = name_filter;
+		return cpu_to_le32(FILE_ACTION_ADDED);
+	}
+	if (mask & FS_DELETE) {
+		*filter = name_filter;
+		return cpu_to_le32(FILE_ACTION_REMOVED);
+	}
+	if (mask & FS_MOVED_FROM) {
+		*filter = name_filter;
+		return cpu_to_le32(FILE_ACTION_RENAMED_OLD_NAME);
+	}
+	if (mask & FS_MOVED_TO) {
+		*filter = name_filter;
+		return cpu_to_le32(FILE_ACTION_RENAMED_NEW_NAME);
+	}
+	if (mask & FS_MODIFY) {
+		*filter = NOTIFY_FILTER_WRITE;
+		return cpu_to_le32(FILE_ACTION_MODIFIED);
+	}
+	if (mask & FS_ATTRIB) {
+		*filter = NOTIFY_FILTER_ATTRIB;
+		return cpu_to_le32(FILE_ACTION_MODIFIED);
+	}
+	return 0;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 19, 0)
+static int notify_handle_event(struct fsnotify_group *group,
+		struct inode *inode, u32 mask, const void *data, int data_type,
+		const unsigned char *file_name, u32 cookie,
+		struct fsnotify_iter_info *iter_info)
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 12, 0)
+static int notify_handle_event(struct fsnotify_group *group,
+		struct inode *inode, struct fsnotify_mark *inode_mark,
+		struct fsnotify_mark *vfsmount_mark, u32 mask,
+		const void *data, int data_type,
+		const unsigned char *file_name, u32 cookie,
+		struct fsnotify_iter_info *iter_info)
+#else
+static int notify_handle_event(struct fsnotify_group *group,
+		struct inode *inode, struct fsnotify_mark *inode_mark,
+		struct fsnotify_mark *vfsmount_mark, u32 mask,
+		const void *data, int data_type,
+		const unsigned char *file_name, u32 cookie)
+#endif
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 19, 0)
+	struct fsnotify_mark *inode_mark = fsnotify_iter_inode_mark(iter_info);
+#endif
+	struct notify_mark *nm;
+	struct cifsd_notify_handle *nh;
+	struct notify_link *link;
+	struct notify_new_dir *nd;
+	struct dentry *dentry, *new_dir = NULL;
+	char *buf = NULL, *dirpath = NULL, *rel;
+	unsigned int filter;
+	__le32 action;
+	int namelen;
+
+	/* only changes to entries of the directory are reported */
+	if (!file_name || !inode_mark)
+		return 0;
+	nm = container_of(inode_mark, struct notify_mark, fsn_mark);
+
+	action = notify_action(mask, &filter);
+	if (!action)
+		return 0;
+	namelen = strlen(file_name);
+
+	if (READ_ONCE(nm->nr_subdir_links)) {
+		buf = kmalloc(PATH_MAX, GFP_KERNEL);
+		dentry = d_find_any_alias(inode);
+		if (buf && dentry) {
+			dirpath = dentry_path_raw(dentry, buf, PATH_MAX);
+			if (IS_ERR(dirpath))
+				dirpath = NULL;
+		}
+		dput(dentry);
+	}
+
+	if (mask & (FS_CREATE | FS_MOVED_TO) && mask & FS_ISDIR &&
+	    data_type == FSNOTIFY_EVENT_INODE)
+		new_dir = d_find_any_alias((struct inode *)data);
+
+	spin_lock(&notify_lock);
+	list_for_each_entry(link, &nm->links, mark_node) {
+		nh = link->nh;
+		if (nh->closing)
+			continue;
+
+		if (new_dir && nh->tree) {
+			nd = kmalloc(sizeof(struct notify_new_dir), GFP_ATOMIC);
+			if (nd) {
+				nd->dentry = dget(new_dir);
+				list_add_tail(&nd->list, &nh->new_dirs);
+				schedule_work(&nh->work);
+			}
+		}
+
+		if (!(nh->filter & filter))
+			continue;
+
+		if (!link->subdir) {
+			notify_add_entry(nh, action, NULL, 0, file_name,
+					namelen);
+		} else if (!dirpath) {
+			nh->overflow = true;
+			nh->buf_len = 0;
+		} else if (!strncmp(dirpath, nh->root_path, nh->root_len) &&
+			   dirpath[nh->root_len] == '/') {
+			rel = dirpath + nh->root_len + 1;
+			notify_add_entry(nh, action, rel, strlen(rel),
+					file_name, namelen);
+		}
+
+		if (!list_empty(&nh->pending))
+			schedule_work(&nh->work);
+	}
+	spin_unlock(&notify_lock);
+
+	dput(new_dir);
+	kfree(buf);
+	return 0;
+}
+
+static const struct fsnotify_ops notify_ops = {
+	.handle_event = notify_handle_event,
+	.freeing_mark = notify_freeing_mark,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 12, 0)
+	.free_mark = notify_free_mark,
+#endif
+};
+
+/**
+ * notify_link_inode() - link a handle to the mark of a directory
+ * @nh:		notify handle
+ * @inode:	directory inode
+ * @subdir:	@inode is below the directory of @nh
+ *
+ * The mark is created on first use. Must be called with notify_mutex held.
+ *
+ * Return:	0 on success, otherwise error
+ */
+static int notify_link_inode(struct cifsd_notify_handle *nh,
+		struct inode *inode, bool subdir)
+{
+	struct notify_link *link, *iter;
+	struct notify_mark *nm;
+	int err;
+
+	link = kzalloc(sizeof(struct notify_link), GFP_KERNEL);
+	if (!link)
+		return -ENOMEM;
+	link->nh = nh;
+	link->subdir = subdir;
+
+	spin_lock(&notify_lock);
+	nm = notify_mark_lookup(inode);
+	if (nm)
+		goto link;
+	spin_unlock(&notify_lock);
+
+	nm = kzalloc(sizeof(struct notify_mark), GFP_KERNEL);
+	if (!nm) {
+		kfree(link);
+		return -ENOMEM;
+	}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 12, 0)
+	fsnotify_init_mark(&nm->fsn_mark, notify_group);
+#else
+	fsnotify_init_mark(&nm->fsn_mark, notify_free_mark);
+#endif
+	nm->fsn_mark.mask = NOTIFY_MARK_MASK;
+	nm->inode = inode;
+	INIT_LIST_HEAD(&nm->links);
+
+	/* freeing_mark may run as soon as the mark is attached */
+	fsnotify_get_mark(&nm->fsn_mark);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 19, 0)
+	err = fsnotify_add_inode_mark(&nm->fsn_mark, inode, 0);
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 12, 0)
+	err = fsnotify_add_mark(&nm->fsn_mark, inode, NULL, 0);
+#else
+	err = fsnotify_add_mark(&nm->fsn_mark, notify_group, inode, NULL, 0);
+#endif
+	if (err) {
+		fsnotify_put_mark(&nm->fsn_mark);
+		fsnotify_put_mark(&nm->fsn_mark);
+		kfree(link);
+		return err;
+	}
+
+	spin_lock(&notify_lock);
+	if (nm->dead) {
+		spin_unlock(&notify_lock);
+		fsnotify_put_mark(&nm->fsn_mark);
+		kfree(link);
+		return -ENOENT;
+	}
+	hash_add(notify_marks, &nm->hnode, (unsigned long)inode);
+	fsnotify_put_mark(&nm->fsn_mark);
+link:
+	/* a directory moved around inside the tree is linked already */
+	list_for_each_entry(iter, &nm->links, mark_node) {
+		if (iter->nh == nh) {
+			spin_unlock(&notify_lock);
+			kfree(link);
+			return -EEXIST;
+		}
+	}
+	link->mark = nm;
+	if (subdir)
+		nm->nr_subdir_links++;
+	list_add_tail(&link->mark_node, &nm->links);
+	list_add_tail(&link->handle_node, &nh->links);
+	spin_unlock(&notify_lock);
+	return 0;
+}
+
+struct notify_tree_ctx {
+	struct dir_context	ctx;
+	char			*names;
+	unsigned int		used;
+	bool			full;
+};
+
+static int notify_tree_filldir(struct dir_context *ctx, const char *name,
+		int namlen, loff_t offset, u64 ino, unsigned int d_type)
+{
+	struct notify_tree_ctx *tctx =
+		container_of(ctx, struct notify_tree_ctx, ctx);
+
+	if (d_type != DT_DIR && d_type != DT_UNKNOWN)
+		return 0;
+	if ((namlen == 1 && name[0] == '.') ||
+	    (namlen == 2 && name[0] == '.' && name[1] == '.'))
+		return 0;
+
+	if (tctx->used + namlen + 1 > PAGE_SIZE) {
+		tctx->full = true;
+		return -EINVAL;
+	}
+	memcpy(tctx->names + tctx->used, name, namlen);
+	tctx->names[tctx->used + namlen] = '\0';
+	tctx->used += namlen + 1;
+	return 0;
+}
+
+/**
+ * notify_watch_tree() - link a handle to the directories below a dentry
+ * @nh:		notify handle watching a tree
+ * @mnt:	mount of @top
+ * @top:	directory to walk
+ *
+ * Walks breadth first until NOTIFY_TREE_MAX_DIRS directories are watched
+ * by the handle; what lies deeper is not reported. Must be called with
+ * notify_mutex held.
+ */
+static void notify_watch_tree(struct cifsd_notify_handle *nh,
+		struct vfsmount *mnt, struct dentry *top)
+{
+	struct notify_tree_ctx tctx = {
+		.ctx.actor = notify_tree_filldir,
+	};
+	struct notify_new_dir *nd, *tmp;
+	struct dentry *child;
+	struct file *filp;
+	struct path path;
+	LIST_HEAD(queue);
+	unsigned int off;
+	int len;
+
+	tctx.names = (char *)__get_free_page(GFP_KERNEL);
+	if (!tctx.names)
+		return;
+
+	nd = kmalloc(sizeof(struct notify_new_dir), GFP_KERNEL);
+	if (!nd)
+		goto out;
+	nd->dentry = dget(top);
+	list_add_tail(&nd->list, &queue);
+
+	while ((nd = list_first_entry_or_null(&queue,
+					struct notify_new_dir, list))) {
+		list_del(&nd->list);
+		path.mnt = mnt;
+		path.dentry = nd->dentry;
+		filp = dentry_open(&path, O_RDONLY | O_DIRECTORY,
+				current_cred());
+		if (IS_ERR(filp))
+			goto next;
+
+		do {
+			tctx.used = 0;
+			tctx.full = false;
+			if (iterate_dir(filp, &tctx.ctx) < 0)
+				break;
+
+			for (off = 0; off < tctx.used; off += len + 1) {
+				len = strlen(tctx.names + off);
+				if (nh->nr_dirs >= NOTIFY_TREE_MAX_DIRS)
+					break;
+
+				child = lookup_one_len_unlocked(
+						tctx.names + off, nd->dentry,
+						len);
+				if (IS_ERR(child))
+					continue;
+				if (!d_is_dir(child) || d_mountpoint(child) ||
+				    notify_link_inode(nh, d_inode(child),
+						      true)) {
+					dput(child);
+					continue;
+				}
+				nh->nr_dirs++;
+
+				tmp = kmalloc(sizeof(struct notify_new_dir),
+						GFP_KERNEL);
+				if (!tmp) {
+					dput(child);
+					continue;
+				}
+				tmp->dentry = child;
+				list_add_tail(&tmp->list, &queue);
+			}
+		} while (tctx.full && nh->nr_dirs < NOTIFY_TREE_MAX_DIRS);
+
+		fput(filp);
+next:
+		dput(nd->dentry);
+		kfree(nd);
+	}
+
+out:
+	free_page((unsigned long)tctx.names);
+}
+
+/* must be called with notify_lock held */
+static void notify_fill_rsp(struct cifsd_notify_handle *nh,
+		struct smb_work *smb_work, struct smb2_notify_rsp *rsp,
+		unsigned int out_len, bool cancelled)
+{
+	unsigned int len = 0;
+
+	if (cancelled) {
+		rsp->hdr.Status = NT_STATUS_CANCELLED;
+		smb2_set_err_rsp(smb_work);
+		return;
+	}
+
+	if (nh->closing) {
+		rsp->hdr.Status = NT_STATUS_NOTIFY_CLEANUP;
+	} else if (nh->overflow || nh->buf_len > out_len) {
+		rsp->hdr.Status = NT_STATUS_NOTIFY_ENUM_DIR;
+	} else {
+		rsp->hdr.Status = NT_STATUS_OK;
+		len = nh->buf_len;
+		memcpy(rsp->Buffer, nh->buf, len);
+	}
+	nh->overflow = false;
+	nh->buf_len = 0;
+
+	rsp->StructureSize = cpu_to_le16(9);
+	rsp->OutputBufferOffset = cpu_to_le16(len ? 72 : 0);
+	rsp->OutputBufferLength = cpu_to_le32(len);
+	if (!len)
+		rsp->Buffer[0] = 0;
+	inc_rfc1001_len(smb_work->rsp_buf, 8 + max(len, 1U));
+}
+
+static void notify_watch_new_dirs(struct cifsd_notify_handle *nh)
+{
+	struct notify_new_dir *nd;
+	struct vfsmount *mnt = nh->fp->filp->f_path.mnt;
+
+	mutex_lock(&notify_mutex);
+	for (;;) {
+		spin_lock(&notify_lock);
+		nd = list_first_entry_or_null(&nh->new_dirs,
+				struct notify_new_dir, list);
+		if (nd)
+			list_del(&nd->list);
+		spin_unlock(&notify_lock);
+		if (!nd)
+			break;
+
+		if (!nh->closing && nh->nr_dirs < NOTIFY_TREE_MAX_DIRS &&
+		    d_inode(nd->dentry) &&
+		    !notify_link_inode(nh, d_inode(nd->dentry), true)) {
+			nh->nr_dirs++;
+			/* the directory may have been moved in with content */
+			notify_watch_tree(nh, mnt, nd->dentry);
+		}
+		dput(nd->dentry);
+		kfree(nd);
+	}
+	mutex_unlock(&notify_mutex);
+}
+
+static void notify_send_work(struct work_struct *work)
+{
+	struct async_info *async =
+		container_of(work, struct async_info, async_work);
+
+	smb_complete_parked_work(async->private);
+}
+
+/**
+ * notify_work() - complete parked requests of a handle
+ * @work:	work of struct cifsd_notify_handle
+ *
+ * Responses are sent from the async work of each request: close waits for
+ * this work while holding srv_mutex of the connection the send needs.
+ */
+static void notify_work(struct work_struct *work)
+{
+	struct cifsd_notify_handle *nh =
+		container_of(work, struct cifsd_notify_handle, work);
+	struct notify_request *nreq, *iter;
+	struct smb_work *smb_work;
+
+	if (!list_empty(&nh->new_dirs))
+		notify_watch_new_dirs(nh);
+
+	for (;;) {
+		nreq = NULL;
+		spin_lock(&notify_lock);
+		list_for_each_entry(iter, &nh->pending, queuelist) {
+			if (iter->cancelled || nh->closing || nh->overflow ||
+			    nh->buf_len) {
+				nreq = iter;
+				break;
+			}
+		}
+		if (!nreq) {
+			spin_unlock(&notify_lock);
+			break;
+		}
+		list_del(&nreq->queuelist);
+		smb_work = nreq->work;
+		notify_fill_rsp(nh, smb_work,
+				(struct smb2_notify_rsp *)smb_work->rsp_buf,
+				nreq->out_len, nreq->cancelled);
+		if (!--nh->nr_requests)
+			wake_up(&nh->wq);
+		spin_unlock(&notify_lock);
+
+		fp_put(nh->fp);
+
+		/* a cancel racing with us is done once we own request_lock */
+		spin_lock(&smb_work->conn->request_lock);
+		smb_work->async->cancel_fn = NULL;
+		smb_work->async->private = smb_work;
+		spin_unlock(&smb_work->conn->request_lock);
+		kfree(nreq);
+
+		INIT_WORK(&smb_work->async->async_work, notify_send_work);
+		schedule_work(&smb_work->async->async_work);
+	}
+}
+
+static void notify_park(struct smb_work *smb_work)
+{
+	struct notify_request *nreq = smb_work->async->private;
+	struct cifsd_notify_handle *nh = nreq->nh;
+
+	spin_lock(&notify_lock);
+	nreq->parked = true;
+	list_add_tail(&nreq->queuelist, &nh->pending);
+	if (nreq->cancelled || nh->closing || nh->overflow || nh->buf_len)
+		schedule_work(&nh->work);
+	spin_unlock(&notify_lock);
+}
+
+/* called with request_lock held */
+static void notify_cancel(struct smb_work *smb_work)
+{
+	struct notify_request *nreq = smb_work->async->private;
+
+	spin_lock(&notify_lock);
+	nreq->cancelled = true;
+	if (nreq->parked)
+		schedule_work(&nreq->nh->work);
+	spin_unlock(&notify_lock);
+}
+
+static struct cifsd_notify_handle *
+notify_handle_alloc(struct smb_work *smb_work, struct cifsd_file *fp,
+		unsigned int filter, bool tree, unsigned int out_len)
+{
+	struct cifsd_notify_handle *nh;
+	char *path;
+
+	nh = kzalloc(sizeof(struct cifsd_notify_handle), GFP_KERNEL);
+	if (!nh)
+		return NULL;
+
+	/* what a response with the large buffer can carry */
+	nh->buf_size = min_t(unsigned int, out_len, SMBMaxBufSize);
+	/* room for the null smb_strtoUTF16() appends */
+	nh->buf = kmalloc(nh->buf_size + 2, GFP_KERNEL);
+	nh->root_path = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!nh->buf || !nh->root_path)
+		goto err;
+
+	path = dentry_path_raw(fp->filp->f_path.dentry, nh->root_path,
+			PATH_MAX);
+	if (IS_ERR(path))
+		goto err;
+	nh->root_len = strlen(path);
+	memmove(nh->root_path, path, nh->root_len + 1);
+	/* the filesystem root itself, keep the separator for subdirs */
+	if (nh->root_len == 1)
+		nh->root_len = 0;
+
+	nh->fp = fp;
+	nh->nls = smb_work->conn->local_nls;
+	nh->filter = filter;
+	nh->tree = tree;
+	INIT_WORK(&nh->work, notify_work);
+	init_waitqueue_head(&nh->wq);
+	INIT_LIST_HEAD(&nh->links);
+	INIT_LIST_HEAD(&nh->pending);
+	INIT_LIST_HEAD(&nh->new_dirs);
+	return nh;
+
+err:
+	kfree(nh->root_path);
+	kfree(nh->buf);
+	kfree(nh);
+	return NULL;
+}
+
+/**
+ * cifsd_notify_request() - answer or park a CHANGE_NOTIFY request
+ * @smb_work:	smb work containing notify command buffer
+ * @fp:		directory handle, referenced by the caller
+ * @rsp:	response of the request
+ * @filter:	CompletionFilter of the request
+ * @tree:	SMB2_WATCH_TREE was set
+ * @out_len:	OutputBufferLength of the request
+ *
+ * The first request of a handle starts watching; filter and tree of later
+ * requests on the same handle are those of the first one.
+ *
+ * Return:	0 if @rsp was filled from changes buffered on the handle,
+ *		-EINPROGRESS if the request was parked and keeps the
+ *		reference on @fp, otherwise error
+ */
+int cifsd_notify_request(struct smb_work *smb_work, struct cifsd_file *fp,
+		struct smb2_notify_rsp *rsp, unsigned int filter, bool tree,
+		unsigned int out_len)
+{
+	struct connection *conn = smb_work->conn;
+	struct cifsd_notify_handle *nh;
+	struct notify_request *nreq;
+	struct async_info *async;
+	struct path *path = &fp->filp->f_path;
+	int err;
+
+	nreq = kzalloc(sizeof(struct notify_request), GFP_KERNEL);
+	if (!nreq)
+		return -ENOMEM;
+
+	mutex_lock(&notify_mutex);
+	if (fp->f_state == FP_FREEING) {
+		err = -EBADF;
+		goto out;
+	}
+
+	nh = fp->notify;
+	if (!nh) {
+		nh = notify_handle_alloc(smb_work, fp, filter, tree, out_len);
+		if (!nh) {
+			err = -ENOMEM;
+			goto out;
+		}
+
+		err = notify_link_inode(nh, d_inode(path->dentry), false);
+		if (err) {
+			kfree(nh->root_path);
+			kfree(nh->buf);
+			kfree(nh);
+			goto out;
+		}
+		if (tree)
+			notify_watch_tree(nh, path->mnt, path->dentry);
+		fp->notify = nh;
+	}
+
+	spin_lock(&notify_lock);
+	if (nh->buf_len || nh->overflow) {
+		notify_fill_rsp(nh, smb_work, rsp, out_len, false);
+		spin_unlock(&notify_lock);
+		err = 0;
+		goto out;
+	}
+
+	/* the rest of a compound cannot wait for this one */
+	if (smb_work->next_smb2_rcv_hdr_off) {
+		spin_unlock(&notify_lock);
+		err = -EOPNOTSUPP;
+		goto out;
+	}
+	nh->nr_requests++;
+	spin_unlock(&notify_lock);
+	mutex_unlock(&notify_mutex);
+
+	nreq->work = smb_work;
+	nreq->nh = nh;
+	nreq->out_len = out_len;
+	INIT_LIST_HEAD(&nreq->queuelist);
+
+	cifsd_debug("parking notify request, filter 0x%x%s\n", filter,
+			tree ? " (tree)" : "");
+	smb2_send_interim_resp(smb_work);
+
+	spin_lock(&conn->request_lock);
+	async = smb_work->async;
+	async->private = nreq;
+	async->cancel_fn = notify_cancel;
+	async->park_fn = notify_park;
+	/* cancelled before cancel_fn was set */
+	if (async->async_status != ASYNC_PROG)
+		notify_cancel(smb_work);
+	spin_unlock(&conn->request_lock);
+
+	return -EINPROGRESS;
+
+out:
+	mutex_unlock(&notify_mutex);
+	kfree(nreq);
+	return err;
+}
+
+static bool notify_idle(struct cifsd_notify_handle *nh)
+{
+	bool idle;
+
+	spin_lock(&notify_lock);
+	idle = !nh->nr_requests;
+	spin_unlock(&notify_lock);
+	return idle;
+}
+
+/**
+ * cifsd_notify_release() - stop watching for a handle being closed
+ * @fp:		cifsd file pointer, FP_FREEING already
+ *
+ * Pending requests of the handle complete with NOTIFY_CLEANUP before
+ * this returns.
+ */
+void cifsd_notify_release(struct cifsd_file *fp)
+{
+	struct cifsd_notify_handle *nh;
+	struct notify_link *link, *tmp;
+	struct notify_mark *nm, *ntmp;
+	struct notify_new_dir *nd, *ndtmp;
+	LIST_HEAD(dead);
+
+	mutex_lock(&notify_mutex);
+	nh = fp->notify;
+	if (!nh) {
+		mutex_unlock(&notify_mutex);
+		return;
+	}
+	fp->notify = NULL;
+
+	spin_lock(&notify_lock);
+	nh->closing = true;
+	list_for_each_entry_safe(link, tmp, &nh->links, handle_node) {
+		nm = link->mark;
+		notify_unlink(link);
+		if (list_empty(&nm->links) && !nm->dead) {
+			nm->dead = true;
+			hash_del(&nm->hnode);
+			fsnotify_get_mark(&nm->fsn_mark);
+			list_add(&nm->dead_node, &dead);
+		}
+	}
+	schedule_work(&nh->work);
+	spin_unlock(&notify_lock);
+
+	list_for_each_entry_safe(nm, ntmp, &dead, dead_node) {
+		fsnotify_destroy_mark(&nm->fsn_mark, notify_group);
+		fsnotify_put_mark(&nm->fsn_mark);
+	}
+	mutex_unlock(&notify_mutex);
+
+	wait_event(nh->wq, notify_idle(nh));
+	flush_work(&nh->work);
+
+	list_for_each_entry_safe(nd, ndtmp, &nh->new_dirs, list) {
+		dput(nd->dentry);
+		kfree(nd);
+	}
+	kfree(nh->root_path);
+	kfree(nh->buf);
+	kfree(nh);
+}
+
+int cifsd_notify_init(void)
+{
+	notify_group = fsnotify_alloc_group(&notify_ops);
+	if (IS_ERR(notify_group)) {
+		cifsd_err("failed to allocate fsnotify group\n");
+		return PTR_ERR(notify_group);
+	}
+	return 0;
+}
+
+void cifsd_notify_exit(void)
+{
+	fsnotify_destroy_group(notify_group);
+}
+
+#endif /* CONFIG_SMB2_NOTIFY_SUPPORT */
@@ -39,6 +39,7 @@ extern const struct nt_err_code_struct nt_errs[];
 #define NT_ERROR_INVALID_PARAMETER     0x0057
 #define NT_ERROR_INSUFFICIENT_BUFFER   0x007a
 #define NT_STATUS_1804                 0x070c
+#define NT_STATUS_NOTIFY_CLEANUP       0x010b
 #define NT_STATUS_NOTIFY_ENUM_DIR      0x010c
 #define NT_STATUS_INVALID_LOCK_RANGE   (0xC0000000 | 0x01a1)
 /*
@@ -559,6 +560,9 @@ extern const struct nt_err_code_struct nt_errs[];
 #define NT_STATUS_QUOTA_LIST_INCONSISTENT (0xC0000000 | 0x0266)
 #define NT_STATUS_FILE_IS_OFFLINE (0xC0000000 | 0x0267)
 #define NT_STATUS_NETWORK_SESSION_EXPIRED  (0xC0000000 | 0x035c)
+#define NT_STATUS_INVALID_TOKEN (0xC0000000 | 0x0465)
+#define NT_STATUS_OFFLOAD_READ_FILE_NOT_SUPPORTED (0xC0000000 | 0xA2A3)
+#define NT_STATUS_OFFLOAD_WRITE_FILE_NOT_SUPPORTED (0xC0000000 | 0xA2A4)
 #define NT_STATUS_NO_SUCH_JOB (0xC0000000 | 0xEDE)     /* scheduler */
 #define NT_STATUS_NO_PREAUTH_INTEGRITY_HASH_OVERLAP (0xC0000000 | 0x5D0000)
 #define NT_STATUS_PENDING 0x00000103
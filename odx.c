@@ -0,0 +1,234 @@
+/*
+ *   fs/cifsd/odx.c
+ *
+ *   Copyright (C) 2016 Namjae Jeon <namjae.jeon@protocolfreedom.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#include <linux/kernel.h>
+#include <linux/fs.h>
+#include <linux/file.h>
+#include <linux/slab.h>
+#include <linux/jhash.h>
+#include <linux/random.h>
+#include <linux/hashtable.h>
+#include <linux/workqueue.h>
+
+#include "glob.h"
+#include "fh.h"
+
+/*
+ * Offloaded data transfer tokens
+ *
+ * FSCTL_OFFLOAD_READ hands out a token standing for a range of a file as
+ * it is at that time, FSCTL_OFFLOAD_WRITE copies from the range a token
+ * stands for. The token is random and only meaningful to this server, so
+ * it can be used from any session and any share.
+ *
+ * A token keeps a reference to the file it was taken on, so it stays
+ * usable after the handle is closed, until it expires. The inode ctime
+ * sampled with the token acts as a generation: once the file changed the
+ * token is invalid. Expired tokens are dropped by a periodic work item,
+ * and the oldest tokens are dropped once there are too many.
+ */
+
+#define ODX_HASH_BITS		8
+#define ODX_MAX_TOKENS		1024
+/* token lifetime when the client leaves it to the server, in ms */
+#define ODX_DEFAULT_TTL		(60 * 1000)
+#define ODX_MAX_TTL		(10 * 60 * 1000)
+#define ODX_GC_INTERVAL		(30 * HZ)
+
+struct odx_token {
+	struct hlist_node	hnode;
+	struct list_head	lru;
+	u8			id[CIFSD_ODX_TOKEN_ID_LEN];
+	struct file		*filp;
+	loff_t			offset;
+	loff_t			length;
+	/* inode ctime when the token was taken */
+	s64			ctime_sec;
+	long			ctime_nsec;
+	unsigned long		expires;
+};
+
+static DEFINE_SPINLOCK(odx_lock);
+static DEFINE_HASHTABLE(odx_table, ODX_HASH_BITS);
+static LIST_HEAD(odx_lru);
+static unsigned int odx_count;
+
+static void odx_gc(struct work_struct *work);
+static DECLARE_DELAYED_WORK(odx_gc_work, odx_gc);
+
+static inline u32 odx_hash(const u8 *id)
+{
+	return jhash(id, CIFSD_ODX_TOKEN_ID_LEN, 0);
+}
+
+/* must be called with odx_lock held, the token goes on @dispose */
+static void __odx_unhash(struct odx_token *tok, struct list_head *dispose)
+{
+	hash_del(&tok->hnode);
+	list_move(&tok->lru, dispose);
+	odx_count--;
+}
+
+static void odx_dispose(struct list_head *dispose)
+{
+	struct odx_token *tok, *tmp;
+
+	list_for_each_entry_safe(tok, tmp, dispose, lru) {
+		list_del(&tok->lru);
+		fput(tok->filp);
+		kfree(tok);
+	}
+}
+
+/* must be called with odx_lock held */
+static void __odx_expire(struct list_head *dispose)
+{
+	struct odx_token *tok, *tmp;
+
+	list_for_each_entry_safe(tok, tmp, &odx_lru, lru) {
+		if (time_after_eq(jiffies, tok->expires))
+			__odx_unhash(tok, dispose);
+	}
+}
+
+static void odx_gc(struct work_struct *work)
+{
+	LIST_HEAD(dispose);
+	bool rearm;
+
+	spin_lock(&odx_lock);
+	__odx_expire(&dispose);
+	rearm = odx_count != 0;
+	spin_unlock(&odx_lock);
+
+	odx_dispose(&dispose);
+	if (rearm)
+		schedule_delayed_work(&odx_gc_work, ODX_GC_INTERVAL);
+}
+
+/**
+ * cifsd_odx_token_create() - take a token on a range of an open
+ * @fp:		open the range belongs to
+ * @offset:	start of the range
+ * @length:	length of the range
+ * @ttl:	token lifetime in ms, 0 for the default
+ * @id:		token id returned, CIFSD_ODX_TOKEN_ID_LEN bytes
+ *
+ * Return:	0 on success, otherwise error
+ */
+int cifsd_odx_token_create(struct cifsd_file *fp, loff_t offset,
+		loff_t length, unsigned int ttl, u8 *id)
+{
+	struct inode *inode = FP_INODE(fp);
+	struct odx_token *tok, *old;
+	LIST_HEAD(dispose);
+
+	tok = kzalloc(sizeof(struct odx_token), GFP_KERNEL);
+	if (!tok)
+		return -ENOMEM;
+
+	if (!ttl || ttl > ODX_MAX_TTL)
+		ttl = ttl ? ODX_MAX_TTL : ODX_DEFAULT_TTL;
+
+	get_random_bytes(tok->id, CIFSD_ODX_TOKEN_ID_LEN);
+	memcpy(id, tok->id, CIFSD_ODX_TOKEN_ID_LEN);
+	tok->filp = get_file(fp->filp);
+	tok->offset = offset;
+	tok->length = length;
+	tok->ctime_sec = inode->i_ctime.tv_sec;
+	tok->ctime_nsec = inode->i_ctime.tv_nsec;
+	tok->expires = jiffies + msecs_to_jiffies(ttl);
+
+	spin_lock(&odx_lock);
+	hash_add(odx_table, &tok->hnode, odx_hash(tok->id));
+	list_add(&tok->lru, &odx_lru);
+	odx_count++;
+
+	while (odx_count > ODX_MAX_TOKENS) {
+		old = list_last_entry(&odx_lru, struct odx_token, lru);
+		__odx_unhash(old, &dispose);
+	}
+	spin_unlock(&odx_lock);
+
+	odx_dispose(&dispose);
+	schedule_delayed_work(&odx_gc_work, ODX_GC_INTERVAL);
+	return 0;
+}
+
+/**
+ * cifsd_odx_token_get() - look up the range a token stands for
+ * @id:		token id, CIFSD_ODX_TOKEN_ID_LEN bytes
+ * @offset:	start of the range
+ * @length:	length of the range
+ *
+ * Return:	referenced file of the range, to be released with fput(),
+ *		-ENOENT if the token is unknown or expired, -ESTALE if
+ *		the file changed since the token was taken
+ */
+struct file *cifsd_odx_token_get(const u8 *id, loff_t *offset,
+		loff_t *length)
+{
+	struct odx_token *tok;
+	struct inode *inode;
+	struct file *filp = ERR_PTR(-ENOENT);
+	LIST_HEAD(dispose);
+
+	spin_lock(&odx_lock);
+	hash_for_each_possible(odx_table, tok, hnode, odx_hash(id)) {
+		if (memcmp(tok->id, id, CIFSD_ODX_TOKEN_ID_LEN))
+			continue;
+
+		inode = file_inode(tok->filp);
+		if (time_after_eq(jiffies, tok->expires)) {
+			__odx_unhash(tok, &dispose);
+		} else if (inode->i_ctime.tv_sec != tok->ctime_sec ||
+			   inode->i_ctime.tv_nsec != tok->ctime_nsec) {
+			__odx_unhash(tok, &dispose);
+			filp = ERR_PTR(-ESTALE);
+		} else {
+			filp = get_file(tok->filp);
+			*offset = tok->offset;
+			*length = tok->length;
+		}
+		break;
+	}
+	spin_unlock(&odx_lock);
+
+	odx_dispose(&dispose);
+	return filp;
+}
+
+/**
+ * cifsd_odx_exit() - drop all tokens
+ */
+void cifsd_odx_exit(void)
+{
+	LIST_HEAD(dispose);
+	struct odx_token *tok, *tmp;
+
+	cancel_delayed_work_sync(&odx_gc_work);
+
+	spin_lock(&odx_lock);
+	list_for_each_entry_safe(tok, tmp, &odx_lru, lru)
+		__odx_unhash(tok, &dispose);
+	spin_unlock(&odx_lock);
+
+	odx_dispose(&dispose);
+}
@@ -655,6 +655,17 @@ out:
 
 
 #ifdef CONFIG_CIFS_SMB2_SERVER
+/*
+ * Breaks are not responses to an encrypted request, but a session that
+ * requires encryption must not see them in the clear. smb_send_rsp()
+ * encrypts them with the keys of the session owning the open.
+ */
+static inline void smb2_break_set_encrypted(struct smb_work *smb_work)
+{
+	if (smb_work->sess && smb_work->sess->enc_forced)
+		smb_work->encrypted = true;
+}
+
 /**
  * smb2_send_lease_break_notification() - send lease break command from server
  * to client
@@ -714,6 +725,7 @@ static void smb2_send_lease_break_notification(struct work_struct *work)
 	rsp->ShareMaskHint = 0;
 
 	inc_rfc1001_len(rsp, 44);
+	smb2_break_set_encrypted(smb_work);
 	smb_send_rsp(smb_work);
 	mempool_free(smb_work->rsp_buf, cifsd_sm_rsp_poolp);
 	kfree(smb_work);
@@ -1810,6 +1822,7 @@ void smb2_send_oplock_break_notification(struct work_struct *work)
 
 	cifsd_debug("sending oplock break v_id %llu p_id = %llu lock level = %d\n",
 			rsp->VolatileFid, rsp->PersistentFid, rsp->OplockLevel);
+	smb2_break_set_encrypted(smb_work);
 	smb_send_rsp(smb_work);
 	mempool_free(smb_work->rsp_buf, cifsd_sm_rsp_poolp);
 	kfree(smb_work);
@@ -21,6 +21,7 @@
 #include <linux/math64.h>
 #include <linux/fs.h>
 #include <linux/posix_acl_xattr.h>
+#include <asm-generic/unaligned.h>
 #include "glob.h"
 #include "export.h"
 #include "smb1pdu.h"
@@ -33,12 +34,108 @@ static const char basechars[43] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ_-!@#$%";
 #define PERIOD '.'
 #define mangle(V) ((char)(basechars[(V) % MANGLE_BASE]))
 
+/* characters allowed in an 8.3 name besides upper case letters and digits */
+static inline bool is_shortname_char(unsigned char c)
+{
+	return c < 0x80 &&
+		(isalnum(c) || (c && strchr("!#$%&'()-@^_`{}~", c)));
+}
+
+/**
+ * smb_shortname_hash() - default mangling hash of a long filename
+ * @longname:	source long filename
+ * @len:	length of @longname
+ *
+ * Return:	hash to be passed to smb_mangle_shortname()
+ */
+unsigned int smb_shortname_hash(const char *longname, int len)
+{
+	unsigned int hash = 0;
+
+	while (len--)
+		hash = hash * 33 + (unsigned char)*longname++;
+	return hash % (MANGLE_BASE * MANGLE_BASE);
+}
+
+/**
+ * smb_mangle_shortname() - build 8.3 short name of a long filename
+ * @longname:	source long filename
+ * @len:	length of @longname
+ * @hash:	mangling hash, only its value modulo MANGLE_BASE^2 is used
+ * @out:	destination buffer of SMB_SHORTNAME_LEN bytes, not terminated
+ *
+ * The short name is made of up to five characters of the base name, the
+ * MAGIC_CHAR, two characters derived from @hash and up to three characters
+ * of the extension. Characters not allowed in 8.3 names, including any
+ * non-ASCII byte, are replaced with '_', so the result is always ASCII.
+ *
+ * Return:	short name length or 0 when source long name starts with '.'
+ */
+int smb_mangle_shortname(const char *longname, int len, unsigned int hash,
+		char *out)
+{
+	const char *p, *end = longname + len, *dot = NULL;
+	int outlen = 0, n;
+
+	if (!len || *longname == '.')
+		return 0;
+
+	for (p = longname; p < end; p++)
+		if (*p == '.')
+			dot = p;
+
+	for (p = longname, n = 0; p < (dot ? dot : end) && n < 5; p++) {
+		if (*p == '.' || *p == ' ')
+			continue;
+		out[outlen++] = is_shortname_char(*p) ? toupper(*p) : '_';
+		n++;
+	}
+
+	hash %= MANGLE_BASE * MANGLE_BASE;
+	out[outlen++] = MAGIC_CHAR;
+	out[outlen++] = mangle(hash / MANGLE_BASE);
+	out[outlen++] = mangle(hash);
+
+	if (dot && dot + 1 < end) {
+		out[outlen++] = PERIOD;
+		for (p = dot + 1, n = 0; p < end && n < 3; p++) {
+			if (*p == ' ')
+				continue;
+			out[outlen++] = is_shortname_char(*p) ?
+				toupper(*p) : '_';
+			n++;
+		}
+	}
+	return outlen;
+}
+
+/**
+ * smb_shortname_to_utf16() - encode a short name built by smb_mangle_shortname
+ * @shortname:	ASCII short name
+ * @len:	length of @shortname
+ * @dst:	destination UTF-16 buffer
+ *
+ * Return:	length of encoded name in bytes
+ */
+int smb_shortname_to_utf16(const char *shortname, int len, char *dst)
+{
+	int i;
+
+	for (i = 0; i < len; i++)
+		put_unaligned_le16((unsigned char)shortname[i],
+				dst + i * 2);
+	return len * 2;
+}
+
 /**
  * smb_get_shortname() - get shortname from long filename
  * @conn:	TCP server instance of connection
  * @longname:	source long filename
  * @shortname:	destination short filename
  *
+ * Short names returned here do not take other entries of the directory
+ * into account, use cifsd_shortname_lookup() while enumerating one.
+ *
  * Return:	shortname length or 0 when source long name is '.' or '..'
  * TODO: Though this function comforms the restriction of 8.3 Filename spec,
  * but the result is different with Windows 7's one. need to check.
@@ -46,69 +143,12 @@ static const char basechars[43] = "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ_-!@#$%";
 int smb_get_shortname(struct connection *conn, char *longname,
 		char *shortname)
 {
-	char *p, *sp;
-	char base[9], extension[4];
-	char out[13] = {0};
-	int baselen = 0;
-	int extlen = 0, len = 0;
-	unsigned int csum = 0;
-	unsigned char *ptr;
-	bool dot_present = true;
-
-	p = longname;
-	if ((*p == '.') || (!(strcmp(p, "..")))) {
-		/*no mangling required */
-		shortname = NULL;
-		return 0;
-	}
-	p = strrchr(longname, '.');
-	if (p == longname) { /*name starts with a dot*/
-		sp = "___";
-		memcpy(extension, sp, 3);
-		extension[3] = '\0';
-	} else {
-		if (p != NULL) {
-			p++;
-			while (*p && extlen < 3) {
-				if (*p != '.')
-					extension[extlen++] = toupper(*p);
-				p++;
-			}
-			extension[extlen] = '\0';
-		} else
-			dot_present = false;
-	}
-
-	p = longname;
-	if (*p == '.')
-		*p++ = 0;
-	while (*p && (baselen < 5)) {
-		if (*p != '.')
-			base[baselen++] = toupper(*p);
-		p++;
-	}
+	char out[SMB_SHORTNAME_LEN];
+	int len = strlen(longname);
 
-	base[baselen] = MAGIC_CHAR;
-	memcpy(out, base, baselen+1);
-
-	ptr = longname;
-	len = strlen(longname);
-	for (; len > 0; len--, ptr++)
-		csum += *ptr;
-
-	csum = csum % (MANGLE_BASE * MANGLE_BASE);
-	out[baselen+1] = mangle(csum/MANGLE_BASE);
-	out[baselen+2] = mangle(csum);
-	out[baselen+3] = PERIOD;
-
-	if (dot_present)
-		memcpy(&out[baselen+4], extension, 4);
-	else
-		out[baselen+4] = '\0';
-	smbConvertToUTF16((__le16 *)shortname, out, PATH_MAX,
-			conn->local_nls, 0);
-	len = strlen(out) * 2;
-	return len;
+	len = smb_mangle_shortname(longname, len,
+			smb_shortname_hash(longname, len), out);
+	return smb_shortname_to_utf16(out, len, shortname);
 }
 
 /**
@@ -349,8 +389,6 @@ int smb_check_user_session(struct smb_work *smb_work)
 	struct smb_hdr *req_hdr = (struct smb_hdr *)smb_work->buf;
 	struct connection *conn = smb_work->conn;
 	struct cifsd_sess *sess;
-	struct list_head *tmp;
-	int rc;
 	unsigned int cmd = conn->ops->get_cmd_val(smb_work);
 
 	smb_work->sess = NULL;
@@ -366,19 +404,21 @@ int smb_check_user_session(struct smb_work *smb_work)
 		return 0;
 	}
 
-	rc = -EINVAL;
-	list_for_each(tmp, &conn->cifsd_sess) {
-		sess = list_entry(tmp, struct cifsd_sess, cifsd_ses_list);
-		if (sess->usr->vuid == req_hdr->Uid && sess->valid) {
-			smb_work->sess = sess;
-			rc = 1;
-			break;
-		}
+	/* the session id of an SMB1 session is the vuid of its user */
+	sess = lookup_session_on_server(conn, req_hdr->Uid);
+	if (sess && !sess->valid) {
+		cifsd_sess_put(sess);
+		sess = NULL;
 	}
 
-	if (!smb_work->sess)
+	if (!sess) {
 		cifsd_debug("Invalid user session, Uid %u\n", req_hdr->Uid);
-	return rc;
+		return -EINVAL;
+	}
+
+	/* the reference goes with the request */
+	smb_work->sess = sess;
+	return 1;
 }
 
 /**
@@ -390,8 +430,6 @@ int smb_check_user_session(struct smb_work *smb_work)
  */
 int smb_get_cifsd_tcon(struct smb_work *smb_work)
 {
-	struct cifsd_tcon *tcon;
-	struct list_head *tmp;
 	struct smb_hdr *req_hdr = (struct smb_hdr *)smb_work->buf;
 	int rc = -1;
 
@@ -407,16 +445,11 @@ int smb_get_cifsd_tcon(struct smb_work *smb_work)
 		return 0;
 	}
 
-	list_for_each(tmp, &smb_work->sess->tcon_list) {
-		tcon = list_entry(tmp, struct cifsd_tcon, tcon_list);
-		if (tcon->share->tid == le16_to_cpu(req_hdr->Tid)) {
-			rc = 1;
-			smb_work->tcon = tcon;
-			break;
-		}
-	}
-
-	if (rc < 0)
+	smb_work->tcon = get_cifsd_tcon(smb_work->sess,
+			le16_to_cpu(req_hdr->Tid));
+	if (smb_work->tcon)
+		rc = 1;
+	else
 		cifsd_debug("Invalid tid %d\n", req_hdr->Tid);
 
 	return rc;
@@ -432,7 +465,6 @@ int smb_session_disconnect(struct smb_work *smb_work)
 {
 	struct connection *conn = smb_work->conn;
 	struct cifsd_sess *sess = smb_work->sess;
-	struct list_head *tmp, *t;
 
 	/* Got a valid session, set connection state */
 	WARN_ON(conn->sess_count != 1);
@@ -448,23 +480,10 @@ int smb_session_disconnect(struct smb_work *smb_work)
 	wait_event(conn->req_running_q,
 			atomic_read(&conn->req_running) == 1);
 
-	/* free all tcons */
-	list_for_each_safe(tmp, t, &sess->tcon_list) {
-		struct cifsd_tcon *tcon = list_entry(tmp,
-						struct cifsd_tcon, tcon_list);
-		list_del(&tcon->tcon_list);
-		sess->tcon_count--;
-		kfree(tcon);
-	}
-
-	WARN_ON(sess->tcon_count != 0);
-
-	/* free all sessions, we have just 1 */
-	list_del(&sess->cifsd_ses_list);
-	list_del(&sess->cifsd_ses_global_list);
-	destroy_fidtable(sess);
-	kfree(sess);
+	/* free all tcons and sessions, we have just 1 */
+	smb_delete_session(sess);
 	smb_work->sess = NULL;
+	cifsd_sess_put(sess);
 
 	conn->sess_count--;
 	/* let start_tcp_sess free conn info now */
@@ -491,12 +510,8 @@ int smb_tree_disconnect(struct smb_work *smb_work)
 		return -EINVAL;
 	}
 
-	if (tcon->share->sharename)
-		path_put(&tcon->share_path);
-	/* delete tcon from sess tcon list and decrease sess tcon count */
-	list_del(&tcon->tcon_list);
-	sess->tcon_count--;
-	kfree(tcon);
+	/* release the tree id and decrease sess tcon count */
+	destroy_cifsd_tcon(tcon);
 
 	close_opens_from_fibtable(sess, le16_to_cpu(req_hdr->Tid));
 	return 0;
@@ -617,7 +632,12 @@ int smb_tree_connect_andx(struct smb_work *smb_work)
 
 	set_service_type(conn, share, rsp);
 
-	rsp_hdr->Tid = tcon->share->tid;
+	rsp_hdr->Tid = tcon->id;
+	/* AndX commands after this one run on the new tree connect */
+	if (smb_work->tcon)
+		cifsd_tcon_put(smb_work->tcon);
+	atomic_inc(&tcon->refcnt);
+	smb_work->tcon = tcon;
 
 	/* For each extra andx response, we have to add 1 byte,
 		 for wc and 2 bytes for byte count */
@@ -877,11 +897,12 @@ int smb_session_setup_andx(struct smb_work *smb_work)
 		}
 
 		sess->conn = conn;
+		atomic_set(&sess->refcnt, 1);
+		init_rwsem(&sess->key_sem);
 		INIT_LIST_HEAD(&sess->cifsd_ses_list);
 		INIT_LIST_HEAD(&sess->cifsd_chann_list);
-		list_add(&sess->cifsd_ses_list, &conn->cifsd_sess);
-		list_add(&sess->cifsd_ses_global_list, &cifsd_session_list);
-		INIT_LIST_HEAD(&sess->tcon_list);
+		idr_init(&sess->tcon_idr);
+		spin_lock_init(&sess->tcon_lock);
 		sess->tcon_count = 0;
 
 		cifsd_debug("session setup request for user %s\n", name);
@@ -897,6 +918,8 @@ int smb_session_setup_andx(struct smb_work *smb_work)
 		sess->sess_id = sess->usr->vuid;
 		init_waitqueue_head(&sess->pipe_q);
 		sess->ev_state = NETLINK_REQ_INIT;
+		/* hashed by session id, visible to lookups from now on */
+		register_session(conn, sess);
 		cifsd_debug("generate session ID : %llu, Uid : %u\n",
 				sess->sess_id, req_hdr->Uid);
 	} else {
@@ -998,11 +1021,10 @@ no_password_check:
 
 out_err:
 	if (rc < 0 && sess) {
-		sess->valid = 0;
-		list_del(&sess->cifsd_ses_list);
-		list_del(&sess->cifsd_ses_global_list);
-		kfree(sess);
+		smb_delete_session(sess);
+		/* drops the reference of the allocation or the request */
 		smb_work->sess = NULL;
+		cifsd_sess_put(sess);
 	}
 	rsp_hdr->Status.CifsError = NT_STATUS_LOGON_FAILURE;
 	return rc;
@@ -2274,7 +2296,7 @@ int smb_read_andx(struct smb_work *smb_work)
 
 	cifsd_debug("fid %u, offset %lld, count %zu\n", req->Fid, pos, count);
 	nbytes = smb_vfs_read(smb_work->sess, req->Fid, 0, &smb_work->rdata_buf,
-		count, &pos);
+		count, &pos, false);
 	if (nbytes < 0) {
 		err = nbytes;
 		goto out;
@@ -2349,7 +2371,7 @@ int smb_write(struct smb_work *smb_work)
 		nbytes = 0;
 	} else
 		err = smb_vfs_write(smb_work->sess, req->Fid, 0, data_buf,
-			count, &pos, 0, &nbytes);
+			count, &pos, 0, false, &nbytes);
 
 out:
 	rsp->hdr.WordCount = 1;
@@ -2503,7 +2525,7 @@ int smb_write_andx(struct smb_work *smb_work)
 
 	cifsd_debug("fid %u, offset %lld, count %zu\n", req->Fid, pos, count);
 	err = smb_vfs_write(smb_work->sess, req->Fid, 0, data_buf, count, &pos,
-			writethrough, &nbytes);
+			writethrough, false, &nbytes);
 	if (err < 0)
 		goto out;
 
@@ -2639,20 +2661,21 @@ void convert_delimiter(char *path, int flags)
 /**
  * convert_to_unix_name() - convert windows name to unix format
  * @path:	name to be converted
- * @tid:	tree id of mathing share
+ * @tcon:	tree connect the name is relative to
  *
  * Return:	converted name on success, otherwise NULL
  */
-char *convert_to_unix_name(char *name, int tid)
+char *convert_to_unix_name(char *name, struct cifsd_tcon *tcon)
 {
 	struct cifsd_share *share;
 	int len;
 	char *new_name;
 
-	share = find_matching_share(tid);
-	if (!share)
+	if (!tcon)
 		return NULL;
 
+	share = tcon->share;
+
 	len = strlen(share->path);
 	len += strlen(name);
 
@@ -3876,9 +3899,9 @@ int query_fs_info(struct smb_work *smb_work)
 		return -EINVAL;
 	}
 
-	share = find_matching_share(req_hdr->Tid);
-	if (!share)
+	if (!smb_work->tcon)
 		return -ENOENT;
+	share = smb_work->tcon->share;
 
 	rc = smb_kern_path(share->path, LOOKUP_FOLLOW, &path, 0);
 	if (rc) {
@@ -4056,7 +4079,7 @@ smb_get_name(const char *src, const int maxlen, struct smb_work *smb_work,
 	if (wild_card_pos != NULL)
 		*wild_card_pos = '\0';
 
-	unixname = convert_to_unix_name(name, req_hdr->Tid);
+	unixname = convert_to_unix_name(name, smb_work->tcon);
 
 	if (!converted)
 		kfree(name);
@@ -4133,7 +4156,7 @@ static char *smb_get_dir_name(const char *src, const int maxlen,
 		*srch_ptr = pattern;
 	}
 
-	unixname = convert_to_unix_name(name, req_hdr->Tid);
+	unixname = convert_to_unix_name(name, smb_work->tcon);
 	kfree(name);
 	if (!unixname) {
 		kfree(pattern);
@@ -5040,36 +5063,44 @@ void *fill_common_info(char **p, struct smb_kstat *smb_kstat)
  * @next_entry_offset:  offset of dentry
  * @buf_len:            response buffer length
  * @data_count:         used response buffer size
+ * @alignment:          alignment mask of next entry offset
+ * @dst:                FileName field of the entry in response buffer
+ *
+ * The name is converted straight into the response buffer once it is
+ * known to fit, so no bounce buffer is needed per directory entry.
  *
- * Return:      return error if next entry could not fit in current response
- *              buffer, otherwise return encode buffer.
+ * Return:      -ENOSPC if next entry could not fit in current response
+ *              buffer, otherwise 0
  */
-char *convname_updatenextoffset(char *namestr, int len, int size,
+int convname_updatenextoffset(char *namestr, int len, int size,
 		const struct nls_table *local_nls, int *name_len,
 		int *next_entry_offset, int *buf_len, int *data_count,
-		int alignment)
+		int alignment, char *dst)
 {
-	char *enc_buf;
-
-	enc_buf = kmalloc(PATH_MAX, GFP_KERNEL);
-	if (!enc_buf)
-		return NULL;
-
-	*name_len = smbConvertToUTF16((__le16 *)enc_buf,
-			namestr, len, local_nls, 0);
-	*name_len *= 2;
+	int namelen = strnlen(namestr, len);
 
+	/* no byte of the local charset turns into more than one UTF-16 char */
+	*name_len = namelen * 2;
 	*next_entry_offset = (size - 1 + *name_len + alignment) & ~alignment;
 
 	if (*next_entry_offset > *buf_len) {
-		cifsd_debug("buf_len : %d next_entry_offset : %d"
-				" data_count : %d\n", *buf_len,
-				*next_entry_offset, *data_count);
-		*buf_len = -1;
-		kfree(enc_buf);
-		return NULL;
+		*name_len = smb_utf16_name_bytes(namestr, namelen, local_nls);
+		*next_entry_offset = (size - 1 + *name_len + alignment) &
+			~alignment;
+		if (*next_entry_offset > *buf_len) {
+			cifsd_debug("buf_len : %d next_entry_offset : %d"
+					" data_count : %d\n", *buf_len,
+					*next_entry_offset, *data_count);
+			*buf_len = -1;
+			return -ENOSPC;
+		}
 	}
-	return enc_buf;
+
+	*name_len = smbConvertToUTF16((__le16 *)dst, namestr, namelen,
+			local_nls, 0);
+	*name_len *= 2;
+	*next_entry_offset = (size - 1 + *name_len + alignment) & ~alignment;
+	return 0;
 }
 
 /**
@@ -5097,25 +5128,24 @@ static int smb_populate_readdir_entry(struct connection *conn,
 {
 	int name_len;
 	int next_entry_offset;
-	char *utfname = NULL;
+	int rc = -ENOSPC;
 
 	switch (info_level) {
 	case SMB_FIND_FILE_DIRECTORY_INFO:
 	{
-		FILE_DIRECTORY_INFO *fdinfo = NULL;
+		FILE_DIRECTORY_INFO *fdinfo =
+			(FILE_DIRECTORY_INFO *)*p;
 
-		utfname = convname_updatenextoffset(namestr, PATH_MAX,
+		rc = convname_updatenextoffset(namestr, PATH_MAX,
 				sizeof(FILE_DIRECTORY_INFO),
 				conn->local_nls, &name_len,
 				&next_entry_offset,
-				buf_len, data_count, 3);
-		if (!utfname)
+				buf_len, data_count, 3, fdinfo->FileName);
+		if (rc)
 			break;
 
-		fdinfo = (FILE_DIRECTORY_INFO *)
-			fill_common_info(p, smb_kstat);
+		fill_common_info(p, smb_kstat);
 		fdinfo->FileNameLength = cpu_to_le32(name_len);
-		memcpy(fdinfo->FileName, utfname, name_len);
 		fdinfo->FileName[name_len - 2] = 0;
 		fdinfo->FileName[name_len - 1] = 0;
 		fdinfo->NextEntryOffset = next_entry_offset;
@@ -5127,21 +5157,20 @@ static int smb_populate_readdir_entry(struct connection *conn,
 	}
 	case SMB_FIND_FILE_FULL_DIRECTORY_INFO:
 	{
-		FILE_FULL_DIRECTORY_INFO *ffdinfo = NULL;
+		FILE_FULL_DIRECTORY_INFO *ffdinfo =
+			(FILE_FULL_DIRECTORY_INFO *)*p;
 
-		utfname = convname_updatenextoffset(namestr, PATH_MAX,
+		rc = convname_updatenextoffset(namestr, PATH_MAX,
 				sizeof(FILE_FULL_DIRECTORY_INFO),
 				conn->local_nls, &name_len,
 				&next_entry_offset,
-				buf_len, data_count, 3);
-		if (!utfname)
+				buf_len, data_count, 3, ffdinfo->FileName);
+		if (rc)
 			break;
 
-		ffdinfo = (FILE_FULL_DIRECTORY_INFO *)
-			fill_common_info(p, smb_kstat);
+		fill_common_info(p, smb_kstat);
 		ffdinfo->FileNameLength = cpu_to_le32(name_len);
 		ffdinfo->EaSize = 0;
-		memcpy(ffdinfo->FileName, utfname, name_len);
 		ffdinfo->FileName[name_len - 2] = 0;
 		ffdinfo->FileName[name_len - 1] = 0;
 		ffdinfo->NextEntryOffset = next_entry_offset;
@@ -5154,24 +5183,23 @@ static int smb_populate_readdir_entry(struct connection *conn,
 	}
 	case SMB_FIND_FILE_BOTH_DIRECTORY_INFO:
 	{
-		FILE_BOTH_DIRECTORY_INFO *fbdinfo = NULL;
+		FILE_BOTH_DIRECTORY_INFO *fbdinfo =
+			(FILE_BOTH_DIRECTORY_INFO *)*p;
 
-		utfname = convname_updatenextoffset(namestr, PATH_MAX,
+		rc = convname_updatenextoffset(namestr, PATH_MAX,
 				sizeof(FILE_BOTH_DIRECTORY_INFO),
 				conn->local_nls, &name_len,
 				&next_entry_offset,
-				buf_len, data_count, 3);
-		if (!utfname)
+				buf_len, data_count, 3, fbdinfo->FileName);
+		if (rc)
 			break;
 
-		fbdinfo = (FILE_BOTH_DIRECTORY_INFO *)
-			fill_common_info(p, smb_kstat);
+		fill_common_info(p, smb_kstat);
 		fbdinfo->FileNameLength = cpu_to_le32(name_len);
 		fbdinfo->EaSize = 0;
 		fbdinfo->ShortNameLength = 0;
 		fbdinfo->Reserved = 0;
 		memset(fbdinfo->ShortName, '\0', 24);
-		memcpy(fbdinfo->FileName, utfname, name_len);
 		fbdinfo->FileName[name_len - 2] = 0;
 		fbdinfo->FileName[name_len - 1] = 0;
 		fbdinfo->NextEntryOffset = next_entry_offset;
@@ -5184,23 +5212,22 @@ static int smb_populate_readdir_entry(struct connection *conn,
 	}
 	case SMB_FIND_FILE_ID_FULL_DIR_INFO:
 	{
-		SEARCH_ID_FULL_DIR_INFO *dinfo = NULL;
+		SEARCH_ID_FULL_DIR_INFO *dinfo =
+			(SEARCH_ID_FULL_DIR_INFO *)*p;
 
-		utfname = convname_updatenextoffset(namestr, PATH_MAX,
+		rc = convname_updatenextoffset(namestr, PATH_MAX,
 				sizeof(SEARCH_ID_FULL_DIR_INFO),
 				conn->local_nls, &name_len,
 				&next_entry_offset,
-				buf_len, data_count, 3);
-		if (!utfname)
+				buf_len, data_count, 3, dinfo->FileName);
+		if (rc)
 			break;
 
-		dinfo = (SEARCH_ID_FULL_DIR_INFO *)
-			fill_common_info(p, smb_kstat);
+		fill_common_info(p, smb_kstat);
 		dinfo->FileNameLength = cpu_to_le32(name_len);
 		dinfo->EaSize = 0;
 		dinfo->Reserved = 0;
 		dinfo->UniqueId = cpu_to_le64(smb_kstat->kstat->ino);
-		memcpy(dinfo->FileName, utfname, name_len);
 		dinfo->FileName[name_len - 2] = 0;
 		dinfo->FileName[name_len - 1] = 0;
 		dinfo->NextEntryOffset = next_entry_offset;
@@ -5212,22 +5239,20 @@ static int smb_populate_readdir_entry(struct connection *conn,
 	}
 	case SMB_FIND_FILE_UNIX:
 	{
-		FILE_UNIX_INFO *finfo = NULL;
+		FILE_UNIX_INFO *finfo = (FILE_UNIX_INFO *)*p;
 		FILE_UNIX_BASIC_INFO *unix_info;
 
-		utfname = convname_updatenextoffset(namestr, PATH_MAX,
+		rc = convname_updatenextoffset(namestr, PATH_MAX,
 				sizeof(FILE_UNIX_INFO),
 				conn->local_nls, &name_len,
 				&next_entry_offset,
-				buf_len, data_count, 3);
-		if (!utfname)
+				buf_len, data_count, 3, finfo->FileName);
+		if (rc)
 			break;
 
-		finfo = (FILE_UNIX_INFO *)(*p);
 		finfo->ResumeKey = 0;
 		unix_info = (FILE_UNIX_BASIC_INFO *)((char *)finfo + 8);
 		init_unix_info(unix_info, smb_kstat->kstat);
-		memcpy(finfo->FileName, utfname, name_len);
 		finfo->FileName[name_len - 2] = 0;
 		finfo->FileName[name_len - 1] = 0;
 		finfo->NextEntryOffset = next_entry_offset;
@@ -5242,12 +5267,11 @@ static int smb_populate_readdir_entry(struct connection *conn,
 		return -EOPNOTSUPP;
 	}
 
-	if (utfname) {
+	if (!rc) {
 		*last_entry_offset = *data_count;
 		*data_count += next_entry_offset;
 		*buf_len -= next_entry_offset;
 		(*num_entry)++;
-		kfree(utfname);
 	}
 
 	cifsd_debug("info_level : %d, buf_len :%d,"
@@ -1111,6 +1111,7 @@ typedef struct {
 #define FILE_SUPPORTS_ENCRYPTION        0x00020000
 #define FILE_NAMED_STREAMS              0x00040000
 #define FILE_READ_ONLY_VOLUME           0x00080000
+#define FILE_SUPPORTS_BLOCK_REFCOUNTING 0x08000000
 
 /* PathInfo/FileInfo infolevels */
 #define SMB_INFO_STANDARD                   1
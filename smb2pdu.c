@@ -27,9 +27,8 @@
 #include "cifsacl.h"
 
 #include <linux/inetdevice.h>
+#include <linux/random.h>
 #include <net/addrconf.h>
-#include <linux/syscalls.h>
-#include <linux/inotify.h>
 
 bool multi_channel_enable;
 
@@ -98,6 +97,7 @@ struct fs_type_info fs_type[] = {
 static inline int check_session_id(struct connection *conn, uint64_t id)
 {
 	struct cifsd_sess *sess;
+	int valid;
 
 	WARN(conn->sess_count > 1, "sess_count %d", conn->sess_count);
 
@@ -105,14 +105,14 @@ static inline int check_session_id(struct connection *conn, uint64_t id)
 		return 0;
 
 	sess = lookup_session_on_server(conn, id);
-	if (sess) {
-		if (sess->valid)
-			return 1;
-		else
-			cifsd_err("Invalid user session\n");
-	}
+	if (!sess)
+		return 0;
 
-	return 0;
+	valid = sess->valid;
+	cifsd_sess_put(sess);
+	if (!valid)
+		cifsd_err("Invalid user session\n");
+	return valid ? 1 : 0;
 }
 
 static inline struct channel *lookup_chann_list(struct cifsd_sess *sess)
@@ -138,10 +138,7 @@ static inline struct channel *lookup_chann_list(struct cifsd_sess *sess)
  */
 int smb2_get_cifsd_tcon(struct smb_work *smb_work)
 {
-	struct cifsd_tcon *tcon;
-	struct list_head *tmp;
 	struct smb2_hdr *req_hdr = (struct smb2_hdr *)smb_work->buf;
-	int rc = -1;
 
 	smb_work->tcon = NULL;
 	if ((smb_work->conn->ops->get_cmd_val(smb_work) ==
@@ -159,21 +156,15 @@ int smb2_get_cifsd_tcon(struct smb_work *smb_work)
 		return -1;
 	}
 
-	list_for_each(tmp, &smb_work->sess->tcon_list) {
-		tcon = list_entry(tmp, struct cifsd_tcon, tcon_list);
-		if (tcon->share->tid ==
-			le32_to_cpu(req_hdr->Id.SyncId.TreeId)) {
-			rc = 1;
-			smb_work->tcon = tcon;
-			break;
-		}
-	}
-
-	if (rc < 0)
+	smb_work->tcon = get_cifsd_tcon(smb_work->sess,
+			le32_to_cpu(req_hdr->Id.SyncId.TreeId));
+	if (!smb_work->tcon) {
 		cifsd_err("Invalid tid %d\n",
 			req_hdr->Id.SyncId.TreeId);
+		return -1;
+	}
 
-	return rc;
+	return 1;
 }
 
 /**
@@ -523,6 +514,10 @@ int smb2_allocate_rsp_buf(struct smb_work *smb_work)
 		case SMB2_IOCTL_HE:
 			/* fall through */
 		case SMB2_QUERY_DIRECTORY_HE:
+#ifdef CONFIG_SMB2_NOTIFY_SUPPORT
+			/* fall through */
+		case SMB2_CHANGE_NOTIFY_HE:
+#endif
 			need_large_buf = true;
 			break;
 		case SMB2_QUERY_INFO_HE:
@@ -650,6 +645,8 @@ int smb2_check_user_session(struct smb_work *smb_work)
 						cifsd_ses_list);
 				if (sess->state == SMB2_SESSION_EXPIRED) {
 					cifsd_debug("invalid session\n");
+					/* on the list, the table holds it */
+					atomic_inc(&sess->refcnt);
 					smb_work->sess = sess;
 					break;
 				}
@@ -663,11 +660,22 @@ int smb2_check_user_session(struct smb_work *smb_work)
 	sess = lookup_session_on_server(conn, le64_to_cpu(req_hdr->SessionId));
 	if (sess) {
 		if (sess->valid) {
-			smb_work->sess = sess;
-			rc = 1;
+			if (smb_work->encrypted &&
+			    smb_work->tr_sess_id != sess->sess_id) {
+				cifsd_err("request encrypted for another session\n");
+				rc = -EACCES;
+			} else if (sess->enc_forced && !smb_work->encrypted) {
+				cifsd_err("unencrypted request on encrypted session\n");
+				rc = -EACCES;
+			} else {
+				/* the reference goes with the request */
+				smb_work->sess = sess;
+				return 1;
+			}
 		} else {
 			cifsd_err("Invalid user session\n");
 		}
+		cifsd_sess_put(sess);
 	}
 
 	return rc;
@@ -681,15 +689,11 @@ int smb2_check_user_session(struct smb_work *smb_work)
 void smb2_invalidate_prev_session(uint64_t sess_id)
 {
 	struct cifsd_sess *sess;
-	struct list_head *tmp, *t;
 
-	list_for_each_safe(tmp, t, &cifsd_session_list) {
-		sess = list_entry(tmp, struct cifsd_sess,
-				cifsd_ses_global_list);
-		if (sess->sess_id == sess_id) {
-			smb_delete_session(sess);
-			break;
-		}
+	sess = lookup_session_global(sess_id);
+	if (sess) {
+		smb_delete_session(sess);
+		cifsd_sess_put(sess);
 	}
 }
 
@@ -697,19 +701,19 @@ void smb2_invalidate_prev_session(uint64_t sess_id)
  * smb2_get_session_global_list() - get existing session from global session
  * list
  * @sess_id:	session id to be invalidated
+ *
+ * Return:	referenced valid session, otherwise NULL
  */
 struct cifsd_sess *smb2_get_session_global_list(uint64_t sess_id)
 {
 	struct cifsd_sess *sess;
-	struct list_head *tmp, *t;
 
-	list_for_each_safe(tmp, t, &cifsd_session_list) {
-		sess = list_entry(tmp, struct cifsd_sess,
-				cifsd_ses_global_list);
-		if (sess->sess_id == sess_id && sess->valid)
-			return sess;
-	}
+	sess = lookup_session_global(sess_id);
+	if (sess && sess->valid)
+		return sess;
 
+	if (sess)
+		cifsd_sess_put(sess);
 	return NULL;
 }
 
@@ -724,14 +728,9 @@ struct cifsd_sess *smb2_get_session_global_list(uint64_t sess_id)
 char *
 smb2_get_name(const char *src, const int maxlen, struct smb_work *smb_work)
 {
-	struct smb2_hdr *req_hdr = (struct smb2_hdr *)smb_work->buf;
 	struct smb2_hdr *rsp_hdr = (struct smb2_hdr *)smb_work->rsp_buf;
 	char *name, *unixname;
 
-	if (smb_work->next_smb2_rcv_hdr_off)
-		req_hdr = (struct smb2_hdr *)((char *)req_hdr
-				+ smb_work->next_smb2_rcv_hdr_off);
-
 	name = smb_strndup_from_utf16(src, maxlen, 1,
 			smb_work->conn->local_nls);
 	if (IS_ERR(name)) {
@@ -746,7 +745,7 @@ smb2_get_name(const char *src, const int maxlen, struct smb_work *smb_work)
 	/* change it to absolute unix name */
 	convert_delimiter(name, 0);
 
-	unixname = convert_to_unix_name(name, req_hdr->Id.SyncId.TreeId);
+	unixname = convert_to_unix_name(name, smb_work->tcon);
 	kfree(name);
 	if (!unixname) {
 		cifsd_err("can not convert absolute name\n");
@@ -819,7 +818,7 @@ void smb2_send_interim_resp(struct smb_work *smb_work)
 
 	rsp_hdr = (struct smb2_hdr *)smb_work->rsp_buf;
 
-	async = kmalloc(sizeof(struct async_info), GFP_KERNEL);
+	async = kzalloc(sizeof(struct async_info), GFP_KERNEL);
 	async->async_status = ASYNC_PROG;
 	smb_work->async = async;
 	rsp_hdr->Flags |= SMB2_FLAGS_ASYNC_COMMAND;
@@ -873,6 +872,10 @@ __le32 smb2_get_dos_mode(struct kstat *stat, __le32 attribute)
 
 #define SMB2_PREAUTH_INTEGRITY_CAPABILITIES	cpu_to_le16(1)
 #define SMB2_ENCRYPTION_CAPABILITIES		cpu_to_le16(2)
+#define SMB2_SIGNING_CAPABILITIES		cpu_to_le16(8)
+
+/* padding between the 74 byte GSS blob and the first negotiate context */
+#define NEG_CONTEXT_PAD		6
 
 static void
 build_preauth_ctxt(struct smb2_preauth_neg_context *pneg_ctxt, int hash_id)
@@ -896,6 +899,17 @@ build_encrypt_ctxt(struct smb2_encryption_neg_context *pneg_ctxt, int cipher_id)
 	pneg_ctxt->Ciphers[0] = cpu_to_le16(cipher_id);
 }
 
+static void
+build_signing_ctxt(struct smb2_signing_neg_context *pneg_ctxt,
+	__le16 sign_algo)
+{
+	pneg_ctxt->ContextType = SMB2_SIGNING_CAPABILITIES;
+	pneg_ctxt->DataLength = cpu_to_le16(4);
+	pneg_ctxt->Reserved = cpu_to_le32(0);
+	pneg_ctxt->SigningAlgorithmCount = cpu_to_le16(1);
+	pneg_ctxt->SigningAlgorithms[0] = sign_algo;
+}
+
 static void
 assemble_neg_contexts(struct connection *conn,
 	struct smb2_negotiate_rsp *rsp)
@@ -903,24 +917,38 @@ assemble_neg_contexts(struct connection *conn,
 	/* +4 is to account for the RFC1001 len field */
 	char *pneg_ctxt = (char *)rsp +
 			le32_to_cpu(rsp->NegotiateContextOffset) + 4;
+	unsigned int ctxt_size;
+	int ctxt_cnt = 1;
 
 	cifsd_debug("assemble SMB2_PREAUTH_INTEGRITY_CAPABILITIES context\n");
 	build_preauth_ctxt((struct smb2_preauth_neg_context *)pneg_ctxt,
 		conn->Preauth_HashId);
-	rsp->NegotiateContextCount = cpu_to_le16(1);
-	inc_rfc1001_len(rsp, 4 + sizeof(struct smb2_preauth_neg_context));
+	ctxt_size = sizeof(struct smb2_preauth_neg_context);
 
+	/* each following context starts on an 8 byte boundary */
 	if (conn->CipherId) {
-		/* Add 2 to size to round to 8 byte boundary */
 		cifsd_debug("assemble SMB2_ENCRYPTION_CAPABILITIES context\n");
-		pneg_ctxt += 2 + sizeof(struct smb2_preauth_neg_context);
+		ctxt_size = round_up(ctxt_size, 8);
 		build_encrypt_ctxt(
-			(struct smb2_encryption_neg_context *)pneg_ctxt,
-			conn->CipherId);
-		rsp->NegotiateContextCount = cpu_to_le16(2);
-		inc_rfc1001_len(rsp, 4 +
-				sizeof(struct smb2_encryption_neg_context) - 2);
+			(struct smb2_encryption_neg_context *)
+			(pneg_ctxt + ctxt_size), conn->CipherId);
+		/* only one cipher is returned */
+		ctxt_size += sizeof(struct smb2_encryption_neg_context) - 2;
+		ctxt_cnt++;
+	}
+
+	if (conn->signing_negotiated) {
+		cifsd_debug("assemble SMB2_SIGNING_CAPABILITIES context\n");
+		ctxt_size = round_up(ctxt_size, 8);
+		build_signing_ctxt(
+			(struct smb2_signing_neg_context *)
+			(pneg_ctxt + ctxt_size), conn->SigningAlgorithmId);
+		ctxt_size += sizeof(struct smb2_signing_neg_context);
+		ctxt_cnt++;
 	}
+
+	rsp->NegotiateContextCount = cpu_to_le16(ctxt_cnt);
+	inc_rfc1001_len(rsp, NEG_CONTEXT_PAD + ctxt_size);
 }
 
 static int
@@ -940,21 +968,63 @@ decode_preauth_ctxt(struct connection *conn,
 
 static void
 decode_encrypt_ctxt(struct connection *conn,
-	struct smb2_encryption_neg_context *pneg_ctxt)
+	struct smb2_encryption_neg_context *pneg_ctxt, int len)
 {
 	int i;
-	int cph_cnt = pneg_ctxt->CipherCount;
+	int cph_cnt = le16_to_cpu(pneg_ctxt->CipherCount);
 
 	conn->CipherId = 0;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0)
+	if (server_encryption == DISABLE)
+		return;
+
+	len -= offsetof(struct smb2_encryption_neg_context, Ciphers);
+	cph_cnt = min_t(int, cph_cnt, len / (int)sizeof(__le16));
+
+	/* the client lists the ciphers in its order of preference */
 	for (i = 0; i < cph_cnt; i++) {
-		if (pneg_ctxt->Ciphers[i] == SMB2_ENCRYPTION_AES128_GCM) {
-			cifsd_debug("Cipher ID = SMB2_ENCRYPTION_AES128_GCM\n");
-			conn->CipherId = SMB2_ENCRYPTION_AES128_GCM;
+		if (pneg_ctxt->Ciphers[i] == SMB2_ENCRYPTION_AES128_GCM ||
+		    pneg_ctxt->Ciphers[i] == SMB2_ENCRYPTION_AES128_CCM ||
+		    pneg_ctxt->Ciphers[i] == SMB2_ENCRYPTION_AES256_GCM ||
+		    pneg_ctxt->Ciphers[i] == SMB2_ENCRYPTION_AES256_CCM) {
+			cifsd_debug("Cipher ID = 0x%x\n",
+				le16_to_cpu(pneg_ctxt->Ciphers[i]));
+			conn->CipherId = pneg_ctxt->Ciphers[i];
+			break;
+		}
+	}
+#endif
+}
+
+/*
+ * The first algorithm of the client's list that is supported is used.
+ * AES-CMAC is used when none is, like for clients not sending the
+ * context at all.
+ */
+static void
+decode_signing_ctxt(struct connection *conn,
+	struct smb2_signing_neg_context *pneg_ctxt, int len)
+{
+	int i;
+	int algo_cnt = le16_to_cpu(pneg_ctxt->SigningAlgorithmCount);
+
+	len -= offsetof(struct smb2_signing_neg_context, SigningAlgorithms);
+	algo_cnt = min_t(int, algo_cnt, len / (int)sizeof(__le16));
+
+	conn->signing_negotiated = true;
+	conn->SigningAlgorithmId = SMB2_SIGNING_AES_CMAC;
+	for (i = 0; i < algo_cnt; i++) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0)
+		if (pneg_ctxt->SigningAlgorithms[i] ==
+				SMB2_SIGNING_AES_GMAC) {
+			cifsd_debug("Signing Algorithm = AES_GMAC\n");
+			conn->SigningAlgorithmId = SMB2_SIGNING_AES_GMAC;
 			break;
-		} else if (pneg_ctxt->Ciphers[i] ==
-			SMB2_ENCRYPTION_AES128_CCM) {
-			cifsd_debug("Cipher ID = SMB2_ENCRYPTION_AES128_CCM\n");
-			conn->CipherId = SMB2_ENCRYPTION_AES128_CCM;
+		}
+#endif
+		if (pneg_ctxt->SigningAlgorithms[i] ==
+				SMB2_SIGNING_AES_CMAC) {
+			cifsd_debug("Signing Algorithm = AES_CMAC\n");
 			break;
 		}
 	}
@@ -968,36 +1038,52 @@ deassemble_neg_contexts(struct connection *conn,
 	/* +4 is to account for the RFC1001 len field */
 	char *pneg_ctxt = (char *)req +
 			le32_to_cpu(req->NegotiateContextOffset) + 4;
-	__le16 *ContextType = (__le16 *)pneg_ctxt;
+	char *end = (char *)req + get_rfc1002_length(req) + 4;
+	__le16 ContextType;
 	int neg_ctxt_cnt = le16_to_cpu(req->NegotiateContextCount);
+	int ctxt_len;
 
 	cifsd_debug("negotiate context count = %d\n", neg_ctxt_cnt);
 	status = NT_STATUS_INVALID_PARAMETER;
+	conn->signing_negotiated = false;
 	while (i++ < neg_ctxt_cnt) {
-		if (*ContextType == SMB2_PREAUTH_INTEGRITY_CAPABILITIES) {
+		/* ContextType, DataLength and Reserved precede the data */
+		if (pneg_ctxt + 8 > end)
+			return NT_STATUS_INVALID_PARAMETER;
+
+		ContextType = *(__le16 *)pneg_ctxt;
+		ctxt_len = 8 + le16_to_cpu(*(__le16 *)(pneg_ctxt + 2));
+		if (pneg_ctxt + ctxt_len > end)
+			return NT_STATUS_INVALID_PARAMETER;
+
+		if (ContextType == SMB2_PREAUTH_INTEGRITY_CAPABILITIES) {
 			cifsd_debug("deassemble SMB2_PREAUTH_INTEGRITY_CAPABILITIES context\n");
 			if (conn->Preauth_HashId)
 				break;
 
 			status = decode_preauth_ctxt(conn,
 				(struct smb2_preauth_neg_context *)pneg_ctxt);
-			pneg_ctxt +=
-				sizeof(struct smb2_preauth_neg_context) + 2;
-			ContextType = (__le16 *)pneg_ctxt;
-		} else if (*ContextType == SMB2_ENCRYPTION_CAPABILITIES) {
+			if (status != NT_STATUS_OK)
+				break;
+		} else if (ContextType == SMB2_ENCRYPTION_CAPABILITIES) {
 			cifsd_debug("deassemble SMB2_ENCRYPTION_CAPABILITIES context\n");
 			if (conn->CipherId)
 				break;
 
 			decode_encrypt_ctxt(conn,
 					(struct smb2_encryption_neg_context *)
-					pneg_ctxt);
-			pneg_ctxt +=
-				sizeof(struct smb2_encryption_neg_context) + 2;
+					pneg_ctxt, ctxt_len);
+		} else if (ContextType == SMB2_SIGNING_CAPABILITIES) {
+			cifsd_debug("deassemble SMB2_SIGNING_CAPABILITIES context\n");
+			if (conn->signing_negotiated)
+				break;
+
+			decode_signing_ctxt(conn,
+					(struct smb2_signing_neg_context *)
+					pneg_ctxt, ctxt_len);
 		}
 
-		if (status != NT_STATUS_OK)
-			break;
+		pneg_ctxt += round_up(ctxt_len, 8);
 	}
 	return status;
 }
@@ -1047,6 +1133,7 @@ int smb2_negotiate(struct smb_work *smb_work)
 
 		calc_preauth_integrity_hash(conn, smb_work->buf,
 			conn->Preauth_HashValue);
+		smb_work->preauth_hash = conn->Preauth_HashValue;
 		assemble_neg_contexts(conn, rsp);
 		break;
 	case SMB302_PROT_ID:
@@ -1078,6 +1165,17 @@ int smb2_negotiate(struct smb_work *smb_work)
 	limit = SMBMaxBufSize;
 
 	conn->cli_cap = req->Capabilities;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0)
+	/* SMB 3.1.1 picks the cipher in a negotiate context instead */
+	if ((conn->dialect == SMB30_PROT_ID ||
+	     conn->dialect == SMB302_PROT_ID) &&
+	    server_encryption != DISABLE &&
+	    conn->cli_cap & SMB2_GLOBAL_CAP_ENCRYPTION) {
+		conn->srv_cap |= SMB2_GLOBAL_CAP_ENCRYPTION;
+		conn->CipherId = SMB2_ENCRYPTION_AES128_CCM;
+		rsp->Capabilities = conn->srv_cap;
+	}
+#endif
 	if (conn->dialect > SMB20_PROT_ID) {
 		memcpy(conn->ClientGUID, req->ClientGUID,
 				SMB2_CLIENT_GUID_SIZE);
@@ -1139,6 +1237,8 @@ int smb2_sess_setup(struct smb_work *smb_work)
 	struct cifsd_sess *sess;
 	NEGOTIATE_MESSAGE *negblob;
 	struct channel *chann = NULL;
+	struct preauth_session *preauth_sess = NULL;
+	bool binding = false;
 	int rc = 0;
 	unsigned char *spnego_blob;
 	u16 spnego_blob_len;
@@ -1172,13 +1272,14 @@ int smb2_sess_setup(struct smb_work *smb_work)
 		cifsd_debug("generate session ID : %llu\n", sess->sess_id);
 		rsp->hdr.SessionId = cpu_to_le64(sess->sess_id);
 		sess->conn = conn;
+		atomic_set(&sess->refcnt, 1);
+		init_rwsem(&sess->key_sem);
 		INIT_LIST_HEAD(&sess->cifsd_ses_list);
 		INIT_LIST_HEAD(&sess->cifsd_chann_list);
-		list_add(&sess->cifsd_ses_list, &conn->cifsd_sess);
-		list_add(&sess->cifsd_ses_global_list, &cifsd_session_list);
-		hash_init(sess->notify_table);
+		register_session(conn, sess);
 
-		INIT_LIST_HEAD(&sess->tcon_list);
+		idr_init(&sess->tcon_idr);
+		spin_lock_init(&sess->tcon_lock);
 		sess->tcon_count = 0;
 		sess->valid = 1;
 		conn->sess_count++;
@@ -1190,6 +1291,7 @@ int smb2_sess_setup(struct smb_work *smb_work)
 		sess->ev_state = NETLINK_REQ_INIT;
 	} else {
 		struct smb2_hdr *req_hdr = (struct smb2_hdr *)smb_work->buf;
+		struct cifsd_sess *bound;
 
 		if (multi_channel_enable &&
 			req_hdr->Flags & SMB2_SESSION_REQ_FLAG_BINDING) {
@@ -1203,6 +1305,7 @@ int smb2_sess_setup(struct smb_work *smb_work)
 					NT_STATUS_USER_SESSION_DELETED;
 				goto out_err;
 			}
+			binding = true;
 
 			if (!(req_hdr->Flags & SMB2_FLAGS_SIGNED)) {
 				rc = -EINVAL;
@@ -1230,9 +1333,10 @@ int smb2_sess_setup(struct smb_work *smb_work)
 				goto out_err;
 			}
 
-			sess = lookup_session_on_server(conn,
+			bound = lookup_session_on_server(conn,
 					le64_to_cpu(req->hdr.SessionId));
-			if (sess) {
+			if (bound) {
+				cifsd_sess_put(bound);
 				rc = -EINVAL;
 				rsp->hdr.Status =
 					NT_STATUS_REQUEST_NOT_ACCEPTED;
@@ -1283,13 +1387,22 @@ int smb2_sess_setup(struct smb_work *smb_work)
 			negblob = (NEGOTIATE_MESSAGE *)conn->mechToken;
 	}
 
-	if (conn->dialect == SMB311_PROT_ID &&
-			negblob->MessageType == NtLmNegotiate)
-		memcpy(sess->Preauth_HashValue, conn->Preauth_HashValue, 64);
+	if (conn->dialect == SMB311_PROT_ID) {
+		if (negblob->MessageType == NtLmNegotiate) {
+			preauth_sess = alloc_preauth_session(conn,
+					sess->sess_id);
+			if (!preauth_sess) {
+				rc = -ENOMEM;
+				goto out_err;
+			}
+		} else
+			preauth_sess = lookup_preauth_session(conn,
+					sess->sess_id);
 
-	if (conn->dialect == SMB311_PROT_ID)
-		calc_preauth_integrity_hash(conn, smb_work->buf,
-			sess->Preauth_HashValue);
+		if (preauth_sess)
+			calc_preauth_integrity_hash(conn, smb_work->buf,
+				preauth_sess->Preauth_HashValue);
+	}
 
 	if (negblob->MessageType == NtLmNegotiate) {
 		CHALLENGE_MESSAGE *chgblob;
@@ -1358,7 +1471,7 @@ int smb2_sess_setup(struct smb_work *smb_work)
 		if (conn->dialect >= SMB30_PROT_ID) {
 			chann = lookup_chann_list(sess);
 			if (!chann) {
-				chann = kmalloc(sizeof(struct channel),
+				chann = kzalloc(sizeof(struct channel),
 					GFP_KERNEL);
 				if (!chann) {
 					rc = -ENOMEM;
@@ -1366,6 +1479,7 @@ int smb2_sess_setup(struct smb_work *smb_work)
 				}
 
 				chann->conn = conn;
+				init_rwsem(&chann->key_sem);
 				INIT_LIST_HEAD(&chann->chann_list);
 				list_add(&chann->chann_list,
 					&sess->cifsd_chann_list);
@@ -1436,8 +1550,11 @@ int smb2_sess_setup(struct smb_work *smb_work)
 				if (conn->dialect >= SMB30_PROT_ID &&
 					conn->ops->compute_signingkey) {
 					rc = conn->ops->compute_signingkey(
-						sess, chann->smb3signingkey,
+						conn, sess,
+						chann->smb3signingkey,
 						SMB3_SIGN_KEY_SIZE);
+					if (!rc)
+						rc = smb3_init_sign_tfm(chann);
 					if (rc) {
 						cifsd_debug("SMB3 session key generation failed\n");
 						rsp->hdr.Status =
@@ -1447,6 +1564,33 @@ int smb2_sess_setup(struct smb_work *smb_work)
 				}
 				sess->sign = true;
 			}
+
+			if (conn->dialect < SMB30_PROT_ID) {
+				rc = smb2_init_sign_tfm(sess);
+				if (rc) {
+					rsp->hdr.Status =
+						NT_STATUS_LOGON_FAILURE;
+					goto out_err;
+				}
+			}
+
+			/* a bound channel keeps the session's cipher keys */
+			if (conn->dialect >= SMB30_PROT_ID && conn->CipherId &&
+			    !binding) {
+				rc = compute_smb3xencryptionkey(conn, sess);
+				if (rc) {
+					cifsd_debug("SMB3 encryption key generation failed\n");
+					rsp->hdr.Status =
+						NT_STATUS_LOGON_FAILURE;
+					goto out_err;
+				}
+
+				if (server_encryption == MANDATORY) {
+					rsp->SessionFlags =
+						SMB2_SESSION_FLAG_ENCRYPT_DATA;
+					sess->enc_forced = true;
+				}
+			}
 		}
 
 		if (conn->use_spnego) {
@@ -1478,9 +1622,27 @@ out_err:
 	if (conn->use_spnego && conn->mechToken)
 		kfree(conn->mechToken);
 
+	if (preauth_sess) {
+		if (rc >= 0 &&
+		    rsp->hdr.Status == NT_STATUS_MORE_PROCESSING_REQUIRED) {
+			/* the challenge goes in the chain once it is sent */
+			smb_work->preauth_hash =
+				preauth_sess->Preauth_HashValue;
+			smb_work->preauth_sess = preauth_sess;
+		} else {
+			/* keys are derived, the chain is done with */
+			remove_preauth_session(conn, preauth_sess->id);
+			put_preauth_session(preauth_sess);
+		}
+	}
+
 	if (rc < 0 && sess) {
-		smb_delete_session(sess);
+		/* a failed binding leaves the session on its channels */
+		if (!binding)
+			smb_delete_session(sess);
+		/* drops the reference of the lookup or allocation above */
 		smb_work->sess = NULL;
+		cifsd_sess_put(sess);
 	}
 
 	return rc;
@@ -1543,7 +1705,7 @@ int smb2_tree_connect(struct smb_work *smb_work)
 	}
 
 	tcon->writeable = can_write;
-	rsp->hdr.Id.SyncId.TreeId = tcon->share->tid;
+	rsp->hdr.Id.SyncId.TreeId = tcon->id;
 
 	if (!strncmp("IPC$", name, 4)) {
 		tcon->share->is_pipe = true;
@@ -1690,12 +1852,8 @@ int smb2_tree_disconnect(struct smb_work *smb_work)
 		return 0;
 	}
 
-	/* delete tcon from sess tcon list and decrease sess tcon count */
-	if (tcon->share->sharename)
-		path_put(&tcon->share_path);
-	list_del(&tcon->tcon_list);
-	sess->tcon_count--;
-	kfree(tcon);
+	/* release the tree id and decrease sess tcon count */
+	destroy_cifsd_tcon(tcon);
 
 	close_opens_from_fibtable(sess, le32_to_cpu(req->hdr.Id.SyncId.TreeId));
 	return 0;
@@ -1714,8 +1872,6 @@ int smb2_session_logoff(struct smb_work *smb_work)
 	struct smb2_logoff_req *req;
 	struct smb2_logoff_rsp *rsp;
 	struct cifsd_sess *sess = smb_work->sess;
-	struct cifsd_tcon *tcon;
-	struct list_head *tmp, *t;
 
 	req = (struct smb2_logoff_req *)smb_work->buf;
 	rsp = (struct smb2_logoff_rsp *)smb_work->rsp_buf;
@@ -1747,21 +1903,7 @@ int smb2_session_logoff(struct smb_work *smb_work)
 			atomic_read(&conn->req_running) == 1);
 
 	/* Free the tree connection to session */
-	list_for_each_safe(tmp, t, &sess->tcon_list) {
-		tcon = list_entry(tmp, struct cifsd_tcon, tcon_list);
-		if (tcon == NULL) {
-			cifsd_debug("Invalid tid %d\n",
-				req->hdr.Id.SyncId.TreeId);
-			rsp->hdr.Status = NT_STATUS_NETWORK_NAME_DELETED;
-			smb2_set_err_rsp(smb_work);
-			return 0;
-		}
-		list_del(&tcon->tcon_list);
-		sess->tcon_count--;
-		kfree(tcon);
-	}
-
-	WARN_ON(sess->tcon_count != 0);
+	destroy_cifsd_tcons(sess);
 
 	sess->valid = 0;
 	sess->state = SMB2_SESSION_EXPIRED;
@@ -1875,6 +2017,7 @@ int smb2_open(struct smb_work *smb_work)
 	int maximal_access = 0, contxt_cnt = 0, query_disk_id = 0;
 	int xattr_stream_size = 0, s_type = 0, store_stream = 0;
 	int next_off = 0;
+	unsigned int neg_seq;
 	char *name = NULL, *context_name, *lname = NULL, *pathname = NULL;
 	char *stream_name = NULL, *xattr_stream_name = NULL;
 	bool file_present = true, islink = false;
@@ -2080,12 +2223,7 @@ int smb2_open(struct smb_work *smb_work)
 			goto err_out1;
 		}
 	} else {
-		share = find_matching_share(rsp->hdr.Id.SyncId.TreeId);
-		if (!share) {
-			rsp->hdr.Status = NT_STATUS_NO_MEMORY;
-			rc = -ENOMEM;
-			goto err_out1;
-		}
+		share = smb_work->tcon->share;
 
 		len = strlen(share->path);
 		cifsd_debug("[%s] %d\n", __func__, len);
@@ -2111,21 +2249,30 @@ int smb2_open(struct smb_work *smb_work)
 	if (rc < 0)
 		goto err_out1;
 
-	if (le32_to_cpu(req->CreateOptions) & FILE_DELETE_ON_CLOSE_LE) {
-		/*
-		 * On delete request, instead of following up, need to
-		 * look the current entity
-		 */
-		rc = smb_kern_path(name, 0, &path, 1);
+	neg_seq = cifsd_neg_cache_seq();
+	if (cifsd_neg_cache_lookup(name)) {
+		rc = -ENOENT;
 	} else {
-		/*
-		* Use LOOKUP_FOLLOW to follow the path of
-		* symlink in path buildup
-		*/
-		rc = smb_kern_path(name, LOOKUP_FOLLOW, &path, 1);
-		if (rc) { /* Case for broken link ?*/
+		if (le32_to_cpu(req->CreateOptions) &
+				FILE_DELETE_ON_CLOSE_LE) {
+			/*
+			 * On delete request, instead of following up, need
+			 * to look the current entity
+			 */
 			rc = smb_kern_path(name, 0, &path, 1);
+		} else {
+			/*
+			 * Use LOOKUP_FOLLOW to follow the path of
+			 * symlink in path buildup
+			 */
+			rc = smb_kern_path(name, LOOKUP_FOLLOW, &path, 1);
+			if (rc) { /* Case for broken link ?*/
+				rc = smb_kern_path(name, 0, &path, 1);
+			}
 		}
+
+		if (rc == -ENOENT)
+			cifsd_neg_cache_add(name, neg_seq);
 	}
 
 	if (rc) {
@@ -2823,26 +2970,25 @@ static int smb2_populate_readdir_entry(struct connection *conn,
 {
 	int name_len;
 	int next_entry_offset;
-	char *utfname = NULL;
+	int rc = -ENOSPC;
 
 	switch (info_level) {
 	case FILE_FULL_DIRECTORY_INFORMATION:
 	{
-		FILE_FULL_DIRECTORY_INFO *ffdinfo;
+		FILE_FULL_DIRECTORY_INFO *ffdinfo =
+			(FILE_FULL_DIRECTORY_INFO *)d_info->bufptr;
 
-		utfname = convname_updatenextoffset(d_info->name, PATH_MAX,
+		rc = convname_updatenextoffset(d_info->name, PATH_MAX,
 			sizeof(FILE_FULL_DIRECTORY_INFO), conn->local_nls,
 			&name_len, &next_entry_offset, &d_info->out_buf_len,
-			&d_info->data_count, 7);
-		if (!utfname)
+			&d_info->data_count, 7, ffdinfo->FileName);
+		if (rc)
 			break;
 
-		ffdinfo = (FILE_FULL_DIRECTORY_INFO *)
-				fill_common_info(&d_info->bufptr, smb_kstat);
+		fill_common_info(&d_info->bufptr, smb_kstat);
 		ffdinfo->FileNameLength = cpu_to_le32(name_len);
 		ffdinfo->EaSize = 0;
 
-		memcpy(ffdinfo->FileName, utfname, name_len);
 		ffdinfo->FileName[name_len] = 0;
 		ffdinfo->FileName[name_len + 1] = 0;
 		ffdinfo->NextEntryOffset = next_entry_offset;
@@ -2850,23 +2996,24 @@ static int smb2_populate_readdir_entry(struct connection *conn,
 	}
 	case FILE_BOTH_DIRECTORY_INFORMATION:
 	{
-		FILE_BOTH_DIRECTORY_INFO *fbdinfo;
+		FILE_BOTH_DIRECTORY_INFO *fbdinfo =
+			(FILE_BOTH_DIRECTORY_INFO *)d_info->bufptr;
 
-		utfname = convname_updatenextoffset(d_info->name, PATH_MAX,
+		rc = convname_updatenextoffset(d_info->name, PATH_MAX,
 			sizeof(FILE_BOTH_DIRECTORY_INFO), conn->local_nls,
 			&name_len, &next_entry_offset, &d_info->out_buf_len,
-			&d_info->data_count, 7);
-		if (!utfname)
+			&d_info->data_count, 7, fbdinfo->FileName);
+		if (rc)
 			break;
-		fbdinfo = (FILE_BOTH_DIRECTORY_INFO *)
-				fill_common_info(&d_info->bufptr, smb_kstat);
+		fill_common_info(&d_info->bufptr, smb_kstat);
 		fbdinfo->FileNameLength = cpu_to_le32(name_len);
 		fbdinfo->EaSize = 0;
-		fbdinfo->ShortNameLength = smb_get_shortname(conn, d_info->name,
-			&(fbdinfo->ShortName[0]));
+		fbdinfo->ShortNameLength =
+			cifsd_shortname_lookup(d_info->short_names,
+				d_info->name, strlen(d_info->name),
+				&(fbdinfo->ShortName[0]));
 		fbdinfo->Reserved = 0;
 
-		memcpy(fbdinfo->FileName, utfname, name_len);
 		fbdinfo->FileName[name_len] = 0;
 		fbdinfo->FileName[name_len + 1] = 0;
 		fbdinfo->NextEntryOffset = next_entry_offset;
@@ -2874,20 +3021,19 @@ static int smb2_populate_readdir_entry(struct connection *conn,
 	}
 	case FILE_DIRECTORY_INFORMATION:
 	{
-		FILE_DIRECTORY_INFO *fdinfo;
+		FILE_DIRECTORY_INFO *fdinfo =
+			(FILE_DIRECTORY_INFO *)d_info->bufptr;
 
-		utfname = convname_updatenextoffset(d_info->name, PATH_MAX,
+		rc = convname_updatenextoffset(d_info->name, PATH_MAX,
 			sizeof(FILE_DIRECTORY_INFO), conn->local_nls, &name_len,
 			&next_entry_offset, &d_info->out_buf_len,
-			&d_info->data_count, 7);
-		if (!utfname)
+			&d_info->data_count, 7, fdinfo->FileName);
+		if (rc)
 			break;
 
-		fdinfo = (FILE_DIRECTORY_INFO *)
-				fill_common_info(&d_info->bufptr, smb_kstat);
+		fill_common_info(&d_info->bufptr, smb_kstat);
 		fdinfo->FileNameLength = cpu_to_le32(name_len);
 
-		memcpy(fdinfo->FileName, utfname, name_len);
 		fdinfo->FileName[name_len] = 0;
 		fdinfo->FileName[name_len + 1] = 0;
 		fdinfo->NextEntryOffset = next_entry_offset;
@@ -2895,20 +3041,19 @@ static int smb2_populate_readdir_entry(struct connection *conn,
 	}
 	case FILE_NAMES_INFORMATION:
 	{
-		FILE_NAMES_INFO *fninfo;
+		FILE_NAMES_INFO *fninfo =
+			(FILE_NAMES_INFO *)d_info->bufptr;
 
-		utfname = convname_updatenextoffset(d_info->name, PATH_MAX,
+		rc = convname_updatenextoffset(d_info->name, PATH_MAX,
 			sizeof(FILE_NAMES_INFO), conn->local_nls, &name_len,
 			&next_entry_offset, &d_info->out_buf_len,
-			&d_info->data_count, 7);
-		if (!utfname)
+			&d_info->data_count, 7, fninfo->FileName);
+		if (rc)
 			break;
 
-		fninfo = (FILE_NAMES_INFO *)
-				fill_common_info(&d_info->bufptr, smb_kstat);
+		fninfo->FileIndex = 0;
 		fninfo->FileNameLength = cpu_to_le32(name_len);
 
-		memcpy(fninfo->FileName, utfname, name_len);
 		fninfo->FileName[name_len] = 0;
 		fninfo->FileName[name_len + 1] = 0;
 		fninfo->NextEntryOffset = next_entry_offset;
@@ -2916,23 +3061,22 @@ static int smb2_populate_readdir_entry(struct connection *conn,
 	}
 	case FILEID_FULL_DIRECTORY_INFORMATION:
 	{
-		SEARCH_ID_FULL_DIR_INFO *dinfo;
+		SEARCH_ID_FULL_DIR_INFO *dinfo =
+			(SEARCH_ID_FULL_DIR_INFO *)d_info->bufptr;
 
-		utfname = convname_updatenextoffset(d_info->name, PATH_MAX,
+		rc = convname_updatenextoffset(d_info->name, PATH_MAX,
 			sizeof(SEARCH_ID_FULL_DIR_INFO), conn->local_nls,
 			&name_len, &next_entry_offset, &d_info->out_buf_len,
-			&d_info->data_count, 7);
-		if (!utfname)
+			&d_info->data_count, 7, dinfo->FileName);
+		if (rc)
 			break;
 
-		dinfo = (SEARCH_ID_FULL_DIR_INFO *)
-				fill_common_info(&d_info->bufptr, smb_kstat);
+		fill_common_info(&d_info->bufptr, smb_kstat);
 		dinfo->FileNameLength = cpu_to_le32(name_len);
 		dinfo->EaSize = 0;
 		dinfo->Reserved = 0;
 		dinfo->UniqueId = cpu_to_le64(smb_kstat->kstat->ino);
 
-		memcpy(dinfo->FileName, utfname, name_len);
 		dinfo->FileName[name_len] = 0;
 		dinfo->FileName[name_len + 1] = 0;
 		dinfo->NextEntryOffset = next_entry_offset;
@@ -2940,27 +3084,27 @@ static int smb2_populate_readdir_entry(struct connection *conn,
 	}
 	case FILEID_BOTH_DIRECTORY_INFORMATION:
 	{
-		FILE_ID_BOTH_DIRECTORY_INFO *fibdinfo;
+		FILE_ID_BOTH_DIRECTORY_INFO *fibdinfo =
+			(FILE_ID_BOTH_DIRECTORY_INFO *)d_info->bufptr;
 
-		utfname = convname_updatenextoffset(d_info->name, PATH_MAX,
+		rc = convname_updatenextoffset(d_info->name, PATH_MAX,
 			sizeof(FILE_ID_BOTH_DIRECTORY_INFO), conn->local_nls,
 			&name_len, &next_entry_offset, &d_info->out_buf_len,
-			&d_info->data_count, 7);
-		if (!utfname)
+			&d_info->data_count, 7, fibdinfo->FileName);
+		if (rc)
 			break;
 
-		fibdinfo = (FILE_ID_BOTH_DIRECTORY_INFO *)
-				fill_common_info(&d_info->bufptr, smb_kstat);
+		fill_common_info(&d_info->bufptr, smb_kstat);
 		fibdinfo->FileNameLength = cpu_to_le32(name_len);
 		fibdinfo->EaSize = 0;
 		fibdinfo->UniqueId = cpu_to_le64(smb_kstat->kstat->ino);
 		fibdinfo->ShortNameLength =
-			smb_get_shortname(conn, d_info->name,
-					&(fibdinfo->ShortName[0]));
+			cifsd_shortname_lookup(d_info->short_names,
+				d_info->name, strlen(d_info->name),
+				&(fibdinfo->ShortName[0]));
 		fibdinfo->Reserved = 0;
 		fibdinfo->Reserved2 = cpu_to_le16(0);
 
-		memcpy(fibdinfo->FileName, utfname, name_len);
 		fibdinfo->FileName[name_len] = 0;
 		fibdinfo->FileName[name_len + 1] = 0;
 		fibdinfo->NextEntryOffset = next_entry_offset;
@@ -2971,12 +3115,11 @@ static int smb2_populate_readdir_entry(struct connection *conn,
 		return -EOPNOTSUPP;
 	}
 
-	if (utfname) {
+	if (!rc) {
 		d_info->num_entry = d_info->data_count;
 		d_info->data_count += next_entry_offset;
 		d_info->out_buf_len -= next_entry_offset;
 		d_info->bufptr = (char *)d_info->bufptr + next_entry_offset;
-		kfree(utfname);
 	}
 	cifsd_debug("info_level : %d, buf_len :%d,"
 			" next_offset : %d, data_count : %d\n",
@@ -2988,7 +3131,7 @@ static int smb2_populate_readdir_entry(struct connection *conn,
 
 static int smb_populate_dot_dotdot_entries(struct connection *conn,
 	__u8 file_info_class, struct cifsd_file *dir,
-	struct cifsd_dir_info *d_info, char *search_patten)
+	struct cifsd_dir_info *d_info, struct cifsd_pattern *pat)
 {
 	int i, rc = 0;
 
@@ -3002,7 +3145,8 @@ static int smb_populate_dot_dotdot_entries(struct connection *conn,
 			else
 				d_info->name = "..";
 
-			if (!is_matched(d_info->name, search_patten)) {
+			if (!cifsd_pattern_match(pat, d_info->name,
+						strlen(d_info->name))) {
 				dir->dot_dotdot[i] = 1;
 				continue;
 			}
@@ -3101,6 +3245,9 @@ int smb2_query_dir(struct smb_work *smb_work)
 		goto err_out2;
 	}
 
+	/* enumeration state below is ours once read ahead has stopped */
+	cifsd_readdir_ahead_wait(dir_fp);
+
 	if (!S_ISDIR(file_inode(dir_fp->filp)->i_mode)) {
 		cifsd_err("can't do query dir for a file\n");
 		rsp->hdr.Status = NT_STATUS_INVALID_PARAMETER;
@@ -3120,6 +3267,26 @@ int smb2_query_dir(struct smb_work *smb_work)
 	} else
 		cifsd_debug("Search pattern is %s\n", srch_ptr);
 
+	/* compile the pattern once and reuse it while client repeats it */
+	if (!dir_fp->srch_pattern ||
+			strcmp(dir_fp->srch_pattern->orig, srch_ptr)) {
+		struct cifsd_pattern *pat;
+
+		pat = cifsd_compile_pattern(srch_ptr);
+		if (IS_ERR(pat)) {
+			cifsd_debug("Search pattern compile failed\n");
+			rc = PTR_ERR(pat);
+			if (rc == -ENOMEM)
+				rsp->hdr.Status = NT_STATUS_NO_MEMORY;
+			else
+				rsp->hdr.Status = NT_STATUS_INVALID_PARAMETER;
+			kfree(srch_ptr);
+			goto err_out2;
+		}
+		kfree(dir_fp->srch_pattern);
+		dir_fp->srch_pattern = pat;
+	}
+
 	path = kmalloc(PATH_MAX, GFP_KERNEL);
 	if (!path) {
 		cifsd_err("Failed to allocate memory\n");
@@ -3172,6 +3339,19 @@ int smb2_query_dir(struct smb_work *smb_work)
 		dir_fp->dirent_offset = 0;
 	}
 
+	/*
+	 * 8.3 names are resolved against the whole directory once per
+	 * enumeration, instead of being mangled again for every entry
+	 */
+	if ((req->FileInformationClass == FILE_BOTH_DIRECTORY_INFORMATION ||
+	     req->FileInformationClass == FILEID_BOTH_DIRECTORY_INFORMATION) &&
+	    (!dir_fp->short_names ||
+	     srch_flag & (SMB2_REOPEN | SMB2_RESTART_SCANS))) {
+		cifsd_shortname_table_put(dir_fp->short_names);
+		dir_fp->short_names =
+			cifsd_shortname_table_get(&dir_fp->filp->f_path);
+	}
+
 	if (srch_flag & SMB2_INDEX_SPECIFIED && le32_to_cpu(req->FileIndex)) {
 		cifsd_debug("specified index\n");
 		generic_file_llseek(dir_fp->filp, le32_to_cpu(req->FileIndex),
@@ -3183,6 +3363,8 @@ int smb2_query_dir(struct smb_work *smb_work)
 	r_data.dirent = dir_fp->readdir_data.dirent;
 	memset(&d_info, 0, sizeof(struct cifsd_dir_info));
 	d_info.bufptr = (char *)rsp->Buffer;
+	if (!IS_ERR(dir_fp->short_names))
+		d_info.short_names = dir_fp->short_names;
 	d_info.out_buf_len = min_t(int, (SMBMaxBufSize + MAX_HEADER_SIZE(conn) -
 		(get_rfc1002_length(rsp_org) + 4)),
 		le32_to_cpu(req->OutputBufferLength)) -
@@ -3194,7 +3376,8 @@ int smb2_query_dir(struct smb_work *smb_work)
 		 * in first response
 		 */
 		rc = smb_populate_dot_dotdot_entries(conn,
-			req->FileInformationClass, dir_fp, &d_info, srch_ptr);
+			req->FileInformationClass, dir_fp, &d_info,
+			dir_fp->srch_pattern);
 		if (rc)
 			goto err_out;
 	}
@@ -3232,6 +3415,17 @@ int smb2_query_dir(struct smb_work *smb_work)
 				sizeof(__le64));
 		dir_fp->dirent_offset += reclen;
 
+		/* dot and dotdot entries are already reserved */
+		if ((de->namelen == 1 && de->name[0] == '.') ||
+			(de->namelen == 2 && de->name[0] == '.' &&
+			 de->name[1] == '.'))
+			continue;
+
+		/* filter before stat so non-matching entries cost nothing */
+		if (!cifsd_pattern_match(dir_fp->srch_pattern, de->name,
+					de->namelen))
+			continue;
+
 		smb_kstat.kstat = &kstat;
 		d_info.name = read_next_entry(smb_work, &smb_kstat, de,
 			dirpath);
@@ -3242,27 +3436,20 @@ int smb2_query_dir(struct smb_work *smb_work)
 			continue;
 		}
 
-		/* dot and dotdot entries are already reserved */
-		if (!strcmp(".", d_info.name) || !strcmp("..", d_info.name))
-			continue;
-
-		if (is_matched(d_info.name, srch_ptr)) {
-			rc = smb2_populate_readdir_entry(conn,
-				req->FileInformationClass, &d_info, &smb_kstat);
-			if (rc)	{
-				kfree(d_info.name);
-				goto err_out;
-			}
+		rc = smb2_populate_readdir_entry(conn,
+			req->FileInformationClass, &d_info, &smb_kstat);
+		if (rc)	{
+			kfree(d_info.name);
+			goto err_out;
+		}
 
-			/* server MUST only return the first search result */
-			if (srch_flag & SMB2_RETURN_SINGLE_ENTRY) {
-				kfree(d_info.name);
-				break;
-			}
+		/* server MUST only return the first search result */
+		if (srch_flag & SMB2_RETURN_SINGLE_ENTRY) {
+			kfree(d_info.name);
+			break;
 		}
 
 		kfree(d_info.name);
-
 	}
 
 	if (d_info.out_buf_len < 0)
@@ -3288,6 +3475,10 @@ int smb2_query_dir(struct smb_work *smb_work)
 		rsp->OutputBufferOffset = cpu_to_le16(72);
 		rsp->OutputBufferLength = cpu_to_le32(d_info.data_count);
 		inc_rfc1001_len(rsp_org, 8 + d_info.data_count);
+
+		/* clients keep asking until STATUS_NO_MORE_FILES */
+		if (!(srch_flag & SMB2_RETURN_SINGLE_ENTRY))
+			cifsd_readdir_ahead(dir_fp);
 	}
 
 	kfree(path);
@@ -4117,14 +4308,20 @@ int smb2_get_info_file(struct smb_work *smb_work)
 	case FILE_ALTERNATE_NAME_INFORMATION:
 	{
 		struct smb2_file_alt_name_info *file_info;
+		struct path parent;
 		char *filename;
 		int uni_filename_len;
 
 		filename = (char *)FP_FILENAME(fp);
 
+		/* report the same short name as directory listings do */
+		parent.mnt = fp->filp->f_path.mnt;
+		parent.dentry = dget_parent(fp->filp->f_path.dentry);
 		file_info = (struct smb2_file_alt_name_info *)rsp->Buffer;
-		uni_filename_len = smb_get_shortname(conn, filename,
+		uni_filename_len = cifsd_shortname_get(&parent,
+				filename, strlen(filename),
 				file_info->FileName);
+		dput(parent.dentry);
 		file_info->FileNameLength = cpu_to_le32(uni_filename_len);
 
 		rsp->OutputBufferLength =
@@ -4407,10 +4604,7 @@ int smb2_get_info_filesystem(struct smb_work *smb_work)
 					smb_work->next_smb2_rsp_hdr_off);
 	}
 
-	share = find_matching_share(req->hdr.Id.SyncId.TreeId);
-	if (!share)
-		return -ENOENT;
-
+	share = smb_work->tcon->share;
 	rc = smb_kern_path(share->path, LOOKUP_FOLLOW, &path, 0);
 
 	if (rc) {
@@ -4448,7 +4642,11 @@ int smb2_get_info_filesystem(struct smb_work *smb_work)
 			FILE_SYSTEM_ATTRIBUTE_INFO *fs_info;
 
 			fs_info = (FILE_SYSTEM_ATTRIBUTE_INFO *)rsp->Buffer;
-			fs_info->Attributes = cpu_to_le32(0x0001002f);
+			fs_info->Attributes = cpu_to_le32(0x0001002f |
+					FILE_SUPPORTS_SPARSE_FILES);
+			if (smb_vfs_can_clone(&path))
+				fs_info->Attributes |= cpu_to_le32(
+					FILE_SUPPORTS_BLOCK_REFCOUNTING);
 			fs_info->MaxPathNameComponentLength =
 				cpu_to_le32(stfs.f_namelen);
 			fs_type_idx = fsTypeSearch(fs_type, stfs.f_type,
@@ -5516,6 +5714,7 @@ int smb2_read(struct smb_work *smb_work)
 	loff_t offset;
 	size_t length, mincount;
 	ssize_t nbytes = 0;
+	bool unbuffered = false;
 	uint64_t id = -1;
 	int err = 0;
 
@@ -5562,10 +5761,14 @@ int smb2_read(struct smb_work *smb_work)
 		length = CIFS_DEFAULT_IOSIZE;
 	}
 
+	if (smb_work->conn->dialect >= SMB302_PROT_ID &&
+	    req->Flags & SMB2_READFLAG_READ_UNBUFFERED)
+		unbuffered = true;
+
 	cifsd_debug("fid %llu, offset %lld, len %zu\n", id, offset, length);
 	nbytes = smb_vfs_read(smb_work->sess, id,
 			le64_to_cpu(req->PersistentFileId),
-			&smb_work->rdata_buf, length, &offset);
+			&smb_work->rdata_buf, length, &offset, unbuffered);
 	if (nbytes < 0) {
 		err = nbytes;
 		goto out;
@@ -5715,7 +5918,7 @@ int smb2_write(struct smb_work *smb_work)
 	size_t length;
 	ssize_t nbytes;
 	char *data_buf;
-	bool writethrough = false;
+	bool writethrough = false, unbuffered = false;
 	uint64_t id = -1;
 	int err = 0;
 
@@ -5773,11 +5976,14 @@ int smb2_write(struct smb_work *smb_work)
 	cifsd_debug("flags %u\n", le32_to_cpu(req->Flags));
 	if (le32_to_cpu(req->Flags) & SMB2_WRITEFLAG_WRITE_THROUGH)
 		writethrough = true;
+	if (smb_work->conn->dialect >= SMB302_PROT_ID &&
+	    le32_to_cpu(req->Flags) & SMB2_WRITEFLAG_WRITE_UNBUFFERED)
+		unbuffered = true;
 
 	cifsd_debug("fid %llu, offset %lld, len %zu\n", id, offset, length);
 	err = smb_vfs_write(smb_work->sess, id,
 		le64_to_cpu(req->PersistentFileId), data_buf, length, &offset,
-			writethrough, &nbytes);
+			writethrough, unbuffered, &nbytes);
 	if (err < 0)
 		goto out;
 
@@ -5878,9 +6084,12 @@ int smb2_cancel(struct smb_work *smb_work)
 				le64_to_cpu(hdr->Id.AsyncId)) {
 				cifsd_debug("smb2 with AsyncId %llu cancelled command = 0x%x\n",
 					hdr->Id.AsyncId, work_hdr->Command);
-				if (work->async->async_status == ASYNC_PROG)
+				if (work->async->async_status == ASYNC_PROG) {
 					work->async->async_status =
 						ASYNC_CANCEL;
+					if (work->async->cancel_fn)
+						work->async->cancel_fn(work);
+				}
 				break;
 			}
 		}
@@ -5948,13 +6157,281 @@ static struct cifsd_lock *smb2_lock_init(struct file_lock *flock,
 	if (lock->start == lock->end)
 		lock->zero_len = 1;
 	INIT_LIST_HEAD(&lock->llist);
-	INIT_LIST_HEAD(&lock->glist);
+	RB_CLEAR_NODE(&lock->rb);
 	INIT_LIST_HEAD(&lock->flist);
 	list_add_tail(&lock->llist, lock_list);
 
 	return lock;
 }
 
+/*
+ * A blocking lock that has to wait is parked rather than keeping a worker
+ * asleep on it. The VFS calls lm_notify of the waiting file_lock when the
+ * conflicting lock goes away, and cancel or close of the request kick it
+ * as well; either way smb2_blocked_lock_work() retries the lock and sends
+ * the final response.
+ *
+ * Only a request made of a single lock outside a compound is parked. The
+ * other locks of a request would have to be taken or rolled back from the
+ * work, so such a request still waits in the worker, woken up by the VFS,
+ * by cancel through smb2_lock_wake() or by close through FP_FREEING.
+ */
+enum {
+	BLOCKED_LOCK_PARKING,
+	BLOCKED_LOCK_PARKED,
+	BLOCKED_LOCK_DONE,
+};
+
+struct smb2_blocked_lock {
+	struct hlist_node	hnode;
+	struct work_struct	work;
+	struct smb_work		*smb_work;
+	struct cifsd_file	*fp;
+	struct cifsd_lock	*lock;
+	int			state;
+	bool			kicked;
+};
+
+static DEFINE_SPINLOCK(blocked_locks_lock);
+static DEFINE_HASHTABLE(blocked_locks, 6);
+
+/* must be called with blocked_locks_lock held */
+static void __smb2_blocked_lock_kick(struct smb2_blocked_lock *blk)
+{
+	if (blk->state == BLOCKED_LOCK_PARKED)
+		schedule_work(&blk->work);
+	else if (blk->state == BLOCKED_LOCK_PARKING)
+		blk->kicked = true;
+}
+
+static void smb2_lock_notify(struct file_lock *fl)
+{
+	struct smb2_blocked_lock *blk;
+
+	spin_lock(&blocked_locks_lock);
+	hash_for_each_possible(blocked_locks, blk, hnode, (unsigned long)fl) {
+		if (blk->lock->fl == fl) {
+			__smb2_blocked_lock_kick(blk);
+			break;
+		}
+	}
+	spin_unlock(&blocked_locks_lock);
+}
+
+static const struct lock_manager_operations smb2_lock_ops = {
+	.lm_notify = smb2_lock_notify,
+};
+
+static void smb2_lock_cancel(struct smb_work *smb_work)
+{
+	struct smb2_blocked_lock *blk = smb_work->async->private;
+
+	spin_lock(&blocked_locks_lock);
+	__smb2_blocked_lock_kick(blk);
+	spin_unlock(&blocked_locks_lock);
+}
+
+static void smb2_lock_park(struct smb_work *smb_work)
+{
+	struct smb2_blocked_lock *blk = smb_work->async->private;
+
+	spin_lock(&blocked_locks_lock);
+	blk->state = BLOCKED_LOCK_PARKED;
+	if (blk->kicked)
+		schedule_work(&blk->work);
+	spin_unlock(&blocked_locks_lock);
+}
+
+/**
+ * smb2_blocked_lock_work() - retry a parked lock and complete its request
+ * @work:	work of struct smb2_blocked_lock
+ */
+static void smb2_blocked_lock_work(struct work_struct *work)
+{
+	struct smb2_blocked_lock *blk =
+		container_of(work, struct smb2_blocked_lock, work);
+	struct smb_work *smb_work;
+	struct smb2_lock_rsp *rsp;
+	struct cifsd_file *fp;
+	struct cifsd_mfile *mfp;
+	struct cifsd_lock *smb_lock;
+	struct file_lock *flock;
+	enum asyncEnum status;
+	bool done, requeued;
+	int err;
+
+	/* kicked once more while completing, nothing left to do */
+	spin_lock(&blocked_locks_lock);
+	done = blk->state == BLOCKED_LOCK_DONE;
+	spin_unlock(&blocked_locks_lock);
+	if (done) {
+		kfree(blk);
+		return;
+	}
+
+	/*
+	 * The lock belongs to this work until it is granted or freed, close
+	 * waits for that and keeps mfp around meanwhile.
+	 */
+	smb_work = blk->smb_work;
+	rsp = (struct smb2_lock_rsp *)smb_work->rsp_buf;
+	fp = blk->fp;
+	mfp = fp->f_mfp;
+	smb_lock = blk->lock;
+	flock = smb_lock->fl;
+
+	spin_lock(&smb_work->conn->request_lock);
+	status = smb_work->async->async_status;
+	spin_unlock(&smb_work->conn->request_lock);
+
+	/* close may have marked the open before the request went async */
+	if (status == ASYNC_PROG && fp->f_state == FP_FREEING)
+		status = ASYNC_CLOSE;
+
+	if (status == ASYNC_CANCEL || status == ASYNC_CLOSE) {
+		posix_unblock_lock(flock);
+		spin_lock(&mfp->m_lock);
+		cifsd_lock_tree_remove(mfp, smb_lock);
+		list_del(&smb_lock->flist);
+		spin_unlock(&mfp->m_lock);
+		locks_free_lock(flock);
+		kfree(smb_lock);
+		wake_up(&fp->wq);
+
+		if (status == ASYNC_CANCEL)
+			rsp->hdr.Status = NT_STATUS_CANCELLED;
+		else
+			rsp->hdr.Status = NT_STATUS_RANGE_NOT_LOCKED;
+		smb2_set_err_rsp(smb_work);
+		goto out;
+	}
+
+	err = smb_vfs_lock(fp->filp, smb_lock->cmd, flock);
+	if (err == FILE_LOCK_DEFERRED)
+		return;
+
+	if (!err) {
+		spin_lock(&mfp->m_lock);
+		smb_lock->work = NULL;
+		spin_unlock(&mfp->m_lock);
+		wake_up(&fp->wq);
+		if (oplocks_enable)
+			smb_break_all_oplock(smb_work, fp, FP_INODE(fp));
+
+		rsp->StructureSize = cpu_to_le16(4);
+		rsp->hdr.Status = NT_STATUS_OK;
+		rsp->Reserved = 0;
+		inc_rfc1001_len(rsp, 4);
+	} else {
+		spin_lock(&mfp->m_lock);
+		cifsd_lock_tree_remove(mfp, smb_lock);
+		list_del(&smb_lock->flist);
+		spin_unlock(&mfp->m_lock);
+		locks_free_lock(flock);
+		kfree(smb_lock);
+		wake_up(&fp->wq);
+		rsp->hdr.Status = NT_STATUS_LOCK_NOT_GRANTED;
+		smb2_set_err_rsp(smb_work);
+	}
+
+out:
+	spin_lock(&blocked_locks_lock);
+	blk->state = BLOCKED_LOCK_DONE;
+	hash_del(&blk->hnode);
+	requeued = work_pending(&blk->work);
+	spin_unlock(&blocked_locks_lock);
+
+	/* close may be waiting for fp while holding srv_mutex */
+	fp_put(fp);
+	smb_complete_parked_work(smb_work);
+	if (!requeued)
+		kfree(blk);
+}
+
+/**
+ * smb2_lock_try_park() - take a blocking lock or park the request on it
+ * @smb_work:	smb work containing lock command buffer
+ * @fp:		cifsd file pointer
+ * @smb_lock:	lock to take, the last one of the request
+ *
+ * Return:	FILE_LOCK_DEFERRED if the request was parked, -EAGAIN if it
+ *		could not be and the caller has to wait for the lock itself,
+ *		otherwise result of the lock attempt
+ */
+static int smb2_lock_try_park(struct smb_work *smb_work,
+		struct cifsd_file *fp, struct cifsd_lock *smb_lock)
+{
+	struct connection *conn = smb_work->conn;
+	struct cifsd_mfile *mfp = fp->f_mfp;
+	struct file_lock *flock = smb_lock->fl;
+	struct smb2_blocked_lock *blk;
+	struct async_info *async;
+	int err;
+
+	blk = kzalloc(sizeof(struct smb2_blocked_lock), GFP_KERNEL);
+	if (!blk)
+		return -EAGAIN;
+
+	INIT_WORK(&blk->work, smb2_blocked_lock_work);
+	blk->smb_work = smb_work;
+	blk->fp = fp;
+	blk->lock = smb_lock;
+	blk->state = BLOCKED_LOCK_PARKING;
+
+	/* hashed before the attempt so no release can be missed */
+	spin_lock(&blocked_locks_lock);
+	hash_add(blocked_locks, &blk->hnode, (unsigned long)flock);
+	spin_unlock(&blocked_locks_lock);
+
+	flock->fl_lmops = &smb2_lock_ops;
+	err = smb_vfs_lock(fp->filp, smb_lock->cmd, flock);
+	if (err != FILE_LOCK_DEFERRED) {
+		spin_lock(&blocked_locks_lock);
+		hash_del(&blk->hnode);
+		spin_unlock(&blocked_locks_lock);
+		flock->fl_lmops = NULL;
+		kfree(blk);
+		return err;
+	}
+
+	cifsd_debug("parking lock request until the range is released\n");
+	spin_lock(&mfp->m_lock);
+	smb_lock->work = smb_work;
+	cifsd_lock_tree_insert(mfp, smb_lock);
+	list_add(&smb_lock->flist, &fp->lock_list);
+	spin_unlock(&mfp->m_lock);
+
+	smb2_send_interim_resp(smb_work);
+
+	spin_lock(&conn->request_lock);
+	async = smb_work->async;
+	async->private = blk;
+	async->cancel_fn = smb2_lock_cancel;
+	async->park_fn = smb2_lock_park;
+	/* cancelled or closed before cancel_fn was set */
+	if (async->async_status != ASYNC_PROG || fp->f_state == FP_FREEING)
+		smb2_lock_cancel(smb_work);
+	spin_unlock(&conn->request_lock);
+
+	return FILE_LOCK_DEFERRED;
+}
+
+/* cancel_fn of a lock waited for in the worker, request_lock held */
+static void smb2_lock_wake(struct smb_work *smb_work)
+{
+	struct file_lock *flock = smb_work->async->private;
+
+	wake_up(&flock->fl_wait);
+}
+
+static bool smb2_lock_wait_done(struct smb_work *smb_work,
+		struct cifsd_file *fp, struct file_lock *flock)
+{
+	return !flock->fl_next ||
+		READ_ONCE(smb_work->async->async_status) != ASYNC_PROG ||
+		fp->f_state == FP_FREEING;
+}
+
 /**
  * smb2_lock() - handler for smb2 file lock command
  * @smb_work:	smb work containing lock command buffer
@@ -5968,6 +6445,7 @@ int smb2_lock(struct smb_work *smb_work)
 	struct smb2_lock_rsp *rsp;
 	struct smb2_lock_element *lock_ele;
 	struct cifsd_file *fp = NULL;
+	struct cifsd_mfile *mfp;
 	struct file_lock *flock = NULL;
 	struct file *filp = NULL;
 	int lock_count;
@@ -5975,7 +6453,7 @@ int smb2_lock(struct smb_work *smb_work)
 	unsigned int cmd = 0;
 	int err = 0, i;
 	uint64_t lock_length;
-	struct cifsd_lock *smb_lock = NULL, *cmp_lock, *tmp;
+	struct cifsd_lock *smb_lock = NULL, *cmp_lock, *tmp, *next;
 	int nolock = 0;
 	LIST_HEAD(lock_list);
 	LIST_HEAD(rollback_list);
@@ -6008,6 +6486,7 @@ int smb2_lock(struct smb_work *smb_work)
 	}
 
 	filp = fp->filp;
+	mfp = fp->f_mfp;
 	lock_count = le16_to_cpu(req->LockCount);
 	lock_ele = req->locks;
 
@@ -6145,11 +6624,13 @@ int smb2_lock(struct smb_work *smb_work)
 			goto no_check_gl;
 
 		nolock = 1;
-		/* check locks in global list */
-		list_for_each_entry(cmp_lock, &global_lock_list, glist) {
-			if (file_inode(cmp_lock->fl->fl_file) !=
-				file_inode(smb_lock->fl->fl_file))
-				continue;
+		/* check locks of this inode overlapping the range */
+		spin_lock(&mfp->m_lock);
+		for (cmp_lock = cifsd_lock_tree_first(mfp, smb_lock->start,
+					smb_lock->end); cmp_lock;
+		     cmp_lock = next) {
+			next = cifsd_lock_tree_next(cmp_lock, smb_lock->start,
+					smb_lock->end);
 
 			if (smb_lock->fl->fl_type == F_UNLCK) {
 				if (cmp_lock->fl->fl_file ==
@@ -6159,7 +6640,7 @@ int smb2_lock(struct smb_work *smb_work)
 					!cmp_lock->work) {
 					nolock = 0;
 					locks_free_lock(cmp_lock->fl);
-					list_del(&cmp_lock->glist);
+					cifsd_lock_tree_remove(mfp, cmp_lock);
 					list_del(&cmp_lock->flist);
 					kfree(cmp_lock);
 					break;
@@ -6181,7 +6662,8 @@ int smb2_lock(struct smb_work *smb_work)
 				cmp_lock->start < smb_lock->end) {
 				cifsd_err("previous lock conflict with zero byte lock range\n");
 				rsp->hdr.Status = NT_STATUS_LOCK_NOT_GRANTED;
-					goto out;
+				spin_unlock(&mfp->m_lock);
+				goto out;
 			}
 
 			if (smb_lock->zero_len && !cmp_lock->zero_len &&
@@ -6189,7 +6671,8 @@ int smb2_lock(struct smb_work *smb_work)
 				smb_lock->start < cmp_lock->end) {
 				cifsd_err("current lock conflict with zero byte lock range\n");
 				rsp->hdr.Status = NT_STATUS_LOCK_NOT_GRANTED;
-					goto out;
+				spin_unlock(&mfp->m_lock);
+				goto out;
 			}
 
 			if (((cmp_lock->start <= smb_lock->start &&
@@ -6200,9 +6683,11 @@ int smb2_lock(struct smb_work *smb_work)
 				cifsd_err("Not allow lock operation on exclusive lock range\n");
 				rsp->hdr.Status =
 					NT_STATUS_LOCK_NOT_GRANTED;
+				spin_unlock(&mfp->m_lock);
 				goto out;
 			}
 		}
+		spin_unlock(&mfp->m_lock);
 
 		if (smb_lock->fl->fl_type == F_UNLCK && nolock) {
 			cifsd_err("Try to unlock nolocked range\n");
@@ -6217,8 +6702,19 @@ no_check_gl:
 		}
 
 		flock = smb_lock->fl;
-		list_del(&smb_lock->llist);
-retry:
+		list_del_init(&smb_lock->llist);
+
+		/* a single blocking lock is parked instead of waited for */
+		if (smb_lock->cmd == F_SETLKW && list_empty(&lock_list) &&
+			list_empty(&rollback_list) &&
+			!smb_work->next_smb2_rcv_hdr_off &&
+			!req->hdr.NextCommand) {
+			err = smb2_lock_try_park(smb_work, fp, smb_lock);
+			if (err == FILE_LOCK_DEFERRED)
+				return 0;
+			if (err != -EAGAIN)
+				goto skip;
+		}
 		err = smb_vfs_lock(filp, smb_lock->cmd, flock);
 skip:
 		if (flags & SMB2_LOCKFLAG_UNLOCK) {
@@ -6237,55 +6733,87 @@ skip:
 
 				cifsd_debug("would have to wait for getting"
 						" lock\n");
+				spin_lock(&mfp->m_lock);
 				smb_lock->work = smb_work;
-				list_add_tail(&smb_lock->glist,
-					&global_lock_list);
-				list_add(&smb_lock->llist, &rollback_list);
+				cifsd_lock_tree_insert(mfp, smb_lock);
 				list_add(&smb_lock->flist, &fp->lock_list);
+				spin_unlock(&mfp->m_lock);
+				list_add(&smb_lock->llist, &rollback_list);
 
 				smb2_send_interim_resp(smb_work);
-wait:
-				err = wait_event_interruptible_timeout(
-						flock->fl_wait,	!flock->fl_next,
-						msecs_to_jiffies(10));
 				spin_lock(rq_lock);
 				async = smb_work->async;
+				async->private = flock;
+				async->cancel_fn = smb2_lock_wake;
+				spin_unlock(rq_lock);
+wait:
+				wait_event_interruptible(flock->fl_wait,
+					smb2_lock_wait_done(smb_work, fp, flock));
+				spin_lock(rq_lock);
 				if (async->async_status == ASYNC_CANCEL ||
-					async->async_status == ASYNC_CLOSE) {
+					async->async_status == ASYNC_CLOSE ||
+					fp->f_state == FP_FREEING) {
+					bool closed = async->async_status !=
+						ASYNC_CANCEL;
+
+					async->cancel_fn = NULL;
+					/* close waits for us to free it */
 					posix_unblock_lock(flock);
 					list_del(&smb_lock->llist);
-					list_del(&smb_lock->glist);
+					spin_lock(&mfp->m_lock);
+					cifsd_lock_tree_remove(mfp, smb_lock);
+					list_del(&smb_lock->flist);
+					spin_unlock(&mfp->m_lock);
+					spin_unlock(rq_lock);
 					locks_free_lock(flock);
-
-					if (async->async_status ==
-							ASYNC_CANCEL) {
+					kfree(smb_lock);
+					wake_up(&fp->wq);
+					if (closed) {
 						rsp->hdr.Status =
-							NT_STATUS_CANCELLED;
-						list_del(&smb_lock->flist);
-						kfree(smb_lock);
-						spin_unlock(rq_lock);
-						goto out;
-					}
-					rsp->hdr.Status =
 						NT_STATUS_RANGE_NOT_LOCKED;
-					kfree(smb_lock);
-					spin_unlock(rq_lock);
-					goto out2;
+						goto out2;
+					}
+					rsp->hdr.Status = NT_STATUS_CANCELLED;
+					goto out;
 				}
 				spin_unlock(rq_lock);
 
+				/* the lock stays linked, close waits for it */
+				err = smb_vfs_lock(filp, smb_lock->cmd, flock);
+				if (err == FILE_LOCK_DEFERRED)
+					goto wait;
+
+				spin_lock(rq_lock);
+				async->cancel_fn = NULL;
+				spin_unlock(rq_lock);
+
+				spin_lock(&mfp->m_lock);
+				if (!err) {
+					smb_lock->work = NULL;
+				} else {
+					cifsd_lock_tree_remove(mfp, smb_lock);
+					list_del(&smb_lock->flist);
+				}
+				spin_unlock(&mfp->m_lock);
+				wake_up(&fp->wq);
+
 				if (err) {
 					list_del(&smb_lock->llist);
-					list_del(&smb_lock->glist);
-					list_del(&smb_lock->flist);
-					goto retry;
-				} else
-					goto wait;
+					locks_free_lock(flock);
+					kfree(smb_lock);
+					rsp->hdr.Status =
+						NT_STATUS_LOCK_NOT_GRANTED;
+					goto out;
+				}
+				cifsd_debug("successful in taking lock\n");
 			} else if (!err) {
-				list_add_tail(&smb_lock->glist,
-					&global_lock_list);
-				list_add(&smb_lock->llist, &rollback_list);
+				/* granted right away */
+				spin_lock(&mfp->m_lock);
+				smb_lock->work = NULL;
+				cifsd_lock_tree_insert(mfp, smb_lock);
 				list_add(&smb_lock->flist, &fp->lock_list);
+				spin_unlock(&mfp->m_lock);
+				list_add(&smb_lock->llist, &rollback_list);
 				cifsd_debug("successful in taking lock\n");
 			} else {
 				rsp->hdr.Status = NT_STATUS_LOCK_NOT_GRANTED;
@@ -6294,6 +6822,10 @@ wait:
 		}
 	}
 
+	/* granted locks stay on fp->lock_list only, not on this stack */
+	list_for_each_entry_safe(smb_lock, tmp, &rollback_list, llist)
+		list_del_init(&smb_lock->llist);
+
 	if (oplocks_enable)
 		smb_break_all_oplock(smb_work, fp, FP_INODE(fp));
 
@@ -6325,8 +6857,10 @@ out:
 		if (err)
 			cifsd_err("rollback unlock fail : %d\n", err);
 		list_del(&smb_lock->llist);
-		list_del(&smb_lock->glist);
+		spin_lock(&mfp->m_lock);
+		cifsd_lock_tree_remove(mfp, smb_lock);
 		list_del(&smb_lock->flist);
+		spin_unlock(&mfp->m_lock);
 		locks_free_lock(smb_lock->fl);
 		locks_free_lock(rlock);
 		kfree(smb_lock);
@@ -6338,6 +6872,520 @@ out2:
 	return 0;
 }
 
+static bool fp_can_read(struct cifsd_file *fp)
+{
+	return fp->daccess & (FILE_READ_DATA_LE | FILE_GENERIC_READ_LE |
+			FILE_MAXIMAL_ACCESS_LE | FILE_GENERIC_ALL_LE);
+}
+
+static bool fp_can_write(struct cifsd_file *fp)
+{
+	return fp->daccess & (FILE_WRITE_DATA_LE | FILE_GENERIC_WRITE_LE |
+			FILE_MAXIMAL_ACCESS_LE | FILE_GENERIC_ALL_LE);
+}
+
+/* status of a failed copy, clone or zeroing of a file range */
+static __le32 fsctl_data_err_status(int err)
+{
+	switch (err) {
+	case -EINVAL:
+		return NT_STATUS_INVALID_PARAMETER;
+	case -EAGAIN:
+		return NT_STATUS_FILE_LOCK_CONFLICT;
+	case -EISDIR:
+		return NT_STATUS_FILE_IS_A_DIRECTORY;
+	case -ENOSPC:
+		return NT_STATUS_DISK_FULL;
+	case -EOPNOTSUPP:
+		return NT_STATUS_NOT_SUPPORTED;
+	case -EACCES:
+	case -EPERM:
+		return NT_STATUS_ACCESS_DENIED;
+	default:
+		return NT_STATUS_UNEXPECTED_IO_ERROR;
+	}
+}
+
+/* open of an ioctl request, NULL if closed */
+static struct cifsd_file *ioctl_lookup_fp(struct smb_work *smb_work,
+		uint64_t id, uint64_t p_id)
+{
+	struct cifsd_file *fp;
+
+	fp = get_id_from_fidtable(smb_work->sess, id);
+	if (fp && fp->is_durable && fp->persistent_id != p_id) {
+		fp_put(fp);
+		return NULL;
+	}
+
+	return fp;
+}
+
+/**
+ * fsctl_request_resume_key() - hand out a resume key for an open
+ * @smb_work:	smb work containing ioctl command buffer
+ * @id:		volatile id of the open
+ * @p_id:	persistent id of the open
+ * @key_rsp:	response buffer to fill
+ *
+ * The key is opaque to the client. It carries the ids of the open, so
+ * a later copychunk finds the source without any extra table.
+ *
+ * Return:	0 on success, otherwise error
+ */
+static int fsctl_request_resume_key(struct smb_work *smb_work, uint64_t id,
+		uint64_t p_id, struct resume_key_ioctl_rsp *key_rsp)
+{
+	struct cifsd_file *fp;
+
+	fp = get_id_from_fidtable(smb_work->sess, id);
+	if (!fp)
+		return -ENOENT;
+
+	if (fp->is_durable && fp->persistent_id != p_id) {
+		fp_put(fp);
+		return -ENOENT;
+	}
+
+	memset(key_rsp, 0, sizeof(struct resume_key_ioctl_rsp));
+	key_rsp->ResumeKey[0] = id;
+	key_rsp->ResumeKey[1] = fp->persistent_id;
+	fp_put(fp);
+	return 0;
+}
+
+/**
+ * fsctl_copychunk() - server side copy between two opens
+ * @smb_work:	smb work containing ioctl command buffer
+ * @ci_req:	copychunk request
+ * @input_count: length of copychunk request
+ * @cnt_code:	FSCTL_SRV_COPYCHUNK or FSCTL_SRV_COPYCHUNK_WRITE
+ * @id:		volatile id of the destination open
+ * @p_id:	persistent id of the destination open
+ * @rsp:	ioctl response, copychunk response goes in its buffer
+ *
+ * Errors detected before anything is copied are returned and sent as a
+ * plain error response. Once chunks are copied, or when the request
+ * exceeds the server limits, the status is set in the response header
+ * and the copychunk response reports progress or the limits.
+ *
+ * Return:	0 when ci_rsp is to be sent, otherwise error
+ */
+static int fsctl_copychunk(struct smb_work *smb_work,
+		struct copychunk_ioctl_req *ci_req, unsigned int input_count,
+		unsigned int cnt_code, uint64_t id, uint64_t p_id,
+		struct smb2_ioctl_rsp *rsp)
+{
+	struct copychunk_ioctl_rsp *ci_rsp;
+	struct cifsd_file *src_fp = NULL, *dst_fp = NULL;
+	struct srv_copychunk *chunk;
+	unsigned int chunk_count, chunks_written = 0, i;
+	unsigned int total = 0, len;
+	loff_t src_off, dst_off;
+	ssize_t copied = 0;
+	int err = 0;
+
+	ci_rsp = (struct copychunk_ioctl_rsp *)&rsp->Buffer[0];
+	memset(ci_rsp, 0, sizeof(struct copychunk_ioctl_rsp));
+	if (input_count < offsetof(struct copychunk_ioctl_req, Chunks))
+		return -EINVAL;
+
+	chunk_count = le32_to_cpu(ci_req->ChunkCount);
+	if (chunk_count > CIFSD_MAX_COPYCHUNK_COUNT)
+		goto limits;
+
+	if (input_count < offsetof(struct copychunk_ioctl_req, Chunks) +
+			chunk_count * sizeof(struct srv_copychunk))
+		return -EINVAL;
+
+	for (i = 0; i < chunk_count; i++) {
+		len = le32_to_cpu(ci_req->Chunks[i].Length);
+		if (!len || len > CIFSD_MAX_COPYCHUNK_SIZE)
+			goto limits;
+		total += len;
+		if (total > CIFSD_MAX_COPYCHUNK_TOTAL)
+			goto limits;
+	}
+
+	src_fp = get_id_from_fidtable(smb_work->sess, ci_req->ResumeKey[0]);
+	if (!src_fp || src_fp->persistent_id != ci_req->ResumeKey[1]) {
+		rsp->hdr.Status = NT_STATUS_OBJECT_NAME_NOT_FOUND;
+		err = -ENOENT;
+		goto out;
+	}
+
+	dst_fp = get_id_from_fidtable(smb_work->sess, id);
+	if (!dst_fp || (dst_fp->is_durable && dst_fp->persistent_id != p_id)) {
+		rsp->hdr.Status = NT_STATUS_FILE_CLOSED;
+		err = -ENOENT;
+		goto out;
+	}
+
+	/* COPYCHUNK also needs read access on the target, MS-SMB2 3.3.5.15.6 */
+	if (!fp_can_read(src_fp) || !fp_can_write(dst_fp) ||
+	    (cnt_code == FSCTL_SRV_COPYCHUNK && !fp_can_read(dst_fp))) {
+		rsp->hdr.Status = NT_STATUS_ACCESS_DENIED;
+		err = -EACCES;
+		goto out;
+	}
+
+	total = 0;
+	for (i = 0; i < chunk_count; i++) {
+		chunk = &ci_req->Chunks[i];
+		src_off = le64_to_cpu(chunk->SourceOffset);
+		dst_off = le64_to_cpu(chunk->TargetOffset);
+		len = le32_to_cpu(chunk->Length);
+
+		copied = smb_vfs_copy_file_range(smb_work->conn, src_fp,
+				src_off, dst_fp, dst_off, len);
+		if (copied > 0)
+			total += copied;
+		if (copied != len)
+			break;
+		chunks_written++;
+	}
+
+	ci_rsp->ChunksWritten = cpu_to_le32(chunks_written);
+	ci_rsp->TotalBytesWritten = cpu_to_le32(total);
+	if (chunks_written == chunk_count)
+		goto out;
+
+	if (copied > 0)
+		ci_rsp->ChunkBytesWritten = cpu_to_le32(copied);
+
+	if (copied >= 0)
+		/* source ended before the chunk did */
+		rsp->hdr.Status = NT_STATUS_INVALID_VIEW_SIZE;
+	else if (copied == -EAGAIN)
+		rsp->hdr.Status = NT_STATUS_FILE_LOCK_CONFLICT;
+	else if (copied == -EISDIR)
+		rsp->hdr.Status = NT_STATUS_FILE_IS_A_DIRECTORY;
+	else if (copied == -ENOSPC)
+		rsp->hdr.Status = NT_STATUS_DISK_FULL;
+	else if (copied == -EOPNOTSUPP)
+		rsp->hdr.Status = NT_STATUS_NOT_SUPPORTED;
+	else
+		rsp->hdr.Status = NT_STATUS_UNEXPECTED_IO_ERROR;
+
+	/* nothing copied, no progress to report */
+	if (!chunks_written && copied <= 0)
+		err = -EIO;
+	goto out;
+
+limits:
+	rsp->hdr.Status = NT_STATUS_INVALID_PARAMETER;
+	ci_rsp->ChunksWritten = cpu_to_le32(CIFSD_MAX_COPYCHUNK_COUNT);
+	ci_rsp->ChunkBytesWritten = cpu_to_le32(CIFSD_MAX_COPYCHUNK_SIZE);
+	ci_rsp->TotalBytesWritten = cpu_to_le32(CIFSD_MAX_COPYCHUNK_TOTAL);
+out:
+	fp_put(src_fp);
+	fp_put(dst_fp);
+	return err;
+}
+
+/**
+ * fsctl_duplicate_extents() - clone a range of one open into another
+ * @smb_work:	smb work containing ioctl command buffer
+ * @dup_ext:	duplicate extents request
+ * @input_count: length of duplicate extents request
+ * @id:		volatile id of the destination open
+ * @p_id:	persistent id of the destination open
+ * @rsp:	ioctl response
+ *
+ * Return:	0 on success, otherwise error with status set in rsp
+ */
+static int fsctl_duplicate_extents(struct smb_work *smb_work,
+		struct duplicate_extents_to_file *dup_ext,
+		unsigned int input_count, uint64_t id, uint64_t p_id,
+		struct smb2_ioctl_rsp *rsp)
+{
+	struct cifsd_file *src_fp = NULL, *dst_fp = NULL;
+	int err;
+
+	if (input_count < sizeof(struct duplicate_extents_to_file)) {
+		rsp->hdr.Status = NT_STATUS_INVALID_PARAMETER;
+		return -EINVAL;
+	}
+
+	src_fp = get_id_from_fidtable(smb_work->sess,
+			le64_to_cpu(dup_ext->VolatileFileHandle));
+	if (!src_fp || (src_fp->is_durable && src_fp->persistent_id !=
+			le64_to_cpu(dup_ext->PersistentFileHandle))) {
+		rsp->hdr.Status = NT_STATUS_INVALID_HANDLE;
+		err = -ENOENT;
+		goto out;
+	}
+
+	dst_fp = get_id_from_fidtable(smb_work->sess, id);
+	if (!dst_fp || (dst_fp->is_durable && dst_fp->persistent_id != p_id)) {
+		rsp->hdr.Status = NT_STATUS_FILE_CLOSED;
+		err = -ENOENT;
+		goto out;
+	}
+
+	if (!fp_can_read(src_fp) || !fp_can_write(dst_fp)) {
+		rsp->hdr.Status = NT_STATUS_ACCESS_DENIED;
+		err = -EACCES;
+		goto out;
+	}
+
+	err = smb_vfs_clone_file_range(smb_work->conn, src_fp,
+			le64_to_cpu(dup_ext->SourceFileOffset), dst_fp,
+			le64_to_cpu(dup_ext->TargetFileOffset),
+			le64_to_cpu(dup_ext->ByteCount));
+	if (err)
+		/* -EINVAL for unaligned range or beyond end of the source */
+		rsp->hdr.Status = fsctl_data_err_status(err);
+out:
+	fp_put(src_fp);
+	fp_put(dst_fp);
+	return err;
+}
+
+/**
+ * fsctl_set_sparse() - set or clear the sparse attribute of an open
+ * @smb_work:	smb work containing ioctl command buffer
+ * @sparse:	set sparse request, may be absent
+ * @input_count: length of set sparse request
+ * @fp:		open to update
+ *
+ * Linux files can always have holes, so only the attribute changes.
+ *
+ * Return:	0 on success, otherwise error
+ */
+static int fsctl_set_sparse(struct smb_work *smb_work,
+		struct file_sparse *sparse, unsigned int input_count,
+		struct cifsd_file *fp)
+{
+	__le32 old_fattr = fp->fattr;
+	int rc;
+
+	if (S_ISDIR(FP_INODE(fp)->i_mode))
+		return -EISDIR;
+
+	if (input_count < sizeof(struct file_sparse) || sparse->SetSparse)
+		fp->fattr |= FILE_ATTRIBUTE_SPARSE_FILE_LE;
+	else
+		fp->fattr &= ~FILE_ATTRIBUTE_SPARSE_FILE_LE;
+
+	if (fp->fattr == old_fattr ||
+	    !get_attr_store_dos(&smb_work->tcon->share->config.attr))
+		return 0;
+
+	rc = smb_store_cont_xattr(&fp->filp->f_path,
+			XATTR_NAME_FILE_ATTRIBUTE, (void *)&fp->fattr,
+			FILE_ATTRIBUTE_LEN);
+	if (rc)
+		cifsd_debug("failed to store file attribute in EA\n");
+
+	return 0;
+}
+
+/**
+ * fsctl_query_allocated_ranges() - list the data extents of a range
+ * @qar_req:	queried range
+ * @input_count: length of queried range
+ * @fp:		open to query
+ * @rsp:	ioctl response, ranges go in its buffer
+ * @out_buf_len: room for ranges in the response
+ * @nbytes:	length of ranges returned
+ *
+ * Return:	0 on success, otherwise error with status set in rsp
+ */
+static int fsctl_query_allocated_ranges(
+		struct file_allocated_range_buffer *qar_req,
+		unsigned int input_count, struct cifsd_file *fp,
+		struct smb2_ioctl_rsp *rsp, int out_buf_len, int *nbytes)
+{
+	struct file_allocated_range_buffer *qar_rsp;
+	int in_count, out_count = 0;
+	int err;
+
+	if (input_count < sizeof(struct file_allocated_range_buffer)) {
+		rsp->hdr.Status = NT_STATUS_INVALID_PARAMETER;
+		return -EINVAL;
+	}
+
+	in_count = out_buf_len / sizeof(struct file_allocated_range_buffer);
+	if (!in_count) {
+		rsp->hdr.Status = NT_STATUS_BUFFER_TOO_SMALL;
+		return -EINVAL;
+	}
+
+	qar_rsp = (struct file_allocated_range_buffer *)&rsp->Buffer[0];
+	err = smb_vfs_fqar_lseek(fp, le64_to_cpu(qar_req->file_offset),
+			le64_to_cpu(qar_req->length), qar_rsp, in_count,
+			&out_count);
+	if (err == -E2BIG) {
+		/* as many ranges as fit, the client asks again from there */
+		rsp->hdr.Status = NT_STATUS_BUFFER_OVERFLOW;
+	} else if (err) {
+		rsp->hdr.Status = err == -EINVAL ?
+			NT_STATUS_INVALID_PARAMETER :
+			NT_STATUS_UNEXPECTED_IO_ERROR;
+		return err;
+	}
+
+	*nbytes = out_count * sizeof(struct file_allocated_range_buffer);
+	return 0;
+}
+
+/**
+ * fsctl_offload_read() - take an offload token on a range of an open
+ * @or_req:	offload read request
+ * @input_count: length of offload read request
+ * @fp:		open to take the token on
+ * @rsp:	ioctl response, offload read response goes in its buffer
+ *
+ * Return:	0 on success, otherwise error with status set in rsp
+ */
+static int fsctl_offload_read(struct offload_read_req *or_req,
+		unsigned int input_count, struct cifsd_file *fp,
+		struct smb2_ioctl_rsp *rsp)
+{
+	struct offload_read_rsp *or_rsp;
+	loff_t off, len, size;
+	unsigned int flags = 0;
+	int err;
+
+	if (input_count < sizeof(struct offload_read_req)) {
+		rsp->hdr.Status = NT_STATUS_INVALID_PARAMETER;
+		return -EINVAL;
+	}
+
+	if (S_ISDIR(FP_INODE(fp)->i_mode) || fp->is_stream) {
+		rsp->hdr.Status = NT_STATUS_OFFLOAD_READ_FILE_NOT_SUPPORTED;
+		return -EOPNOTSUPP;
+	}
+
+	off = le64_to_cpu(or_req->FileOffset);
+	len = le64_to_cpu(or_req->CopyLength);
+	if (off < 0 || len <= 0) {
+		rsp->hdr.Status = NT_STATUS_INVALID_PARAMETER;
+		return -EINVAL;
+	}
+
+	size = i_size_read(FP_INODE(fp));
+	if (off >= size) {
+		rsp->hdr.Status = NT_STATUS_END_OF_FILE;
+		return -EINVAL;
+	}
+
+	if (len > size - off) {
+		len = size - off;
+		flags |= OFFLOAD_READ_FLAG_ALL_ZERO_BEYOND_CURRENT_RANGE;
+	}
+
+	if (check_lock_range(fp, off, off + len - 1, READ)) {
+		rsp->hdr.Status = NT_STATUS_FILE_LOCK_CONFLICT;
+		return -EAGAIN;
+	}
+
+	or_rsp = (struct offload_read_rsp *)&rsp->Buffer[0];
+	memset(or_rsp, 0, sizeof(struct offload_read_rsp));
+	err = cifsd_odx_token_create(fp, off, len,
+			le32_to_cpu(or_req->TokenTimeToLive),
+			or_rsp->Token.TokenId);
+	if (err) {
+		rsp->hdr.Status = NT_STATUS_NO_MEMORY;
+		return err;
+	}
+
+	or_rsp->Size = cpu_to_le32(sizeof(struct offload_read_rsp));
+	or_rsp->Flags = cpu_to_le32(flags);
+	or_rsp->TransferLength = cpu_to_le64(len);
+	or_rsp->Token.TokenType = cpu_to_be32(CIFSD_OFFLOAD_TOKEN_TYPE);
+	or_rsp->Token.TokenIdLength =
+		cpu_to_be16(STORAGE_OFFLOAD_TOKEN_ID_SIZE);
+	return 0;
+}
+
+/**
+ * fsctl_offload_write() - copy the range of an offload token
+ * @smb_work:	smb work containing ioctl command buffer
+ * @ow_req:	offload write request
+ * @input_count: length of offload write request
+ * @fp:		open to write to
+ * @rsp:	ioctl response, offload write response goes in its buffer
+ *
+ * At most CIFSD_MAX_OFFLOAD_WRITE bytes are copied per request, the
+ * client sends the next request for the rest.
+ *
+ * Return:	0 on success, otherwise error with status set in rsp
+ */
+static int fsctl_offload_write(struct smb_work *smb_work,
+		struct offload_write_req *ow_req, unsigned int input_count,
+		struct cifsd_file *fp, struct smb2_ioctl_rsp *rsp)
+{
+	struct offload_write_rsp *ow_rsp;
+	struct storage_offload_token *token = &ow_req->Token;
+	struct file *src;
+	loff_t off, len, xfer_off, src_off, src_len;
+	ssize_t copied;
+
+	if (input_count < sizeof(struct offload_write_req)) {
+		rsp->hdr.Status = NT_STATUS_INVALID_PARAMETER;
+		return -EINVAL;
+	}
+
+	if (S_ISDIR(FP_INODE(fp)->i_mode) || fp->is_stream) {
+		rsp->hdr.Status = NT_STATUS_OFFLOAD_WRITE_FILE_NOT_SUPPORTED;
+		return -EOPNOTSUPP;
+	}
+
+	off = le64_to_cpu(ow_req->FileOffset);
+	len = le64_to_cpu(ow_req->CopyLength);
+	xfer_off = le64_to_cpu(ow_req->TransferOffset);
+	if (off < 0 || len < 0 || xfer_off < 0) {
+		rsp->hdr.Status = NT_STATUS_INVALID_PARAMETER;
+		return -EINVAL;
+	}
+	len = min_t(loff_t, len, CIFSD_MAX_OFFLOAD_WRITE);
+
+	if (be32_to_cpu(token->TokenType) ==
+			STORAGE_OFFLOAD_TOKEN_TYPE_ZERO_DATA) {
+		copied = smb_vfs_zero_data(smb_work->conn, fp, off, len);
+		if (!copied)
+			copied = len;
+		goto done;
+	}
+
+	if (be32_to_cpu(token->TokenType) != CIFSD_OFFLOAD_TOKEN_TYPE ||
+	    be16_to_cpu(token->TokenIdLength) !=
+			STORAGE_OFFLOAD_TOKEN_ID_SIZE) {
+		rsp->hdr.Status = NT_STATUS_INVALID_TOKEN;
+		return -EINVAL;
+	}
+
+	src = cifsd_odx_token_get(token->TokenId, &src_off, &src_len);
+	if (IS_ERR(src)) {
+		rsp->hdr.Status = NT_STATUS_INVALID_TOKEN;
+		return PTR_ERR(src);
+	}
+
+	if (xfer_off >= src_len) {
+		fput(src);
+		rsp->hdr.Status = NT_STATUS_INVALID_PARAMETER;
+		return -EINVAL;
+	}
+
+	copied = smb_vfs_offload_write(smb_work->conn, src,
+			src_off + xfer_off, fp, off,
+			min(len, src_len - xfer_off));
+	fput(src);
+done:
+	if (copied < 0) {
+		rsp->hdr.Status = fsctl_data_err_status(copied);
+		return copied;
+	}
+
+	ow_rsp = (struct offload_write_rsp *)&rsp->Buffer[0];
+	ow_rsp->Size = cpu_to_le32(sizeof(struct offload_write_rsp));
+	ow_rsp->Flags = 0;
+	ow_rsp->LengthWritten = cpu_to_le64(copied);
+	return 0;
+}
+
 /**
  * smb2_ioctl() - handler for smb2 ioctl command
  * @smb_work:	smb work containing ioctl command buffer
@@ -6352,10 +7400,12 @@ int smb2_ioctl(struct smb_work *smb_work)
 	int out_buf_len;
 	char *data_buf;
 	uint64_t id = -1;
+	unsigned int in_off, in_cnt, out_off, out_cnt, avail;
 	int ret = 0;
 	struct connection *conn = smb_work->conn;
 	struct cifsd_uevent *ev;
 	struct cifsd_pipe *pipe_desc;
+	struct cifsd_file *fp;
 
 	req = (struct smb2_ioctl_req *)smb_work->buf;
 	rsp = (struct smb2_ioctl_rsp *)smb_work->rsp_buf;
@@ -6385,7 +7435,31 @@ int smb2_ioctl(struct smb_work *smb_work)
 	cnt_code = le32_to_cpu(req->CntCode);
 	out_buf_len = le32_to_cpu(req->maxoutputresp);
 	out_buf_len = min(NETLINK_CIFSD_MAX_PAYLOAD, out_buf_len);
-	data_buf = (char *)&req->Buffer[0];
+
+	/*
+	 * Input and output buffers must lie within the received request,
+	 * offsets are from the start of the SMB2 header.
+	 */
+	avail = get_rfc1002_length(smb_work->buf) -
+		smb_work->next_smb2_rcv_hdr_off;
+	in_off = le32_to_cpu(req->inputoffset);
+	in_cnt = le32_to_cpu(req->inputcount);
+	out_off = le32_to_cpu(req->outputoffset);
+	out_cnt = le32_to_cpu(req->outputcount);
+	if ((in_cnt && (in_off < offsetof(struct smb2_ioctl_req, Buffer) - 4 ||
+			(u64)in_off + in_cnt > avail)) ||
+	    (out_cnt && (out_off < offsetof(struct smb2_ioctl_req, Buffer) - 4 ||
+			(u64)out_off + out_cnt > avail))) {
+		cifsd_err("invalid ioctl buffer in %u:%u out %u:%u, smb_len %u\n",
+				in_off, in_cnt, out_off, out_cnt, avail);
+		rsp->hdr.Status = NT_STATUS_INVALID_PARAMETER;
+		goto out;
+	}
+
+	if (in_cnt)
+		data_buf = (char *)&req->hdr.ProtocolId + in_off;
+	else
+		data_buf = (char *)&req->Buffer[0];
 
 	switch (cnt_code) {
 	case FSCTL_DFS_GET_REFERRALS:
@@ -6413,7 +7487,7 @@ int smb2_ioctl(struct smb_work *smb_work)
 		break;
 	}
 	case FSCTL_PIPE_TRANSCEIVE:
-		if (rsp->hdr.Id.SyncId.TreeId != 1) {
+		if (!smb_work->tcon->share->is_pipe) {
 			cifsd_debug("Not Pipe transceive\n");
 			goto out;
 		}
@@ -6426,7 +7500,7 @@ int smb2_ioctl(struct smb_work *smb_work)
 
 		ret = cifsd_sendmsg(smb_work->sess, CIFSD_KEVENT_IOCTL_PIPE,
 				pipe_desc->pipe_type,
-				le32_to_cpu(req->inputcount), data_buf,
+				in_cnt, data_buf,
 				out_buf_len);
 		if (ret)
 			cifsd_err("failed to send event, err %d\n", ret);
@@ -6472,7 +7546,15 @@ int smb2_ioctl(struct smb_work *smb_work)
 		start_index = CIFS_PROT;
 #endif
 
-		neg_req = (struct validate_negotiate_info_req *)&req->Buffer[0];
+		neg_req = (struct validate_negotiate_info_req *)data_buf;
+		if (in_cnt < offsetof(struct validate_negotiate_info_req,
+				Dialects) ||
+		    in_cnt < offsetof(struct validate_negotiate_info_req,
+				Dialects) +
+				le16_to_cpu(neg_req->DialectCount) *
+				sizeof(__le16))
+			goto out;
+
 		ret = find_matching_smb2_dialect(start_index, neg_req->Dialects,
 					le16_to_cpu(neg_req->DialectCount));
 		if (ret == BAD_PROT_ID || ret != conn->dialect)
@@ -6499,6 +7581,194 @@ int smb2_ioctl(struct smb_work *smb_work)
 		rsp->VolatileFileId = cpu_to_le64(0xFFFFFFFFFFFFFFFF);
 		break;
 	}
+	case FSCTL_SRV_REQUEST_RESUME_KEY:
+		if (out_buf_len < sizeof(struct resume_key_ioctl_rsp))
+			goto out;
+
+		ret = fsctl_request_resume_key(smb_work, id,
+				le64_to_cpu(req->PersistentFileId),
+				(struct resume_key_ioctl_rsp *)&rsp->Buffer[0]);
+		if (ret) {
+			rsp->hdr.Status = NT_STATUS_FILE_CLOSED;
+			goto out;
+		}
+
+		rsp->PersistentFileId = req->PersistentFileId;
+		rsp->VolatileFileId = cpu_to_le64(id);
+		nbytes = sizeof(struct resume_key_ioctl_rsp);
+		break;
+	case FSCTL_SRV_COPYCHUNK:
+	case FSCTL_SRV_COPYCHUNK_WRITE:
+		if (out_buf_len < sizeof(struct copychunk_ioctl_rsp))
+			goto out;
+
+		ret = fsctl_copychunk(smb_work,
+				(struct copychunk_ioctl_req *)data_buf,
+				in_cnt, cnt_code, id,
+				le64_to_cpu(req->PersistentFileId), rsp);
+		if (ret)
+			goto out;
+
+		rsp->PersistentFileId = req->PersistentFileId;
+		rsp->VolatileFileId = cpu_to_le64(id);
+		nbytes = sizeof(struct copychunk_ioctl_rsp);
+		break;
+	case FSCTL_SET_SPARSE:
+		fp = ioctl_lookup_fp(smb_work, id,
+				le64_to_cpu(req->PersistentFileId));
+		if (!fp) {
+			rsp->hdr.Status = NT_STATUS_FILE_CLOSED;
+			goto out;
+		}
+
+		if (!fp_can_write(fp) &&
+		    !(fp->daccess & FILE_WRITE_ATTRIBUTES_LE)) {
+			fp_put(fp);
+			rsp->hdr.Status = NT_STATUS_ACCESS_DENIED;
+			goto out;
+		}
+
+		ret = fsctl_set_sparse(smb_work,
+				(struct file_sparse *)data_buf,
+				in_cnt, fp);
+		fp_put(fp);
+		if (ret)
+			goto out;
+
+		rsp->PersistentFileId = req->PersistentFileId;
+		rsp->VolatileFileId = cpu_to_le64(id);
+		break;
+	case FSCTL_SET_ZERO_DATA:
+	{
+		struct file_zero_data_information *zero_data;
+		loff_t off, bfz;
+
+		if (in_cnt <
+				sizeof(struct file_zero_data_information))
+			goto out;
+
+		zero_data = (struct file_zero_data_information *)data_buf;
+		off = le64_to_cpu(zero_data->FileOffset);
+		bfz = le64_to_cpu(zero_data->BeyondFinalZero);
+		if (off < 0 || bfz < off)
+			goto out;
+
+		fp = ioctl_lookup_fp(smb_work, id,
+				le64_to_cpu(req->PersistentFileId));
+		if (!fp) {
+			rsp->hdr.Status = NT_STATUS_FILE_CLOSED;
+			goto out;
+		}
+
+		if (!fp_can_write(fp)) {
+			fp_put(fp);
+			rsp->hdr.Status = NT_STATUS_ACCESS_DENIED;
+			goto out;
+		}
+
+		ret = smb_vfs_zero_data(conn, fp, off, bfz - off);
+		fp_put(fp);
+		if (ret) {
+			rsp->hdr.Status = fsctl_data_err_status(ret);
+			goto out;
+		}
+
+		rsp->PersistentFileId = req->PersistentFileId;
+		rsp->VolatileFileId = cpu_to_le64(id);
+		break;
+	}
+	case FSCTL_QUERY_ALLOCATED_RANGES:
+		fp = ioctl_lookup_fp(smb_work, id,
+				le64_to_cpu(req->PersistentFileId));
+		if (!fp) {
+			rsp->hdr.Status = NT_STATUS_FILE_CLOSED;
+			goto out;
+		}
+
+		if (!fp_can_read(fp)) {
+			fp_put(fp);
+			rsp->hdr.Status = NT_STATUS_ACCESS_DENIED;
+			goto out;
+		}
+
+		ret = fsctl_query_allocated_ranges(
+				(struct file_allocated_range_buffer *)
+				data_buf, in_cnt,
+				fp, rsp, out_buf_len, &nbytes);
+		fp_put(fp);
+		if (ret)
+			goto out;
+
+		rsp->PersistentFileId = req->PersistentFileId;
+		rsp->VolatileFileId = cpu_to_le64(id);
+		break;
+	case FSCTL_OFFLOAD_READ:
+		if (out_buf_len < sizeof(struct offload_read_rsp))
+			goto out;
+
+		fp = ioctl_lookup_fp(smb_work, id,
+				le64_to_cpu(req->PersistentFileId));
+		if (!fp) {
+			rsp->hdr.Status = NT_STATUS_FILE_CLOSED;
+			goto out;
+		}
+
+		if (!fp_can_read(fp)) {
+			fp_put(fp);
+			rsp->hdr.Status = NT_STATUS_ACCESS_DENIED;
+			goto out;
+		}
+
+		ret = fsctl_offload_read(
+				(struct offload_read_req *)data_buf,
+				in_cnt, fp, rsp);
+		fp_put(fp);
+		if (ret)
+			goto out;
+
+		rsp->PersistentFileId = req->PersistentFileId;
+		rsp->VolatileFileId = cpu_to_le64(id);
+		nbytes = sizeof(struct offload_read_rsp);
+		break;
+	case FSCTL_OFFLOAD_WRITE:
+		if (out_buf_len < sizeof(struct offload_write_rsp))
+			goto out;
+
+		fp = ioctl_lookup_fp(smb_work, id,
+				le64_to_cpu(req->PersistentFileId));
+		if (!fp) {
+			rsp->hdr.Status = NT_STATUS_FILE_CLOSED;
+			goto out;
+		}
+
+		if (!fp_can_write(fp)) {
+			fp_put(fp);
+			rsp->hdr.Status = NT_STATUS_ACCESS_DENIED;
+			goto out;
+		}
+
+		ret = fsctl_offload_write(smb_work,
+				(struct offload_write_req *)data_buf,
+				in_cnt, fp, rsp);
+		fp_put(fp);
+		if (ret)
+			goto out;
+
+		rsp->PersistentFileId = req->PersistentFileId;
+		rsp->VolatileFileId = cpu_to_le64(id);
+		nbytes = sizeof(struct offload_write_rsp);
+		break;
+	case FSCTL_DUPLICATE_EXTENTS_TO_FILE:
+		ret = fsctl_duplicate_extents(smb_work,
+				(struct duplicate_extents_to_file *)
+				data_buf, in_cnt,
+				id, le64_to_cpu(req->PersistentFileId), rsp);
+		if (ret)
+			goto out;
+
+		rsp->PersistentFileId = req->PersistentFileId;
+		rsp->VolatileFileId = cpu_to_le64(id);
+		break;
 	case FSCTL_QUERY_NETWORK_INTERFACE_INFO:
 	{
 		struct network_interface_info_ioctl_rsp *nii_rsp = NULL;
@@ -6646,8 +7916,11 @@ int smb2_ioctl(struct smb_work *smb_work)
 			struct channel *chann;
 
 			chann = lookup_chann_list(smb_work->sess);
-			ret = conn->ops->compute_signingkey(smb_work->sess,
-				chann->smb3signingkey, SMB3_SIGN_KEY_SIZE);
+			ret = conn->ops->compute_signingkey(conn,
+				smb_work->sess, chann->smb3signingkey,
+				SMB3_SIGN_KEY_SIZE);
+			if (!ret)
+				ret = smb3_init_sign_tfm(chann);
 			if (ret)
 				cifsd_err("SMB3 sesskey generation failed\n");
 			else
@@ -6990,22 +8263,6 @@ err_out:
 }
 
 #ifdef CONFIG_SMB2_NOTIFY_SUPPORT
-static unsigned int convert_inotify_mask(unsigned int mode)
-{
-	unsigned int mask = 0;
-
-	if (mode & FILE_NOTIFY_CHANGE_NAME)
-		mask |= IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO;
-	if (mode & FILE_NOTIFY_CHANGE_ATTRIBUTES)
-		mask |= IN_ATTRIB | IN_MOVED_TO | IN_MOVED_FROM | IN_MODIFY;
-	if (mode & (FILE_NOTIFY_CHANGE_LAST_WRITE |
-		FILE_NOTIFY_CHANGE_LAST_ACCESS | FILE_NOTIFY_CHANGE_EA |
-		FILE_NOTIFY_CHANGE_SECURITY))
-		mask |= IN_ATTRIB;
-
-	return mask;
-}
-
 /**
  * smb2_notify() - handler for smb2 notify request
  * @smb_work:	smb work containing notify command buffer
@@ -7015,23 +8272,14 @@ static unsigned int convert_inotify_mask(unsigned int mode)
 int smb2_notify(struct smb_work *smb_work)
 {
 	struct smb2_notify_req *req;
-	struct smb2_notify_rsp *rsp, *rsp_org;
-	struct notification *notify_req;
-	struct cifsd_file *fp, *prev_fp;
-	struct inotify_event *event;
-	struct notification *request;
-	struct FileNotifyInformation *out_buf = NULL;
-	struct smb_work *work;
-	int fd, offset = 0, wd, byte, count = 1024, i = 0;
-	int filename_len, total_len, out_len;
-	int err = 0;
-	u32 mask;
-	char *p, *pbuf, *buf;
-	mm_segment_t cur_fs = get_fs();
+	struct smb2_notify_rsp *rsp;
+	struct cifsd_file *fp;
+	unsigned int filter;
+	bool tree;
+	int err;
 
 	req = (struct smb2_notify_req *)smb_work->buf;
 	rsp = (struct smb2_notify_rsp *)smb_work->rsp_buf;
-	rsp_org = rsp;
 
 	if (smb_work->next_smb2_rcv_hdr_off) {
 		req = (struct smb2_notify_req *)((char *)req +
@@ -7056,10 +8304,10 @@ int smb2_notify(struct smb_work *smb_work)
 	fp = get_id_from_fidtable(smb_work->sess,
 			le64_to_cpu(req->VolatileFileId));
 	if (!fp) {
-		cifsd_err("Invalid file id for lock : %llu\n",
+		cifsd_err("Invalid file id for notify : %llu\n",
 				le64_to_cpu(req->VolatileFileId));
 		rsp->hdr.Status = NT_STATUS_FILE_CLOSED;
-		goto out3;
+		goto out;
 	}
 
 	if (fp->is_durable && fp->persistent_id !=
@@ -7067,190 +8315,38 @@ int smb2_notify(struct smb_work *smb_work)
 		cifsd_err("persistent id mismatch : %llu, %llu\n",
 				fp->persistent_id, req->PersistentFileId);
 		rsp->hdr.Status = NT_STATUS_FILE_CLOSED;
-		goto out3;
+		goto out;
 	}
 
-	pbuf = kzalloc(PATH_MAX, GFP_KERNEL);
-	if (!pbuf)
-		goto out3;
-
-	p = d_path(&(fp->filp->f_path), pbuf, PATH_MAX);
-	if (IS_ERR(p)) {
-		kfree(pbuf);
-		goto out3;
+	if (!S_ISDIR(FP_INODE(fp)->i_mode)) {
+		rsp->hdr.Status = NT_STATUS_INVALID_PARAMETER;
+		goto out;
 	}
 
-	notify_req = kmalloc(sizeof(struct notification), GFP_KERNEL);
-	if (!notify_req)
-		goto out3;
-
-	notify_req->mode = le32_to_cpu(req->CompletionFileter);
-	cifsd_debug("CompletionFileter : 0x%x\n", notify_req->mode);
+	filter = le32_to_cpu(req->CompletionFileter);
+	tree = le16_to_cpu(req->Flags) & SMB2_WATCH_TREE;
+	cifsd_debug("CompletionFileter : 0x%x\n", filter);
 
-	notify_req->work = smb_work;
-
-	hash_for_each_possible(smb_work->sess->notify_table, prev_fp, node,
-		(unsigned long)GET_FP_INODE(fp)) {
-		if (GET_FP_INODE(fp) == GET_FP_INODE(prev_fp)) {
-			list_add_tail(&notify_req->queuelist, &prev_fp->queue);
-			goto out2;
-		}
+	err = cifsd_notify_request(smb_work, fp, rsp, filter, tree,
+			le32_to_cpu(req->OutputBufferLength));
+	if (err == -EINPROGRESS)
+		return 0;
+	if (!err) {
+		fp_put(fp);
+		return 0;
 	}
 
-	INIT_LIST_HEAD(&fp->queue);
-	list_add_tail(&notify_req->queuelist, &fp->queue);
-
-	fd = sys_inotify_init();
-
-start:
-	while (!list_empty(&fp->queue)) {
-		request = list_first_entry_or_null(&fp->queue,
-			struct notification, queuelist);
-		if (!request)
-			continue;
-		list_del_init(&request->queuelist);
-
-		work = request->work;
-
-		req = (struct smb2_notify_req *)work->buf;
-		rsp = (struct smb2_notify_rsp *)work->rsp_buf;
-		rsp_org = rsp;
-
-		out_len = le32_to_cpu(req->OutputBufferLength);
-
-		mask = convert_inotify_mask(request->mode);
-		if (!mask) {
-			list_add_tail(&request->queuelist, &fp->queue);
-			continue;
-		}
-
-		kfree(request);
-
-		set_fs(get_ds());
-		wd = sys_inotify_add_watch(fd, (__force char __user *)p, mask);
-		set_fs(cur_fs);
-
-		spin_lock(&work->conn->request_lock);
-		if (work->async->async_status == ASYNC_CANCEL) {
-			spin_unlock(&work->conn->request_lock);
-			sys_inotify_rm_watch(fd, wd);
-			continue;
-		}
-
-		work->async->async_status = ASYNC_PROG;
-
-		work->async->fd = fd;
-		work->async->wd = wd;
-		spin_unlock(&work->conn->request_lock);
-
-		buf = kmalloc(1024 * (sizeof(struct inotify_event) + 16),
-			GFP_KERNEL);
-		if (!buf)
-			break;
-
-		rsp->hdr.Flags |= SMB2_FLAGS_ASYNC_COMMAND;
-		rsp->hdr.Id.AsyncId = cpu_to_le64(work->async->async_id);
-
-		/* Send interim Response to inform asynchronous request */
-		cifsd_debug("Send interim Response to inform asynchronous request id : %lld\n",
-			work->async->async_id);
-		smb2_set_err_rsp(work);
-		rsp->hdr.Status = NT_STATUS_PENDING;
-		work->multiRsp = 1;
-		smb_send_rsp(work);
-		work->multiRsp = 0;
-
-		cifsd_debug("watching filename : %s, mask : 0x%x\n", p, mask);
-		set_fs(get_ds());
-		byte = sys_read(fd, (__force char __user *)buf, count);
-		set_fs(cur_fs);
-		if (byte < 0) {
-			cifsd_err("event read failed : %d\n", byte);
-			sys_inotify_rm_watch(fd, wd);
-			continue;
-		}
-
-		i = 0;
-		total_len = 0;
-		while (i < byte) {
-			if (i >= out_len) {
-				cifsd_err("buffer length(%d) is greater than output's one (%d) of request\n",
-					i, out_len);
-				rsp->hdr.Status = NT_STATUS_NOTIFY_ENUM_DIR;
-				goto out;
-			}
-
-			out_buf = (struct FileNotifyInformation *)
-				&rsp->Buffer[offset];
-			event = (struct inotify_event *) &buf[i];
-			cifsd_debug("event->mask : 0x%x, event length : %d\n",
-				event->mask, event->len);
-
-			if (event->mask & (IN_IGNORED | IN_UNMOUNT |
-					IN_Q_OVERFLOW) || !event->len) {
-				rsp->hdr.Status = NT_STATUS_CANCELLED;
-				smb2_set_err_rsp(work);
-				smb_send_rsp(work);
-				remove_async_id(work->async->async_id);
-				goto start;
-			}
-
-			if (event->mask & IN_CREATE) {
-				cifsd_err("get file creation event\n");
-				out_buf->Action = FILE_ACTION_ADDED;
-			} else if (event->mask & (IN_DELETE | IN_DELETE_SELF)) {
-				cifsd_err("get file deletion event\n");
-				out_buf->Action = FILE_ACTION_REMOVED;
-			} else if (event->mask & (IN_ATTRIB | IN_MODIFY)) {
-				cifsd_err("get file modification event\n");
-				out_buf->Action = FILE_ACTION_MODIFIED;
-			} else if (event->mask & IN_MOVED_FROM) {
-				cifsd_err("get file rename(from old) event\n");
-				out_buf->Action = FILE_ACTION_RENAMED_OLD_NAME;
-			} else if (event->mask & IN_MOVED_TO) {
-				cifsd_err("get file rename(to new) event\n");
-				out_buf->Action = FILE_ACTION_RENAMED_NEW_NAME;
-			}
-			/* TODO : add named stream notify */
-
-			i += sizeof(struct inotify_event) + event->len;
-			filename_len =
-				smbConvertToUTF16((__le16 *)out_buf->FileName,
-				event->name, event->len,
-				work->sess->conn->local_nls, 0);
-			filename_len *= 2;
-			out_buf->FileNameLength = cpu_to_le32(filename_len);
-			offset = 12 + filename_len;
-			total_len += offset;
-			out_buf->NextEntryOffset = cpu_to_le32(offset);
-		}
-
-		out_buf->NextEntryOffset = 0;
-
-		rsp->hdr.Status = NT_STATUS_OK;
-		rsp->StructureSize = cpu_to_le16(9);
-		rsp->OutputBufferOffset = cpu_to_le16(72);
-		rsp->OutputBufferLength = cpu_to_le32(total_len);
-		inc_rfc1001_len(rsp_org, 8 + total_len);
+	if (err == -EBADF)
+		rsp->hdr.Status = NT_STATUS_FILE_CLOSED;
+	else if (err == -ENOMEM)
+		rsp->hdr.Status = NT_STATUS_NO_MEMORY;
 
 out:
-		smb_send_rsp(work);
-		remove_async_id(work->async->async_id);
-		sys_inotify_rm_watch(fd, wd);
-	}
-
-	kfree(pbuf);
-out2:
-	smb_work->send_no_response = 1;
-	fp_put(fp);
-	return 0;
-
-out3:
 	if (rsp->hdr.Status == 0)
 		rsp->hdr.Status = NT_STATUS_NOT_SUPPORTED;
 	smb2_set_err_rsp(smb_work);
 	fp_put(fp);
-	return err;
+	return 0;
 }
 
 #else
@@ -7490,32 +8586,172 @@ void smb3_set_sign_rsp(struct smb_work *work)
 		memcpy(hdr->Signature, signature, SMB2_SIGNATURE_SIZE);
 }
 
+/**
+ * smb3_decrypt_req() - decrypt a transform message in place
+ * @work:	smb work containing the transform message
+ *
+ * On success work->buf is moved past the transform header, onto the
+ * RFC1001 length rewritten for the decrypted request.
+ *
+ * Return:	0 on success, otherwise error
+ */
+int smb3_decrypt_req(struct smb_work *work)
+{
+	struct connection *conn = work->conn;
+	struct smb2_transform_hdr *tr_hdr =
+		(struct smb2_transform_hdr *)work->buf;
+	unsigned int pdu_length = get_rfc1002_length(work->buf);
+	unsigned int buf_data_size;
+	struct cifsd_sess *sess;
+	struct kvec iov;
+	char *buf;
+	int rc;
+
+	if (pdu_length + 4 <
+	    sizeof(struct smb2_transform_hdr) + sizeof(struct smb2_hdr) - 4) {
+		cifsd_err("Transform message is too small (%u)\n",
+				pdu_length);
+		return -EINVAL;
+	}
+
+	buf_data_size = pdu_length + 4 - sizeof(struct smb2_transform_hdr);
+	if (le32_to_cpu(tr_hdr->OriginalMessageSize) != buf_data_size) {
+		cifsd_err("Transform message size mismatch (%u, %u)\n",
+				le32_to_cpu(tr_hdr->OriginalMessageSize),
+				buf_data_size);
+		return -EINVAL;
+	}
+
+	/* EncryptionAlgorithm before SMB 3.1.1, AES-128-CCM has the same value */
+	if (tr_hdr->Flags != SMB2_TRANSFORM_FLAG_ENCRYPTED) {
+		cifsd_err("Transform message flags 0x%x not supported\n",
+				le16_to_cpu(tr_hdr->Flags));
+		return -EINVAL;
+	}
+
+	work->tr_sess_id = le64_to_cpu(tr_hdr->SessionId);
+	sess = lookup_session_on_server(conn, work->tr_sess_id);
+	if (!sess || !sess->dec_tfm) {
+		cifsd_err("No session to decrypt for id %llu\n",
+				work->tr_sess_id);
+		if (sess)
+			cifsd_sess_put(sess);
+		return -EINVAL;
+	}
+
+	buf = work->buf + sizeof(struct smb2_transform_hdr);
+	iov.iov_base = buf;
+	iov.iov_len = buf_data_size;
+	rc = cifsd_crypt_message(sess, tr_hdr, &iov, 1, false);
+	cifsd_sess_put(sess);
+	if (rc)
+		return rc;
+
+	if (*(__le32 *)((struct smb2_hdr *)(buf - 4))->ProtocolId !=
+			SMB2_PROTO_NUMBER) {
+		cifsd_err("Decrypted message is not SMB2\n");
+		return -EINVAL;
+	}
+
+	/* the RFC1001 length goes over the end of the transform header */
+	work->transform_off = sizeof(struct smb2_transform_hdr) - 4;
+	work->buf += work->transform_off;
+	*(__be32 *)work->buf = cpu_to_be32(buf_data_size);
+	work->encrypted = true;
+	return 0;
+}
+
+/**
+ * smb3_encrypt_resp() - encrypt a response in place
+ * @work:	smb work containing the response
+ *
+ * The transform header is returned in work->tr_buf, sent ahead of the
+ * encrypted response from its ProtocolId on.
+ *
+ * Return:	0 on success, otherwise error
+ */
+int smb3_encrypt_resp(struct smb_work *work)
+{
+	struct connection *conn = work->conn;
+	struct smb2_hdr *rsp_hdr = (struct smb2_hdr *)work->rsp_buf;
+	unsigned int len = get_rfc1002_length(rsp_hdr);
+	struct smb2_transform_hdr *tr_hdr;
+	struct cifsd_sess *sess;
+	struct kvec iov[2];
+	int n_vec = 1;
+	int rc;
+
+	sess = work->sess;
+	if (sess)
+		atomic_inc(&sess->refcnt);
+	else
+		sess = lookup_session_on_server(conn, work->tr_sess_id);
+	if (!sess)
+		return -EINVAL;
+	if (!sess->enc_tfm) {
+		rc = -EINVAL;
+		goto out;
+	}
+
+	tr_hdr = kzalloc(sizeof(struct smb2_transform_hdr), GFP_KERNEL);
+	if (!tr_hdr) {
+		rc = -ENOMEM;
+		goto out;
+	}
+
+	tr_hdr->smb2_buf_length = cpu_to_be32(len +
+			sizeof(struct smb2_transform_hdr) - 4);
+	*(__le32 *)tr_hdr->ProtocolId = SMB2_TRANSFORM_PROTO_NUM;
+	if (conn->CipherId == SMB2_ENCRYPTION_AES128_GCM ||
+	    conn->CipherId == SMB2_ENCRYPTION_AES256_GCM)
+		get_random_bytes(tr_hdr->Nonce, SMB3_AES_GCM_NONCE);
+	else
+		get_random_bytes(tr_hdr->Nonce, SMB3_AES_CCM_NONCE);
+	tr_hdr->OriginalMessageSize = cpu_to_le32(len);
+	tr_hdr->Flags = SMB2_TRANSFORM_FLAG_ENCRYPTED;
+	tr_hdr->SessionId = cpu_to_le64(sess->sess_id);
+
+	iov[0].iov_base = rsp_hdr->ProtocolId;
+	iov[0].iov_len = len;
+	if (work->rdata_buf) {
+		iov[0].iov_len = work->rrsp_hdr_size - 4;
+		iov[1].iov_base = work->rdata_buf;
+		iov[1].iov_len = work->rdata_cnt;
+		n_vec++;
+	}
+
+	rc = cifsd_crypt_message(sess, tr_hdr, iov, n_vec, true);
+	if (rc) {
+		kfree(tr_hdr);
+		goto out;
+	}
+
+	work->tr_buf = (char *)tr_hdr;
+out:
+	cifsd_sess_put(sess);
+	return rc;
+}
+
 /**
  * smb3_preauth_hash_rsp() - handler for computing preauth hash on response
  * @work:   smb work containing response buffer
  *
+ * Only called for responses that negotiate or session setup asked to be
+ * hashed, through smb_work->preauth_hash.
  */
 void smb3_preauth_hash_rsp(struct smb_work *smb_work)
 {
-	struct connection *conn = smb_work->conn;
-	struct cifsd_sess *sess = smb_work->sess;
-	struct smb2_hdr *req = (struct smb2_hdr *)smb_work->buf;
-	struct smb2_hdr *rsp = (struct smb2_hdr *)smb_work->rsp_buf;
+	char *rsp = smb_work->rsp_buf;
 
-	if (smb_work->next_smb2_rcv_hdr_off) {
-		req = (struct smb2_hdr *)((char *)req +
-				smb_work->next_smb2_rcv_hdr_off);
-		rsp = (struct smb2_hdr *)((char *)rsp +
-				smb_work->next_smb2_rsp_hdr_off);
-	}
+	if (smb_work->next_smb2_rcv_hdr_off)
+		rsp += smb_work->next_smb2_rsp_hdr_off;
 
-	if (le16_to_cpu(req->Command) == SMB2_NEGOTIATE_HE)
-		calc_preauth_integrity_hash(conn, (char *)rsp,
-			conn->Preauth_HashValue);
+	calc_preauth_integrity_hash(smb_work->conn, rsp,
+		smb_work->preauth_hash);
+	smb_work->preauth_hash = NULL;
 
-	if (le16_to_cpu(rsp->Command) == SMB2_SESSION_SETUP_HE) {
-		if (rsp->Status == NT_STATUS_MORE_PROCESSING_REQUIRED)
-			calc_preauth_integrity_hash(conn, (char *)rsp,
-					sess->Preauth_HashValue);
+	if (smb_work->preauth_sess) {
+		put_preauth_session(smb_work->preauth_sess);
+		smb_work->preauth_sess = NULL;
 	}
 }
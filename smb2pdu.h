@@ -94,6 +94,7 @@
 #define MAX_SMB2_HDR_SIZE 0x78 /* 4 len + 64 hdr + (2*24 wct) + 2 bct + 2 pad */
 
 #define SMB2_PROTO_NUMBER __constant_cpu_to_le32(0x424d53fe) /* 'B''M''S' */
+#define SMB2_TRANSFORM_PROTO_NUM __constant_cpu_to_le32(0x424d53fd)
 
 #define STATUS_NO_MORE_FILES __constant_cpu_to_le32(0x80000006)
 #define STATUS_OBJECT_NAME_NOT_FOUND __constant_cpu_to_le32(0xC0000034)
@@ -108,6 +109,25 @@
 
 #define SMB2_HEADER_STRUCTURE_SIZE __constant_cpu_to_le16(64)
 
+#define SMB2_TRANSFORM_FLAG_ENCRYPTED	cpu_to_le16(0x0001)
+
+/* nonce bytes used by the ciphers, out of the 16 byte Nonce field */
+#define SMB3_AES_CCM_NONCE	11
+#define SMB3_AES_GCM_NONCE	12
+/* transform header fields from Nonce on are authenticated */
+#define SMB2_TRANSFORM_AAD_SIZE	32
+
+struct smb2_transform_hdr {
+	__be32 smb2_buf_length;	/* big endian on wire */
+	__u8   ProtocolId[4];	/* 0xFD 'S' 'M' 'B' */
+	__u8   Signature[16];
+	__u8   Nonce[16];
+	__le32 OriginalMessageSize;
+	__u16  Reserved1;
+	__le16 Flags; /* EncryptionAlgorithm before SMB 3.1.1 */
+	__le64 SessionId;
+} __packed;
+
 struct smb2_hdr {
 	__be32 smb2_buf_length;	/* big endian on wire */
 				/* length is only two or three bytes - with
@@ -212,6 +232,8 @@ struct smb2_preauth_neg_context {
 /* Encryption Algorithms Ciphers */
 #define SMB2_ENCRYPTION_AES128_CCM	cpu_to_le16(0x0001)
 #define SMB2_ENCRYPTION_AES128_GCM	cpu_to_le16(0x0002)
+#define SMB2_ENCRYPTION_AES256_CCM	cpu_to_le16(0x0003)
+#define SMB2_ENCRYPTION_AES256_GCM	cpu_to_le16(0x0004)
 
 struct smb2_encryption_neg_context {
 	__le16	ContextType; /* 2 */
@@ -221,6 +243,19 @@ struct smb2_encryption_neg_context {
 	__le16	Ciphers[2]; /* Ciphers[0] since only one used now */
 } __packed;
 
+/* Signing Algorithms */
+#define SMB2_SIGNING_HMAC_SHA256	cpu_to_le16(0x0000)
+#define SMB2_SIGNING_AES_CMAC		cpu_to_le16(0x0001)
+#define SMB2_SIGNING_AES_GMAC		cpu_to_le16(0x0002)
+
+struct smb2_signing_neg_context {
+	__le16	ContextType; /* 8 */
+	__le16	DataLength;
+	__le32	Reserved;
+	__le16	SigningAlgorithmCount;
+	__le16	SigningAlgorithms[1]; /* only one used in response */
+} __packed;
+
 struct smb2_negotiate_rsp {
 	struct smb2_hdr hdr;
 	__le16 StructureSize;	/* Must be 65 */
@@ -605,7 +640,7 @@ struct smb2_read_req {
 	struct smb2_hdr hdr;
 	__le16 StructureSize; /* Must be 49 */
 	__u8   Padding; /* offset from start of SMB2 header to place read */
-	__u8   Reserved;
+	__u8   Flags; /* MBZ before SMB 3.0.2 */
 	__le32 Length;
 	__le64 Offset;
 	__u64  PersistentFileId; /* opaque endianness */
@@ -629,8 +664,12 @@ struct smb2_read_rsp {
 	__u8   Buffer[1];
 } __packed;
 
+/* For read request Flags field below the following flag is defined: */
+#define SMB2_READFLAG_READ_UNBUFFERED	0x01
+
 /* For write request Flags field below the following flag is defined: */
 #define SMB2_WRITEFLAG_WRITE_THROUGH 0x00000001
+#define SMB2_WRITEFLAG_WRITE_UNBUFFERED 0x00000002
 
 struct smb2_write_req {
 	struct smb2_hdr hdr;
@@ -751,6 +790,104 @@ struct file_object_buf_type1_ioctl_rsp {
 	__u8 DomainId[16];
 } __packed;
 
+/* server side copy limits, see MS-SMB2 3.3.3 */
+#define CIFSD_MAX_COPYCHUNK_COUNT	256
+#define CIFSD_MAX_COPYCHUNK_SIZE	(1024 * 1024)
+#define CIFSD_MAX_COPYCHUNK_TOTAL	(16 * 1024 * 1024)
+
+/* largest range copied by one FSCTL_OFFLOAD_WRITE */
+#define CIFSD_MAX_OFFLOAD_WRITE		(64 * 1024 * 1024)
+
+#define COPY_CHUNK_RES_KEY_SIZE	24
+
+struct resume_key_ioctl_rsp {
+	__u64 ResumeKey[3]; /* opaque, volatile and persistent id of open */
+	__le32 ContextLength; /* MBZ */
+	__u8 Context[4]; /* ignored, Windows sets to 4 bytes of zero */
+} __packed;
+
+struct srv_copychunk {
+	__le64 SourceOffset;
+	__le64 TargetOffset;
+	__le32 Length;
+	__le32 Reserved;
+} __packed;
+
+struct copychunk_ioctl_req {
+	__u64 ResumeKey[3];
+	__le32 ChunkCount;
+	__le32 Reserved;
+	struct srv_copychunk Chunks[1];
+} __packed;
+
+struct copychunk_ioctl_rsp {
+	__le32 ChunksWritten;
+	__le32 ChunkBytesWritten;
+	__le32 TotalBytesWritten;
+} __packed;
+
+/* offload data transfer, see MS-FSCC 2.3.41 - 2.3.44 */
+#define STORAGE_OFFLOAD_TOKEN_SIZE		512
+#define STORAGE_OFFLOAD_TOKEN_ID_SIZE		504
+#define STORAGE_OFFLOAD_TOKEN_TYPE_ZERO_DATA	0xFFFF0001
+#define CIFSD_OFFLOAD_TOKEN_TYPE		0x43494644 /* "CIFD" */
+#define OFFLOAD_READ_FLAG_ALL_ZERO_BEYOND_CURRENT_RANGE	0x00000001
+
+struct storage_offload_token {
+	__be32 TokenType;
+	__u8 Reserved[2];
+	__be16 TokenIdLength;
+	__u8 TokenId[STORAGE_OFFLOAD_TOKEN_ID_SIZE];
+} __packed;
+
+struct offload_read_req {
+	__le32 Size;
+	__le32 Flags;
+	__le32 TokenTimeToLive; /* in milliseconds */
+	__le32 Reserved;
+	__le64 FileOffset;
+	__le64 CopyLength;
+} __packed;
+
+struct offload_read_rsp {
+	__le32 Size;
+	__le32 Flags;
+	__le64 TransferLength;
+	struct storage_offload_token Token;
+} __packed;
+
+struct offload_write_req {
+	__le32 Size;
+	__le32 Flags;
+	__le64 FileOffset;
+	__le64 CopyLength;
+	__le64 TransferOffset;
+	struct storage_offload_token Token;
+} __packed;
+
+struct offload_write_rsp {
+	__le32 Size;
+	__le32 Flags;
+	__le64 LengthWritten;
+} __packed;
+
+struct file_zero_data_information {
+	__le64 FileOffset;
+	__le64 BeyondFinalZero;
+} __packed;
+
+struct file_sparse {
+	__u8 SetSparse; /* optional, TRUE if no buffer */
+} __packed;
+
+struct duplicate_extents_to_file {
+	__u64 PersistentFileHandle; /* source file handle, opaque endianness */
+	__u64 VolatileFileHandle;
+	__le64 SourceFileOffset;
+	__le64 TargetFileOffset;
+	__le64 ByteCount;  /* Bytes to be copied */
+} __packed;
+
 /* Completion Filter flags for Notify */
 #define FILE_NOTIFY_CHANGE_FILE_NAME	0x00000001
 #define FILE_NOTIFY_CHANGE_DIR_NAME	0x00000002
@@ -777,6 +914,9 @@ struct smb2_notify_req {
 	__u32 Reserved;
 } __packed;
 
+/* SMB2 Notify Flags */
+#define SMB2_WATCH_TREE			0x0001
+
 struct smb2_notify_rsp {
 	struct smb2_hdr hdr;
 	__le16 StructureSize; /* Must be 9 */
@@ -1306,6 +1446,8 @@ extern int smb2_check_sign_req(struct smb_work *work);
 extern void smb2_set_sign_rsp(struct smb_work *work);
 extern int smb3_check_sign_req(struct smb_work *work);
 extern void smb3_set_sign_rsp(struct smb_work *work);
+extern int smb3_decrypt_req(struct smb_work *work);
+extern int smb3_encrypt_resp(struct smb_work *work);
 extern int find_matching_smb2_dialect(int start_index, __le16 *cli_dialects,
 	__le16 dialects_count);
 extern struct file_lock *smb_flock_init(struct file *f);
@@ -1334,6 +1476,11 @@ extern int smb2_lock(struct smb_work *smb_work);
 extern int smb2_ioctl(struct smb_work *smb_work);
 extern int smb2_oplock_break(struct smb_work *smb_work);
 extern int smb2_notify(struct smb_work *smb_work);
+#ifdef CONFIG_SMB2_NOTIFY_SUPPORT
+extern int cifsd_notify_request(struct smb_work *smb_work,
+		struct cifsd_file *fp, struct smb2_notify_rsp *rsp,
+		unsigned int filter, bool tree, unsigned int out_len);
+#endif
 
 /* smb2 sub command handlers */
 extern int smb2_get_info_filesystem(struct smb_work *smb_work);
@@ -77,6 +77,9 @@
 #define FSCTL_SET_SHORT_NAME_BEHAVIOR 0x000901B4 /* BB add struct */
 #define FSCTL_QUERY_ALLOCATED_RANGES 0x000940CF /* BB add struct */
 #define FSCTL_SET_DEFECT_MANAGEMENT  0x00098134 /* BB add struct */
+#define FSCTL_DUPLICATE_EXTENTS_TO_FILE 0x00098344
+#define FSCTL_OFFLOAD_READ           0x00094264
+#define FSCTL_OFFLOAD_WRITE          0x00098268
 #define FSCTL_SIS_LINK_FILES         0x0009C104
 #define FSCTL_PIPE_PEEK              0x0011400C /* BB add struct */
 #define FSCTL_PIPE_TRANSCEIVE        0x0011C017 /* BB add struct */
@@ -84,6 +87,9 @@
 #define FSCTL_PIPE_WAIT              0x00110018 /* BB add struct */
 #define FSCTL_LMR_GET_LINK_TRACK_INF 0x001400E8 /* BB add struct */
 #define FSCTL_LMR_SET_LINK_TRACK_INF 0x001400EC /* BB add struct */
+#define FSCTL_SRV_REQUEST_RESUME_KEY 0x00140078
+#define FSCTL_SRV_COPYCHUNK          0x001440F2
+#define FSCTL_SRV_COPYCHUNK_WRITE    0x001480F2
 #define FSCTL_VALIDATE_NEGOTIATE_INFO 0x00140204
 #define FSCTL_QUERY_NETWORK_INTERFACE_INFO 0x001401FC
 
@@ -0,0 +1,457 @@
+/*
+ *   fs/cifsd/splitcrypt.c
+ *
+ *   Copyright (C) 2016 Namjae Jeon <namjae.jeon@protocolfreedom.org>
+ *
+ *   This program is free software; you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation; either version 2 of the License, or
+ *   (at your option) any later version.
+ *
+ *   This program is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with this program; if not, write to the Free Software
+ *   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA  02111-1307 USA
+ */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/cpumask.h>
+#include <linux/completion.h>
+#include <linux/workqueue.h>
+#include <asm/unaligned.h>
+
+#include "glob.h"
+#include "export.h"
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 13, 0)
+#include <crypto/aes.h>
+#include <crypto/algapi.h>
+#include <crypto/gf128mul.h>
+#include <crypto/skcipher.h>
+
+/*
+ * Split AES-GCM
+ *
+ * One AEAD request runs on one CPU, so a large encrypted read or write
+ * goes no faster than AES-GCM on a single core. GCM is CTR encryption
+ * plus a GHASH over the associated data and the ciphertext. A CTR block
+ * only depends on its counter, and GHASH is a polynomial in H: the hash
+ * of a message is the hash of each part, multiplied by H to the power
+ * of the number of blocks following that part.
+ *
+ * Large messages are cut in page aligned segments. Each segment is
+ * encrypted and hashed by its own worker, and the caller combines the
+ * partial hashes into the tag. AES-GMAC signing is GCM with nothing to
+ * encrypt and is split the same way. CCM and CMAC chain every block
+ * and can not be split.
+ */
+
+#define SPLIT_CRYPT_MIN		(256 * 1024)
+#define SPLIT_SEG_MIN		(64 * 1024)
+#define SPLIT_MAX_SEGS		16
+
+static bool split_crypto_enable = true;
+module_param(split_crypto_enable, bool, 0644);
+MODULE_PARM_DESC(split_crypto_enable,
+		"Spread AES-GCM/GMAC of large messages over CPUs. Default: y/Y/1");
+
+struct cifsd_split_gcm {
+	struct crypto_skcipher	*ctr;
+	struct crypto_ahash	*ghash;
+	be128			h;
+};
+
+struct split_req;
+
+struct split_seg {
+	struct work_struct	work;
+	struct split_req	*req;
+	/* associated data or data the segment is part of */
+	struct kvec		*iov;
+	int			n_vec;
+	unsigned int		off;
+	unsigned int		len;
+	/* first counter block of the segment, for data */
+	unsigned int		blk;
+	bool			data;
+	be128			hash;
+	int			rc;
+};
+
+struct split_req {
+	struct cifsd_split_gcm	*ctx;
+	const u8		*nonce;
+	bool			enc;
+	atomic_t		pending;
+	struct completion	done;
+	u8			ekj0[AES_BLOCK_SIZE];
+	int			nr_segs;
+	struct split_seg	segs[];
+};
+
+static unsigned int split_iov_len(struct kvec *iov, int n_vec)
+{
+	unsigned int len = 0;
+	int i;
+
+	for (i = 0; i < n_vec; i++)
+		len += iov[i].iov_len;
+	return len;
+}
+
+/* map @len bytes at @off of @iov to @sg, vmalloc'ed buffers page by page */
+static void split_iov_to_sg(struct scatterlist *sg, int nents,
+		struct kvec *iov, int n_vec, unsigned int off, unsigned int len)
+{
+	struct scatterlist *last = sg;
+	unsigned int n, chunk;
+	char *buf;
+	int i;
+
+	sg_init_table(sg, nents);
+	for (i = 0; i < n_vec && len; i++) {
+		if (off >= iov[i].iov_len) {
+			off -= iov[i].iov_len;
+			continue;
+		}
+
+		buf = (char *)iov[i].iov_base + off;
+		n = min_t(unsigned int, len, iov[i].iov_len - off);
+		off = 0;
+		len -= n;
+
+		for (; n; n -= chunk, buf += chunk) {
+			last = sg++;
+			if (!is_vmalloc_addr(buf)) {
+				chunk = n;
+				sg_set_buf(last, buf, chunk);
+				continue;
+			}
+
+			chunk = min_t(unsigned int, n,
+					PAGE_SIZE - offset_in_page(buf));
+			sg_set_page(last, vmalloc_to_page(buf), chunk,
+					offset_in_page(buf));
+		}
+	}
+	sg_mark_end(last);
+}
+
+/* encrypt the block at @buf in place with counter @iv */
+static int split_ctr_block(struct cifsd_split_gcm *ctx, u8 *iv, u8 *buf)
+{
+	DECLARE_CRYPTO_WAIT(wait);
+	struct skcipher_request *req;
+	struct scatterlist sg;
+	int rc;
+
+	req = skcipher_request_alloc(ctx->ctr, GFP_KERNEL);
+	if (!req)
+		return -ENOMEM;
+
+	sg_init_one(&sg, buf, AES_BLOCK_SIZE);
+	skcipher_request_set_callback(req, CRYPTO_TFM_REQ_MAY_BACKLOG |
+			CRYPTO_TFM_REQ_MAY_SLEEP, crypto_req_done, &wait);
+	skcipher_request_set_crypt(req, &sg, &sg, AES_BLOCK_SIZE, iv);
+	rc = crypto_wait_req(crypto_skcipher_encrypt(req), &wait);
+	skcipher_request_free(req);
+	return rc;
+}
+
+static int split_seg_run(struct split_seg *seg)
+{
+	struct split_req *req = seg->req;
+	struct cifsd_split_gcm *ctx = req->ctx;
+	struct skcipher_request *creq = NULL;
+	struct ahash_request *hreq = NULL;
+	DECLARE_CRYPTO_WAIT(wait);
+	struct scatterlist *sg;
+	u8 iv[AES_BLOCK_SIZE];
+	int nents, rc = -ENOMEM;
+
+	nents = DIV_ROUND_UP(seg->len, PAGE_SIZE) + 2 * seg->n_vec;
+	sg = kmalloc_array(nents, sizeof(struct scatterlist), GFP_KERNEL);
+	if (!sg)
+		return -ENOMEM;
+	split_iov_to_sg(sg, nents, seg->iov, seg->n_vec, seg->off, seg->len);
+
+	hreq = ahash_request_alloc(ctx->ghash, GFP_KERNEL);
+	if (!hreq)
+		goto out;
+	ahash_request_set_callback(hreq, CRYPTO_TFM_REQ_MAY_BACKLOG |
+			CRYPTO_TFM_REQ_MAY_SLEEP, crypto_req_done, &wait);
+	ahash_request_set_crypt(hreq, sg, (u8 *)&seg->hash, seg->len);
+
+	if (seg->data) {
+		creq = skcipher_request_alloc(ctx->ctr, GFP_KERNEL);
+		if (!creq)
+			goto out;
+
+		/* counter 1 is for the tag, data starts at 2 */
+		memcpy(iv, req->nonce, SMB3_AES_GCM_NONCE);
+		put_unaligned_be32(seg->blk + 2, iv + SMB3_AES_GCM_NONCE);
+		skcipher_request_set_callback(creq,
+				CRYPTO_TFM_REQ_MAY_BACKLOG |
+				CRYPTO_TFM_REQ_MAY_SLEEP, crypto_req_done,
+				&wait);
+		skcipher_request_set_crypt(creq, sg, sg, seg->len, iv);
+	}
+
+	/* the ciphertext is hashed, after encryption or before decryption */
+	if (creq && req->enc) {
+		rc = crypto_wait_req(crypto_skcipher_encrypt(creq), &wait);
+		if (rc)
+			goto out;
+	}
+
+	rc = crypto_wait_req(crypto_ahash_digest(hreq), &wait);
+	if (rc)
+		goto out;
+
+	if (creq && !req->enc)
+		rc = crypto_wait_req(crypto_skcipher_decrypt(creq), &wait);
+out:
+	skcipher_request_free(creq);
+	ahash_request_free(hreq);
+	kfree(sg);
+	return rc;
+}
+
+static void split_seg_work(struct work_struct *work)
+{
+	struct split_seg *seg = container_of(work, struct split_seg, work);
+	struct split_req *req = seg->req;
+
+	seg->rc = split_seg_run(seg);
+	if (atomic_dec_and_test(&req->pending))
+		complete(&req->done);
+}
+
+/* @x = @x * H^@n */
+static void split_mul_hpow(be128 *x, const be128 *h, unsigned int n)
+{
+	be128 p = *h, t;
+
+	while (n) {
+		if (n & 1)
+			gf128mul_lle(x, &p);
+		n >>= 1;
+		if (n) {
+			t = p;
+			gf128mul_lle(&p, &t);
+		}
+	}
+}
+
+/* cut @len bytes of @iov in segments of @seg_len, returns next segment */
+static struct split_seg *split_add_segs(struct split_req *req,
+		struct split_seg *seg, struct kvec *iov, int n_vec,
+		unsigned int len, unsigned int seg_len, bool data)
+{
+	unsigned int off;
+
+	for (off = 0; off < len; off += seg_len, seg++) {
+		seg->req = req;
+		seg->iov = iov;
+		seg->n_vec = n_vec;
+		seg->off = off;
+		seg->len = min(seg_len, len - off);
+		seg->blk = off / AES_BLOCK_SIZE;
+		seg->data = data;
+		INIT_WORK(&seg->work, split_seg_work);
+	}
+	return seg;
+}
+
+/**
+ * cifsd_split_gcm_wanted() - check if a message is worth splitting
+ * @ctx:	split transforms, NULL if not set up
+ * @len:	number of bytes to encrypt and hash
+ *
+ * Return:	true if cifsd_split_gcm_crypt() should be used
+ */
+bool cifsd_split_gcm_wanted(struct cifsd_split_gcm *ctx, unsigned int len)
+{
+	return ctx && split_crypto_enable && len >= SPLIT_CRYPT_MIN &&
+		num_online_cpus() > 1;
+}
+
+/**
+ * cifsd_split_gcm_crypt() - AES-GCM over several workers
+ * @ctx:	split transforms keyed with the GCM key
+ * @nonce:	12 byte nonce
+ * @assoc:	associated data
+ * @n_assoc:	number of associated data iovecs
+ * @data:	data encrypted or decrypted in place, may be empty
+ * @n_data:	number of data iovecs
+ * @tag:	16 byte tag, filled in when encrypting, checked otherwise
+ * @enc:	encrypt, otherwise decrypt
+ *
+ * Return:	0 on success, -EBADMSG if the tag does not match,
+ *		otherwise error
+ */
+int cifsd_split_gcm_crypt(struct cifsd_split_gcm *ctx, const u8 *nonce,
+		struct kvec *assoc, int n_assoc, struct kvec *data, int n_data,
+		u8 *tag, bool enc)
+{
+	unsigned int assoc_len = split_iov_len(assoc, n_assoc);
+	unsigned int data_len = split_iov_len(data, n_data);
+	unsigned int total = assoc_len + data_len;
+	unsigned int seg_len, nr_segs;
+	struct split_req *req;
+	struct split_seg *seg, *end;
+	be128 hash = {0, 0}, lens;
+	u8 iv[AES_BLOCK_SIZE];
+	int rc = 0;
+
+	seg_len = max_t(unsigned int, total / num_online_cpus(),
+			SPLIT_SEG_MIN);
+	seg_len = max_t(unsigned int, seg_len,
+			DIV_ROUND_UP(total, SPLIT_MAX_SEGS));
+	seg_len = round_up(seg_len, PAGE_SIZE);
+	nr_segs = DIV_ROUND_UP(assoc_len, seg_len) +
+		DIV_ROUND_UP(data_len, seg_len);
+
+	req = kzalloc(sizeof(struct split_req) +
+			nr_segs * sizeof(struct split_seg), GFP_KERNEL);
+	if (!req)
+		return -ENOMEM;
+
+	req->ctx = ctx;
+	req->nonce = nonce;
+	req->enc = enc;
+	init_completion(&req->done);
+
+	/* the tag is masked with the encryption of counter 1 */
+	memcpy(iv, nonce, SMB3_AES_GCM_NONCE);
+	put_unaligned_be32(1, iv + SMB3_AES_GCM_NONCE);
+	rc = split_ctr_block(ctx, iv, req->ekj0);
+	if (rc)
+		goto out;
+
+	seg = split_add_segs(req, req->segs, assoc, n_assoc, assoc_len,
+			seg_len, false);
+	end = split_add_segs(req, seg, data, n_data, data_len, seg_len, true);
+	req->nr_segs = end - req->segs;
+
+	/* the caller works on the first segment itself */
+	atomic_set(&req->pending, req->nr_segs);
+	for (seg = req->segs + 1; seg < end; seg++)
+		queue_work(system_unbound_wq, &seg->work);
+
+	req->segs[0].rc = split_seg_run(&req->segs[0]);
+	if (!atomic_dec_and_test(&req->pending))
+		wait_for_completion(&req->done);
+
+	for (seg = req->segs; seg < end; seg++) {
+		if (seg->rc) {
+			rc = seg->rc;
+			goto out;
+		}
+
+		split_mul_hpow(&hash, &ctx->h,
+				DIV_ROUND_UP(seg->len, AES_BLOCK_SIZE));
+		be128_xor(&hash, &hash, &seg->hash);
+	}
+
+	lens.a = cpu_to_be64((u64)assoc_len * 8);
+	lens.b = cpu_to_be64((u64)data_len * 8);
+	be128_xor(&hash, &hash, &lens);
+	gf128mul_lle(&hash, &ctx->h);
+	crypto_xor((u8 *)&hash, req->ekj0, AES_BLOCK_SIZE);
+
+	if (enc)
+		memcpy(tag, &hash, AES_BLOCK_SIZE);
+	else if (crypto_memneq(tag, &hash, AES_BLOCK_SIZE))
+		rc = -EBADMSG;
+out:
+	kzfree(req);
+	return rc;
+}
+
+/**
+ * cifsd_split_gcm_setkey() - allocate and key split transforms
+ * @pctx:	set to the new split transforms
+ * @key:	AES key
+ * @key_size:	AES key size
+ *
+ * Transforms in use are never rekeyed, a new key gets new transforms.
+ * On failure *@pctx is NULL, the caller keeps using its AEAD transform
+ * alone.
+ *
+ * Return:	0 on success, otherwise error
+ */
+int cifsd_split_gcm_setkey(struct cifsd_split_gcm **pctx, const u8 *key,
+		unsigned int key_size)
+{
+	struct cifsd_split_gcm *ctx;
+	u8 iv[AES_BLOCK_SIZE];
+	int rc;
+
+	*pctx = NULL;
+	ctx = kzalloc(sizeof(struct cifsd_split_gcm), GFP_KERNEL);
+	if (!ctx)
+		return -ENOMEM;
+
+	ctx->ctr = crypto_alloc_skcipher("ctr(aes)", 0, 0);
+	if (IS_ERR(ctx->ctr)) {
+		rc = PTR_ERR(ctx->ctr);
+		ctx->ctr = NULL;
+		goto err;
+	}
+
+	ctx->ghash = crypto_alloc_ahash("ghash", 0, 0);
+	if (IS_ERR(ctx->ghash)) {
+		rc = PTR_ERR(ctx->ghash);
+		ctx->ghash = NULL;
+		goto err;
+	}
+
+	rc = crypto_skcipher_setkey(ctx->ctr, key, key_size);
+	if (rc)
+		goto err;
+
+	/* H is the encryption of the zero block */
+	memset(iv, 0, AES_BLOCK_SIZE);
+	memset(&ctx->h, 0, sizeof(be128));
+	rc = split_ctr_block(ctx, iv, (u8 *)&ctx->h);
+	if (rc)
+		goto err;
+
+	rc = crypto_ahash_setkey(ctx->ghash, (u8 *)&ctx->h, sizeof(be128));
+	if (rc)
+		goto err;
+
+	*pctx = ctx;
+	return 0;
+err:
+	cifsd_debug("split gcm setup error %d\n", rc);
+	cifsd_split_gcm_free(ctx);
+	return rc;
+}
+
+/**
+ * cifsd_split_gcm_free() - free split transforms
+ * @ctx:	split transforms, may be NULL
+ */
+void cifsd_split_gcm_free(struct cifsd_split_gcm *ctx)
+{
+	if (!ctx)
+		return;
+
+	if (ctx->ctr)
+		crypto_free_skcipher(ctx->ctr);
+	if (ctx->ghash)
+		crypto_free_ahash(ctx->ghash);
+	kzfree(ctx);
+}
+#else
+void cifsd_split_gcm_free(struct cifsd_split_gcm *ctx)
+{
+}
+#endif
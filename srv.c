@@ -28,6 +28,7 @@
 #endif
 #include "oplock.h"
 #include "cifsacl.h"
+#include "crypto_ctx.h"
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 11, 0)
 #include <linux/sched/signal.h>
 #endif
@@ -63,8 +64,6 @@ static DEFINE_SPINLOCK(tcp_sess_list_lock);
 
 struct fidtable_desc global_fidtable;
 
-LIST_HEAD(global_lock_list);
-
 /* Default: allocation roundup size = 1048576, to disable set 0 in config */
 unsigned int alloc_roundup_size = 1048576;
 
@@ -107,6 +106,12 @@ struct smb_hdr *smb_small_buf_get(void)
 	return mempool_alloc(cifsd_sm_req_poolp, GFP_NOFS | __GFP_ZERO);
 }
 
+/*
+ * Tree connects of a session are indexed by tree id in sess->tcon_idr.
+ * Ids are allocated and released under sess->tcon_lock, looked up under
+ * RCU, and a tree connect is freed after a grace period.
+ */
+
 /**
  * construct_cifsd_tcon() - alloc tcon object and initialize
  *		 from session and share info and increment tcon count
@@ -119,7 +124,7 @@ struct cifsd_tcon *construct_cifsd_tcon(struct cifsd_share *share,
 				struct cifsd_sess *sess)
 {
 	struct cifsd_tcon *tcon;
-	int err;
+	int err, id;
 
 	tcon = kzalloc(sizeof(struct cifsd_tcon), GFP_KERNEL);
 	if (!tcon)
@@ -138,13 +143,107 @@ struct cifsd_tcon *construct_cifsd_tcon(struct cifsd_share *share,
 out:
 	tcon->share = share;
 	tcon->sess = sess;
-	INIT_LIST_HEAD(&tcon->tcon_list);
-	list_add(&tcon->tcon_list, &sess->tcon_list);
-	sess->tcon_count++;
+	atomic_set(&tcon->refcnt, 1);
+
+	idr_preload(GFP_KERNEL);
+	spin_lock(&sess->tcon_lock);
+	id = idr_alloc(&sess->tcon_idr, tcon, 1, CIFSD_MAX_TREE_ID,
+			GFP_NOWAIT);
+	if (id >= 0) {
+		tcon->id = id;
+		sess->tcon_count++;
+	}
+	spin_unlock(&sess->tcon_lock);
+	idr_preload_end();
+
+	if (id < 0) {
+		cifsd_err("no tree id left in session %llu\n", sess->sess_id);
+		if (share->path)
+			path_put(&tcon->share_path);
+		kfree(tcon);
+		return ERR_PTR(id);
+	}
 
 	return tcon;
 }
 
+/**
+ * get_cifsd_tcon() - find a tree connect of a session
+ * @sess:	session the tree connect was made in
+ * @tid:	tree id
+ *
+ * Return:	referenced matching tree connect, otherwise NULL
+ */
+struct cifsd_tcon *get_cifsd_tcon(struct cifsd_sess *sess, unsigned int tid)
+{
+	struct cifsd_tcon *tcon;
+
+	if (tid >= CIFSD_MAX_TREE_ID)
+		return NULL;
+
+	rcu_read_lock();
+	tcon = idr_find(&sess->tcon_idr, tid);
+	if (tcon && !atomic_inc_not_zero(&tcon->refcnt))
+		tcon = NULL;
+	rcu_read_unlock();
+	return tcon;
+}
+
+/**
+ * cifsd_tcon_put() - drop a reference to a tree connect
+ * @tcon:	tree connect, freed once the last reference is gone
+ */
+void cifsd_tcon_put(struct cifsd_tcon *tcon)
+{
+	if (!atomic_dec_and_test(&tcon->refcnt))
+		return;
+
+	if (tcon->share->path)
+		path_put(&tcon->share_path);
+	/* lookups may still be walking past it */
+	kfree_rcu(tcon, rcu);
+}
+
+/**
+ * destroy_cifsd_tcon() - release the tree id of a tree connect
+ * @tcon:	tree connect
+ *
+ * Requests still using the tree connect keep it until they are done.
+ */
+void destroy_cifsd_tcon(struct cifsd_tcon *tcon)
+{
+	struct cifsd_sess *sess = tcon->sess;
+	bool removed = false;
+
+	/* idr_remove() returns the removed entry only from 4.15 on */
+	spin_lock(&sess->tcon_lock);
+	if (idr_find(&sess->tcon_idr, tcon->id) == tcon) {
+		idr_remove(&sess->tcon_idr, tcon->id);
+		sess->tcon_count--;
+		removed = true;
+	}
+	spin_unlock(&sess->tcon_lock);
+
+	/* a concurrent tree disconnect dropped the tree id already */
+	if (removed)
+		cifsd_tcon_put(tcon);
+}
+
+/**
+ * destroy_cifsd_tcons() - free all tree connects of a session
+ * @sess:	session
+ */
+void destroy_cifsd_tcons(struct cifsd_sess *sess)
+{
+	struct cifsd_tcon *tcon;
+	int id;
+
+	idr_for_each_entry(&sess->tcon_idr, tcon, id)
+		destroy_cifsd_tcon(tcon);
+
+	WARN_ON(sess->tcon_count != 0);
+}
+
 /**
  * allocate_buffers() - allocate response buffer for smb requests
  * @conn:     TCP server instance of connection
@@ -197,10 +296,10 @@ int smb_send_rsp(struct smb_work *work)
 	struct connection *conn = work->conn;
 	struct smb_hdr *rsp_hdr = (struct smb_hdr *)work->rsp_buf;
 	struct socket *sock = conn->sock;
-	struct kvec iov;
+	struct kvec iov[3];
 	struct msghdr smb_msg = {};
-	int len, total_len = 0;
-	int val = 1;
+	int len, total_len = 0, expected = 0;
+	int i, n_vec = 0;
 
 	spin_lock(&conn->request_lock);
 	if (work->added_in_request_list && !work->multiRsp) {
@@ -218,55 +317,58 @@ int smb_send_rsp(struct smb_work *work)
 		return -ENOMEM;
 	}
 
-	if (!work->rdata_buf) {
-		iov.iov_len = get_rfc1002_length(rsp_hdr) + 4;
-		iov.iov_base = rsp_hdr;
-
-		len = kernel_sendmsg(sock, &smb_msg, &iov, 1, iov.iov_len);
-		if (len < 0) {
-			cifsd_err("err1 %d while sending data\n", len);
-			goto out;
-		}
-		total_len = len;
-	} else {
-		/* cork the socket */
-		kernel_setsockopt(sock, SOL_TCP, TCP_CORK,
-				(char *)&val, sizeof(val));
-
-		/* write read smb header on socket*/
-		iov.iov_base = rsp_hdr;
-		iov.iov_len = work->rrsp_hdr_size;
-
-		len = kernel_sendmsg(sock, &smb_msg, &iov, 1, iov.iov_len);
-		if (len < 0) {
-			cifsd_err("err2 %d while sending data\n", len);
-			goto uncork;
+	/* responses to encrypted requests go out encrypted */
+	if (work->encrypted && !work->tr_buf) {
+		if (!conn->ops->encrypt_resp ||
+		    conn->ops->encrypt_resp(work)) {
+			cifsd_err("failed to encrypt response\n");
+			return -EINVAL;
 		}
-		total_len = len;
-
-		/* write data read from file on socket*/
-		iov.iov_base = work->rdata_buf;
-		iov.iov_len = work->rdata_cnt;
-		len = kernel_sendmsg(sock, &smb_msg, &iov, 1, iov.iov_len);
-		if (len < 0) {
-			cifsd_err("err3 %d while sending data\n", len);
-			goto uncork;
-		}
-		total_len += len;
+	}
 
-uncork:
-		/* uncork it */
-		val = 0;
-		kernel_setsockopt(sock, SOL_TCP, TCP_CORK,
-				(char *)&val, sizeof(val));
+#ifdef CONFIG_CIFS_SMB2_SERVER
+	if (work->tr_buf) {
+		/* the transform header carries the RFC1001 length */
+		iov[n_vec].iov_base = work->tr_buf;
+		iov[n_vec++].iov_len = sizeof(struct smb2_transform_hdr);
+		iov[n_vec].iov_base = (char *)rsp_hdr + 4;
+		iov[n_vec++].iov_len = work->rdata_buf ?
+			work->rrsp_hdr_size - 4 :
+			get_rfc1002_length(rsp_hdr);
+	} else
+#endif
+	{
+		iov[n_vec].iov_base = rsp_hdr;
+		iov[n_vec++].iov_len = work->rdata_buf ?
+			work->rrsp_hdr_size :
+			get_rfc1002_length(rsp_hdr) + 4;
+	}
+
+	/* write data read from file on socket */
+	if (work->rdata_buf) {
+		iov[n_vec].iov_base = work->rdata_buf;
+		iov[n_vec++].iov_len = work->rdata_cnt;
 	}
 
-	if (total_len != get_rfc1002_length(rsp_hdr) + 4)
+	for (i = 0; i < n_vec; i++)
+		expected += iov[i].iov_len;
+
+	/* one call for all pieces, no need to cork the socket */
+	len = kernel_sendmsg(sock, &smb_msg, iov, n_vec, expected);
+	if (len < 0) {
+		cifsd_err("err %d while sending data\n", len);
+		goto out;
+	}
+	total_len = len;
+
+	if (total_len != expected)
 		cifsd_err("transfered %d, expected %d bytes\n",
-				total_len, get_rfc1002_length(rsp_hdr) + 4);
+				total_len, expected);
 
 out:
 	cifsd_debug("data sent = %d\n", total_len);
+	kfree(work->tr_buf);
+	work->tr_buf = NULL;
 
 #ifdef CONFIG_CIFS_SMB2_SERVER
 	if (conn->tcp_status == CifsGood && IS_SMB2(conn))
@@ -276,6 +378,59 @@ out:
 	return 0;
 }
 
+/**
+ * cifsd_read_large_request() - read a large request into conn->wbuf
+ * @conn:	TCP server instance of connection
+ * @pdu_length:	request length after the RFC1001 header
+ *
+ * The payload of an SMB2 WRITE is read to a page boundary of the buffer,
+ * so that an unbuffered write reaches the filesystem without a bounce
+ * buffer. The fixed part of the request is read first to find the data
+ * offset, the request then starts at conn->wbuf_off in conn->wbuf.
+ *
+ * Return:	number of bytes read, otherwise error
+ */
+static int cifsd_read_large_request(struct connection *conn,
+		unsigned int pdu_length)
+{
+	char *buf = conn->wbuf;
+#ifdef CONFIG_CIFS_SMB2_SERVER
+	unsigned int fixed = offsetof(struct smb2_write_req, Buffer) - 4;
+	struct smb2_write_req *req = (struct smb2_write_req *)buf;
+	unsigned int data_off;
+	int length, rest;
+
+	conn->wbuf_off = 0;
+	if (pdu_length <= fixed)
+		return cifsd_read_from_socket(conn, buf + 4, pdu_length);
+
+	length = cifsd_read_from_socket(conn, buf + 4, fixed);
+	if (length != fixed)
+		return length;
+
+	data_off = le16_to_cpu(req->DataOffset);
+	if (*(__le32 *)req->hdr.ProtocolId == SMB2_PROTO_NUMBER &&
+	    req->hdr.Command == SMB2_WRITE &&
+	    data_off >= fixed && data_off < pdu_length) {
+		/* the data starts 4 + DataOffset bytes into the request */
+		conn->wbuf_off = -(4 + data_off) & (PAGE_SIZE - 1);
+		if (conn->wbuf_off) {
+			memmove(buf + conn->wbuf_off, buf, 4 + fixed);
+			buf += conn->wbuf_off;
+		}
+	}
+
+	rest = cifsd_read_from_socket(conn, buf + 4 + fixed,
+			pdu_length - fixed);
+	if (rest < 0)
+		return rest;
+	return length + rest;
+#else
+	conn->wbuf_off = 0;
+	return cifsd_read_from_socket(conn, buf + 4, pdu_length);
+#endif
+}
+
 /**
  * queue_dynamic_work_helper() - helper function to queue smb request
  *		work to worker thread
@@ -297,9 +452,11 @@ void queue_dynamic_work_helper(struct connection *conn)
 	work->conn = conn;
 
 	if (conn->wbuf) {
-		work->buf = conn->wbuf;
+		work->buf = conn->wbuf + conn->wbuf_off;
+		work->wbuf_off = conn->wbuf_off;
 		work->req_wbuf = 1;
 		conn->wbuf = NULL;
+		conn->wbuf_off = 0;
 	} else if (conn->large_buf) {
 		work->buf = conn->bigbuf;
 		work->large_buf = 1;
@@ -369,8 +526,20 @@ static inline int check_conn_state(struct smb_work *smb_work)
  */
 static void free_workitem_buffers(struct smb_work *smb_work)
 {
+	/* a decrypted request starts past its transform header */
+	smb_work->buf -= smb_work->transform_off;
+
+	/* the response was never sent */
+	if (smb_work->preauth_sess)
+		put_preauth_session(smb_work->preauth_sess);
+
+	if (smb_work->tcon)
+		cifsd_tcon_put(smb_work->tcon);
+	if (smb_work->sess)
+		cifsd_sess_put(smb_work->sess);
+
 	if (smb_work->req_wbuf)
-		vfree(smb_work->buf);
+		vfree(smb_work->buf - smb_work->wbuf_off);
 	else {
 		if (smb_work->large_buf)
 			mempool_free(smb_work->buf, cifsd_req_poolp);
@@ -388,6 +557,34 @@ static void free_workitem_buffers(struct smb_work *smb_work)
 	kmem_cache_free(cifsd_work_cache, smb_work);
 }
 
+/**
+ * smb_decrypt_work() - decrypt a transform message request
+ * @smb_work:	smb work containing the transform message
+ *
+ * The request is only queued to conn->requests once decrypted, as the
+ * command is not known before.
+ *
+ * Return:	0 on success, otherwise error
+ */
+static int smb_decrypt_work(struct smb_work *smb_work)
+{
+	struct connection *conn = smb_work->conn;
+	int rc;
+
+	if (!conn->ops->decrypt_req)
+		return -EOPNOTSUPP;
+
+	rc = conn->ops->decrypt_req(smb_work);
+	if (rc)
+		return rc;
+
+	if (check_smb_message(smb_work->buf))
+		return -EINVAL;
+
+	add_request_to_queue(smb_work);
+	return 0;
+}
+
 /**
  * handle_smb_work() - process pending smb work requests
  * @smb_work:	smb work containing request command buffer
@@ -403,6 +600,7 @@ void handle_smb_work(struct work_struct *work)
 	bool conn_valid = false;
 	struct smb_version_cmds *cmds;
 	long int start_time = 0, end_time = 0, time_elapsed = 0;
+	void (*park_fn)(struct smb_work *work) = NULL;
 
 	atomic_inc(&conn->req_running);
 	mutex_lock(&conn->srv_mutex);
@@ -412,6 +610,17 @@ void handle_smb_work(struct work_struct *work)
 
 	conn->stats.request_served++;
 
+	/* decryption does not need srv_mutex, let requests run in parallel */
+	if (is_transform_message(smb_work->buf)) {
+		mutex_unlock(&conn->srv_mutex);
+		rc = smb_decrypt_work(smb_work);
+		mutex_lock(&conn->srv_mutex);
+		if (rc) {
+			cifsd_debug("dropping transform message, err %d\n", rc);
+			goto nosend;
+		}
+	}
+
 	if (unlikely(conn->need_neg)) {
 		if (is_smb2_neg_cmd(smb_work))
 			init_smb2_0_server(conn);
@@ -434,7 +643,12 @@ void handle_smb_work(struct work_struct *work)
 
 	if (conn->ops->check_user_session) {
 		rc = conn->ops->check_user_session(smb_work);
-		if (rc < 0) {
+		if (rc == -EACCES) {
+			command = conn->ops->get_cmd_val(smb_work);
+			conn->ops->set_rsp_status(smb_work,
+					NT_STATUS_ACCESS_DENIED);
+			goto send;
+		} else if (rc < 0) {
 			command = conn->ops->get_cmd_val(smb_work);
 			conn->ops->set_rsp_status(smb_work,
 					NT_STATUS_USER_SESSION_DELETED);
@@ -473,7 +687,9 @@ again:
 
 	mutex_unlock(&conn->srv_mutex);
 
-	if (smb_work->sess && smb_work->sess->sign &&
+	/* encryption authenticates the request already */
+	if (!smb_work->encrypted &&
+		smb_work->sess && smb_work->sess->sign &&
 		conn->ops->is_sign_req &&
 		conn->ops->is_sign_req(smb_work, command)) {
 		rc = conn->ops->check_sign_req(smb_work);
@@ -504,6 +720,12 @@ again:
 		cifsd_debug("error(%d) while processing cmd %u\n",
 							rc, command);
 
+	/* the handler sends the response itself once it completes */
+	if (smb_work->async && smb_work->async->park_fn) {
+		park_fn = smb_work->async->park_fn;
+		goto parked;
+	}
+
 	if (smb_work->send_no_response) {
 		spin_lock(&conn->request_lock);
 		if (smb_work->added_in_request_list) {
@@ -524,20 +746,32 @@ send:
 	if (is_smb2_rsp(smb_work))
 		conn->ops->set_rsp_credits(smb_work);
 
-	if (conn->dialect == SMB311_PROT_ID)
+	if (smb_work->preauth_hash)
 		smb3_preauth_hash_rsp(smb_work);
 
-	if (smb_work->sess && smb_work->sess->sign &&
+	if (!smb_work->encrypted &&
+		smb_work->sess && smb_work->sess->sign &&
 		conn->ops->is_sign_req &&
 		conn->ops->is_sign_req(smb_work, command))
 		conn->ops->set_sign_rsp(smb_work);
 
+	/*
+	 * Encrypt outside srv_mutex too, smb_send_rsp() tries again and
+	 * drops the response if this fails.
+	 */
+	if (smb_work->encrypted && conn->ops->encrypt_resp) {
+		mutex_unlock(&conn->srv_mutex);
+		conn->ops->encrypt_resp(smb_work);
+		mutex_lock(&conn->srv_mutex);
+	}
+
 	smb_send_rsp(smb_work);
 
 nosend:
 	/* free buffers */
 	free_workitem_buffers(smb_work);
 
+parked:
 	if (cifsd_debug_enable) {
 		end_time = jiffies;
 
@@ -561,6 +795,12 @@ nosend:
 	if (waitqueue_active(&conn->req_running_q))
 		wake_up_all(&conn->req_running_q);
 
+	/* parked work keeps its reference until it is completed */
+	if (park_fn) {
+		park_fn(smb_work);
+		return;
+	}
+
 	/*
 	 * Decrement Ref count when all processing finished
 	 *  - in both success or failure cases
@@ -568,6 +808,62 @@ nosend:
 	atomic_dec(&conn->r_count);
 }
 
+/**
+ * smb_complete_parked_work() - send final response of a parked request
+ * @smb_work:	smb work whose handler set async->park_fn
+ *
+ * Called by the owner of a parked request once its response is ready,
+ * the work is freed on return.
+ */
+void smb_complete_parked_work(struct smb_work *smb_work)
+{
+	struct connection *conn = smb_work->conn;
+	unsigned int command;
+
+	mutex_lock(&conn->srv_mutex);
+	command = conn->ops->get_cmd_val(smb_work);
+
+	if (is_smb2_rsp(smb_work))
+		conn->ops->set_rsp_credits(smb_work);
+
+	if (!smb_work->encrypted &&
+		smb_work->sess && smb_work->sess->sign &&
+		conn->ops->is_sign_req &&
+		conn->ops->is_sign_req(smb_work, command))
+		conn->ops->set_sign_rsp(smb_work);
+
+	smb_send_rsp(smb_work);
+	free_workitem_buffers(smb_work);
+	mutex_unlock(&conn->srv_mutex);
+
+	atomic_dec(&conn->r_count);
+}
+
+/**
+ * smb_close_parked_works() - complete parked requests of a dying connection
+ * @conn:	connection being torn down
+ *
+ * Parked requests are completed by their owners once kicked, marking them
+ * ASYNC_CLOSE lets them drop their state without touching the connection
+ * any further than sending the final response.
+ */
+static void smb_close_parked_works(struct connection *conn)
+{
+	struct smb_work *smb_work;
+	struct async_info *async;
+
+	spin_lock(&conn->request_lock);
+	list_for_each_entry(smb_work, &conn->async_requests, request_entry) {
+		async = smb_work->async;
+		if (!async || async->async_status != ASYNC_PROG)
+			continue;
+		async->async_status = ASYNC_CLOSE;
+		if (async->cancel_fn)
+			async->cancel_fn(smb_work);
+	}
+	spin_unlock(&conn->request_lock);
+}
+
 /**
  * init_tcp_conn() - intialize tcp server thread for a new connection
  * @conn:     TCP server instance of connection
@@ -597,6 +893,8 @@ int init_tcp_conn(struct connection *conn, struct socket *sock)
 	INIT_LIST_HEAD(&conn->requests);
 	INIT_LIST_HEAD(&conn->async_requests);
 	spin_lock_init(&conn->request_lock);
+	hash_init(conn->preauth_sess_table);
+	spin_lock_init(&conn->preauth_lock);
 	conn->srv_cap = SERVER_CAPS;
 	init_waitqueue_head(&conn->oplock_q);
 	init_waitqueue_head(&conn->oplock_brk);
@@ -630,6 +928,7 @@ static void conn_cleanup(struct connection *conn)
 
 	list_del(&conn->list);
 	free_opinfo_disconnect(conn);
+	destroy_preauth_sessions(conn);
 	kfree(conn);
 }
 
@@ -638,25 +937,60 @@ void free_channel_list(struct cifsd_sess *sess)
 	struct channel *chann;
 	struct list_head *tmp, *t;
 
-	if (sess->conn->dialect >= SMB30_PROT_ID) {
-		list_for_each_safe(tmp, t, &sess->cifsd_chann_list) {
-			chann = list_entry(tmp, struct channel, chann_list);
-			if (chann) {
-				list_del(&chann->chann_list);
-				kfree(chann);
-			}
+	/* only SMB 3 sessions have channels, conn may be gone already */
+	list_for_each_safe(tmp, t, &sess->cifsd_chann_list) {
+		chann = list_entry(tmp, struct channel, chann_list);
+		if (chann) {
+			list_del(&chann->chann_list);
+			crypto_free_shash(chann->sign_tfm);
+			if (chann->gmac_tfm)
+				crypto_free_aead(chann->gmac_tfm);
+			cifsd_split_gcm_free(chann->gmac_split);
+			kfree(chann);
 		}
 	}
 }
 
+/**
+ * smb_delete_session() - tear down a session and drop it from the table
+ * @sess:	session
+ *
+ * Open files and tree connects go away at once, the session and its keys
+ * stay until the requests still using it are done.
+ */
 void smb_delete_session(struct cifsd_sess *sess)
 {
 	sess->valid = 0;
-	list_del(&sess->cifsd_ses_list);
-	list_del(&sess->cifsd_ses_global_list);
-	free_channel_list(sess);
+	/* deleted already */
+	if (!unregister_session(sess))
+		return;
+
+	remove_preauth_session(sess->conn, sess->sess_id);
 	destroy_fidtable(sess);
-	kfree(sess);
+	destroy_cifsd_tcons(sess);
+	cifsd_sess_put(sess);
+}
+
+/**
+ * cifsd_sess_put() - drop a reference to a session
+ * @sess:	session, freed once the last reference is gone
+ */
+void cifsd_sess_put(struct cifsd_sess *sess)
+{
+	if (!atomic_dec_and_test(&sess->refcnt))
+		return;
+
+	free_channel_list(sess);
+	idr_destroy(&sess->tcon_idr);
+	crypto_free_shash(sess->sign_tfm);
+	if (sess->enc_tfm)
+		crypto_free_aead(sess->enc_tfm);
+	if (sess->dec_tfm)
+		crypto_free_aead(sess->dec_tfm);
+	cifsd_split_gcm_free(sess->enc_split);
+	cifsd_split_gcm_free(sess->dec_split);
+	/* lookups may still be walking past it */
+	kfree_rcu(sess, rcu);
 }
 
 /**
@@ -724,13 +1058,16 @@ static int tcp_sess_kthread(void *p)
 				continue;
 		}
 
-		if (conn->wbuf)
-			buf = conn->wbuf;
-		else if (conn->large_buf)
-			buf = conn->bigbuf;
-
 		/* read the request */
-		length = cifsd_read_from_socket(conn, buf + 4, pdu_length);
+		if (conn->wbuf) {
+			length = cifsd_read_large_request(conn, pdu_length);
+			buf = conn->wbuf + conn->wbuf_off;
+		} else {
+			if (conn->large_buf)
+				buf = conn->bigbuf;
+			length = cifsd_read_from_socket(conn, buf + 4,
+					pdu_length);
+		}
 		if (length < 0) {
 			cifsd_err("sock_read failed: %d\n", length);
 			continue;
@@ -752,6 +1089,9 @@ static int tcp_sess_kthread(void *p)
 	wait_event(conn->req_running_q,
 				atomic_read(&conn->req_running) == 0);
 
+	/* parked requests hold r_count until their owner completes them */
+	smb_close_parked_works(conn);
+
 	/* Wait till all reference dropped to the Server object*/
 	while (atomic_read(&conn->r_count) > 0)
 		schedule_timeout(HZ);
@@ -1008,6 +1348,10 @@ static int __init init_smb_server(void)
 	if (rc)
 		return rc;
 
+	rc = cifsd_crypto_ctx_init();
+	if (rc)
+		goto err0;
+
 	rc = cifsd_export_init();
 	if (rc)
 		goto err1;
@@ -1024,6 +1368,10 @@ static int __init init_smb_server(void)
 
 	mfp_hash_init();
 
+	rc = cifsd_notify_init();
+	if (rc)
+		goto err3;
+
 #ifdef CONFIG_CIFSD_ACL
 	rc = init_cifsd_idmap();
 	if (rc)
@@ -1039,6 +1387,8 @@ err2:
 #endif
 	cifsd_export_exit();
 err1:
+	cifsd_crypto_ctx_exit();
+err0:
 	smb_free_mempools();
 	return rc;
 }
@@ -1055,7 +1405,14 @@ static void __exit exit_smb_server(void)
 	destroy_global_fidtable();
 #endif
 	cifsd_export_exit();
+	cifsd_namecache_exit();
+	cifsd_notify_exit();
+#ifdef CONFIG_CIFS_SMB2_SERVER
+	cifsd_odx_exit();
+#endif
+	smb_vfs_clone_probes_free();
 	dispose_ofile_list();
+	cifsd_crypto_ctx_exit();
 	smb_free_mempools();
 #ifdef CONFIG_CIFSD_ACL
 	exit_cifsd_idmap();
@@ -27,6 +27,122 @@
 #include "smb1pdu.h"
 #include "glob.h"
 
+/* every byte of a word has its high bit clear and no byte is zero */
+#define ASCII_HIGH_BITS		REPEAT_BYTE(0x80)
+#define ASCII_LOW_BITS		REPEAT_BYTE(0x01)
+
+static inline bool word_is_ascii(unsigned long w)
+{
+	return !(w & ASCII_HIGH_BITS) &&
+		!((w - ASCII_LOW_BITS) & ASCII_HIGH_BITS);
+}
+
+/* SFU style remap of the characters NTFS does not allow in names */
+static const __u16 ascii_remap[128] = {
+	[':'] = UNI_COLON,
+	['*'] = UNI_ASTERISK,
+	['?'] = UNI_QUESTION,
+	['<'] = UNI_LESSTHAN,
+	['>'] = UNI_GRTRTHAN,
+	['|'] = UNI_PIPE,
+};
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 15, 0)
+#define smb_load_word(p)	read_word_at_a_time(p)
+#else
+#define smb_load_word(p)	(*(const unsigned long *)(p))
+#endif
+
+/*
+ * smb_ascii_to_utf16() - convert the leading 7-bit ASCII run of a string
+ * @to:		destination buffer
+ * @from:	source buffer
+ * @len:	don't walk past this many bytes of the source buffer
+ * @mapchars:	remap characters reserved by windows
+ *
+ * Almost all names are plain ASCII, which maps 1:1 to UTF-16 in every
+ * codepage. Scan the source a word at a time and expand it without going
+ * through the nls tables, stopping at the first NUL or non-ASCII byte.
+ * Many callers pass a buffer size rather than the string length, so the
+ * word holding the NUL may extend past the allocation. Word loads are only
+ * done aligned, which never crosses into the next page, and through
+ * read_word_at_a_time() so KASAN does not flag the bytes past the NUL.
+ * Kernels without it bound the scan by the string length instead.
+ *
+ * Return:	number of bytes consumed (and UTF-16 chars written)
+ */
+static int smb_ascii_to_utf16(__le16 *to, const char *from, int len,
+		bool mapchars)
+{
+	int i = 0, k;
+	unsigned char c;
+
+	if (!mapchars) {
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 15, 0)
+		len = strnlen(from, len);
+#endif
+		while (i < len && !IS_ALIGNED((unsigned long)(from + i),
+					sizeof(unsigned long))) {
+			c = from[i];
+			if (!c || c >= 0x80)
+				return i;
+			put_unaligned_le16(c, &to[i++]);
+		}
+
+		while (i + (int)sizeof(unsigned long) <= len &&
+			word_is_ascii(smb_load_word(from + i))) {
+			for (k = 0; k < sizeof(unsigned long); k++, i++)
+				put_unaligned_le16((unsigned char)from[i],
+						&to[i]);
+		}
+	}
+
+	for (; i < len; i++) {
+		c = from[i];
+		if (!c || c >= 0x80)
+			break;
+		if (mapchars && ascii_remap[c])
+			put_unaligned_le16(ascii_remap[c], &to[i]);
+		else
+			put_unaligned_le16(c, &to[i]);
+	}
+
+	return i;
+}
+
+/*
+ * smb_utf16_ascii_len() - length of the leading 7-bit ASCII run of a
+ *		utf16le string
+ * @from:	source buffer
+ * @maxwords:	don't walk past this many UTF-16 chars
+ *
+ * Return:	number of leading non-zero UTF-16 chars below 0x80
+ */
+static int smb_utf16_ascii_len(const __le16 *from, int maxwords)
+{
+	int i = 0;
+	u64 w;
+
+	while (i + 4 <= maxwords) {
+		w = get_unaligned_le64(&from[i]);
+		if (w & 0xff80ff80ff80ff80ULL)
+			break;
+		if ((w - 0x0001000100010001ULL) & 0x8000800080008000ULL)
+			break;
+		i += 4;
+	}
+
+	while (i < maxwords) {
+		__u16 c = get_unaligned_le16(&from[i]);
+
+		if (!c || c >= 0x80)
+			break;
+		i++;
+	}
+
+	return i;
+}
+
 /*
  * smb_utf16_bytes() - how long will a string be after conversion?
  * @from:	pointer to input string
@@ -50,6 +166,13 @@ smb_utf16_bytes(const __le16 *from, int maxbytes,
 	__u16 ftmp;
 
 	for (i = 0; i < maxwords; i++) {
+		charlen = smb_utf16_ascii_len(&from[i], maxwords - i);
+		if (charlen) {
+			outlen += charlen;
+			i += charlen - 1;
+			continue;
+		}
+
 		ftmp = get_unaligned_le16(&from[i]);
 		if (ftmp == 0)
 			break;
@@ -189,6 +312,19 @@ smb_from_utf16(char *to, const __le16 *from, int tolen, int fromlen,
 	safelen = tolen - (NLS_MAX_CHARSET_SIZE + nullsize);
 
 	for (i = 0; i < fromwords; i++) {
+		/* plain ASCII is the same in every codepage, copy it in bulk */
+		charlen = smb_utf16_ascii_len(&from[i],
+				min(fromwords - i, tolen - nullsize - outlen));
+		if (charlen) {
+			int k;
+
+			for (k = 0; k < charlen; k++)
+				to[outlen++] = (char)get_unaligned_le16(
+						&from[i + k]);
+			i += charlen - 1;
+			continue;
+		}
+
 		ftmp = get_unaligned_le16(&from[i]);
 		if (ftmp == 0)
 			break;
@@ -229,9 +365,15 @@ smb_strtoUTF16(__le16 *to, const char *from, int len,
 	      const struct nls_table *codepage)
 {
 	int charlen;
-	int i;
+	int i, ascii_len;
 	wchar_t wchar_to; /* needed to quiet sparse */
 
+	ascii_len = smb_ascii_to_utf16(to, from, len, false);
+	if (ascii_len == len || !from[ascii_len]) {
+		i = ascii_len;
+		goto success;
+	}
+
 	/* special case for utf8 to handle no plane0 chars */
 	if (!strcmp(codepage->charset, "utf8")) {
 		/*
@@ -239,12 +381,15 @@ smb_strtoUTF16(__le16 *to, const char *from, int len,
 		 * as caller should have assumed conversion does not overflow
 		 * in destination len is length in wchar_t units (16bits)
 		 */
-		i  = utf8s_to_utf16s(from, len, UTF16_LITTLE_ENDIAN,
-				       (wchar_t *) to, len);
+		i  = utf8s_to_utf16s(from + ascii_len, len - ascii_len,
+				UTF16_LITTLE_ENDIAN,
+				(wchar_t *)(to + ascii_len), len - ascii_len);
 
 		/* if success terminate and exit */
-		if (i >= 0)
+		if (i >= 0) {
+			i += ascii_len;
 			goto success;
+		}
 		/*
 		 * if fails fall back to UCS encoding as this
 		 * function should not return negative values
@@ -254,6 +399,12 @@ smb_strtoUTF16(__le16 *to, const char *from, int len,
 	}
 
 	for (i = 0; len && *from; i++, from += charlen, len -= charlen) {
+		charlen = smb_ascii_to_utf16(&to[i], from, len, false);
+		if (charlen) {
+			i += charlen - 1;
+			continue;
+		}
+
 		charlen = codepage->char2uni(from, len, &wchar_to);
 		if (charlen < 1) {
 			/* A question mark */
@@ -347,6 +498,15 @@ smbConvertToUTF16(__le16 *target, const char *source, int srclen,
 		return smb_strtoUTF16(target, source, PATH_MAX, cp);
 
 	for (i = 0, j = 0; i < srclen; j++) {
+		/* ASCII runs, including the reserved chars, in bulk */
+		charlen = smb_ascii_to_utf16(&target[j], source + i,
+				srclen - i, true);
+		if (charlen) {
+			i += charlen;
+			j += charlen - 1;
+			continue;
+		}
+
 		src_char = source[i];
 		charlen = 1;
 		switch (src_char) {
@@ -400,6 +560,48 @@ smbConvertToUTF16(__le16 *target, const char *source, int srclen,
 	return j;
 }
 
+/*
+ * smb_utf16_name_bytes() - how long will a name be in UTF-16?
+ * @from:	source string
+ * @len:	don't walk past this many bytes of the source string
+ * @codepage:	source codepage
+ *
+ * Upper bound of the size smbConvertToUTF16() without remapping needs
+ * for @from, so that callers can check for room before converting in
+ * place.
+ *
+ * Return:	length in bytes, not including null termination
+ */
+int smb_utf16_name_bytes(const char *from, int len,
+		const struct nls_table *codepage)
+{
+	bool is_utf8 = !strcmp(codepage->charset, "utf8");
+	int charlen, n = 0;
+	wchar_t wchar_to;
+	unicode_t u;
+
+	while (len > 0 && *from) {
+		if (!(*from & 0x80)) {
+			charlen = 1;
+		} else if (is_utf8) {
+			charlen = utf8_to_utf32(from, len, &u);
+			/* supplementary plane chars take a surrogate pair */
+			if (charlen > 0 && u > 0xffff)
+				n++;
+		} else {
+			charlen = codepage->char2uni(from, len, &wchar_to);
+		}
+
+		if (charlen < 1)
+			charlen = 1;
+		n++;
+		from += charlen;
+		len -= charlen;
+	}
+
+	return n * 2;
+}
+
 #ifdef CONFIG_CIFS_SMB2
 /*
  * cifs_local_to_utf16_bytes() - how long will a string be after conversion?
@@ -84,6 +84,8 @@ int smb_from_utf16(char *to, const __le16 *from, int tolen, int fromlen,
 int smb_utf16_bytes(const __le16 *from, int maxbytes,
 		const struct nls_table *codepage);
 int smb_strtoUTF16(__le16 *, const char *, int, const struct nls_table *);
+int smb_utf16_name_bytes(const char *from, int len,
+		const struct nls_table *codepage);
 char *smb_strndup_from_utf16(const char *src, const int maxlen,
 		const bool is_unicode,
 		const struct nls_table *codepage);
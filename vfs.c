@@ -21,6 +21,7 @@
 
 #include <linux/kernel.h>
 #include <linux/fs.h>
+#include <linux/file.h>
 #include <linux/uaccess.h>
 #include <linux/backing-dev.h>
 #include <linux/writeback.h>
@@ -31,6 +32,9 @@
 #include <linux/falloc.h>
 #include <linux/genhd.h>
 #include <linux/blkdev.h>
+#include <linux/magic.h>
+#include <linux/fsnotify.h>
+#include <linux/uio.h>
 
 #include "export.h"
 #include "glob.h"
@@ -60,6 +64,10 @@ int smb_vfs_create(const char *name, umode_t mode)
 	err = vfs_create(path.dentry->d_inode, dentry, mode, true);
 	if (err)
 		cifsd_err("File(%s): creation failed (err:%d)\n", name, err);
+	else {
+		cifsd_ci_index_invalidate(path.dentry->d_inode);
+		cifsd_neg_cache_remove(name);
+	}
 
 	done_path_create(&path, dentry);
 
@@ -92,12 +100,140 @@ int smb_vfs_mkdir(const char *name, umode_t mode)
 	err = vfs_mkdir(path.dentry->d_inode, dentry, mode);
 	if (err)
 		cifsd_err("mkdir(%s): creation failed (err:%d)\n", name, err);
+	else {
+		cifsd_ci_index_invalidate(path.dentry->d_inode);
+		cifsd_neg_cache_remove(name);
+	}
 
 	done_path_create(&path, dentry);
 
 	return err;
 }
 
+/*
+ * Unbuffered I/O
+ *
+ * O_DIRECT on the file would make the filesystem pin the pages of the
+ * buffer with get_user_pages(), which workers without a user mm can't
+ * do. The pages of our kernel buffer are handed over in a bvec iov_iter
+ * with IOCB_DIRECT instead. Buffer, offset and length must be aligned
+ * to the logical block size; an unaligned buffer goes through an
+ * aligned bounce buffer, an unaligned range is left to buffered I/O.
+ * Read buffers are allocated aligned, and the payload of a write larger
+ * than the big request buffer is received page aligned, so only small
+ * writes are bounced.
+ */
+static bool smb_use_direct_io(struct cifsd_file *fp, bool unbuffered)
+{
+	return unbuffered || (fp->coption & FILE_NO_INTERMEDIATE_BUFFERING_LE);
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 1, 0)
+static ssize_t __smb_vfs_direct_io(struct file *filp, char *buf,
+		size_t count, loff_t *pos, int rw)
+{
+	struct bio_vec *bvec;
+	struct iov_iter iter;
+	struct kiocb kiocb;
+	unsigned int nr_segs, i;
+	size_t left = count, len;
+	ssize_t ret;
+
+	nr_segs = DIV_ROUND_UP(offset_in_page(buf) + count, PAGE_SIZE);
+	bvec = kmalloc_array(nr_segs, sizeof(struct bio_vec), GFP_KERNEL);
+	if (!bvec)
+		return -ENOMEM;
+
+	for (i = 0; i < nr_segs; i++) {
+		len = min_t(size_t, left, PAGE_SIZE - offset_in_page(buf));
+		bvec[i].bv_page = is_vmalloc_addr(buf) ?
+			vmalloc_to_page(buf) : virt_to_page(buf);
+		bvec[i].bv_offset = offset_in_page(buf);
+		bvec[i].bv_len = len;
+		buf += len;
+		left -= len;
+	}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
+	iov_iter_bvec(&iter, rw, bvec, nr_segs, count);
+#else
+	iov_iter_bvec(&iter, ITER_BVEC | rw, bvec, nr_segs, count);
+#endif
+	init_sync_kiocb(&kiocb, filp);
+	kiocb.ki_pos = *pos;
+	kiocb.ki_flags |= IOCB_DIRECT;
+
+	if (rw == READ) {
+		ret = filp->f_op->read_iter(&kiocb, &iter);
+	} else {
+		file_start_write(filp);
+		ret = filp->f_op->write_iter(&kiocb, &iter);
+		file_end_write(filp);
+		if (ret > 0)
+			fsnotify_modify(filp);
+	}
+	if (ret > 0)
+		*pos = kiocb.ki_pos;
+
+	kfree(bvec);
+	return ret;
+}
+#endif
+
+/**
+ * smb_vfs_direct_io() - read or write bypassing the page cache
+ * @filp:	file to read or write
+ * @buf:	kernel buffer
+ * @count:	byte count
+ * @pos:	file pos, advanced by the bytes transferred
+ * @rw:		READ or WRITE
+ *
+ * Return:	number of bytes transferred, -EOPNOTSUPP if the request can
+ *		only be served by buffered I/O, otherwise error
+ */
+static ssize_t smb_vfs_direct_io(struct file *filp, char *buf, size_t count,
+		loff_t *pos, int rw)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 1, 0)
+	struct super_block *sb = file_inode(filp)->i_sb;
+	unsigned int align;
+	char *bounce;
+	ssize_t ret;
+
+	if (!sb->s_bdev || !filp->f_mapping->a_ops ||
+	    !filp->f_mapping->a_ops->direct_IO ||
+	    !filp->f_op->read_iter || !filp->f_op->write_iter)
+		return -EOPNOTSUPP;
+
+	align = bdev_logical_block_size(sb->s_bdev) - 1;
+	if (!count || (*pos & align) || (count & align))
+		return -EOPNOTSUPP;
+
+	if (!((unsigned long)buf & align))
+		return __smb_vfs_direct_io(filp, buf, count, pos, rw);
+
+	/* vmalloc and power of two kmalloc buffers are aligned */
+	bounce = alloc_data_mem(count);
+	if (!bounce)
+		return -ENOMEM;
+
+	if ((unsigned long)bounce & align) {
+		kvfree(bounce);
+		return -EOPNOTSUPP;
+	}
+
+	if (rw == WRITE)
+		memcpy(bounce, buf, count);
+	ret = __smb_vfs_direct_io(filp, bounce, count, pos, rw);
+	if (rw == READ && ret > 0)
+		memcpy(buf, bounce, ret);
+	kvfree(bounce);
+	return ret;
+#else
+	return -EOPNOTSUPP;
+#endif
+}
+
 /**
  * smb_vfs_read() - vfs helper for smb file read
  * @sess:	session
@@ -105,11 +241,12 @@ int smb_vfs_mkdir(const char *name, umode_t mode)
  * @buf:	buf containing read data
  * @count:	read byte count
  * @pos:	file pos
+ * @unbuffered:	bypass the page cache for this read
  *
  * Return:	number of read bytes on success, otherwise error
  */
 int smb_vfs_read(struct cifsd_sess *sess, uint64_t fid, uint64_t p_id,
-	char **buf, size_t count, loff_t *pos)
+	char **buf, size_t count, loff_t *pos, bool unbuffered)
 {
 	struct file *filp;
 	ssize_t nbytes = 0;
@@ -183,7 +320,7 @@ int smb_vfs_read(struct cifsd_sess *sess, uint64_t fid, uint64_t p_id,
 		goto out;
 	}
 
-	ret = check_lock_range(filp, *pos, *pos + count - 1,
+	ret = check_lock_range(fp, *pos, *pos + count - 1,
 			READ);
 	if (ret) {
 		cifsd_err("%s: unable to read due to lock\n",
@@ -193,11 +330,17 @@ int smb_vfs_read(struct cifsd_sess *sess, uint64_t fid, uint64_t p_id,
 		goto out;
 	}
 
-	old_fs = get_fs();
-	set_fs(KERNEL_DS);
+	nbytes = -EOPNOTSUPP;
+	if (smb_use_direct_io(fp, unbuffered))
+		nbytes = smb_vfs_direct_io(filp, rbuf, count, pos, READ);
 
-	nbytes = vfs_read(filp, rbuf, count, pos);
-	set_fs(old_fs);
+	if (nbytes == -EOPNOTSUPP) {
+		cifsd_read_ahead(fp, *pos, count);
+		old_fs = get_fs();
+		set_fs(KERNEL_DS);
+		nbytes = vfs_read(filp, rbuf, count, pos);
+		set_fs(old_fs);
+	}
 	if (nbytes < 0) {
 		name = d_path(&filp->f_path, namebuf, sizeof(namebuf));
 		if (IS_ERR(name))
@@ -215,6 +358,84 @@ out:
 	return nbytes;
 }
 
+/**
+ * smb_vfs_sync_range() - sync a range of a file, batched per inode
+ * @fp:		open of the file
+ * @start:	start of the range
+ * @end:	end of the range, inclusive
+ *
+ * Concurrent callers on the same inode are synced together: while one
+ * fsync runs, new callers join a pending batch covering the union of
+ * their ranges, and the first of them to wake up syncs the whole batch
+ * once the running fsync is done. Every caller of a batch gets its
+ * result.
+ *
+ * Return:	0 on success, otherwise error
+ */
+int smb_vfs_sync_range(struct cifsd_file *fp, loff_t start, loff_t end)
+{
+	struct cifsd_mfile *mfp = fp->f_mfp;
+	struct cifsd_sync_batch *batch, *new;
+	int err;
+
+	if (!mfp)
+		return vfs_fsync_range(fp->filp, start, end, 0);
+
+	new = kmalloc(sizeof(struct cifsd_sync_batch), GFP_KERNEL);
+	if (!new)
+		return vfs_fsync_range(fp->filp, start, end, 0);
+
+	spin_lock(&mfp->m_lock);
+	batch = mfp->m_sync_pending;
+	if (batch) {
+		batch->start = min(batch->start, start);
+		batch->end = max(batch->end, end);
+	} else {
+		batch = new;
+		new = NULL;
+		batch->start = start;
+		batch->end = end;
+		batch->nr_waiters = 0;
+		batch->done = false;
+		batch->err = 0;
+		mfp->m_sync_pending = batch;
+	}
+	batch->nr_waiters++;
+
+	while (!batch->done) {
+		if (!mfp->m_sync_running && mfp->m_sync_pending == batch) {
+			/* lead the batch, later callers start the next one */
+			mfp->m_sync_running = true;
+			mfp->m_sync_pending = NULL;
+			spin_unlock(&mfp->m_lock);
+
+			err = vfs_fsync_range(fp->filp, batch->start,
+					batch->end, 0);
+
+			spin_lock(&mfp->m_lock);
+			batch->err = err;
+			batch->done = true;
+			mfp->m_sync_running = false;
+			wake_up_all(&mfp->m_sync_wq);
+			break;
+		}
+
+		spin_unlock(&mfp->m_lock);
+		wait_event(mfp->m_sync_wq, batch->done ||
+				(!mfp->m_sync_running &&
+				 mfp->m_sync_pending == batch));
+		spin_lock(&mfp->m_lock);
+	}
+
+	err = batch->err;
+	if (!--batch->nr_waiters)
+		kfree(batch);
+	spin_unlock(&mfp->m_lock);
+
+	kfree(new);
+	return err;
+}
+
 /**
  * smb_vfs_write() - vfs helper for smb file write
  * @sess:	session
@@ -223,12 +444,14 @@ out:
  * @count:	read byte count
  * @pos:	file pos
  * @sync:	fsync after write
+ * @unbuffered:	bypass the page cache for this write
  * @written:	number of bytes written
  *
  * Return:	0 on success, otherwise error
  */
 int smb_vfs_write(struct cifsd_sess *sess, uint64_t fid, uint64_t p_id,
-	char *buf, size_t count, loff_t *pos, bool sync, ssize_t *written)
+	char *buf, size_t count, loff_t *pos, bool sync, bool unbuffered,
+	ssize_t *written)
 {
 	struct file *filp;
 	loff_t	offset = *pos;
@@ -315,7 +538,7 @@ int smb_vfs_write(struct cifsd_sess *sess, uint64_t fid, uint64_t p_id,
 		goto out;
 	}
 
-	err = check_lock_range(filp, *pos, *pos + count - 1,
+	err = check_lock_range(fp, *pos, *pos + count - 1,
 			WRITE);
 	if (err) {
 		cifsd_err("%s: unable to write due to lock\n",
@@ -324,9 +547,6 @@ int smb_vfs_write(struct cifsd_sess *sess, uint64_t fid, uint64_t p_id,
 		goto out;
 	}
 
-	old_fs = get_fs();
-	set_fs(KERNEL_DS);
-
 	if (oplocks_enable) {
 		/* Do we need to break any of a levelII oplock? */
 		mutex_lock(&ofile_list_lock);
@@ -334,8 +554,16 @@ int smb_vfs_write(struct cifsd_sess *sess, uint64_t fid, uint64_t p_id,
 		mutex_unlock(&ofile_list_lock);
 	}
 
-	err = vfs_write(filp, buf, count, pos);
-	set_fs(old_fs);
+	err = -EOPNOTSUPP;
+	if (smb_use_direct_io(fp, unbuffered))
+		err = smb_vfs_direct_io(filp, buf, count, pos, WRITE);
+
+	if (err == -EOPNOTSUPP) {
+		old_fs = get_fs();
+		set_fs(KERNEL_DS);
+		err = vfs_write(filp, buf, count, pos);
+		set_fs(old_fs);
+	}
 	if (err < 0) {
 		cifsd_debug("smb write failed, err = %d\n", err);
 		goto out;
@@ -345,7 +573,7 @@ int smb_vfs_write(struct cifsd_sess *sess, uint64_t fid, uint64_t p_id,
 	*written = err;
 	err = 0;
 	if (sync) {
-		err = vfs_fsync_range(filp, offset, offset + *written, 0);
+		err = smb_vfs_sync_range(fp, offset, offset + *written);
 		if (err < 0)
 			cifsd_err("fsync failed for fid %llu, err = %d\n",
 					fid, err);
@@ -540,10 +768,11 @@ int smb_vfs_fsync(struct cifsd_sess *sess, uint64_t fid, uint64_t p_id)
 	if (fp->is_durable && fp->persistent_id != p_id) {
 		cifsd_err("persistent id mismatch : %llu, %llu\n",
 				fp->persistent_id, p_id);
+		fp_put(fp);
 		return -ENOENT;
 	}
 
-	err = vfs_fsync(fp->filp, 0);
+	err = smb_vfs_sync_range(fp, 0, LLONG_MAX);
 	if (err < 0)
 		cifsd_err("smb fsync failed, err = %d\n", err);
 	fp_put(fp);
@@ -616,6 +845,8 @@ int smb_vfs_remove_file(char *name)
 			cifsd_debug("%s: unlink failed, err %d\n", name, err);
 	}
 
+	if (!err)
+		cifsd_ci_index_invalidate(dir->d_inode);
 	dput(dentry);
 out_err:
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0)
@@ -669,6 +900,10 @@ int smb_vfs_link(const char *oldname, const char *newname)
 #endif
 	if (err)
 		cifsd_debug("vfs_link failed err %d\n", err);
+	else {
+		cifsd_ci_index_invalidate(newpath.dentry->d_inode);
+		cifsd_neg_cache_remove(newname);
+	}
 
 out3:
 	done_path_create(&newpath, dentry);
@@ -702,6 +937,10 @@ int smb_vfs_symlink(const char *name, const char *symname)
 	err = vfs_symlink(dentry->d_parent->d_inode, dentry, name);
 	if (err && (err != -EEXIST || err != -ENOSPC))
 		cifsd_debug("failed to create symlink, err %d\n", err);
+	else if (!err) {
+		cifsd_ci_index_invalidate(path.dentry->d_inode);
+		cifsd_neg_cache_remove(symname);
+	}
 
 	done_path_create(&path, dentry);
 
@@ -888,8 +1127,13 @@ int smb_vfs_rename(struct cifsd_sess *sess, char *abs_oldname,
 #else
 	err = vfs_rename(dold_p->d_inode, dold, dnew_p->d_inode, dnew);
 #endif
-	if (err)
+	if (err) {
 		cifsd_err("vfs_rename failed err %d\n", err);
+	} else {
+		cifsd_ci_index_invalidate(dold_p->d_inode);
+		cifsd_ci_index_invalidate(dnew_p->d_inode);
+		cifsd_neg_cache_flush();
+	}
 out4:
 	dput(dnew);
 out3:
@@ -951,10 +1195,10 @@ int smb_vfs_truncate(struct cifsd_sess *sess, const char *name,
 		} else {
 			inode = file_inode(filp);
 			if (size < inode->i_size) {
-				err = check_lock_range(filp, size,
+				err = check_lock_range(fp, size,
 					inode->i_size - 1, WRITE);
 			} else {
-				err = check_lock_range(filp, inode->i_size,
+				err = check_lock_range(fp, inode->i_size,
 					size - 1, WRITE);
 			}
 
@@ -1213,43 +1457,50 @@ int smb_vfs_lock(struct file *filp, int cmd,
 
 /**
  * check_lock_range() - vfs helper for smb byte range file locking
- * @filp:	the file to apply the lock to
+ * @fp:		the open to apply the lock to
  * @start:	lock start byte offset
  * @end:	lock end byte offset
  * @type:	byte range type read/write
  *
+ * Only locks overlapping the range are visited, looked up in the lock
+ * tree of the master file.
+ *
  * Return:	0 on success, otherwise error
  */
-int check_lock_range(struct file *filp, loff_t start, loff_t end,
+int check_lock_range(struct cifsd_file *fp, loff_t start, loff_t end,
 		unsigned char type)
 {
-	struct file_lock *flock;
-	struct file_lock_context *ctx = file_inode(filp)->i_flctx;
+	struct cifsd_mfile *mfp = fp->f_mfp;
+	struct cifsd_lock *lock;
 	int error = 0;
 
-	if (!ctx || list_empty_careful(&ctx->flc_posix))
+	if (!mfp)
 		return 0;
 
-	list_for_each_entry(flock, &ctx->flc_posix, fl_list) {
-		/* check conflict locks */
-		if (flock->fl_end >= start && end >= flock->fl_start) {
-			if (flock->fl_type == F_RDLCK) {
-				if (type == WRITE) {
-					cifsd_err("not allow write by shared lock\n");
-					error = 1;
-					goto out;
-				}
-			} else if (flock->fl_type == F_WRLCK) {
-				/* check owner in lock */
-				if (flock->fl_file != filp) {
-					error = 1;
-					cifsd_err("not allow rw access by exclusive lock from other opens\n");
-					goto out;
-				}
+	spin_lock(&mfp->m_lock);
+	for (lock = cifsd_lock_tree_first(mfp, start, end); lock;
+	     lock = cifsd_lock_tree_next(lock, start, end)) {
+		/* zero byte locks and pending requests cover no byte */
+		if (lock->zero_len || lock->work)
+			continue;
+
+		if (lock->fl->fl_type == F_RDLCK) {
+			if (type == WRITE) {
+				cifsd_err("not allow write by shared lock\n");
+				error = 1;
+				goto out;
+			}
+		} else if (lock->fl->fl_type == F_WRLCK) {
+			/* check owner in lock */
+			if (lock->fl->fl_file != fp->filp) {
+				error = 1;
+				cifsd_err("not allow rw access by exclusive lock from other opens\n");
+				goto out;
 			}
 		}
 	}
 out:
+	spin_unlock(&mfp->m_lock);
 	return error;
 }
 
@@ -1272,6 +1523,475 @@ int smb_vfs_alloc_size(struct file *filp, loff_t len)
 	return vfs_fallocate(filp, FALLOC_FL_KEEP_SIZE, 0, len);
 }
 
+/* bounce buffer size used when the filesystem can't copy by itself */
+#define SMB_COPY_BUF_SIZE	(1024 * 1024)
+
+static ssize_t smb_vfs_copy_buffered(struct file *src, loff_t src_off,
+		struct file *dst, loff_t dst_off, size_t len)
+{
+	mm_segment_t old_fs;
+	ssize_t copied = 0, nr, nw;
+	char *buf;
+
+	buf = alloc_data_mem(min_t(size_t, len, SMB_COPY_BUF_SIZE));
+	if (!buf)
+		return -ENOMEM;
+
+	old_fs = get_fs();
+	set_fs(KERNEL_DS);
+	while (copied < len) {
+		nr = vfs_read(src, buf, min_t(size_t, len - copied,
+				SMB_COPY_BUF_SIZE), &src_off);
+		if (nr <= 0) {
+			if (!copied)
+				copied = nr;
+			break;
+		}
+
+		nw = vfs_write(dst, buf, nr, &dst_off);
+		if (nw > 0)
+			copied += nw;
+		if (nw != nr) {
+			if (!copied)
+				copied = nw < 0 ? nw : -EIO;
+			break;
+		}
+	}
+	set_fs(old_fs);
+
+	kvfree(buf);
+	return copied;
+}
+
+/*
+ * smb_vfs_prepare_dst() - checks on the destination of a copy or clone
+ *
+ * The open must be a regular file, not a stream, and the range must not
+ * be locked by other opens. Level II oplocks are broken as for a write.
+ */
+static int smb_vfs_prepare_dst(struct connection *conn,
+		struct cifsd_file *dst_fp, loff_t dst_off, u64 len)
+{
+	if (S_ISDIR(file_inode(dst_fp->filp)->i_mode))
+		return -EISDIR;
+
+	if (dst_fp->is_stream)
+		return -EOPNOTSUPP;
+
+	if (check_lock_range(dst_fp, dst_off, dst_off + len - 1, WRITE)) {
+		cifsd_err("%s: unable to copy due to lock\n", __func__);
+		return -EAGAIN;
+	}
+
+	if (oplocks_enable) {
+		mutex_lock(&ofile_list_lock);
+		smb_break_all_levII_oplock(conn, dst_fp, NULL, 1);
+		mutex_unlock(&ofile_list_lock);
+	}
+
+	return 0;
+}
+
+/* checks common to copy and clone of a range, see smb_vfs_prepare_dst() */
+static int smb_vfs_prepare_copy(struct connection *conn,
+		struct cifsd_file *src_fp, loff_t src_off,
+		struct cifsd_file *dst_fp, loff_t dst_off, u64 len)
+{
+	if (S_ISDIR(file_inode(src_fp->filp)->i_mode))
+		return -EISDIR;
+
+	if (src_fp->is_stream)
+		return -EOPNOTSUPP;
+
+	if (check_lock_range(src_fp, src_off, src_off + len - 1, READ)) {
+		cifsd_err("%s: unable to copy due to lock\n", __func__);
+		return -EAGAIN;
+	}
+
+	return smb_vfs_prepare_dst(conn, dst_fp, dst_off, len);
+}
+
+static ssize_t smb_vfs_do_copy(struct file *src, loff_t src_off,
+		struct file *dst, loff_t dst_off, size_t len)
+{
+	ssize_t copied = 0, ret;
+
+	while (copied < len) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
+		ret = vfs_copy_file_range(src, src_off + copied, dst,
+				dst_off + copied, len - copied, 0);
+		if (ret == -EXDEV || ret == -EOPNOTSUPP)
+#endif
+			ret = smb_vfs_copy_buffered(src, src_off + copied, dst,
+					dst_off + copied, len - copied);
+		if (ret <= 0)
+			break;
+		copied += ret;
+	}
+
+	if (!copied && ret < 0) {
+		cifsd_debug("copy failed, err = %zd\n", ret);
+		return ret;
+	}
+
+	return copied;
+}
+
+/**
+ * smb_vfs_copy_file_range() - vfs helper for smb server side copy
+ * @conn:	connection the copy was requested on
+ * @src_fp:	open to copy from
+ * @src_off:	offset in source file
+ * @dst_fp:	open to copy to
+ * @dst_off:	offset in destination file
+ * @len:	number of bytes to copy
+ *
+ * The copy is left to the filesystem, which may share extents or copy
+ * within the device, and falls back to copying through a kernel buffer
+ * when source and destination are on different filesystems.
+ *
+ * Return:	number of copied bytes, short at end of source file,
+ *		otherwise error
+ */
+ssize_t smb_vfs_copy_file_range(struct connection *conn,
+		struct cifsd_file *src_fp, loff_t src_off,
+		struct cifsd_file *dst_fp, loff_t dst_off, size_t len)
+{
+	int err;
+
+	if (!len)
+		return 0;
+
+	err = smb_vfs_prepare_copy(conn, src_fp, src_off, dst_fp, dst_off,
+			len);
+	if (err)
+		return err;
+
+	return smb_vfs_do_copy(src_fp->filp, src_off, dst_fp->filp, dst_off,
+			len);
+}
+
+/**
+ * smb_vfs_offload_write() - vfs helper for smb offload write
+ * @conn:	connection the write was requested on
+ * @src:	file the offload token was taken on
+ * @src_off:	offset in source file
+ * @dst_fp:	open to copy to
+ * @dst_off:	offset in destination file
+ * @len:	number of bytes to copy
+ *
+ * Same as smb_vfs_copy_file_range(), for a source that may no longer
+ * be open. Its range was checked for locks when the token was taken.
+ *
+ * Return:	number of copied bytes, short at end of source file,
+ *		otherwise error
+ */
+ssize_t smb_vfs_offload_write(struct connection *conn, struct file *src,
+		loff_t src_off, struct cifsd_file *dst_fp, loff_t dst_off,
+		size_t len)
+{
+	int err;
+
+	if (!len)
+		return 0;
+
+	err = smb_vfs_prepare_dst(conn, dst_fp, dst_off, len);
+	if (err)
+		return err;
+
+	return smb_vfs_do_copy(src, src_off, dst_fp->filp, dst_off, len);
+}
+
+/**
+ * smb_vfs_clone_file_range() - vfs helper for smb block cloning
+ * @conn:	connection the clone was requested on
+ * @src_fp:	open to clone from
+ * @src_off:	offset in source file
+ * @dst_fp:	open to clone to
+ * @dst_off:	offset in destination file
+ * @len:	number of bytes to clone
+ *
+ * The destination range shares the extents of the source range on
+ * filesystems with reflink support. Clients are told block cloning is
+ * a metadata only operation, so it is never turned into a copy.
+ *
+ * Return:	0 on success, -EOPNOTSUPP if the filesystem can not clone
+ *		the range, otherwise error
+ */
+int smb_vfs_clone_file_range(struct connection *conn,
+		struct cifsd_file *src_fp, loff_t src_off,
+		struct cifsd_file *dst_fp, loff_t dst_off, u64 len)
+{
+	loff_t ret;
+
+	/* a zero length clones up to end of file for the vfs */
+	if (!len)
+		return 0;
+
+	ret = smb_vfs_prepare_copy(conn, src_fp, src_off, dst_fp, dst_off,
+			len);
+	if (ret)
+		return ret;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
+	ret = vfs_clone_file_range(src_fp->filp, src_off, dst_fp->filp,
+			dst_off, len, 0);
+	if (ret >= 0 && ret != len)
+		ret = -EINVAL;
+#elif LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
+	ret = vfs_clone_file_range(src_fp->filp, src_off, dst_fp->filp,
+			dst_off, len);
+#else
+	ret = -EOPNOTSUPP;
+#endif
+	if (ret >= 0)
+		return 0;
+
+	cifsd_debug("clone failed, err = %lld\n", ret);
+	if (ret == -EXDEV)
+		ret = -EOPNOTSUPP;
+	return ret;
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
+/* result of the clone probe, per filesystem */
+struct clone_probe {
+	struct list_head	list;
+	dev_t			dev;
+	bool			can_clone;
+};
+
+static LIST_HEAD(clone_probes);
+static DEFINE_SPINLOCK(clone_probes_lock);
+
+/*
+ * Reflink is a per filesystem feature, e.g. of XFS formatted with it, so
+ * clone an empty temporary file onto itself, which fails the same way a
+ * real clone would when the filesystem has no support.
+ */
+static bool smb_vfs_probe_clone(struct path *path)
+{
+	struct file *filp;
+	char *buf, *name;
+	loff_t ret;
+
+	buf = kmalloc(PATH_MAX, GFP_KERNEL);
+	if (!buf)
+		return false;
+
+	name = d_path(path, buf, PATH_MAX);
+	if (IS_ERR(name)) {
+		kfree(buf);
+		return false;
+	}
+
+	filp = filp_open(name, O_TMPFILE | O_RDWR, 0600);
+	kfree(buf);
+	if (IS_ERR(filp))
+		return false;
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
+	ret = vfs_clone_file_range(filp, 0, filp, 0, 0, 0);
+#else
+	ret = vfs_clone_file_range(filp, 0, filp, 0, 0);
+#endif
+	filp_close(filp, NULL);
+	return ret >= 0;
+}
+#endif
+
+/**
+ * smb_vfs_can_clone() - check if a filesystem shares extents
+ * @path:	share root on the filesystem
+ *
+ * Return:	true if ranges can be cloned within the filesystem
+ */
+bool smb_vfs_can_clone(struct path *path)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
+	struct super_block *sb = path->dentry->d_sb;
+	struct clone_probe *probe, *new;
+	bool can_clone;
+
+	switch (sb->s_magic) {
+	case BTRFS_SUPER_MAGIC:
+	case XFS_SUPER_MAGIC:
+	case OCFS2_SUPER_MAGIC:
+		break;
+	default:
+		return false;
+	}
+
+	spin_lock(&clone_probes_lock);
+	list_for_each_entry(probe, &clone_probes, list) {
+		if (probe->dev == sb->s_dev) {
+			can_clone = probe->can_clone;
+			spin_unlock(&clone_probes_lock);
+			return can_clone;
+		}
+	}
+	spin_unlock(&clone_probes_lock);
+
+	can_clone = smb_vfs_probe_clone(path);
+
+	new = kmalloc(sizeof(struct clone_probe), GFP_KERNEL);
+	if (!new)
+		return can_clone;
+	new->dev = sb->s_dev;
+	new->can_clone = can_clone;
+
+	spin_lock(&clone_probes_lock);
+	list_for_each_entry(probe, &clone_probes, list) {
+		if (probe->dev == sb->s_dev) {
+			kfree(new);
+			new = NULL;
+			break;
+		}
+	}
+	if (new)
+		list_add(&new->list, &clone_probes);
+	spin_unlock(&clone_probes_lock);
+	return can_clone;
+#else
+	return false;
+#endif
+}
+
+/**
+ * smb_vfs_clone_probes_free() - forget filesystems probed for cloning
+ */
+void smb_vfs_clone_probes_free(void)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 5, 0)
+	struct clone_probe *probe, *tmp;
+
+	list_for_each_entry_safe(probe, tmp, &clone_probes, list) {
+		list_del(&probe->list);
+		kfree(probe);
+	}
+#endif
+}
+
+/**
+ * smb_vfs_zero_data() - vfs helper for FSCTL_SET_ZERO_DATA
+ * @conn:	connection the request came on
+ * @fp:		open to zero a range of
+ * @off:	start of the range
+ * @len:	length of the range
+ *
+ * Blocks of a sparse file are deallocated, other files keep their
+ * allocation. File size never changes.
+ *
+ * Return:	0 on success, otherwise error
+ */
+int smb_vfs_zero_data(struct connection *conn, struct cifsd_file *fp,
+		loff_t off, loff_t len)
+{
+	struct file *filp = fp->filp;
+	int err = -EOPNOTSUPP;
+
+	if (!len)
+		return 0;
+
+	if (S_ISDIR(file_inode(filp)->i_mode))
+		return -EISDIR;
+
+	if (check_lock_range(fp, off, off + len - 1, WRITE)) {
+		cifsd_err("%s: unable to zero due to lock\n", __func__);
+		return -EAGAIN;
+	}
+
+	if (oplocks_enable) {
+		mutex_lock(&ofile_list_lock);
+		smb_break_all_levII_oplock(conn, fp, NULL, 1);
+		mutex_unlock(&ofile_list_lock);
+	}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 15, 0)
+	if (!(fp->fattr & FILE_ATTRIBUTE_SPARSE_FILE_LE))
+		err = vfs_fallocate(filp, FALLOC_FL_ZERO_RANGE |
+				FALLOC_FL_KEEP_SIZE, off, len);
+#endif
+	if (err == -EOPNOTSUPP)
+		err = vfs_fallocate(filp, FALLOC_FL_PUNCH_HOLE |
+				FALLOC_FL_KEEP_SIZE, off, len);
+	if (err)
+		cifsd_debug("zero data failed, err = %d\n", err);
+
+	return err;
+}
+
+/**
+ * smb_vfs_fqar_lseek() - vfs helper for FSCTL_QUERY_ALLOCATED_RANGES
+ * @fp:		open to query
+ * @start:	start of the queried range
+ * @length:	length of the queried range
+ * @ranges:	allocated ranges found
+ * @in_count:	number of entries in ranges
+ * @out_count:	number of entries filled
+ *
+ * Data extents are found with SEEK_DATA and SEEK_HOLE, so holes are
+ * skipped without reading any block. The seeks go through a private
+ * open of the file, the file position of the open is left alone.
+ *
+ * Return:	0 on success, -E2BIG when ranges is too small,
+ *		otherwise error
+ */
+int smb_vfs_fqar_lseek(struct cifsd_file *fp, loff_t start, loff_t length,
+		struct file_allocated_range_buffer *ranges, int in_count,
+		int *out_count)
+{
+	struct file *filp;
+	loff_t maxbytes = file_inode(fp->filp)->i_sb->s_maxbytes;
+	loff_t end, data_start, data_end;
+	int err = 0;
+
+	*out_count = 0;
+	if (start < 0 || length < 0)
+		return -EINVAL;
+
+	if (start >= maxbytes)
+		return 0;
+
+	filp = dentry_open(&fp->filp->f_path, O_RDONLY | O_LARGEFILE,
+			current_cred());
+	if (IS_ERR(filp))
+		return PTR_ERR(filp);
+
+	end = length > maxbytes - start ? maxbytes : start + length;
+	while (start < end) {
+		data_start = vfs_llseek(filp, start, SEEK_DATA);
+		if (data_start < 0) {
+			/* no data past start */
+			if (data_start != -ENXIO)
+				err = data_start;
+			break;
+		}
+		if (data_start >= end)
+			break;
+
+		data_end = vfs_llseek(filp, data_start, SEEK_HOLE);
+		if (data_end < 0) {
+			err = data_end;
+			break;
+		}
+
+		if (*out_count == in_count) {
+			err = -E2BIG;
+			break;
+		}
+
+		ranges[*out_count].file_offset = cpu_to_le64(data_start);
+		ranges[*out_count].length =
+			cpu_to_le64(min(data_end, end) - data_start);
+		(*out_count)++;
+		start = data_end;
+	}
+
+	fput(filp);
+	return err;
+}
+
 int smb_vfs_remove_xattr(struct path *path, char *field_name)
 {
 	return vfs_removexattr(path->dentry, field_name);
@@ -1300,6 +2020,8 @@ int smb_vfs_unlink(struct dentry *dir, struct dentry *dentry)
 #else
 	err = vfs_unlink(dir->d_inode, dentry);
 #endif
+	if (!err)
+		cifsd_ci_index_invalidate(dir->d_inode);
 
 out:
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 2, 0)